@@ -24,6 +24,11 @@
 
 #include "cluon-complete.hpp"
 #include "messages.hpp"
+#include "message-bus.hpp"
+
+#ifdef SERVICE_HOST
+namespace InputDirection {
+#endif
 
 using namespace std;
 using namespace cluon;
@@ -45,7 +50,7 @@ int32_t main(int32_t argc, char **argv) {
    	}
 
 	// od4 session declarartion
-	cluon::OD4Session od4{static_cast<uint16_t>(std::stoi(commandlineArguments["cid"]))};		
+	ServiceSession od4{static_cast<uint16_t>(std::stoi(commandlineArguments["cid"]))};		
 
 	if (0 == od4.isRunning()) {
 	   std::cerr << "ERROR: No OD4Session running!!!" << std::endl;
@@ -56,9 +61,8 @@ int32_t main(int32_t argc, char **argv) {
 
 	
 	//Safe to go - choose direction
-	auto onSafeToGo{[&od4, &trafficSignPresence, VERBOSE](cluon::data::Envelope &&envelope)
+	auto onSafeToGo{[&od4, &trafficSignPresence, VERBOSE](SafeToGo &&, const cluon::data::Envelope &)
 	    {
-		auto msg = cluon::extractMessage<SafeToGo>(std::move(envelope));
 		char input = '0';
 
 		std::cout << "Please enter direction for kiwi car. " << std::endl << 
@@ -91,12 +95,11 @@ int32_t main(int32_t argc, char **argv) {
 		od4.send(directionRequest);
 	    }
 	};
-	od4.dataTrigger(SafeToGo::ID(), onSafeToGo);
+	onMessage<SafeToGo>(od4, onSafeToGo);
 
 	
-	auto onYieldPresenceUpdate{[&od4, &trafficSignPresence, VERBOSE](cluon::data::Envelope &&envelope)
+	auto onYieldPresenceUpdate{[&od4, &trafficSignPresence, VERBOSE](YieldPresenceUpdate &&msg, const cluon::data::Envelope &)
 	    {
-		auto msg = cluon::extractMessage<YieldPresenceUpdate>(std::move(envelope));
 		bool yieldPresence = msg.yieldPresence();
 		
 		if (VERBOSE) {
@@ -111,14 +114,18 @@ int32_t main(int32_t argc, char **argv) {
 		
 	    }
 	};
-	od4.dataTrigger(YieldPresenceUpdate::ID(), onYieldPresenceUpdate);
+	onMessage<YieldPresenceUpdate>(od4, onYieldPresenceUpdate);
  
 
 
+	// everything happens in the message triggers; do not spin a core while waiting for them
 	while(od4.isRunning()) {
-
-
-}
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
 
 	return 0;
 }
+
+#ifdef SERVICE_HOST
+} // namespace InputDirection
+#endif
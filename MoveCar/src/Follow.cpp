@@ -15,6 +15,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <chrono>
 #include <iostream>
@@ -24,6 +26,15 @@
 
 #include "cluon-complete.hpp"
 #include "messages.hpp"
+#include "message-bus.hpp"
+#include "scenario-mode.hpp"
+#include "service-clock.hpp"
+#include "flight-recorder.hpp"
+#include "thread-pool.hpp"
+
+#ifdef SERVICE_HOST
+namespace MoveCar {
+#endif
 
 using namespace std;
 using namespace cluon;
@@ -32,37 +43,55 @@ float currentCarSpeed = 0.0;
 float currentSteering = 0.0;
 //bool stopCarSent = false;
 
-std::chrono::time_point<std::chrono::system_clock> lastTimeZeroSpeed;
+ServiceClock *serviceClock = nullptr; // the wall clock, or the sample times of the ultrasound with --virtual-clock
+int64_t lastTimeZeroSpeed = 0; // microseconds on serviceClock
 float previousSpeed = 0.1; // set previous speed to 0.1 as a start condition so that MoveForward function can see the change of speed to zero
 bool standingStillForPeriodOfTime = false;
+std::atomic<uint8_t> scenarioMode{MODE_FOLLOWING}; // MoveCar owns the scenario; the perception services idle by it
+FlightRecorder *flightRecorder = nullptr; // the messages before and after a safety stop, with --recorder
+
+void SendScenarioMode(ServiceSession& od4)
+{
+	ScenarioModeUpdate modeUpdate;
+	modeUpdate.mode(scenarioMode.load());
+	od4.send(modeUpdate);
+	flightRecorder->record(modeUpdate);
+}
+
+void SetScenarioMode(ServiceSession& od4, uint8_t mode, bool VERBOSE)
+{
+	if (scenarioMode.exchange(mode) != mode) {
+		SendScenarioMode(od4);
+		if (VERBOSE) std::cout << "[ Scenario mode: " << modeName(mode) << " ]" << std::endl;
+	}
+}
 
-void SetSpeed(cluon::OD4Session& od4, float speed, bool VERBOSE)
+void SetSpeed(ServiceSession& od4, float speed, bool VERBOSE)
 {
 	opendlv::proxy::PedalPositionRequest pedalReq;
 	pedalReq.position(speed);
 	od4.send(pedalReq);
+	flightRecorder->record(pedalReq);
 	if (VERBOSE) std::cout << "[ Speed: " << speed << " ] //	" << std::endl;
 }
 
-void StopCar(cluon::OD4Session& od4, bool VERBOSE)
+void StopCar(ServiceSession& od4, bool VERBOSE)
 {
 	SetSpeed(od4, 0.0, VERBOSE);
  	 if (VERBOSE) { std::cout << "		[ Now stop ...] " << std::endl; }
 }
 
-void MoveForward(cluon::OD4Session& od4, float speed, bool VERBOSE)
+void MoveForward(ServiceSession& od4, float speed, bool VERBOSE)
 {
 	SetSpeed(od4, speed, VERBOSE);
 	// if (VERBOSE) std::cout << "Now move forward ... " << std::endl;
 
 	if (standingStillForPeriodOfTime == false) { // The car was never still for a period of time
 		if (previousSpeed != 0.0 && speed == 0.0) {
-			lastTimeZeroSpeed = std::chrono::system_clock::now(); // Take time stamp when car stopped
+			lastTimeZeroSpeed = serviceClock->microseconds(); // Take time stamp when car stopped
 		} else if (previousSpeed == 0.0 && speed == 0.0) {
-			// Inspired by: https://en.cppreference.com/w/cpp/chrono/system_clock/now and https://en.cppreference.com/w/cpp/chrono
-			auto now = std::chrono::system_clock::now();
-			std::chrono::duration<double> elapsed_seconds = now-lastTimeZeroSpeed; // Calculate the time the car stands still
-			if (elapsed_seconds.count() >= 7) {
+			int64_t elapsed_microseconds = serviceClock->microseconds() - lastTimeZeroSpeed; // Calculate the time the car stands still
+			if (elapsed_microseconds >= 7000000) {
 				standingStillForPeriodOfTime = true;
 	    			std::cout << "Not moving for 7 seconds. We are standing behind a car at the intersection. \n";
 			}
@@ -72,18 +101,19 @@ void MoveForward(cluon::OD4Session& od4, float speed, bool VERBOSE)
 	}
 }
 
-void SetSteering(cluon::OD4Session& od4, float steer, bool VERBOSE)
+void SetSteering(ServiceSession& od4, float steer, bool VERBOSE)
 {
 	opendlv::proxy::GroundSteeringRequest steerReq;
         steerReq.groundSteering(steer);
         od4.send(steerReq);
+        flightRecorder->record(steerReq);
         if (VERBOSE)
         {
             std::cout << "GroundSteeringRequest: " << steer << std::endl;
         }
 }
 
-void TurnLeft(cluon::OD4Session& od4, float steer, float speed, bool VERBOSE, int timer1, int timer2, int timer3)
+void TurnLeft(ServiceSession& od4, float steer, float speed, bool VERBOSE, int timer1, int timer2, int timer3)
 {
 	SetSteering(od4, 0.0, VERBOSE); //put wheels straight
 	MoveForward(od4, speed, VERBOSE);
@@ -96,7 +126,7 @@ void TurnLeft(cluon::OD4Session& od4, float steer, float speed, bool VERBOSE, in
 }
 
 
-void TurnRight(cluon::OD4Session& od4, float steer, float speed, bool VERBOSE, int timer1, int timer2)
+void TurnRight(ServiceSession& od4, float steer, float speed, bool VERBOSE, int timer1, int timer2)
 {
 	steer = -steer; // GroundSteeringRequest received negative values for steering right. Argument steer must always be positive!
 	SetSteering(od4, steer, VERBOSE);
@@ -107,7 +137,7 @@ void TurnRight(cluon::OD4Session& od4, float steer, float speed, bool VERBOSE, i
 	StopCar(od4, VERBOSE);
 }
 
-void GoStraight(cluon::OD4Session& od4, float speed, bool VERBOSE, int timer1){
+void GoStraight(ServiceSession& od4, float speed, bool VERBOSE, int timer1){
 
 	SetSteering(od4, 0.0, VERBOSE);
 	SetSpeed(od4, speed, VERBOSE);
@@ -125,13 +155,29 @@ int32_t main(int32_t argc, char **argv) {
 	if ( (0 == commandlineArguments.count("cid")) || (0 != commandlineArguments.count("help")) )
 	{
 		std::cerr << argv[0] << " is a first version of Kiwi car control. It is intended slowly move forward following the obstacle. " << std::endl;
-		std::cerr << "Usage:  " << argv[0] << " --cid=<CID of your OD4Session> [--safetyDistance] [--speed] [--verbose] [--help]" << std::endl;
+		std::cerr << "Usage:  " << argv[0] << " --cid=<CID of your OD4Session> [--safetyDistance] [--reactionTime] [--speed] [--cpus=<list>] [--nice=<n>] [--virtual-clock] [--recorder=<directory> [--recorder-seconds=<s>]] [--verbose] [--help]" << std::endl;
 		std::cerr << "example:  " << argv[0] << " --cid=112 --speed=1.5 --safetyDistance=1.5 --speedIncrement=0.01 -- steerIncrement=0.01 --verbose" << std::endl;
 		std::cerr << "example:  " << argv[0] << " --cid=112 --verbose" << std::endl;
+		std::cerr << "example:  " << argv[0] << " --cid=112 --cpus=3 --nice=-5   (a core of its own, the perception services on --cpus=0-2)" << std::endl;
+		std::cerr << "example:  " << argv[0] << " --cid=112 --virtual-clock   (time standing still by the ultrasound sample times, for replays and the simulator)" << std::endl;
+		std::cerr << "example:  " << argv[0] << " --cid=112 --recorder=/tmp   (keep 10 s of messages in memory, write them to /tmp/move-car-safety-stop-<time>.rec on a safety stop)" << std::endl;
 		return -1;
    }
 	else {
-		cluon::OD4Session od4{static_cast<uint16_t>(std::stoi(commandlineArguments["cid"]))};
+		// pinned before the OD4Session starts its threads, so that they inherit the CPUs and priority
+		const std::vector<int> CPUS{parseCpuList(commandlineArguments["cpus"])};
+		const int NICE{(commandlineArguments["nice"].size() != 0) ? std::stoi(commandlineArguments["nice"]) : 0};
+		if (!pinCurrentThread(CPUS, NICE)) {
+			std::cerr << argv[0] << ": could not apply --cpus or --nice, running unpinned." << std::endl;
+		}
+
+		ServiceClock clock{commandlineArguments.count("virtual-clock") != 0};
+		serviceClock = &clock;
+		const double RECORDER_SECONDS{(commandlineArguments["recorder-seconds"].size() != 0) ? std::stod(commandlineArguments["recorder-seconds"]) : 10.0};
+		FlightRecorder recorder{"move-car", commandlineArguments["recorder"], RECORDER_SECONDS, 200, 0, 0};
+		flightRecorder = &recorder;
+
+		ServiceSession od4{static_cast<uint16_t>(std::stoi(commandlineArguments["cid"]))};
 
 		if (0 == od4.isRunning()) {
 		   std::cerr << "ERROR: No OD4Session running!!!" << std::endl;
@@ -145,17 +191,21 @@ int32_t main(int32_t argc, char **argv) {
 		const float MAXSTEER{(commandlineArguments["maxsteer"].size() != 0) ? static_cast<float>(std::stof(commandlineArguments["maxsteer"])) : static_cast<float>(0.4)};
 		const float MINSTEER{(commandlineArguments["minsteer"].size() != 0) ? static_cast<float>(std::stof(commandlineArguments["minsteer"])) : static_cast<float>(-0.4)};
 		const float SAFETYDISTANCE{(commandlineArguments["safetyDistance"].size() != 0) ? static_cast<float>(std::stof(commandlineArguments["safetyDistance"])) : static_cast<float>(0.07)};
+		const float REACTIONTIME{(commandlineArguments["reactionTime"].size() != 0) ? static_cast<float>(std::stof(commandlineArguments["reactionTime"])) : static_cast<float>(0.3)};
 
 		const float LOSTVISUAL = 1337;
 		const float DECELERATE = 999;
 		bool safety_dist_triggered = false;
+		bool gap_closing_triggered = false;
+		int64_t lastLeadCarGap{0}; // sample time in microseconds
       // A Data-triggered function to detect front obstacle and stop or move car accordingly
       float currentDistance{0.0};
-      auto onFrontDistanceReading{ [&od4, SAFETYDISTANCE, VERBOSE, MINSTEER, MAXSTEER, &currentDistance, &safety_dist_triggered](cluon::data::Envelope &&envelope)
+      auto onFrontDistanceReading{ [&od4, SAFETYDISTANCE, VERBOSE, MINSTEER, MAXSTEER, &currentDistance, &safety_dist_triggered, &gap_closing_triggered, &lastLeadCarGap](opendlv::proxy::DistanceReading &&msg, const cluon::data::Envelope &envelope)
       { // &<variables> will be captured by reference (instead of value only)
-	      auto msg = cluon::extractMessage<opendlv::proxy::DistanceReading>(std::move(envelope));
 			// senderStamp 0 corresponds to front ultra-sound distance sensor
 	      const uint16_t senderStamp = envelope.senderStamp();
+	      serviceClock->observe(envelope.sampleTimeStamp());
+	      flightRecorder->record(msg, envelope.sampleTimeStamp(), senderStamp);
 	      currentDistance = msg.distance(); // Get the distance
 
 		// proceed only if senderStamp is 0 (front sensor)
@@ -181,21 +231,44 @@ int32_t main(int32_t argc, char **argv) {
 				if (currentSteering > MAXSTEER) { currentSteering = MAXSTEER; }
 
 				SetSteering(od4, currentSteering, VERBOSE);
+				if (safety_dist_triggered == false) { flightRecorder->trigger("safety-stop"); }
 				safety_dist_triggered = true; // used to override steering corrections
 				std::cout << "Obstacle too close: " << currentDistance << std::endl;
 				}
 				if (currentDistance > SAFETYDISTANCE) { safety_dist_triggered = false; }
+				// without a fused gap for a while, e.g. accSafeDistance stopped, only the reading above counts
+				if (cluon::time::toMicroseconds(envelope.sampleTimeStamp()) - lastLeadCarGap > 500000) { gap_closing_triggered = false; }
 			}
        }
    };
-	od4.dataTrigger(opendlv::proxy::DistanceReading::ID(), onFrontDistanceReading);
+	onMessage<opendlv::proxy::DistanceReading>(od4, onFrontDistanceReading);
+
+	// The gap fused from ultrasound and camera by accSafeDistance, at the rate of either sensor.
+	// Brakes when the lead car will be within the safety distance before the car can react,
+	// i.e. earlier the faster it closes in.
+	auto onLeadCarGap{[&od4, SAFETYDISTANCE, REACTIONTIME, VERBOSE, &gap_closing_triggered, &lastLeadCarGap](LeadCarGap &&msg, const cluon::data::Envelope &envelope)
+	{
+		lastLeadCarGap = cluon::time::toMicroseconds(envelope.sampleTimeStamp());
+		flightRecorder->record(msg, envelope.sampleTimeStamp());
+		float predictedGap = msg.gap() - std::max(0.0f, msg.closingSpeed()) * REACTIONTIME;
+		if (predictedGap <= SAFETYDISTANCE) {
+			if (gap_closing_triggered == false) {
+				std::cout << "Closing in on the lead car: " << msg.gap() << " m at " << msg.closingSpeed() << " m/s" << std::endl;
+				flightRecorder->trigger("safety-stop");
+			}
+			currentCarSpeed = 0.0;
+			MoveForward(od4, currentCarSpeed, VERBOSE);
+			gap_closing_triggered = true; // used to override speed corrections
+		}
+		else { gap_closing_triggered = false; }
+	}};
+	onMessage<LeadCarGap>(od4, onLeadCarGap);
 
 
 	//Bool message for stoping the car
-   auto onStopCar{[&od4, VERBOSE](cluon::data::Envelope &&envelope)
+   auto onStopCar{[&od4, VERBOSE](StopSignPresenceUpdate &&msg, const cluon::data::Envelope &)
             {
 		//if (!stopCarSent) {
-		auto msg = cluon::extractMessage<StopSignPresenceUpdate>(std::move(envelope));
 		bool stopSignPresence = msg.stopSignPresence(); // Get the bool
 
 			if (VERBOSE)
@@ -206,22 +279,23 @@ int32_t main(int32_t argc, char **argv) {
 			if (stopSignPresence==false){
 				//stopCarSent = true;
 				StopCar(od4, VERBOSE);
+				SetScenarioMode(od4, MODE_AT_STOP_LINE, VERBOSE);
 			}
 
 		//}
 	    }
         };
-        od4.dataTrigger(StopSignPresenceUpdate::ID(), onStopCar);
+        onMessage<StopSignPresenceUpdate>(od4, onStopCar);
 
 
 
 // [Relative PID for speed correction]
 	auto onSpeedCorrection {
-	    [&od4, VERBOSE, STARTSPEED, MAXSPEED, LOSTVISUAL, DECELERATE, &safety_dist_triggered](cluon::data::Envelope &&envelope)
+	    [&od4, VERBOSE, STARTSPEED, MAXSPEED, LOSTVISUAL, DECELERATE, &safety_dist_triggered, &gap_closing_triggered](SpeedCorrectionRequest &&msg, const cluon::data::Envelope &)
 	{
-    	if (safety_dist_triggered == false) {
+		flightRecorder->record(msg);
+    	if (safety_dist_triggered == false && gap_closing_triggered == false) {
 		    if (!standingStillForPeriodOfTime) { // Don't listen corrections if car was still for period of time
-			auto msg = cluon::extractMessage<SpeedCorrectionRequest>(std::move(envelope));
 			float amount = msg.amount(); // Get the amount
 
 				if (VERBOSE)
@@ -257,10 +331,10 @@ int32_t main(int32_t argc, char **argv) {
 // (Data trigger below)
 // [Absolute pid for speed was too fast]
 // Absolute pid steering
-	auto onSteeringCorrection{[&od4, VERBOSE, MAXSTEER, MINSTEER, MAXSPEED, STARTSPEED, LOSTVISUAL ](cluon::data::Envelope &&envelope)
+	auto onSteeringCorrection{[&od4, VERBOSE, MAXSTEER, MINSTEER, MAXSPEED, STARTSPEED, LOSTVISUAL ](SteeringCorrectionRequest &&msg, const cluon::data::Envelope &)
 	{
+		flightRecorder->record(msg);
 		if (!standingStillForPeriodOfTime) { // Don't listen corrections if car was still for period of time
-			auto msg = cluon::extractMessage<SteeringCorrectionRequest>(std::move(envelope));
 		  	float amount = msg.amount(); // Get the amount
 			if (VERBOSE)
 			{
@@ -314,15 +388,18 @@ int32_t main(int32_t argc, char **argv) {
 };
 
 // triggers - ordering is probably important
-       od4.dataTrigger(SteeringCorrectionRequest::ID(), onSteeringCorrection); //check steering correction first
-	    od4.dataTrigger(SpeedCorrectionRequest::ID(), onSpeedCorrection);
+       onMessage<SteeringCorrectionRequest>(od4, onSteeringCorrection); //check steering correction first
+	    onMessage<SpeedCorrectionRequest>(od4, onSpeedCorrection);
 
 
 
 	// Function to move forward to approach the stop line
-	auto onCarOutOfSight{[&od4, VERBOSE, STARTSPEED ](cluon::data::Envelope &&envelope)
+	auto onCarOutOfSight{[&od4, VERBOSE, STARTSPEED ](CarOutOfSight &&, const cluon::data::Envelope &)
 	{
-		auto msg = cluon::extractMessage<CarOutOfSight>(std::move(envelope));
+
+		if (scenarioMode == MODE_FOLLOWING) {
+			SetScenarioMode(od4, MODE_APPROACHING, VERBOSE);
+		}
 
 		if (standingStillForPeriodOfTime == true) {
 			if (VERBOSE)
@@ -334,19 +411,19 @@ int32_t main(int32_t argc, char **argv) {
 			MoveForward(od4, STARTSPEED, VERBOSE);
 		}
 	}};
-	od4.dataTrigger(CarOutOfSight::ID(), onCarOutOfSight);
+	onMessage<CarOutOfSight>(od4, onCarOutOfSight);
 
 
 		//Direction movments left /right /straight
-	auto onChooseDirectionRequest{[&od4, MAXSTEER, VERBOSE](cluon::data::Envelope &&envelope)
+	auto onChooseDirectionRequest{[&od4, MAXSTEER, VERBOSE](ChooseDirectionRequest &&msg, const cluon::data::Envelope &)
             {
-		auto msg = cluon::extractMessage<ChooseDirectionRequest>(std::move(envelope));
 		float direction = msg.direction(); // Get the amount
 
 			if (VERBOSE)
 			{
 		    		std::cout << "Received Direction message: " << std::endl;
 			}
+			SetScenarioMode(od4, MODE_CROSSING, VERBOSE);
 
 			if (direction == 1) {
 			TurnRight(od4, MAXSTEER, 0.12, VERBOSE, 2200, 1500);
@@ -359,14 +436,22 @@ int32_t main(int32_t argc, char **argv) {
 			else if (direction == 3) {
 			TurnLeft(od4, MAXSTEER, 0.12, VERBOSE, 1400, 2000, 2000);
 			}
+			SetScenarioMode(od4, MODE_FOLLOWING, VERBOSE); // intersection done, next scenario
 	    }
         };
-        od4.dataTrigger(ChooseDirectionRequest::ID(), onChooseDirectionRequest);
+        onMessage<ChooseDirectionRequest>(od4, onChooseDirectionRequest);
 
 
+        // Repeat the scenario mode every second so that restarted services pick it up.
+        SendScenarioMode(od4);
         while(od4.isRunning()) {
-
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+		SendScenarioMode(od4);
 		}
 		return 0;
 	}
 }
+
+#ifdef SERVICE_HOST
+} // namespace MoveCar
+#endif
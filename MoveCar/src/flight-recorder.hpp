@@ -0,0 +1,358 @@
+/*
+ * Copyright (C) 2019  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Flight recorder: keeps the last seconds of a service's downscaled frames, detections and
+// messages in memory, in rings allocated up front, and writes them out only when the service
+// triggers it, e.g. on a safety stop. Nothing touches the SD card in between. The file is a
+// .rec like cluon-rec writes, with the frames as raw BGR ImageReadings, so cluon-replay and
+// cluon-rec2csv read it. Include it after the message set.
+// This file is shared between the services; keep all copies identical.
+
+#ifndef FLIGHT_RECORDER_HPP
+#define FLIGHT_RECORDER_HPP
+
+#include "cluon-complete.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <initializer_list>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+const char FLIGHT_RECORDER_FOURCC[] = "BGR3";     // raw 8 bit BGR
+const int64_t FLIGHT_RECORDER_AFTER = 2000000;    // us recorded after a trigger
+const size_t FLIGHT_RECORDER_MESSAGE_BYTES = 128; // reserved per message, most are smaller
+
+// Encodes messages as cluon::ToProtoVisitor and envelopes as cluon::serializeEnvelope do, but
+// appends to strings the caller keeps, so that once those have grown nothing is allocated.
+class ProtoAppender {
+  private:
+   ProtoAppender(const ProtoAppender &) = delete;
+   ProtoAppender &operator=(const ProtoAppender &) = delete;
+
+  public:
+   ProtoAppender() : m_out{nullptr}, m_nested{}, m_depth{0} {}
+
+   template <typename T>
+   void append(T &message, std::string *out) {
+      m_out = out;
+      message.accept(*this);
+   }
+
+   // 0x0D 0xA4, the length of the envelope in three bytes, the envelope.
+   void appendEnvelope(int32_t dataType, const std::string &payload, cluon::data::TimeStamp sent, cluon::data::TimeStamp received,
+                       cluon::data::TimeStamp sampleTime, uint32_t senderStamp, std::string *out) {
+      m_out = out;
+      const size_t start = out->size();
+      out->append(5, '\0');
+      visit(1, std::string(), std::string(), dataType);
+      key(2, cluon::ProtoConstants::LENGTH_DELIMITED);
+      varint(payload.size());
+      out->append(payload);
+      nested(3, sent);
+      nested(4, received);
+      nested(5, sampleTime);
+      visit(6, std::string(), std::string(), senderStamp);
+      const size_t length = out->size() - start - 5;
+      (*out)[start] = static_cast<char>(0x0D);
+      (*out)[start + 1] = static_cast<char>(0xA4);
+      (*out)[start + 2] = static_cast<char>(length & 0xFF);
+      (*out)[start + 3] = static_cast<char>((length >> 8) & 0xFF);
+      (*out)[start + 4] = static_cast<char>((length >> 16) & 0xFF);
+   }
+
+   void preVisit(int32_t, const std::string &, const std::string &) {}
+   void postVisit() {}
+
+   void visit(uint32_t id, std::string &&, std::string &&, bool &v) { keyValue(id, v ? 1 : 0); }
+   void visit(uint32_t id, std::string &&, std::string &&, char &v) { keyValue(id, static_cast<uint8_t>(v)); }
+   void visit(uint32_t id, std::string &&, std::string &&, int8_t &v) { keyValue(id, static_cast<uint8_t>(zigZag(v))); }
+   void visit(uint32_t id, std::string &&, std::string &&, uint8_t &v) { keyValue(id, v); }
+   void visit(uint32_t id, std::string &&, std::string &&, int16_t &v) { keyValue(id, static_cast<uint16_t>(zigZag(v))); }
+   void visit(uint32_t id, std::string &&, std::string &&, uint16_t &v) { keyValue(id, v); }
+   void visit(uint32_t id, std::string &&, std::string &&, int32_t &v) { keyValue(id, static_cast<uint32_t>(zigZag(v))); }
+   void visit(uint32_t id, std::string &&, std::string &&, uint32_t &v) { keyValue(id, v); }
+   void visit(uint32_t id, std::string &&, std::string &&, int64_t &v) { keyValue(id, zigZag(v)); }
+   void visit(uint32_t id, std::string &&, std::string &&, uint64_t &v) { keyValue(id, v); }
+   void visit(uint32_t id, std::string &&, std::string &&, float &v) {
+      uint32_t bits;
+      std::memcpy(&bits, &v, sizeof(bits));
+      bits = htole32(bits);
+      key(id, cluon::ProtoConstants::FOUR_BYTES);
+      m_out->append(reinterpret_cast<const char *>(&bits), sizeof(bits));
+   }
+   void visit(uint32_t id, std::string &&, std::string &&, double &v) {
+      uint64_t bits;
+      std::memcpy(&bits, &v, sizeof(bits));
+      bits = htole64(bits);
+      key(id, cluon::ProtoConstants::EIGHT_BYTES);
+      m_out->append(reinterpret_cast<const char *>(&bits), sizeof(bits));
+   }
+   void visit(uint32_t id, std::string &&, std::string &&, std::string &v) {
+      key(id, cluon::ProtoConstants::LENGTH_DELIMITED);
+      varint(v.size());
+      m_out->append(v);
+   }
+   template <typename T>
+   void visit(uint32_t &id, std::string &&, std::string &&, T &value) { nested(id, value); }
+
+  private:
+   // Encoded into the buffer of its depth first, as its length comes before it.
+   template <typename T>
+   void nested(uint32_t id, T &value) {
+      if (m_nested.size() <= m_depth) { m_nested.emplace_back(); }
+      std::string *outer = m_out;
+      std::string &buffer = m_nested[m_depth++];
+      buffer.clear();
+      m_out = &buffer;
+      value.accept(*this);
+      m_out = outer;
+      m_depth--;
+      key(id, cluon::ProtoConstants::LENGTH_DELIMITED);
+      varint(buffer.size());
+      m_out->append(buffer);
+   }
+
+   static uint64_t zigZag(int64_t v) { return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63); }
+
+   void key(uint32_t id, cluon::ProtoConstants type) { varint((static_cast<uint64_t>(id) << 3) | static_cast<uint64_t>(type)); }
+   void keyValue(uint32_t id, uint64_t v) {
+      key(id, cluon::ProtoConstants::VARINT);
+      varint(v);
+   }
+   void varint(uint64_t v) {
+      while (v > 0x7F) {
+         m_out->push_back(static_cast<char>((v & 0x7F) | 0x80));
+         v >>= 7;
+      }
+      m_out->push_back(static_cast<char>(v));
+   }
+
+   std::string *m_out;
+   std::deque<std::string> m_nested; // by depth; a deque keeps the outer ones in place
+   size_t m_depth;
+};
+
+class FlightRecorder {
+  private:
+   FlightRecorder(const FlightRecorder &) = delete;
+   FlightRecorder &operator=(const FlightRecorder &) = delete;
+
+   struct RecordedMessage {
+      int64_t time{0};     // us, when recorded
+      std::string bytes{}; // serialised envelope
+   };
+   struct RecordedFrame {
+      int64_t time{0};
+      cluon::data::TimeStamp sampleTime{};
+      uint32_t width{0};
+      uint32_t height{0};
+      std::vector<char> data{};
+   };
+
+  public:
+   // An empty directory disables the recorder. A dump holds the seconds before the trigger;
+   // the rings hold those and FLIGHT_RECORDER_AFTER more, of messageRate messages and
+   // frameRate frames of up to frameBytes each. frameRate is 0 for services without camera.
+   // There are two of each ring: the recorder swaps in the spare ones when it writes a dump.
+   FlightRecorder(const std::string &service, const std::string &directory, double seconds, double messageRate, double frameRate, size_t frameBytes)
+      : m_service{service}, m_directory{directory}, m_window{static_cast<int64_t>(seconds * 1e6)},
+        m_messages(directory.empty() ? 0 : std::max<size_t>(1, static_cast<size_t>(heldSeconds(seconds) * messageRate))), m_nextMessage{0},
+        m_frames(directory.empty() ? 0 : static_cast<size_t>(heldSeconds(seconds) * frameRate)), m_nextFrame{0},
+        m_spareMessages(m_messages.size()), m_spareFrames(m_frames.size()), m_encoder{}, m_payload{},
+        m_mutex{}, m_wake{}, m_reason{}, m_dumpAt{0}, m_lastDump{std::numeric_limits<int64_t>::min() / 2}, m_stop{false}, m_writer{} {
+      for (std::vector<RecordedMessage> *ring : {&m_messages, &m_spareMessages}) {
+         for (RecordedMessage &message : *ring) { message.bytes.reserve(FLIGHT_RECORDER_MESSAGE_BYTES); }
+      }
+      for (std::vector<RecordedFrame> *ring : {&m_frames, &m_spareFrames}) {
+         for (RecordedFrame &frame : *ring) { frame.data.resize(frameBytes); }
+      }
+      m_payload.reserve(FLIGHT_RECORDER_MESSAGE_BYTES);
+      if (enabled()) { m_writer = std::thread([this]() { writeDumps(); }); }
+   }
+
+   ~FlightRecorder() {
+      if (m_writer.joinable()) {
+         {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+         }
+         m_wake.notify_all();
+         m_writer.join();
+      }
+   }
+
+   bool enabled() const { return !m_directory.empty(); }
+
+   // A message sent, received or noted by the service. It is encoded straight into its slot.
+   template <typename T>
+   void record(T &message, const cluon::data::TimeStamp &sampleTime = cluon::data::TimeStamp(), uint32_t senderStamp = 0) {
+      if (!enabled()) { return; }
+      const cluon::data::TimeStamp now = cluon::time::now();
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_payload.clear();
+      m_encoder.append(message, &m_payload);
+      RecordedMessage &slot = m_messages[m_nextMessage];
+      m_nextMessage = (m_nextMessage + 1) % m_messages.size();
+      slot.time = cluon::time::toMicroseconds(now);
+      slot.bytes.clear();
+      m_encoder.appendEnvelope(static_cast<int32_t>(T::ID()), m_payload, now, now,
+                               (0 == (sampleTime.seconds() + sampleTime.microseconds())) ? now : sampleTime, senderStamp, &slot.bytes);
+   }
+
+   // A downscaled BGR frame; it is copied into the ring, frames too large for a slot are left out.
+   void recordFrame(const cluon::data::TimeStamp &sampleTime, uint32_t width, uint32_t height, const void *bgr) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_frames.empty()) { return; }
+      RecordedFrame &slot = m_frames[m_nextFrame];
+      const size_t bytes = static_cast<size_t>(width) * height * 3;
+      if (bytes > slot.data.size()) { return; }
+      m_nextFrame = (m_nextFrame + 1) % m_frames.size();
+      slot.time = cluon::time::toMicroseconds(cluon::time::now());
+      slot.sampleTime = sampleTime;
+      slot.width = width;
+      slot.height = height;
+      std::memcpy(slot.data.data(), bgr, bytes);
+   }
+
+   // Writes the rings to <directory>/<service>-<reason>-<time>.rec, FLIGHT_RECORDER_AFTER
+   // from now so that the aftermath is in as well. Triggers while a dump is pending, or
+   // within the window of the last one, are in that file already and are ignored.
+   void trigger(const std::string &reason) {
+      if (!enabled()) { return; }
+      const int64_t now = cluon::time::toMicroseconds(cluon::time::now());
+      {
+         std::lock_guard<std::mutex> lock(m_mutex);
+         if (!m_reason.empty() || now - m_lastDump < m_window) { return; }
+         m_reason = reason;
+         m_dumpAt = now + FLIGHT_RECORDER_AFTER;
+      }
+      m_wake.notify_all();
+      std::clog << m_service << ": flight recorder triggered by " << reason << std::endl;
+   }
+
+  private:
+   static double heldSeconds(double seconds) { return seconds + static_cast<double>(FLIGHT_RECORDER_AFTER) / 1e6; }
+
+   void writeDumps() {
+      ProtoAppender encoder;
+      opendlv::proxy::ImageReading image;
+      std::string frameBytes, payload, envelope;
+      std::vector<std::pair<int64_t, size_t> > entries; // time and slot, frames after the messages
+      entries.reserve(m_messages.size() + m_frames.size());
+
+      std::unique_lock<std::mutex> lock(m_mutex);
+      while (!m_stop) {
+         const int64_t now = cluon::time::toMicroseconds(cluon::time::now());
+         if (m_reason.empty()) {
+            m_wake.wait(lock);
+            continue;
+         }
+         if (now < m_dumpAt) {
+            m_wake.wait_for(lock, std::chrono::microseconds(m_dumpAt - now));
+            continue;
+         }
+
+         // the service goes on recording into the cleared spare rings; those written out
+         // here are cleared afterwards and become the spare ones
+         std::swap(m_messages, m_spareMessages);
+         std::swap(m_frames, m_spareFrames);
+         m_nextMessage = 0;
+         m_nextFrame = 0;
+         const int64_t from = m_dumpAt - FLIGHT_RECORDER_AFTER - m_window;
+         std::string reason;
+         std::swap(reason, m_reason);
+         m_lastDump = m_dumpAt;
+         lock.unlock();
+
+         entries.clear();
+         for (size_t i = 0; i < m_spareMessages.size(); i++) {
+            if (!m_spareMessages[i].bytes.empty() && m_spareMessages[i].time >= from) { entries.push_back(std::make_pair(m_spareMessages[i].time, i)); }
+         }
+         for (size_t i = 0; i < m_spareFrames.size(); i++) {
+            if (m_spareFrames[i].width > 0 && m_spareFrames[i].time >= from) { entries.push_back(std::make_pair(m_spareFrames[i].time, m_spareMessages.size() + i)); }
+         }
+         std::stable_sort(entries.begin(), entries.end(), [](const std::pair<int64_t, size_t> &a, const std::pair<int64_t, size_t> &b) { return a.first < b.first; });
+
+         const std::string file = m_directory + "/" + m_service + "-" + reason + "-" + std::to_string(m_lastDump / 1000000) + ".rec";
+         std::ofstream out(file, std::ios::out | std::ios::binary | std::ios::trunc);
+         for (const auto &entry : entries) {
+            if (entry.second < m_spareMessages.size()) {
+               const std::string &bytes = m_spareMessages[entry.second].bytes;
+               out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+               continue;
+            }
+            const RecordedFrame &frame = m_spareFrames[entry.second - m_spareMessages.size()];
+            frameBytes.assign(frame.data.data(), static_cast<size_t>(frame.width) * frame.height * 3);
+            image.fourcc(FLIGHT_RECORDER_FOURCC).width(frame.width).height(frame.height).data(frameBytes);
+            payload.clear();
+            encoder.append(image, &payload);
+            envelope.clear();
+            const cluon::data::TimeStamp time = cluon::time::fromMicroseconds(frame.time);
+            encoder.appendEnvelope(static_cast<int32_t>(opendlv::proxy::ImageReading::ID()), payload, time, time, frame.sampleTime, 0, &envelope);
+            out.write(envelope.data(), static_cast<std::streamsize>(envelope.size()));
+         }
+         out.close();
+         if (out.fail()) {
+            std::cerr << m_service << ": flight recorder could not write " << file << std::endl;
+         } else {
+            std::clog << m_service << ": flight recorder wrote " << entries.size() << " envelopes to " << file << std::endl;
+         }
+
+         for (RecordedMessage &message : m_spareMessages) {
+            message.time = 0;
+            message.bytes.clear();
+         }
+         for (RecordedFrame &frame : m_spareFrames) {
+            frame.time = 0;
+            frame.width = 0;
+         }
+         lock.lock();
+      }
+   }
+
+   const std::string m_service;
+   const std::string m_directory;
+   const int64_t m_window;
+   std::vector<RecordedMessage> m_messages;
+   size_t m_nextMessage;
+   std::vector<RecordedFrame> m_frames;
+   size_t m_nextFrame;
+   std::vector<RecordedMessage> m_spareMessages; // owned by writeDumps between two swaps
+   std::vector<RecordedFrame> m_spareFrames;
+   ProtoAppender m_encoder; // and m_payload, for record()
+   std::string m_payload;
+   std::mutex m_mutex;
+   std::condition_variable m_wake;
+   std::string m_reason; // of the pending dump, empty if none
+   int64_t m_dumpAt;
+   int64_t m_lastDump;
+   bool m_stop;
+   std::thread m_writer;
+};
+
+#endif
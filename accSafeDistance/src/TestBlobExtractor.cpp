@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2019  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define CATCH_CONFIG_MAIN  // This tells Catch to provide a main() - only do this once per test-runner
+
+#include "catch.hpp"
+#include "blob-extraction.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+// The 8-connected blobs of a mask by a flood fill from every unlabelled foreground pixel.
+static std::vector<Blob> floodFillBlobs(const cv::Mat &mask) {
+   std::vector<Blob> blobs;
+   std::vector<bool> labelled(static_cast<size_t>(mask.rows * mask.cols), false);
+   for (int y0 = 0; y0 < mask.rows; y0++) {
+      for (int x0 = 0; x0 < mask.cols; x0++) {
+         if (mask.at<uint8_t>(y0, x0) == 0 || labelled[static_cast<size_t>(y0 * mask.cols + x0)]) { continue; }
+         double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0, syy = 0;
+         int left = x0, top = y0, right = x0 + 1, bottom = y0 + 1;
+         std::vector<cv::Point> stack{cv::Point(x0, y0)};
+         labelled[static_cast<size_t>(y0 * mask.cols + x0)] = true;
+         while (!stack.empty()) {
+            const cv::Point p = stack.back();
+            stack.pop_back();
+            n++;
+            sx += p.x;
+            sy += p.y;
+            sxx += p.x * p.x;
+            sxy += p.x * p.y;
+            syy += p.y * p.y;
+            left = std::min(left, p.x);
+            top = std::min(top, p.y);
+            right = std::max(right, p.x + 1);
+            bottom = std::max(bottom, p.y + 1);
+            for (int dy = -1; dy <= 1; dy++) {
+               for (int dx = -1; dx <= 1; dx++) {
+                  const int x = p.x + dx, y = p.y + dy;
+                  if (x < 0 || y < 0 || x >= mask.cols || y >= mask.rows) { continue; }
+                  if (mask.at<uint8_t>(y, x) == 0 || labelled[static_cast<size_t>(y * mask.cols + x)]) { continue; }
+                  labelled[static_cast<size_t>(y * mask.cols + x)] = true;
+                  stack.push_back(cv::Point(x, y));
+               }
+            }
+         }
+         const cv::Point2d centroid(sx / n, sy / n);
+         blobs.push_back(Blob{cv::Rect(left, top, right - left, bottom - top), n, centroid,
+            sxx / n - centroid.x * centroid.x, sxy / n - centroid.x * centroid.y, syy / n - centroid.y * centroid.y});
+      }
+   }
+   return blobs;
+}
+
+static std::vector<Blob> extractedBlobs(const cv::Mat &mask) {
+   std::vector<PixelRun> runs;
+   maskRuns(mask, runs);
+   BlobExtractor extractor;
+   std::vector<Blob> blobs;
+   extractor.extract(runs, blobs);
+   return blobs;
+}
+
+// Both lists in the same order, by the top left corner and then the area of the blobs.
+static void sortBlobs(std::vector<Blob> *blobs) {
+   std::sort(blobs->begin(), blobs->end(), [](const Blob &a, const Blob &b) {
+      if (a.box.y != b.box.y) { return a.box.y < b.box.y; }
+      if (a.box.x != b.box.x) { return a.box.x < b.box.x; }
+      return a.area < b.area;
+   });
+}
+
+TEST_CASE("Test BlobExtractor joins diagonal neighbours.") {
+   // a pixel down right and one down left of the one above, and one on its own
+   cv::Mat mask = cv::Mat::zeros(5, 5, CV_8UC1);
+   mask.at<uint8_t>(0, 0) = 255;
+   mask.at<uint8_t>(1, 1) = 255;
+   mask.at<uint8_t>(0, 4) = 255;
+   mask.at<uint8_t>(1, 3) = 255;
+   mask.at<uint8_t>(4, 0) = 255;
+   std::vector<Blob> blobs = extractedBlobs(mask);
+   sortBlobs(&blobs);
+   REQUIRE(blobs.size() == 3);
+   REQUIRE(blobs[0].box == cv::Rect(0, 0, 2, 2));
+   REQUIRE(blobs[0].area == Approx(2));
+   REQUIRE(blobs[1].box == cv::Rect(3, 0, 2, 2));
+   REQUIRE(blobs[1].area == Approx(2));
+   REQUIRE(blobs[2].box == cv::Rect(0, 4, 1, 1));
+}
+
+TEST_CASE("Test BlobExtractor joins the arms of a U.") {
+   // the arms are separate runs until the bottom row joins them
+   cv::Mat mask = cv::Mat::zeros(4, 5, CV_8UC1);
+   for (int y = 0; y < 4; y++) {
+      mask.at<uint8_t>(y, 0) = 255;
+      mask.at<uint8_t>(y, 4) = 255;
+   }
+   mask.row(3).setTo(255);
+   std::vector<Blob> blobs = extractedBlobs(mask);
+   REQUIRE(blobs.size() == 1);
+   REQUIRE(blobs[0].box == cv::Rect(0, 0, 5, 4));
+   REQUIRE(blobs[0].area == Approx(11));
+}
+
+TEST_CASE("Test BlobExtractor on an empty mask.") {
+   REQUIRE(extractedBlobs(cv::Mat::zeros(8, 8, CV_8UC1)).empty());
+}
+
+TEST_CASE("Test BlobExtractor finds the blobs of a flood fill.") {
+   std::mt19937 random(2019);
+   for (int trial = 0; trial < 300; trial++) {
+      const int rows = 1 + static_cast<int>(random() % 40);
+      const int cols = 1 + static_cast<int>(random() % 40);
+      const unsigned int density = random() % 100;
+      cv::Mat mask(rows, cols, CV_8UC1);
+      for (int y = 0; y < rows; y++) {
+         for (int x = 0; x < cols; x++) { mask.at<uint8_t>(y, x) = (random() % 100 < density) ? 255 : 0; }
+      }
+
+      std::vector<Blob> expected = floodFillBlobs(mask);
+      std::vector<Blob> blobs = extractedBlobs(mask);
+      REQUIRE(blobs.size() == expected.size());
+      sortBlobs(&expected);
+      sortBlobs(&blobs);
+      for (size_t i = 0; i < blobs.size(); i++) {
+         REQUIRE(blobs[i].box == expected[i].box);
+         REQUIRE(blobs[i].area == Approx(expected[i].area));
+         REQUIRE(blobs[i].centroid.x == Approx(expected[i].centroid.x));
+         REQUIRE(blobs[i].centroid.y == Approx(expected[i].centroid.y));
+         REQUIRE(blobs[i].mu20 == Approx(expected[i].mu20).margin(1e-6));
+         REQUIRE(blobs[i].mu11 == Approx(expected[i].mu11).margin(1e-6));
+         REQUIRE(blobs[i].mu02 == Approx(expected[i].mu02).margin(1e-6));
+      }
+   }
+}
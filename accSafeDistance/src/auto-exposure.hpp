@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2019  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Brightness and contrast of the camera frames, stretched so that clip_percent / 1.6 of the
+// pixels are clipped at each end of the range, as BrightnessAndContrastAuto (the answer on
+// answers.opencv.org this replaces in safe-distance) does. The light changes over seconds, not from one frame to the next: the range
+// is measured on a sparse grid of pixels every few frames only, and the black and white
+// points follow the measurements exponentially, so the contrast does not flicker and jitter
+// the HSV mask behind it. Every frame goes through a 256-entry LUT of the current alpha/beta.
+
+#ifndef AUTO_EXPOSURE_HPP
+#define AUTO_EXPOSURE_HPP
+
+#include "opencv2/core.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+const int EXPOSURE_GRID_STEP = 4;        // px between the pixels sampled, in x and y
+const int EXPOSURE_UPDATE_FRAMES = 5;    // frames from one measurement to the next
+const float EXPOSURE_SMOOTHING = 0.3f;   // of a measurement taken into the black and white points
+
+class AutoExposure {
+  private:
+   AutoExposure(const AutoExposure &) = delete;
+   AutoExposure &operator=(const AutoExposure &) = delete;
+
+  public:
+   // clip_percent as BrightnessAndContrastAuto's clipHistPercent: clip_percent / 1.6 at each end.
+   explicit AutoExposure(float clip_percent, int update_frames = EXPOSURE_UPDATE_FRAMES, float smoothing = EXPOSURE_SMOOTHING)
+      : m_clipPercent{clip_percent}, m_updateFrames{update_frames}, m_smoothing{smoothing}, m_frames{0}, m_measured{false},
+        m_black{0}, m_white{255}, m_alpha{1}, m_beta{0}, m_lut{} {
+      CV_Assert(clip_percent >= 0 && update_frames > 0 && smoothing > 0 && smoothing <= 1);
+   }
+
+   // dst = src * alpha + beta for a gray, BGR or BGRA frame; the alpha channel is kept.
+   void apply(const cv::Mat &src, cv::Mat &dst) {
+      CV_Assert(src.type() == CV_8UC1 || src.type() == CV_8UC3 || src.type() == CV_8UC4);
+      if (m_frames % static_cast<uint64_t>(m_updateFrames) == 0 || m_lut.channels() != src.channels()) {
+         float black = 0, white = 0;
+         if (measure(src, &black, &white)) {
+            // the first measurement is taken as it is
+            const float weight = m_measured ? m_smoothing : 1.0f;
+            m_black += weight * (black - m_black);
+            m_white += weight * (white - m_white);
+            m_measured = true;
+         }
+         updateLut(src.channels());
+      }
+      m_frames++;
+      cv::LUT(src, m_lut, dst);
+   }
+
+   // Starts over at the next frame, e.g. when the source changes.
+   void reset() {
+      m_frames = 0;
+      m_measured = false;
+      m_black = 0;
+      m_white = 255;
+   }
+
+   float alpha() const { return m_alpha; }
+   float beta() const { return m_beta; }
+
+  private:
+   // The gray values below which and above which clip_percent / 1.6 of the sampled pixels lie,
+   // false if the samples have one value only.
+   bool measure(const cv::Mat &src, float *black, float *white) const {
+      uint32_t histogram[256];
+      std::memset(histogram, 0, sizeof(histogram));
+      const int channels = src.channels();
+      uint32_t total = 0;
+      for (int y = EXPOSURE_GRID_STEP / 2; y < src.rows; y += EXPOSURE_GRID_STEP) {
+         const uint8_t *row = src.ptr<uint8_t>(y);
+         for (int x = EXPOSURE_GRID_STEP / 2; x < src.cols; x += EXPOSURE_GRID_STEP) {
+            const uint8_t *pixel = row + x * channels;
+            // the luma of cvtColor(COLOR_BGR2GRAY) in 14 bit fixed point
+            const int gray = (channels == 1) ? pixel[0] : (pixel[0] * 1868 + pixel[1] * 9617 + pixel[2] * 4899 + (1 << 13)) >> 14;
+            histogram[gray]++;
+            total++;
+         }
+      }
+      if (total == 0) { return false; }
+
+      // clip_percent / 1.6 at each end, as in BrightnessAndContrastAuto
+      const float clip = m_clipPercent * static_cast<float>(total) / 100.0f / 1.6f;
+      int low = 0;
+      uint32_t below = histogram[0];
+      while (low < 255 && static_cast<float>(below) < clip) { below += histogram[++low]; }
+      int high = 255;
+      uint32_t above = 0;
+      while (high > 0 && static_cast<float>(total - above) >= static_cast<float>(total) - clip) { above += histogram[high--]; }
+      if (high <= low) { return false; }
+      *black = static_cast<float>(low);
+      *white = static_cast<float>(high);
+      return true;
+   }
+
+   void updateLut(int channels) {
+      m_alpha = 255.0f / std::max(m_white - m_black, 1.0f);
+      m_beta = -m_black * m_alpha;
+      uint8_t stretched[256];
+      for (int i = 0; i < 256; i++) { stretched[i] = cv::saturate_cast<uint8_t>(static_cast<float>(i) * m_alpha + m_beta); }
+      m_lut.create(1, 256, CV_8UC(channels));
+      uint8_t *lut = m_lut.ptr<uint8_t>(0);
+      for (int i = 0; i < 256; i++) {
+         for (int c = 0; c < channels; c++) {
+            // the fourth channel is the alpha of the frame, it is passed through
+            lut[i * channels + c] = (c == 3) ? static_cast<uint8_t>(i) : stretched[i];
+         }
+      }
+   }
+
+   float m_clipPercent;
+   int m_updateFrames;
+   float m_smoothing;
+   uint64_t m_frames;
+   bool m_measured;
+   float m_black;
+   float m_white;
+   float m_alpha;
+   float m_beta;
+   cv::Mat m_lut;
+};
+
+#endif
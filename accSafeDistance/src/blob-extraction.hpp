@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2019  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Connected blobs of a colour mask from its runs of foreground pixels, without tracing the
+// contours of the mask. The runs come row by row, e.g. straight out of the segmentation;
+// a run joins the runs of the row above it touches (8-connected) through union-find, and
+// the sums of the pixel coordinates and their squares of every run are added up per blob.
+// The cost is in the number of runs, not the size of the frame.
+
+#ifndef BLOB_EXTRACTION_HPP
+#define BLOB_EXTRACTION_HPP
+
+#include "opencv2/core.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// The foreground pixels x0 to x1 - 1 of row y.
+struct PixelRun {
+   int y;
+   int x0;
+   int x1;
+};
+
+struct Blob {
+   cv::Rect box;
+   double area;          // pixels
+   cv::Point2d centroid;
+   double mu20;          // central second moments per pixel: the variance in x,
+   double mu11;          // the covariance
+   double mu02;          // and the variance in y
+};
+
+// Appends the runs of the non-zero pixels of a mask, row by row.
+inline void maskRuns(const cv::Mat &mask, std::vector<PixelRun> &runs) {
+   CV_Assert(mask.type() == CV_8UC1);
+   for (int y = 0; y < mask.rows; y++) {
+      const uint8_t *row = mask.ptr<uint8_t>(y);
+      int x = 0;
+      while (x < mask.cols) {
+         while (x < mask.cols && row[x] == 0) { x++; }
+         const int start = x;
+         while (x < mask.cols && row[x] != 0) { x++; }
+         if (x > start) { runs.push_back(PixelRun{y, start, x}); }
+      }
+   }
+}
+
+class BlobExtractor {
+  private:
+   BlobExtractor(const BlobExtractor &) = delete;
+   BlobExtractor &operator=(const BlobExtractor &) = delete;
+
+   struct Sums {
+      double n;
+      double x;
+      double y;
+      double xx;
+      double xy;
+      double yy;
+      int left;
+      int top;
+      int right; // exclusive
+      int bottom;
+   };
+
+  public:
+   BlobExtractor() : m_parent{}, m_sums{} {}
+
+   // The blobs of at least min_area pixels of runs in row order, in x order within a row;
+   // the buffers are kept from call to call.
+   void extract(const std::vector<PixelRun> &runs, std::vector<Blob> &blobs, double min_area = 1) {
+      blobs.clear();
+      m_parent.resize(runs.size());
+      size_t above = 0, aboveEnd = 0, rowStart = 0;
+      for (size_t i = 0; i < runs.size(); i++) {
+         const PixelRun &run = runs[i];
+         if (i == 0 || run.y != runs[i - 1].y) {
+            // a new row; the one before is the row above only if it is adjacent
+            const bool adjacent = (i > 0 && run.y == runs[i - 1].y + 1);
+            above = adjacent ? rowStart : i;
+            aboveEnd = i;
+            rowStart = i;
+         }
+         m_parent[i] = i;
+         // the runs above that end left of this one do not touch the next ones of the row either
+         while (above < aboveEnd && runs[above].x1 < run.x0) { above++; }
+         for (size_t j = above; j < aboveEnd && runs[j].x0 <= run.x1; j++) { unite(i, j); }
+      }
+
+      // the sums of every run into its root
+      m_sums.assign(runs.size(), Sums{0, 0, 0, 0, 0, 0, INT_MAX, INT_MAX, INT_MIN, INT_MIN});
+      for (size_t i = 0; i < runs.size(); i++) {
+         const PixelRun &run = runs[i];
+         Sums &sums = m_sums[find(i)];
+         const double n = run.x1 - run.x0;
+         const double y = run.y;
+         const double x = n * (run.x0 + run.x1 - 1) / 2;
+         sums.n += n;
+         sums.x += x;
+         sums.y += n * y;
+         sums.xx += squares(run.x1 - 1) - squares(run.x0 - 1);
+         sums.xy += x * y;
+         sums.yy += n * y * y;
+         sums.left = std::min(sums.left, run.x0);
+         sums.top = std::min(sums.top, run.y);
+         sums.right = std::max(sums.right, run.x1);
+         sums.bottom = std::max(sums.bottom, run.y + 1);
+      }
+      for (size_t i = 0; i < runs.size(); i++) {
+         const Sums &sums = m_sums[i];
+         if (m_parent[i] != i || sums.n < min_area) { continue; }
+         const cv::Point2d centroid(sums.x / sums.n, sums.y / sums.n);
+         blobs.push_back(Blob{cv::Rect(sums.left, sums.top, sums.right - sums.left, sums.bottom - sums.top), sums.n, centroid,
+            sums.xx / sums.n - centroid.x * centroid.x, sums.xy / sums.n - centroid.x * centroid.y, sums.yy / sums.n - centroid.y * centroid.y});
+      }
+   }
+
+  private:
+   // 0^2 + 1^2 + ... + k^2
+   static double squares(int k) {
+      const double d = k;
+      return d * (d + 1) * (2 * d + 1) / 6;
+   }
+
+   size_t find(size_t i) {
+      while (m_parent[i] != i) {
+         m_parent[i] = m_parent[m_parent[i]];
+         i = m_parent[i];
+      }
+      return i;
+   }
+
+   // the root with the lower index stays, so a root is always the first run of its blob
+   void unite(size_t a, size_t b) {
+      a = find(a);
+      b = find(b);
+      if (a < b) { m_parent[b] = a; }
+      if (b < a) { m_parent[a] = b; }
+   }
+
+   std::vector<size_t> m_parent;
+   std::vector<Sums> m_sums;
+};
+
+#endif
@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2019  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Follows a detected box from frame to frame with pyramidal Lucas-Kanade optical flow, so
+// that the full detection only runs every few frames. Corners inside the box are seeded on
+// the frame it was detected on; each frame they are tracked forward and back on a small
+// region around the box, and those that come back to where they started move the box: its
+// centre by their median shift, its size by the median change of their distances to each
+// other. The box is lost, and has to be detected again, when too few corners survive.
+// A plain marker has corners at its own corners only, so they are also seeded on a margin
+// around the box, on what carries the marker.
+
+#ifndef BOX_TRACKER_HPP
+#define BOX_TRACKER_HPP
+
+#include "opencv2/core.hpp"
+#include "opencv2/imgproc.hpp"
+#include "opencv2/video/tracking.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+const int TRACK_FEATURES = 24;            // corners seeded inside a detected box
+const int TRACK_MIN_FEATURES = 6;         // corners that have to survive
+const double TRACK_MIN_SURVIVING = 0.5;   // of the corners seeded
+const double TRACK_SEED_MARGIN = 0.25;    // of the box size on every side, where corners are seeded
+const double TRACK_MARGIN = 0.5;          // of the box size on every side, the region of the flow
+const float TRACK_MAX_BACK_ERROR = 1.0f;  // px between a corner and where it is tracked back to
+const double TRACK_MAX_SCALE_STEP = 1.25; // a larger change of the box size in one frame is lost
+const int TRACK_WINDOW = 11;              // px, the Lucas-Kanade window
+const int TRACK_LEVELS = 2;               // pyramid levels above the frame
+
+class BoxTracker {
+  private:
+   BoxTracker(const BoxTracker &) = delete;
+   BoxTracker &operator=(const BoxTracker &) = delete;
+
+  public:
+   // max_frames is how many frames a box is followed before it has to be detected again.
+   explicit BoxTracker(int max_frames)
+      : m_maxFrames{max_frames}, m_frames{0}, m_seeded{0}, m_frameSize{}, m_box{}, m_region{}, m_previous{}, m_next{}, m_points{},
+        m_tracked{}, m_back{}, m_status{}, m_backStatus{}, m_errors{} {}
+
+   // Starts following box, detected on frame (BGR, BGRA or gray). False if the box has too
+   // few corners to follow.
+   bool reset(const cv::Mat &frame, const cv::Rect2d &box) {
+      clear();
+      if (m_maxFrames <= 0) { return false; }
+      m_frameSize = frame.size();
+      m_box = box;
+      m_region = regionOf(box, TRACK_MARGIN);
+      const cv::Rect seeds = regionOf(box, TRACK_SEED_MARGIN);
+      if (seeds.width < TRACK_WINDOW || seeds.height < TRACK_WINDOW) { return false; }
+      regionGray(frame, m_region, m_previous);
+      cv::Mat mask = cv::Mat::zeros(m_previous.size(), CV_8UC1);
+      mask(seeds - m_region.tl()).setTo(255);
+      const double spacing = std::max(2.0, std::min(box.width, box.height) / 8);
+      cv::goodFeaturesToTrack(m_previous, m_points, TRACK_FEATURES, 0.01, spacing, mask);
+      m_seeded = m_points.size();
+      return m_seeded >= static_cast<size_t>(TRACK_MIN_FEATURES);
+   }
+
+   // Moves the box into frame, the one after the last. False if it is lost or was followed
+   // for max_frames; either way the next box has to come from a detection.
+   bool track(const cv::Mat &frame, cv::Rect2d *box) {
+      if (m_seeded < static_cast<size_t>(TRACK_MIN_FEATURES) || m_frames >= m_maxFrames || frame.size() != m_frameSize) {
+         clear();
+         return false;
+      }
+      regionGray(frame, m_region, m_next);
+      const cv::Size window(TRACK_WINDOW, TRACK_WINDOW);
+      cv::calcOpticalFlowPyrLK(m_previous, m_next, m_points, m_tracked, m_status, m_errors, window, TRACK_LEVELS);
+      cv::calcOpticalFlowPyrLK(m_next, m_previous, m_tracked, m_back, m_backStatus, m_errors, window, TRACK_LEVELS);
+
+      // the corners that come back to where they started
+      std::vector<cv::Point2f> from, to;
+      for (size_t i = 0; i < m_points.size(); i++) {
+         const cv::Point2f miss = m_back[i] - m_points[i];
+         if (m_status[i] != 0 && m_backStatus[i] != 0 && miss.dot(miss) <= TRACK_MAX_BACK_ERROR * TRACK_MAX_BACK_ERROR) {
+            from.push_back(m_points[i]);
+            to.push_back(m_tracked[i]);
+         }
+      }
+      if (from.size() < static_cast<size_t>(TRACK_MIN_FEATURES) || from.size() < TRACK_MIN_SURVIVING * static_cast<double>(m_seeded)) {
+         clear();
+         return false;
+      }
+
+      std::vector<double> dx, dy, ratios;
+      for (size_t i = 0; i < from.size(); i++) {
+         dx.push_back(to[i].x - from[i].x);
+         dy.push_back(to[i].y - from[i].y);
+         for (size_t j = i + 1; j < from.size(); j++) {
+            const double before = cv::norm(from[i] - from[j]);
+            if (before > 1) { ratios.push_back(cv::norm(to[i] - to[j]) / before); }
+         }
+      }
+      const double scale = ratios.empty() ? 1.0 : median(&ratios);
+      if (scale > TRACK_MAX_SCALE_STEP || scale < 1 / TRACK_MAX_SCALE_STEP) {
+         clear();
+         return false;
+      }
+      const cv::Point2d centre(m_box.x + m_box.width / 2 + median(&dx), m_box.y + m_box.height / 2 + median(&dy));
+      const cv::Rect2d moved(centre.x - m_box.width * scale / 2, centre.y - m_box.height * scale / 2, m_box.width * scale, m_box.height * scale);
+      if ((moved & cv::Rect2d(0, 0, m_frameSize.width, m_frameSize.height)).area() < 0.5 * moved.area()) {
+         clear(); // mostly out of the frame
+         return false;
+      }
+
+      // the surviving corners where they were seeded are followed on, on the region of the moved box
+      const cv::Rect2d seeds = padded(moved, TRACK_SEED_MARGIN);
+      const cv::Rect region = regionOf(moved, TRACK_MARGIN);
+      m_points.clear();
+      for (const cv::Point2f &point : to) {
+         const cv::Point2f inFrame(point.x + static_cast<float>(m_region.x), point.y + static_cast<float>(m_region.y));
+         if (seeds.contains(inFrame) && region.contains(cv::Point(inFrame))) {
+            m_points.push_back(cv::Point2f(inFrame.x - static_cast<float>(region.x), inFrame.y - static_cast<float>(region.y)));
+         }
+      }
+      if (region == m_region) {
+         std::swap(m_previous, m_next);
+      } else {
+         regionGray(frame, region, m_previous);
+      }
+      m_region = region;
+      m_box = moved;
+      m_frames++;
+      *box = moved;
+      return true;
+   }
+
+   void clear() {
+      m_frames = 0;
+      m_seeded = 0;
+      m_points.clear();
+   }
+
+   // Share of the seeded corners still followed.
+   double confidence() const { return (m_seeded == 0) ? 0 : static_cast<double>(m_points.size()) / static_cast<double>(m_seeded); }
+
+  private:
+   static cv::Rect2d padded(const cv::Rect2d &box, double margin) {
+      return cv::Rect2d(box.x - box.width * margin, box.y - box.height * margin, box.width * (1 + 2 * margin), box.height * (1 + 2 * margin));
+   }
+
+   // The padded box in the frame.
+   cv::Rect regionOf(const cv::Rect2d &box, double margin) const {
+      return cv::Rect(padded(box, margin)) & cv::Rect(0, 0, m_frameSize.width, m_frameSize.height);
+   }
+
+   static void regionGray(const cv::Mat &frame, const cv::Rect &region, cv::Mat &gray) {
+      if (frame.channels() == 4) {
+         cv::cvtColor(frame(region), gray, cv::COLOR_BGRA2GRAY);
+      } else if (frame.channels() == 3) {
+         cv::cvtColor(frame(region), gray, cv::COLOR_BGR2GRAY);
+      } else {
+         frame(region).copyTo(gray);
+      }
+   }
+
+   static double median(std::vector<double> *values) {
+      std::nth_element(values->begin(), values->begin() + static_cast<std::ptrdiff_t>(values->size() / 2), values->end());
+      return (*values)[values->size() / 2];
+   }
+
+   int m_maxFrames;
+   int m_frames;
+   size_t m_seeded;
+   cv::Size m_frameSize;
+   cv::Rect2d m_box;
+   cv::Rect m_region;
+   cv::Mat m_previous;                 // gray of the region on the last frame
+   cv::Mat m_next;
+   std::vector<cv::Point2f> m_points;  // corners on the last frame, in the region
+   std::vector<cv::Point2f> m_tracked;
+   std::vector<cv::Point2f> m_back;
+   std::vector<uint8_t> m_status;
+   std::vector<uint8_t> m_backStatus;
+   std::vector<float> m_errors;
+};
+
+#endif
@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2019  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// The colour masks of the markers in one pass over the frame, instead of a cvtColor to HSV
+// and an inRange per colour. The HSV ranges are evaluated once, on the centre colour of
+// every cell of a quantised colour cube; each pixel then looks its cell up in the table and
+// gets the masks of all ranges its colour is in, or their runs for the blob extraction. With
+// 5 bits per channel the table has 32K entries and stays in the L1 cache; the edges of the
+// ranges move by up to half a cell.
+
+#ifndef COLOR_SEGMENTATION_HPP
+#define COLOR_SEGMENTATION_HPP
+
+#include "blob-extraction.hpp"
+
+#include "opencv2/core.hpp"
+#include "opencv2/imgproc.hpp"
+
+#include <cstdint>
+#include <vector>
+
+const int COLOR_CLASSES_MAX = 8; // one bit of a table entry each
+
+class ColorSegmenter {
+  private:
+   ColorSegmenter(const ColorSegmenter &) = delete;
+   ColorSegmenter &operator=(const ColorSegmenter &) = delete;
+
+  public:
+   // hsv_code is the conversion the ranges were tuned with, e.g. COLOR_RGB2HSV; the channels
+   // of the frames are taken in the order it takes them. bits are per channel, 4 to 6.
+   explicit ColorSegmenter(int hsv_code, int bits = 5) : m_bits{bits}, m_shift{8 - bits}, m_classes{0}, m_cells{}, m_table{} {
+      CV_Assert(bits >= 4 && bits <= 6);
+      const int levels = 1 << bits;
+      const int half = (1 << m_shift) / 2;
+      cv::Mat centres(1, levels * levels * levels, CV_8UC3);
+      cv::Vec3b *centre = centres.ptr<cv::Vec3b>(0);
+      for (int c0 = 0; c0 < levels; c0++) {
+         for (int c1 = 0; c1 < levels; c1++) {
+            for (int c2 = 0; c2 < levels; c2++) {
+               *centre++ = cv::Vec3b(static_cast<uint8_t>((c0 << m_shift) + half), static_cast<uint8_t>((c1 << m_shift) + half),
+                                     static_cast<uint8_t>((c2 << m_shift) + half));
+            }
+         }
+      }
+      cv::cvtColor(centres, m_cells, hsv_code);
+      m_table.assign(centres.total(), 0);
+   }
+
+   // Adds the colours inRange(hsv, low, high) would let through; returns the class, which is
+   // the index of its mask in segment().
+   int addClass(const cv::Scalar &low, const cv::Scalar &high) {
+      CV_Assert(m_classes < COLOR_CLASSES_MAX);
+      const uint8_t bit = static_cast<uint8_t>(1 << m_classes);
+      const cv::Vec3b *cell = m_cells.ptr<cv::Vec3b>(0);
+      for (size_t i = 0; i < m_table.size(); i++) {
+         bool inside = true;
+         for (int c = 0; c < 3; c++) { inside = inside && cell[i][c] >= low[c] && cell[i][c] <= high[c]; }
+         if (inside) { m_table[i] |= bit; }
+      }
+      return m_classes++;
+   }
+
+   int classes() const { return m_classes; }
+
+   // One mask per class of a BGR or BGRA frame, 255 where the colour is in the class's range.
+   void segment(const cv::Mat &frame, std::vector<cv::Mat> &masks) const {
+      CV_Assert(frame.depth() == CV_8U && (frame.channels() == 3 || frame.channels() == 4));
+      const int channels = frame.channels();
+      masks.resize(static_cast<size_t>(m_classes));
+      for (cv::Mat &mask : masks) { mask.create(frame.size(), CV_8UC1); }
+      uint8_t *out[COLOR_CLASSES_MAX];
+      for (int y = 0; y < frame.rows; y++) {
+         const uint8_t *pixel = frame.ptr<uint8_t>(y);
+         for (int c = 0; c < m_classes; c++) { out[c] = masks[static_cast<size_t>(c)].ptr<uint8_t>(y); }
+         for (int x = 0; x < frame.cols; x++, pixel += channels) {
+            const uint8_t code = m_table[static_cast<size_t>(((pixel[0] >> m_shift) << (2 * m_bits)) | ((pixel[1] >> m_shift) << m_bits) | (pixel[2] >> m_shift))];
+            for (int c = 0; c < m_classes; c++) { out[c][x] = static_cast<uint8_t>(((code >> c) & 1) * 255); }
+         }
+      }
+   }
+
+   // The same as the runs of the masks (see blob-extraction.hpp), without writing the masks;
+   // the runs of every class are in row order.
+   void segmentRuns(const cv::Mat &frame, std::vector<std::vector<PixelRun> > &runs) const {
+      CV_Assert(frame.depth() == CV_8U && (frame.channels() == 3 || frame.channels() == 4));
+      const int channels = frame.channels();
+      runs.resize(static_cast<size_t>(m_classes));
+      for (std::vector<PixelRun> &classRuns : runs) { classRuns.clear(); }
+      int start[COLOR_CLASSES_MAX] = {0};
+      for (int y = 0; y < frame.rows; y++) {
+         const uint8_t *pixel = frame.ptr<uint8_t>(y);
+         uint8_t previous = 0;
+         for (int x = 0; x < frame.cols; x++, pixel += channels) {
+            const uint8_t code = m_table[static_cast<size_t>(((pixel[0] >> m_shift) << (2 * m_bits)) | ((pixel[1] >> m_shift) << m_bits) | (pixel[2] >> m_shift))];
+            if (code == previous) { continue; }
+            // a run of some class starts or ends here
+            for (int c = 0; c < m_classes; c++) {
+               const int bit = 1 << c;
+               if ((code & bit) != 0 && (previous & bit) == 0) { start[c] = x; }
+               if ((code & bit) == 0 && (previous & bit) != 0) { runs[static_cast<size_t>(c)].push_back(PixelRun{y, start[c], x}); }
+            }
+            previous = code;
+         }
+         for (int c = 0; c < m_classes; c++) {
+            if ((previous & (1 << c)) != 0) { runs[static_cast<size_t>(c)].push_back(PixelRun{y, start[c], frame.cols}); }
+         }
+      }
+   }
+
+  private:
+   int m_bits;
+   int m_shift;
+   int m_classes;
+   cv::Mat m_cells;              // the HSV of the centre of every cell
+   std::vector<uint8_t> m_table; // a bit per class for every cell
+};
+
+#endif
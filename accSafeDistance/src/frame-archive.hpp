@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2019  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Decoded frames of a recording in one flat file, so that benchmarks and replays at full
+// speed do not decode h264 every run. frame-archiver writes it once; FrameArchive maps it
+// and hands out the frames in place as cv::Mat, as BGRA like on the shared memory area.
+// This file is shared between the services; keep all copies identical.
+
+#ifndef FRAME_ARCHIVE_HPP
+#define FRAME_ARCHIVE_HPP
+
+#include "opencv2/core.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// File layout: a FrameArchiveHeader, the frames at a fixed stride, each starting on a page
+// boundary, and the sample times of the frames as int64 microseconds. The file is written
+// in the byte order of the machine that writes it.
+const uint32_t FRAME_ARCHIVE_MAGIC = 0x41524644; // "DFRA" when read little endian
+const uint32_t FRAME_ARCHIVE_VERSION = 1;
+const uint64_t FRAME_ARCHIVE_ALIGNMENT = 4096;
+
+struct FrameArchiveHeader {
+   uint32_t magic;
+   uint32_t version;
+   uint32_t width;
+   uint32_t height;
+   uint32_t channels;      // 4, BGRA
+   uint32_t row_bytes;
+   uint64_t frame_stride;  // bytes from one frame to the next
+   uint64_t frame_count;
+   uint64_t frames_offset; // bytes from the start of the file
+   uint64_t index_offset;
+   uint64_t file_size;
+};
+
+inline uint64_t frameArchiveAligned(uint64_t offset) {
+   return (offset + FRAME_ARCHIVE_ALIGNMENT - 1) / FRAME_ARCHIVE_ALIGNMENT * FRAME_ARCHIVE_ALIGNMENT;
+}
+
+// Appends BGRA frames of one size; the header and the index are written by close().
+class FrameArchiveWriter {
+  private:
+   FrameArchiveWriter(const FrameArchiveWriter &) = delete;
+   FrameArchiveWriter &operator=(const FrameArchiveWriter &) = delete;
+
+  public:
+   FrameArchiveWriter() : m_file{}, m_header(), m_times{}, m_padding{} {}
+
+   bool open(const std::string &path, uint32_t width, uint32_t height) {
+      m_file.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+      m_header = FrameArchiveHeader();
+      m_header.magic = FRAME_ARCHIVE_MAGIC;
+      m_header.version = FRAME_ARCHIVE_VERSION;
+      m_header.width = width;
+      m_header.height = height;
+      m_header.channels = 4;
+      m_header.row_bytes = width * 4;
+      m_header.frame_stride = frameArchiveAligned(static_cast<uint64_t>(m_header.row_bytes) * height);
+      m_header.frames_offset = frameArchiveAligned(sizeof(FrameArchiveHeader));
+      m_times.clear();
+      m_padding.assign(static_cast<size_t>(m_header.frames_offset), 0);
+      m_file.write(m_padding.data(), static_cast<std::streamsize>(m_padding.size())); // the header goes here
+      return m_file.good();
+   }
+
+   // A BGRA frame of the size given to open().
+   bool add(const cv::Mat &frame, int64_t sampleTime) {
+      if (frame.type() != CV_8UC4 || frame.cols != static_cast<int>(m_header.width) || frame.rows != static_cast<int>(m_header.height)) { return false; }
+      for (int row = 0; row < frame.rows; row++) {
+         m_file.write(frame.ptr<char>(row), static_cast<std::streamsize>(m_header.row_bytes));
+      }
+      const uint64_t bytes = static_cast<uint64_t>(m_header.row_bytes) * m_header.height;
+      m_padding.assign(static_cast<size_t>(m_header.frame_stride - bytes), 0);
+      m_file.write(m_padding.data(), static_cast<std::streamsize>(m_padding.size()));
+      m_times.push_back(sampleTime);
+      return m_file.good();
+   }
+
+   uint64_t count() const { return m_times.size(); }
+
+   bool close() {
+      m_header.frame_count = m_times.size();
+      m_header.index_offset = m_header.frames_offset + m_header.frame_count * m_header.frame_stride;
+      m_header.file_size = m_header.index_offset + m_header.frame_count * sizeof(int64_t);
+      m_file.write(reinterpret_cast<const char *>(m_times.data()), static_cast<std::streamsize>(m_times.size() * sizeof(int64_t)));
+      m_file.seekp(0);
+      m_file.write(reinterpret_cast<const char *>(&m_header), sizeof(m_header));
+      m_file.close();
+      return !m_file.fail();
+   }
+
+  private:
+   std::ofstream m_file;
+   FrameArchiveHeader m_header;
+   std::vector<int64_t> m_times;
+   std::vector<char> m_padding;
+};
+
+// A memory-mapped archive. The frames are views into the mapping; the mapping is private,
+// so a caller writing to a frame gets its own copy of those pages and the file is left alone.
+class FrameArchive {
+  private:
+   FrameArchive(const FrameArchive &) = delete;
+   FrameArchive &operator=(const FrameArchive &) = delete;
+
+  public:
+   FrameArchive() : m_map{nullptr}, m_size{0}, m_header{nullptr} {}
+   ~FrameArchive() { unload(); }
+
+   bool load(const std::string &path) {
+      unload();
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0) { return false; }
+      struct stat info;
+      if (::fstat(fd, &info) != 0 || info.st_size < static_cast<off_t>(sizeof(FrameArchiveHeader))) {
+         ::close(fd);
+         return false;
+      }
+      void *map = ::mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+      if (map == MAP_FAILED) { return false; }
+      m_map = map;
+      m_size = static_cast<size_t>(info.st_size);
+      m_header = static_cast<const FrameArchiveHeader *>(m_map);
+      if (!valid()) {
+         unload();
+         return false;
+      }
+      // read front to back; the kernel reads ahead and drops what is behind
+      ::madvise(m_map, m_size, MADV_SEQUENTIAL);
+      return true;
+   }
+
+   bool empty() const { return m_header == nullptr; }
+   size_t size() const { return (m_header == nullptr) ? 0 : static_cast<size_t>(m_header->frame_count); }
+   cv::Size frameSize() const { return cv::Size(static_cast<int>(m_header->width), static_cast<int>(m_header->height)); }
+
+   cv::Mat frame(size_t i) const {
+      char *data = static_cast<char *>(m_map) + m_header->frames_offset + i * m_header->frame_stride;
+      return cv::Mat(static_cast<int>(m_header->height), static_cast<int>(m_header->width), CV_8UC4, data, m_header->row_bytes);
+   }
+
+   // Sample time of a frame in microseconds.
+   int64_t time(size_t i) const {
+      return reinterpret_cast<const int64_t *>(static_cast<const char *>(m_map) + m_header->index_offset)[i];
+   }
+
+  private:
+   bool valid() const {
+      const FrameArchiveHeader &h = *m_header;
+      if (h.magic != FRAME_ARCHIVE_MAGIC || h.version != FRAME_ARCHIVE_VERSION || h.file_size != m_size || h.channels != 4) { return false; }
+      if (h.row_bytes != h.width * 4 || h.frame_stride < static_cast<uint64_t>(h.row_bytes) * h.height) { return false; }
+      return h.index_offset == h.frames_offset + h.frame_count * h.frame_stride &&
+             h.file_size == h.index_offset + h.frame_count * sizeof(int64_t);
+   }
+
+   void unload() {
+      if (m_map != nullptr) { ::munmap(m_map, m_size); }
+      m_map = nullptr;
+      m_size = 0;
+      m_header = nullptr;
+   }
+
+   void *m_map;
+   size_t m_size;
+   const FrameArchiveHeader *m_header;
+};
+
+#endif
@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2019  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Fuses the front ultrasonic sensor with the lead car box of the camera into one estimate of
+// the gap to the lead car and how fast it closes. The ultrasound is precise but short-sighted
+// and sees anything in front; the camera sees the lead car farther away but late, noisy and
+// only as an area. A constant velocity Kalman filter over [gap, rate] runs on every reading
+// of either sensor. Readings are kept in timestamped rings so that a camera measurement,
+// which arrives a frame's processing time after it was taken, is still applied in the order
+// it was taken: everything younger than FUSION_LAG is filtered again from a checkpoint.
+
+#ifndef GAP_FUSION_HPP
+#define GAP_FUSION_HPP
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+// The last SIZE samples of a sensor, oldest first.
+template <typename T, size_t SIZE>
+class TimedRing {
+  public:
+   TimedRing() : m_items{}, m_next{0}, m_count{0} {}
+
+   void push(const T &item) {
+      m_items[m_next] = item;
+      m_next = (m_next + 1) % SIZE;
+      if (m_count < SIZE) { m_count++; }
+   }
+   void clear() { m_next = 0; m_count = 0; }
+
+   size_t size() const { return m_count; }
+   bool empty() const { return m_count == 0; }
+   const T &operator[](size_t i) const { return m_items[(m_next + SIZE - m_count + i) % SIZE]; }
+   const T &back() const { return (*this)[m_count - 1]; }
+
+  private:
+   std::array<T, SIZE> m_items;
+   size_t m_next;
+   size_t m_count;
+};
+
+struct TimedSample {
+   int64_t time; // microseconds
+   float value;
+};
+
+struct GapEstimate {
+   int64_t time;       // microseconds
+   float gap;          // metres to the lead car
+   float closingSpeed; // metres per second, positive while the gap shrinks
+   float deviation;    // standard deviation of the gap in metres
+};
+
+const int64_t FUSION_LAG = 250000;          // us; camera readings older than this are dropped
+const int64_t FUSION_MAX_AGE = 500000;      // us without a reading before the estimate is void
+const int64_t FUSION_RESTART = 1000000;     // us backwards in time, e.g. a replay starting over
+const int64_t CALIBRATION_WINDOW = 50000;   // us between an ultrasound and a camera reading
+const double ULTRASOUND_DEVIATION = 0.02;   // m
+const double VISION_DEVIATION = 0.15;       // of the gap
+const double ACCELERATION_NOISE = 1.5;      // m/s^2 of the lead car and ourselves
+const double INITIAL_RATE_DEVIATION = 1.0;  // m/s
+const double FUSION_GATE = 9.0;             // squared innovation in variances, 3 sigma
+const int MAX_REJECTED = 3;                 // readings outside the gate before starting over
+const double CALIBRATION_RATE = 0.05;
+
+class GapEstimator {
+  private:
+   GapEstimator(const GapEstimator &) = delete;
+   GapEstimator &operator=(const GapEstimator &) = delete;
+
+   struct FilterState {
+      int64_t time;
+      double gap;
+      double rate; // of the gap, negative while closing
+      double p00;
+      double p01;
+      double p11;
+      int rejected;
+      bool initialised;
+   };
+   typedef TimedRing<TimedSample, 64> SampleRing;
+
+  public:
+   // The camera gap is vision_scale / sqrt(normalised box area). The scale is a starting
+   // value; it is calibrated against the ultrasound whenever both see the lead car.
+   GapEstimator(float vision_scale, float ultrasound_range)
+      : m_mutex{}, m_ultrasound{}, m_vision{}, m_checkpoint{}, m_current{}, m_visionScale{vision_scale}, m_ultrasoundRange{ultrasound_range} {
+      reset();
+   }
+
+   // Readings beyond the range of the sensor are echoes of nothing and left out.
+   void addUltrasound(int64_t time, float distance) {
+      if (distance <= 0 || distance > m_ultrasoundRange) { return; }
+      std::lock_guard<std::mutex> lock(m_mutex);
+      add(&m_ultrasound, TimedSample{time, distance});
+   }
+
+   // area is the lead car box normalised to the frame; time is when the frame was taken.
+   void addVision(int64_t time, float area) {
+      if (area <= 0) { return; }
+      std::lock_guard<std::mutex> lock(m_mutex);
+      add(&m_vision, TimedSample{time, area});
+   }
+
+   // The estimate at the given time, or at the newest reading if that is later. False if
+   // there is no reading of the lead car within FUSION_MAX_AGE.
+   bool estimate(int64_t time, GapEstimate *estimate) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_current.initialised == false) { return false; }
+      time = std::max(time, m_current.time);
+      const double dt = static_cast<double>(time - m_current.time) * 1e-6;
+      if (time - m_current.time > FUSION_MAX_AGE) { return false; }
+      const double variance = m_current.p00 + 2 * dt * m_current.p01 + dt * dt * m_current.p11;
+      estimate->time = time;
+      estimate->gap = static_cast<float>(m_current.gap + m_current.rate * dt);
+      estimate->closingSpeed = static_cast<float>(-m_current.rate);
+      estimate->deviation = static_cast<float>(std::sqrt(std::max(0.0, variance)));
+      return true;
+   }
+
+   float visionScale() {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      return m_visionScale;
+   }
+
+  private:
+   void reset() {
+      m_ultrasound.clear();
+      m_vision.clear();
+      m_checkpoint = FilterState{0, 0, 0, 0, 0, 0, 0, false};
+      m_current = m_checkpoint;
+   }
+
+   void add(SampleRing *ring, const TimedSample &sample) {
+      const int64_t newest = std::max(m_ultrasound.empty() ? sample.time : m_ultrasound.back().time,
+                                      m_vision.empty() ? sample.time : m_vision.back().time);
+      if (sample.time < newest - FUSION_RESTART) { reset(); }
+      // too late to be filtered in order, or out of order for its own sensor
+      if (m_checkpoint.initialised && sample.time <= m_checkpoint.time) { return; }
+      if (!ring->empty() && sample.time <= ring->back().time) { return; }
+      ring->push(sample);
+
+      // readings that cannot be overtaken any more become part of the checkpoint, the
+      // current estimate is the checkpoint with the younger ones filtered again
+      const int64_t latest = std::max(newest, sample.time);
+      filter(&m_checkpoint, latest - FUSION_LAG, true);
+      m_current = m_checkpoint;
+      filter(&m_current, latest, false);
+   }
+
+   // Applies the readings after the state's time up to until, both sensors in time order.
+   void filter(FilterState *state, int64_t until, bool calibrate) {
+      size_t u = firstAfter(m_ultrasound, state->time, state->initialised);
+      size_t v = firstAfter(m_vision, state->time, state->initialised);
+      while (true) {
+         const bool haveUltrasound = u < m_ultrasound.size() && m_ultrasound[u].time <= until;
+         const bool haveVision = v < m_vision.size() && m_vision[v].time <= until;
+         if (!haveUltrasound && !haveVision) { break; }
+         if (haveUltrasound && (!haveVision || m_ultrasound[u].time <= m_vision[v].time)) {
+            const TimedSample &sample = m_ultrasound[u++];
+            if (calibrate) { calibrateVision(sample); }
+            update(state, sample.time, sample.value, ULTRASOUND_DEVIATION);
+         } else {
+            const TimedSample &sample = m_vision[v++];
+            const double gap = m_visionScale / std::sqrt(static_cast<double>(sample.value));
+            update(state, sample.time, gap, VISION_DEVIATION * gap);
+         }
+      }
+   }
+
+   static size_t firstAfter(const SampleRing &ring, int64_t time, bool initialised) {
+      if (!initialised) { return 0; }
+      size_t i = ring.size();
+      while (i > 0 && ring[i - 1].time > time) { i--; }
+      return i;
+   }
+
+   // One predict and update step of the constant velocity filter.
+   static void update(FilterState *state, int64_t time, double measurement, double deviation) {
+      const double r = deviation * deviation;
+      if (state->initialised == false || time - state->time > FUSION_MAX_AGE) {
+         *state = FilterState{time, measurement, 0, r, 0, INITIAL_RATE_DEVIATION * INITIAL_RATE_DEVIATION, 0, true};
+         return;
+      }
+      const double dt = static_cast<double>(time - state->time) * 1e-6;
+      const double q = ACCELERATION_NOISE * ACCELERATION_NOISE;
+      state->gap += state->rate * dt;
+      state->p00 += 2 * dt * state->p01 + dt * dt * state->p11 + q * dt * dt * dt * dt / 4;
+      state->p01 += dt * state->p11 + q * dt * dt * dt / 2;
+      state->p11 += q * dt * dt;
+      state->time = time;
+
+      const double innovation = measurement - state->gap;
+      const double s = state->p00 + r;
+      if (innovation * innovation > FUSION_GATE * s) {
+         // a few in a row mean another lead car or another object in front
+         if (++state->rejected >= MAX_REJECTED) {
+            *state = FilterState{time, measurement, 0, r, 0, INITIAL_RATE_DEVIATION * INITIAL_RATE_DEVIATION, 0, true};
+         }
+         return;
+      }
+      state->rejected = 0;
+      const double k0 = state->p00 / s;
+      const double k1 = state->p01 / s;
+      state->gap += k0 * innovation;
+      state->rate += k1 * innovation;
+      state->p11 -= k1 * state->p01;
+      state->p01 *= (1 - k0);
+      state->p00 *= (1 - k0);
+   }
+
+   // Moves the camera scale towards what the ultrasound measured at about the same time.
+   // Pairs far off are another object in front of the ultrasound and are ignored.
+   void calibrateVision(const TimedSample &ultrasound) {
+      for (size_t i = 0; i < m_vision.size(); i++) {
+         if (std::abs(m_vision[i].time - ultrasound.time) > CALIBRATION_WINDOW) { continue; }
+         const float scale = ultrasound.value * std::sqrt(m_vision[i].value);
+         if (scale > m_visionScale / 2 && scale < m_visionScale * 2) {
+            m_visionScale += static_cast<float>(CALIBRATION_RATE) * (scale - m_visionScale);
+         }
+         return;
+      }
+   }
+
+   std::mutex m_mutex;
+   SampleRing m_ultrasound;
+   SampleRing m_vision;
+   FilterState m_checkpoint;
+   FilterState m_current;
+   float m_visionScale;
+   const float m_ultrasoundRange;
+};
+
+#endif
@@ -26,6 +26,18 @@
 
 #include "cluon-complete.hpp"
 #include "opendlv-standard-message-set.hpp"
+#include "scenario-mode.hpp"
+#include "load-shedding.hpp"
+#include "thread-pool.hpp"
+#include "message-bus.hpp"
+#include "frame-reader.hpp"
+#include "gap-fusion.hpp"
+#include "auto-exposure.hpp"
+#include "color-segmentation.hpp"
+#include "blob-extraction.hpp"
+#include "box-tracker.hpp"
+#include "service-clock.hpp"
+#include "flight-recorder.hpp"
 
 #include "opencv2/core.hpp"
 #include <opencv2/highgui/highgui.hpp>
@@ -44,63 +56,159 @@
 #include <stdio.h>
 
 
+#include <algorithm>
 #include <ctime>
 #include <cstdint>
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <numeric>
 
 
+#ifdef SERVICE_HOST
+namespace accSafeDistance {
+#endif
+
 using namespace std;
 using namespace cv;
 using namespace cluon;
 
-
-static Mat drawSquares( Mat& image, const vector<vector<Point> >& squares, OD4Session *od4,
-   double *prev_area, int *lost_visual_frame_counter, bool *sent_lost_visual, bool *stop_line_arrived);
-static void findSquares( const Mat& image, vector<vector<Point> >& squares );
+// All geometry is expressed in normalised frame coordinates (0 - 1 of the full frame),
+// so the same thresholds hold for any camera resolution and --process-scale.
+// The values were originally tuned in pixels on 640x480 frames.
+const double CROP_BOTTOM = 0.77;         // ~370 px, cuts off the bottom of the frame
+const double MIN_SQUARE_AREA = 0.0033;   // ~1000 px
+const double MAX_SQUARE_AREA = 0.65;     // ~200000 px
+const double MAX_SQUARE_COSINE = 0.25;   // of the angles between the edges of a square
+const double MIN_MARKER_FILL = 0.8;      // of its box a marker blob covers; a disc covers 0.785
+
+// Frames kept by the flight recorder are downscaled to this width.
+const int RECORDER_WIDTH = 160;
+
+// The same square is found on several threshold levels. Boxes overlapping the best box of a
+// group by this IoU join it, and a group needs boxes from this many levels to count, which
+// is what groupRectangles(boxes, 1, 0.6) used to do.
+const double SQUARE_NMS_OVERLAP = 0.5;
+const int MIN_SQUARE_SUPPORT = 2;
+
+// The lead car box after suppression: the score weighted mean of a group of boxes.
+struct ScoredRect {
+   Rect rect;
+   double score;  // sum of the scores of the group
+   int support;   // boxes in the group
+};
+
+static Mat drawSquares( Mat& image, const vector<vector<Point> >& squares, const vector<double> &scores, const Size &frame_size, ServiceSession *od4,
+   double *prev_area, int *lost_visual_frame_counter, bool *sent_lost_visual, bool *stop_line_arrived, GapEstimator *gapEstimator, int64_t frame_time,
+   int min_support = MIN_SQUARE_SUPPORT, ScoredRect *lead_car = nullptr);
+static void findSquares( const Mat& image, const Size &frame_size, int threshold_levels, ThreadPool *pool, vector<vector<Point> >& squares, vector<double> &scores );
+static void findMarkerBlobs(const vector<Blob> &blobs, const Size &frame_size, vector<vector<Point> >& squares, vector<double> &scores);
+static vector<Point> rectCorners(const Rect &rect);
+static bool bestRect(const vector<Rect> &rects, const vector<double> &scores, ScoredRect *best, int min_support = MIN_SQUARE_SUPPORT);
+static Rect2d normaliseRect(const Rect &rect, const Size &frame_size);
 static double angle( Point pt1, Point pt2, Point pt0 );
 void countCars(Mat frame, vector<Rect>& rects);
-void checkCarPosition(double centerX, OD4Session *od4) ;
-void checkCarDistance(double *prev_area, double area, double centerY, OD4Session *od4);
-void BrightnessAndContrastAuto(const cv::Mat &src, cv::Mat &dst, float clipHistPercent);
-void stopLineLostVisual(OD4Session *od4, int *lost_visual_sec_count, bool *sent_lost_visual);
+void checkCarPosition(double centerX, ServiceSession *od4) ;
+void checkCarDistance(double *prev_area, double area, double centerY, ServiceSession *od4);
+void stopLineLostVisual(ServiceSession *od4, int *lost_visual_sec_count, bool *sent_lost_visual);
+void sendLeadCarGap(ServiceSession *od4, GapEstimator *gapEstimator, int64_t time);
+
+// what the service saw and sent, written out when the lead car is lost; off unless --recorder
+FlightRecorder *flightRecorder = nullptr;
 
 int32_t main(int32_t argc, char **argv) {
    int32_t retCode{1};
    auto commandlineArguments = cluon::getCommandlineArguments(argc, argv);
    if((0 == commandlineArguments.count("cid")) ||
-      (0 == commandlineArguments.count("name")) ||
+      (0 == commandlineArguments.count("name") && 0 == commandlineArguments.count("source")) ||
       (0 == commandlineArguments.count("width")) ||
       (0 == commandlineArguments.count("height")) ) {
       std::cerr << argv[0] << " attaches to a shared memory area containing an ARGB image." << std::endl;
-      std::cerr << "Usage:   " << argv[0] << " --cid=<OD4 session> --name=<name of shared memory area> [--verbose]" << std::endl;
+      std::cerr << "Usage:   " << argv[0] << " --cid=<OD4 session> --name=<name of shared memory area>|--source=<camera:n|file.rec|video|directory> [--process-scale=<0..1>] [--latency-budget=<ms>] [--markers=squares|blobs] [--track-frames=<n>] [--cpus=<list>] [--threads=<n>] [--nice=<n>] [--vision-gap-scale=<m>] [--ultrasound-range=<m>] [--virtual-clock] [--recorder=<directory> [--recorder-seconds=<s>]] [--verbose]" << std::endl;
       std::cerr << "         --cid:    CID of the OD4Session to send and receive messages" << std::endl;
       std::cerr << "         --name:   name of the shared memory area to attach" << std::endl;
+      std::cerr << "         --source: frames from a camera, the ImageReadings of a .rec (raw or h264), a video file or a directory of images instead, files as fast as they are processed" << std::endl;
       std::cerr << "         --width:  width of the frame" << std::endl;
       std::cerr << "         --height: height of the frame" << std::endl;
-      std::cerr << "Example: " << argv[0] << " --cid=112 --name=img.i420 --width=640 --height=480" << std::endl;
+      std::cerr << "         --process-scale: downscale the frame by this factor before detection (default 1)" << std::endl;
+      std::cerr << "         --latency-budget: p95 frame latency to hold by degrading detection under load (default 100, 0 disables)" << std::endl;
+      std::cerr << "         --markers: find the pink marker as squares traced on the threshold levels of the colour mask, or as a blob of it (default squares)" << std::endl;
+      std::cerr << "         --track-frames: follow the lead car box by optical flow for up to this many frames between detections (default 5, 0 detects on every frame)" << std::endl;
+      std::cerr << "         --cpus: CPUs to pin the service and its detection threads to, e.g. 2 (default all)" << std::endl;
+      std::cerr << "         --threads: threads searching the threshold levels for squares with --markers=squares (default the number of --cpus, else 1)" << std::endl;
+      std::cerr << "         --nice: nice value of the service threads (default 0)" << std::endl;
+      std::cerr << "         --vision-gap-scale: gap to the lead car times the square root of its box area, calibrated while running (default 0.056)" << std::endl;
+      std::cerr << "         --ultrasound-range: farthest front ultrasound reading fused with the camera (default 2.0)" << std::endl;
+      std::cerr << "         --virtual-clock: time the timers by the sample times of the frames and ultrasound readings, for recordings replayed faster than real time (with --latency-budget=0 for the same results every time)" << std::endl;
+      std::cerr << "         --recorder: keep the last seconds of frames and messages in memory and write them to a .rec in this directory when the lead car is lost (default off)" << std::endl;
+      std::cerr << "         --recorder-seconds: seconds the recorder keeps (default 10)" << std::endl;
+      std::cerr << "Example: " << argv[0] << " --cid=112 --name=img.i420 --width=640 --height=480 --process-scale=0.5" << std::endl;
    } else {
       const std::string NAME{commandlineArguments["name"]};
       const uint32_t WIDTH{static_cast<uint32_t>(std::stoi(commandlineArguments["width"]))};
       const uint32_t HEIGHT{static_cast<uint32_t>(std::stoi(commandlineArguments["height"]))};
       const bool VERBOSE{commandlineArguments.count("verbose") != 0};
+      const float PROCESS_SCALE{(commandlineArguments["process-scale"].size() != 0) ? static_cast<float>(std::stof(commandlineArguments["process-scale"])) : static_cast<float>(1.0)};
+      if (PROCESS_SCALE <= 0 || PROCESS_SCALE > 1) {
+         std::cerr << argv[0] << ": --process-scale must be in (0, 1]." << std::endl;
+         return retCode;
+      }
+      const double LATENCY_BUDGET{(commandlineArguments["latency-budget"].size() != 0) ? std::stod(commandlineArguments["latency-budget"]) : 100.0};
+      const Rect CROP_RECT(0, 0, static_cast<int>(WIDTH), cvRound(HEIGHT * CROP_BOTTOM));
+      const std::string MARKERS{(commandlineArguments["markers"].size() != 0) ? commandlineArguments["markers"] : "squares"};
+      if (MARKERS != "blobs" && MARKERS != "squares") {
+         std::cerr << argv[0] << ": --markers must be blobs or squares." << std::endl;
+         return retCode;
+      }
+      const int TRACK_FRAMES{(commandlineArguments["track-frames"].size() != 0) ? std::stoi(commandlineArguments["track-frames"]) : 5};
+      const std::vector<int> CPUS{parseCpuList(commandlineArguments["cpus"])};
+      if (CPUS.empty() && commandlineArguments["cpus"].size() != 0) {
+         std::cerr << argv[0] << ": --cpus must be a list like 0,1 or 0-2." << std::endl;
+         return retCode;
+      }
+      const int THREADS{(commandlineArguments["threads"].size() != 0) ? std::stoi(commandlineArguments["threads"]) : std::max(1, static_cast<int>(CPUS.size()))};
+      const int NICE{(commandlineArguments["nice"].size() != 0) ? std::stoi(commandlineArguments["nice"]) : 0};
+      // before any other thread is started, so that they all inherit the CPUs and priority
+      if (!pinCurrentThread(CPUS, NICE)) {
+         std::cerr << argv[0] << ": could not apply --cpus or --nice, running unpinned." << std::endl;
+      }
+      ThreadPool threadPool{static_cast<unsigned>(std::max(1, THREADS) - 1), CPUS, NICE};
+      ServiceClock serviceClock{commandlineArguments.count("virtual-clock") != 0};
+      const float VISION_GAP_SCALE{(commandlineArguments["vision-gap-scale"].size() != 0) ? std::stof(commandlineArguments["vision-gap-scale"]) : 0.056f};
+      const float ULTRASOUND_RANGE{(commandlineArguments["ultrasound-range"].size() != 0) ? std::stof(commandlineArguments["ultrasound-range"]) : 2.0f};
+      const double RECORDER_SECONDS{(commandlineArguments["recorder-seconds"].size() != 0) ? std::stod(commandlineArguments["recorder-seconds"]) : 10.0};
+      const Size RECORDER_SIZE(RECORDER_WIDTH, cvRound(RECORDER_WIDTH * CROP_RECT.height / static_cast<double>(WIDTH)));
+      // the ultrasound, the corrections and the gap of every frame
+      FlightRecorder recorder{"safe-distance", commandlineArguments["recorder"], RECORDER_SECONDS, 250, 15, static_cast<size_t>(RECORDER_SIZE.area()) * 3};
+      Mat recorder_small, recorder_bgr; // the recorded frame, allocated once
+      flightRecorder = &recorder;
 
       // Attach to the shared memory.
-      std::unique_ptr<cluon::SharedMemory> sharedMemory{new cluon::SharedMemory{NAME}};
-      if (sharedMemory && sharedMemory->valid()) {
-         std::clog << argv[0] << ": Attached to shared memory '" << sharedMemory->name() << " (" << sharedMemory->size() << " bytes)." << std::endl;
+      FrameReader frames{NAME, WIDTH, HEIGHT, commandlineArguments["source"]};
+      if (frames.valid()) {
+         std::clog << argv[0] << ": Attached to '" << frames.name() << "' (" << frames.size() << " bytes)." << std::endl;
 
          // Interface to a running OpenDaVINCI session; here, you can send and receive messages.
-         cluon::OD4Session od4{static_cast<uint16_t>(std::stoi(commandlineArguments["cid"]))};
+         ServiceSession od4{static_cast<uint16_t>(std::stoi(commandlineArguments["cid"]))};
 
          // Measure beginning time
-         int64_t starttimestampmicro = cluon::time::toMicroseconds(cluon::time::now());
+         int64_t starttimestampmicro = serviceClock.microseconds();
          int64_t starttimestampsecs = starttimestampmicro / 1000000;
          cout << "Starting Timestamp: " << starttimestampsecs << endl;
 
          int64_t prevtimestampsecs = 0;
          int framecounter = 0;
+         LoadShedder loadShedder{"safe-distance", LATENCY_BUDGET};
+         AutoExposure autoExposure{0.6f}; // follows the light over the frames
+         // The lead car carries a pink marker. Another marker colour is another class of the
+         // same pass over the frame, its mask comes with the pink one.
+         ColorSegmenter markers{COLOR_RGB2HSV};
+         const int PINK = markers.addClass(Scalar(135, 53, 65), Scalar(360 / 2, 255, 255));
+         vector<Mat> marker_masks; // kept from frame to frame so that they are allocated once
+         vector<vector<PixelRun> > marker_runs;
+         BlobExtractor blobExtractor;
+         vector<Blob> pinkBlobs;
+         BoxTracker leadCarTracker{TRACK_FRAMES};
 
          double prev_area = 0; // used to determine whether car is moving and amount of acceleration
 
@@ -110,11 +218,26 @@ int32_t main(int32_t argc, char **argv) {
 
          bool stop_line_arrived = false;
 
+         // The front ultrasound is fused with the lead car box at the rate of either sensor; the
+         // fused gap goes out on every reading, also while the frames are not processed.
+         GapEstimator gapEstimator{VISION_GAP_SCALE, ULTRASOUND_RANGE};
+         auto onDistanceReading {
+            [&od4, &gapEstimator, &serviceClock](opendlv::proxy::DistanceReading &&msg, const cluon::data::Envelope &envelope) {
+               serviceClock.observe(envelope.sampleTimeStamp());
+               flightRecorder->record(msg, envelope.sampleTimeStamp(), envelope.senderStamp());
+               if (envelope.senderStamp() == 0) { // front sensor
+                  const int64_t time = cluon::time::toMicroseconds(envelope.sampleTimeStamp());
+                  gapEstimator.addUltrasound(time, msg.distance());
+                  sendLeadCarGap(&od4, &gapEstimator, time);
+               }
+            }
+         };
+         onMessage<opendlv::proxy::DistanceReading>(od4, onDistanceReading);
+
          auto onStopCar {
             [&od4, &stop_line_arrived]
-            (cluon::data::Envelope &&envelope) {
+            (StopSignPresenceUpdate &&msg, const cluon::data::Envelope &) {
 
-               auto msg = cluon::extractMessage<StopSignPresenceUpdate>(std::move(envelope));
                bool stopSignPresence = msg.stopSignPresence(); // Get the bool
                if (stopSignPresence == false) {
                   cout << "We have arrived at the stop line. " << endl;
@@ -122,12 +245,31 @@ int32_t main(int32_t argc, char **argv) {
                }
             }
          };
-         od4.dataTrigger(StopSignPresenceUpdate::ID(), onStopCar);
+         onMessage<StopSignPresenceUpdate>(od4, onStopCar);
+
+         // the leading car only needs to be followed until we are at the stop line
+         ScenarioGate scenarioGate{modeBit(MODE_FOLLOWING) | modeBit(MODE_APPROACHING)};
+         auto onScenarioModeUpdate {
+            [&scenarioGate, &stop_line_arrived](ScenarioModeUpdate &&msg, const cluon::data::Envelope &) {
+               if (scenarioGate.update(msg.mode())) {
+                  cout << "   [ Scenario mode: " << modeName(msg.mode()) << (scenarioGate.isActive() ? " ]" : ", idle ]") << endl;
+                  if (msg.mode() == MODE_FOLLOWING) {
+                     stop_line_arrived = false; // a new scenario begins
+                  }
+               }
+            }
+         };
+         onMessage<ScenarioModeUpdate>(od4, onScenarioModeUpdate);
 
          // Endless loop; end the program by pressing Ctrl-C.
          while (od4.isRunning()) {
+            // sleep without touching the shared memory while not needed in this scenario mode
+            if (scenarioGate.isActive() == false) {
+               scenarioGate.waitUntilActive();
+               continue;
+            }
+
             Mat frame;
-            Mat frame_HSV;
             Mat frame_gray;
             Mat cropped_frame;
             // Mat cropped_frame_BGR;
@@ -136,60 +278,86 @@ int32_t main(int32_t argc, char **argv) {
             Mat frame_threshold_pink;
             Mat finalFramePink;
             vector<vector<Point> > pinkSquares;
+            vector<double> pinkSquareScores;
 
-            const int max_value_H = 360/2;
-            const int max_value = 255;
+            // only follow a car when we have not arrived at the line.
+            // Read once, the flag is also changed by the message triggers.
+            const bool following_car = (stop_line_arrived == false);
+            // under load, detection may also be skipped on some frames
+            const bool process_frame = following_car && loadShedder.shouldProcess();
 
             // Wait for a notification of a new frame.
-            sharedMemory->wait();
-
-            // Lock the shared memory.
-            sharedMemory->lock();
-            {
-              // Copy image into cvMat structure.
-              // Be aware of that any code between lock/unlock is blocking
-              // the camera to provide the next frame. Thus, any
-              // computationally heavy algorithms should be placed outside
-              // lock/unlock.
-              cv::Mat wrapped(HEIGHT, WIDTH, CV_8UC4, sharedMemory->data());
-              frame = wrapped.clone();
+            if (frames.wait() == false) {
+               std::clog << argv[0] << ": end of " << frames.name() << "." << std::endl;
+               break;
+            }
+            auto frame_start = std::chrono::steady_clock::now();
+
+            // Crop the frame to get useful stuff; nothing is needed at the line.
+            int64_t frame_time = 0;
+            if (process_frame == true) {
+               frame = frames.latest(CROP_RECT);
+               frame_time = cluon::time::toMicroseconds(frames.timeStamp());
+               if (frames.timeStamped()) { serviceClock.observe(frames.timeStamp()); }
+               if (recorder.enabled()) {
+                  resize(frame, recorder_small, RECORDER_SIZE, 0, 0, INTER_AREA);
+                  cvtColor(recorder_small, recorder_bgr, COLOR_BGRA2BGR);
+                  recorder.recordFrame(frames.timeStamp(), static_cast<uint32_t>(recorder_bgr.cols), static_cast<uint32_t>(recorder_bgr.rows), recorder_bgr.data);
+               }
             }
-            sharedMemory->unlock();
             // TODO: Do something with the frame.
 
             // measure current time; needs to be after frame is copied to shared memory. I think.
-            int64_t timestampmicro = cluon::time::toMicroseconds(cluon::time::now());
-            int64_t timestampsecs = timestampmicro / 1000000;
-
-         // Pink
-            int low_H_pink = 135;
-            int low_S_pink = 53;
-            int low_V_pink = 65;
-            int high_H_pink = max_value_H;
-            int high_S_pink = max_value;
-            int high_V_pink = max_value;
-
-            // Crop the frame to get useful stuff
-            frame(Rect(Point(0, 0), Point(640, 370))).copyTo(cropped_frame);
-
-            // only follow a car when we have not arrived at the line
-            if (stop_line_arrived == false) {
-               //////////////////// auto brightness /////////////////////
-               // Automatically increase the brightness and contrast of the video.
-               BrightnessAndContrastAuto(cropped_frame, brightened_frame, 0.6f);
-               // Convert from BGR to HSV colorspace
-               cvtColor(brightened_frame, frame_HSV, COLOR_RGB2HSV);
-               //==//////////////////////////////////////////////////////==//
-
-               ////////////// no auto brightness ////////////////////
-               // cvtColor(cropped_frame, frame_HSV, COLOR_RGB2HSV);
-               ////////////////////////////////////////////////
-
-               // Detect the object based on HSV Range Values
-               inRange(frame_HSV, Scalar(low_H_pink, low_S_pink, low_V_pink), Scalar(high_H_pink, high_S_pink, high_V_pink), frame_threshold_pink);
-
-               findSquares(frame_threshold_pink, pinkSquares);
-               finalFramePink = drawSquares(frame_threshold_pink, pinkSquares, &od4, &prev_area, &lost_visual_frame_counter, &sent_lost_visual, &stop_line_arrived); // pass reference of prev_area
+            int64_t timestampsecs = serviceClock.seconds();
+
+            if (process_frame == true) {
+               // downscale for detection if requested or under load.
+               // Detections are normalised against the size of the full frame after downscaling.
+               const DegradationLevel &quality = loadShedder.level();
+               const float scale = PROCESS_SCALE * quality.process_scale;
+               const Size process_size(cvRound(WIDTH * scale), cvRound(HEIGHT * scale));
+               if (scale < 1) {
+                  resize(frame, cropped_frame, Size(), scale, scale, INTER_AREA);
+               } else {
+                  cropped_frame = frame;
+               }
+
+               // Between detections the lead car box is followed by the optical flow of its
+               // corners; it is detected again once the flow loses it, at the latest after --track-frames.
+               ScoredRect leadCar{Rect(), 0, 0};
+               Rect2d tracked;
+               if (leadCarTracker.track(cropped_frame, &tracked)) {
+                  pinkSquares.assign(1, rectCorners(Rect(tracked)));
+                  pinkSquareScores.assign(1, leadCarTracker.confidence());
+                  finalFramePink = drawSquares(frame_threshold_pink, pinkSquares, pinkSquareScores, process_size, &od4, &prev_area, &lost_visual_frame_counter, &sent_lost_visual, &stop_line_arrived, &gapEstimator, frame_time, 1);
+               } else {
+                  //////////////////// auto brightness /////////////////////
+                  // Automatically increase the brightness and contrast of the video.
+                  autoExposure.apply(cropped_frame, brightened_frame);
+                  //==//////////////////////////////////////////////////////==//
+
+                  ////////////// no auto brightness ////////////////////
+                  // markers.segment(cropped_frame, marker_masks);
+                  ////////////////////////////////////////////////
+
+                  // Detect the object based on HSV Range Values
+                  if (MARKERS == "blobs") {
+                     // the runs of the pink straight into blobs, no mask; one box per blob
+                     markers.segmentRuns(brightened_frame, marker_runs);
+                     blobExtractor.extract(marker_runs[static_cast<size_t>(PINK)], pinkBlobs, MIN_SQUARE_AREA * process_size.area());
+                     findMarkerBlobs(pinkBlobs, process_size, pinkSquares, pinkSquareScores);
+                     finalFramePink = drawSquares(frame_threshold_pink, pinkSquares, pinkSquareScores, process_size, &od4, &prev_area, &lost_visual_frame_counter, &sent_lost_visual, &stop_line_arrived, &gapEstimator, frame_time, 1, &leadCar);
+                  } else {
+                     markers.segment(brightened_frame, marker_masks);
+                     frame_threshold_pink = marker_masks[static_cast<size_t>(PINK)];
+
+                     findSquares(frame_threshold_pink, process_size, quality.threshold_levels, &threadPool, pinkSquares, pinkSquareScores);
+                     finalFramePink = drawSquares(frame_threshold_pink, pinkSquares, pinkSquareScores, process_size, &od4, &prev_area, &lost_visual_frame_counter, &sent_lost_visual, &stop_line_arrived, &gapEstimator, frame_time, MIN_SQUARE_SUPPORT, &leadCar); // pass reference of prev_area
+                  }
+                  if (leadCar.support > 0) { leadCarTracker.reset(cropped_frame, leadCar.rect); }
+               }
+
+               loadShedder.addSample(millisecondsSince(frame_start));
 
                // findSquares(frame_threshold_green, greenSquares);
                // finalFrameGreen = drawSquares(frame_threshold_green, greenSquares, 0, &od4);
@@ -216,7 +384,7 @@ int32_t main(int32_t argc, char **argv) {
                // reset if car is seen again
                if (lost_visual_frame_counter == 0) {   lost_visual_sec_count = 0;  }
 
-               cout << "Timestamp: " << timestampsecs << "          FPS: " << framecounter << endl;
+               cout << "Timestamp: " << timestampsecs << "          FPS: " << framecounter << "   Quality level: " << loadShedder.levelIndex() << endl;
                prevtimestampsecs = timestampsecs;
                framecounter = 0;
             }
@@ -239,18 +407,31 @@ static double angle(cv::Point pt1, cv::Point pt2, cv::Point pt0) {
    return (dx1*dx2 + dy1*dy2)/sqrt((dx1*dx1 + dy1*dy1)*(dx2*dx2 + dy2*dy2) + 1e-10);
 }
 
-// returns sequence of squares detected on the image.
-static void findSquares( const Mat& image, vector<vector<Point> >& squares ) {
-   int thresh = 50, N = 11;
+// Converts a rect found on the processed frame into normalised frame coordinates.
+static Rect2d normaliseRect(const Rect &rect, const Size &frame_size) {
+   return Rect2d(rect.x / (double) frame_size.width, rect.y / (double) frame_size.height,
+      rect.width / (double) frame_size.width, rect.height / (double) frame_size.height);
+}
+
+// returns sequence of squares detected on the image, each scored by how close its angles
+// are to 90 degree (1 for a perfect rectangle, 0 at the limit).
+static void findSquares( const Mat& image, const Size &frame_size, int threshold_levels, ThreadPool *pool, vector<vector<Point> >& squares, vector<double> &scores ) {
+   int thresh = 50, N = threshold_levels;
+   double frame_area = frame_size.area();
    squares.clear();
+   scores.clear();
 
-   Mat pyr, timg, gray0(image.size(), CV_8U), gray;
+   Mat pyr, timg, gray0(image.size(), CV_8U);
 
    // down-scale and upscale the image to filter out the noise
    // blur works too.
    pyrDown(image, pyr, Size(image.cols/2, image.rows/2));
    pyrUp(pyr, timg, image.size());
-   vector<vector<Point> > contours;
+
+   // the threshold levels are independent, so they run on the pool; their squares are
+   // concatenated in level order afterwards so the result does not depend on the threads
+   vector<vector<vector<Point> > > levelSquares(static_cast<size_t>(std::max(N, 0)));
+   vector<vector<double> > levelScores(static_cast<size_t>(std::max(N, 0)));
 
    // find squares in every color plane of the image
    for( int c = 0; c < 1; c++ ) {
@@ -258,7 +439,9 @@ static void findSquares( const Mat& image, vector<vector<Point> >& squares ) {
       mixChannels(&timg, 1, &gray0, 1, ch, 1);
 
       // try several threshold levels
-      for( int l = 0; l < N; l++ ) {
+      auto level = [&](int l) {
+         Mat gray;
+         vector<vector<Point> > contours;
          // hack: use Canny instead of zero threshold level.
          // Canny helps to catch squares with gradient shading
          if( l == 0 ) {
@@ -295,8 +478,8 @@ static void findSquares( const Mat& image, vector<vector<Point> >& squares ) {
             // contour orientation
 
             if( approx.size() == 4 && // if there are 4 sides...
-            fabs(contourArea(approx)) > 1000 && // and the square is big enough...
-            fabs(contourArea(approx)) < 200000 &&
+            fabs(contourArea(approx)) > MIN_SQUARE_AREA * frame_area && // and the square is big enough...
+            fabs(contourArea(approx)) < MAX_SQUARE_AREA * frame_area &&
             isContourConvex(approx) ) { // and square is convex...
 
                double maxCosine = 0;
@@ -309,16 +492,50 @@ static void findSquares( const Mat& image, vector<vector<Point> >& squares ) {
                // if cosines of all angles are small
                // (all angles are ~90 degree) then its a square/rectangle.
                // push the vertices to resultant sequence(array)
-               if( maxCosine < 0.25 ) {
-                  squares.push_back(approx);
+               if( maxCosine < MAX_SQUARE_COSINE ) {
+                  levelSquares[static_cast<size_t>(l)].push_back(approx);
+                  levelScores[static_cast<size_t>(l)].push_back(1 - maxCosine / MAX_SQUARE_COSINE);
                }
             }
          }
+      };
+      if( pool != nullptr ) {
+         pool->parallelFor(N, level);
+      } else {
+         for( int l = 0; l < N; l++ ) { level(l); }
+      }
+      for( size_t l = 0; l < levelSquares.size(); l++ ) {
+         squares.insert(squares.end(), levelSquares[l].begin(), levelSquares[l].end());
+         scores.insert(scores.end(), levelScores[l].begin(), levelScores[l].end());
+         levelSquares[l].clear();
+         levelScores[l].clear();
+      }
+   }
+}
+
+// The blobs of the marker colour that are squares: as large as the squares of findSquares
+// and filling most of their box. A blob is only seen once, so its box needs no support from
+// other threshold levels; the score is how much of the box beyond MIN_MARKER_FILL it fills.
+static void findMarkerBlobs(const vector<Blob> &blobs, const Size &frame_size, vector<vector<Point> >& squares, vector<double> &scores) {
+   const double frame_area = frame_size.area();
+   squares.clear();
+   scores.clear();
+   for (const Blob &blob : blobs) {
+      const double fill = blob.area / blob.box.area();
+      if (blob.area > MIN_SQUARE_AREA * frame_area && blob.area < MAX_SQUARE_AREA * frame_area && fill >= MIN_MARKER_FILL) {
+         squares.push_back(rectCorners(blob.box));
+         scores.push_back((fill - MIN_MARKER_FILL) / (1 - MIN_MARKER_FILL));
       }
    }
 }
 
-void checkCarDistance(double *prev_area, double area, double centerY, OD4Session *od4) {
+// The corners of a box as a square, so that boundingRect gives the box back.
+static vector<Point> rectCorners(const Rect &rect) {
+   const int right = rect.x + rect.width - 1, bottom = rect.y + rect.height - 1;
+   return {rect.tl(), Point(right, rect.y), Point(right, bottom), Point(rect.x, bottom)};
+}
+
+void checkCarDistance(double *prev_area, double area, double centerY, ServiceSession *od4) {
 // PID controller
 // https://robotics.stackexchange.com/questions/9786/how-do-the-pid-parameters-kp-ki-and-kd-affect-the-heading-of-a-differential
    SpeedCorrectionRequest speed_correction;
@@ -326,15 +543,15 @@ void checkCarDistance(double *prev_area, double area, double centerY, OD4Session
    const float LOSTVISUAL = 1337;
    const float DECELERATE = 999;  // code for Artificial "Letting go of the pedal"
 
-   if (area < 1 || centerY > LOSTVISUAL - 1) {
+   if (area <= 0 || centerY > LOSTVISUAL - 1) { // no box; the area is a fraction of the frame
       // correction_speed = LOSTVISUAL; // special code for visual lost
       // correction_speed = -0.002f;
    }
    else {
-      float optimal_area = 8000; // default optimal area
+      float optimal_area = 0.026f; // default optimal area, ~8000 px
       float area_diff = (float)area - (float) *prev_area; // looks at how much car has accelerated/deccelerated
       float accel_area_diff_thresh = 0;
-      float brake_area_diff_thresh = 600;
+      float brake_area_diff_thresh = 0.00195f; // ~600 px
 
       if (area_diff < accel_area_diff_thresh) { // If the car is moving away
          optimal_area = optimal_area + (area_diff * 0.2f); // dampen (softly) accelerate
@@ -354,14 +571,15 @@ void checkCarDistance(double *prev_area, double area, double centerY, OD4Session
       float output = kp * error;
 
       // braking needs to be stronger than accelerating, need to modify correction to suit it.
-      if (output > 0) { correction_speed = output / 7500000; }
-      if (output <= 0) { correction_speed = output / 100000; }
+      // gains are per normalised area; they equal 1/7500000 and 1/100000 per pixel at 640x480.
+      if (output > 0) { correction_speed = output / 24.41f; }
+      if (output <= 0) { correction_speed = output / 0.3255f; }
 
    // braking needs to be faster than accelerating. I dont care.
       if (correction_speed <= 0) { correction_speed = correction_speed * 5; } // hard multiplier by 5
 
-   // If the car in front has somewhat been maintaining the distance and area > 5000 (close enough)
-      if (error > 0 && error < 3000 && area_diff >= accel_area_diff_thresh && area_diff < brake_area_diff_thresh) {
+   // If the car in front has somewhat been maintaining the distance and area > 0.016 (close enough)
+      if (error > 0 && error < 0.0098f && area_diff >= accel_area_diff_thresh && area_diff < brake_area_diff_thresh) {
          correction_speed = DECELERATE;
       }
 
@@ -372,11 +590,12 @@ void checkCarDistance(double *prev_area, double area, double centerY, OD4Session
 
    speed_correction.amount(correction_speed);
    od4->send(speed_correction);
+   flightRecorder->record(speed_correction);
 }
 
-void checkCarPosition(double centerX, OD4Session *od4) {
+void checkCarPosition(double centerX, ServiceSession *od4) {
 
-   int frame_center = 320; // Setpoint - we want the car to ideally be in center.
+   float frame_center = 0.5f; // Setpoint - we want the car to ideally be in center.
 // PID controller test
 // https://robotics.stackexchange.com/questions/9786/how-do-the-pid-parameters-kp-ki-and-kd-affect-the-heading-of-a-differential
    SteeringCorrectionRequest steering_correction;
@@ -392,7 +611,7 @@ void checkCarPosition(double centerX, OD4Session *od4) {
    //////////////////////// Absolute pid steering correction ////////////////////
       float kp = 1;
       float output = kp * error; // Ki * integral + Kd * derivative
-      correction_angle = output / 800; // because groundsteering max = 0.4 here
+      correction_angle = output * 0.8f; // error is at most 0.5, because groundsteering max = 0.4 here
 
       cout << "[center X: " << centerX << " ]";
       cout << " // [[ steering correction: " << correction_angle << " ]]  // " << endl;
@@ -401,9 +620,10 @@ void checkCarPosition(double centerX, OD4Session *od4) {
    /////////////////////////// PID Controller test ////////////////////////////
    steering_correction.amount(correction_angle);
    od4->send(steering_correction);
+   flightRecorder->record(steering_correction);
 }
 
-void stopLineLostVisual(OD4Session *od4, int *lost_visual_sec_count, bool *sent_lost_visual) {
+void stopLineLostVisual(ServiceSession *od4, int *lost_visual_sec_count, bool *sent_lost_visual) {
    CarOutOfSight car_outta_sight;
    *lost_visual_sec_count += 1;
    cout << "lost visual secs: " << *lost_visual_sec_count << endl;
@@ -413,34 +633,99 @@ void stopLineLostVisual(OD4Session *od4, int *lost_visual_sec_count, bool *sent_
       *lost_visual_sec_count = 0;
       *sent_lost_visual = true;
       od4->send(car_outta_sight);
+      flightRecorder->record(car_outta_sight);
+      flightRecorder->trigger("lost-visual");
+   }
+}
+
+// The fused gap at the given time; nothing is sent without a recent reading of the lead car.
+void sendLeadCarGap(ServiceSession *od4, GapEstimator *gapEstimator, int64_t time) {
+   GapEstimate estimate;
+   if (gapEstimator->estimate(time, &estimate)) {
+      LeadCarGap lead_car_gap;
+      lead_car_gap.gap(estimate.gap);
+      lead_car_gap.closingSpeed(estimate.closingSpeed);
+      lead_car_gap.deviation(estimate.deviation);
+      od4->send(lead_car_gap, cluon::time::fromMicroseconds(estimate.time));
+      flightRecorder->record(lead_car_gap, cluon::time::fromMicroseconds(estimate.time));
    }
 }
 
-// the function draws all the squares in the image
+// Weighted non-maximum suppression. The boxes are visited in order of score and each joins
+// the first group whose best box it overlaps, else starts a new group; a group's box is the
+// score weighted mean of its boxes. A box is only compared against the k groups, a handful,
+// so the cost is O(n log n + n k) where groupRectangles partitions all pairs in O(n^2).
+// Returns false if no group has min_support boxes.
+static bool bestRect(const vector<Rect> &rects, const vector<double> &scores, ScoredRect *best, int min_support) {
+   vector<size_t> order(rects.size());
+   std::iota(order.begin(), order.end(), 0);
+   std::stable_sort(order.begin(), order.end(), [&scores](size_t a, size_t b) { return scores[a] > scores[b]; });
+
+   vector<Rect> heads;      // best box of every group
+   vector<Rect2d> sums;     // score weighted sums of x, y, width and height of every group
+   vector<ScoredRect> groups;
+   for (size_t i : order) {
+      const Rect &rect = rects[i];
+      const double score = scores[i];
+      size_t g = 0;
+      for (; g < heads.size(); g++) {
+         const double overlap = (heads[g] & rect).area();
+         if (overlap >= SQUARE_NMS_OVERLAP * (heads[g].area() + rect.area() - overlap)) { break; }
+      }
+      if (g == heads.size()) {
+         heads.push_back(rect);
+         sums.push_back(Rect2d(0, 0, 0, 0));
+         groups.push_back(ScoredRect{rect, 0, 0});
+      }
+      sums[g].x += rect.x * score;
+      sums[g].y += rect.y * score;
+      sums[g].width += rect.width * score;
+      sums[g].height += rect.height * score;
+      groups[g].score += score;
+      groups[g].support += 1;
+   }
+
+   bool found = false;
+   for (size_t g = 0; g < groups.size(); g++) {
+      if (groups[g].support < min_support || (found && groups[g].score <= best->score)) { continue; }
+      // a group of zero scores keeps its best box
+      if (groups[g].score > 0) {
+         const double weight = 1.0 / groups[g].score;
+         groups[g].rect = Rect(cvRound(sums[g].x * weight), cvRound(sums[g].y * weight),
+            cvRound(sums[g].width * weight), cvRound(sums[g].height * weight));
+      }
+      *best = groups[g];
+      found = true;
+   }
+   return found;
+}
+
+// the function draws all the squares in the image, if there is one
 static Mat drawSquares(
-   Mat& image, const vector<vector<Point> >& squares, OD4Session *od4,
-   double *prev_area, int *lost_visual_frame_counter, bool *sent_lost_visual, bool *stop_line_arrived)
+   Mat& image, const vector<vector<Point> >& squares, const vector<double> &scores, const Size &frame_size, ServiceSession *od4,
+   double *prev_area, int *lost_visual_frame_counter, bool *sent_lost_visual, bool *stop_line_arrived, GapEstimator *gapEstimator, int64_t frame_time,
+   int min_support, ScoredRect *lead_car)
 {
    Scalar color = Scalar(255,0,0 );
    vector<Rect> boundRects( squares.size() );
 
-   int group_thresh = 1;
-   double merge_box_diff = 0.6;
-
    for( size_t i = 0; i < squares.size(); i++ ) {
       // Code from http://answers.opencv.org/question/72237/measuring-width-height-of-bounding-box/
       boundRects[i] = boundingRect(squares[i]);
-      rectangle(image, boundRects[i].tl(), boundRects[i].br(), color, 2 );
+      if (!image.empty()) { rectangle(image, boundRects[i].tl(), boundRects[i].br(), color, 2 ); }
    }
 
-   groupRectangles(boundRects, group_thresh, merge_box_diff);  //group overlapping rectangles into 1
+   // one lead car box out of the squares of all threshold levels
+   ScoredRect leadCar{Rect(), 0, 0};
+   const bool leadCarFound = bestRect(boundRects, scores, &leadCar, min_support);
+   if (lead_car != nullptr) { *lead_car = leadCar; }
 
    double rect_area = 0;
-   double rect_centerX = 1337; // valid range from 0 - 640
-   double rect_centerY = 1337; // valid range from 0 - 480
+   double rect_centerX = 1337; // valid range from 0 - 1
+   double rect_centerY = 1337; // valid range from 0 - 1
 
-   // if there are no bounding Rects....
-   if (boundRects.size() < 1) {
+   // if there is no lead car box....
+   if (leadCarFound == false) {
       // ...notify Movecar component that car is nowhere to be seen / lost visual
       // checkCarDistance( prev_area, rect_area, rect_centerY, od4);
       checkCarPosition( rect_centerX, od4);
@@ -453,32 +738,29 @@ static Mat drawSquares(
       cout << "   | Lost Visual | " << endl;
    }
 
-   // if no bounding boxes, for loop is not entered because "i < boundrects.size" is -1
-   // only check distance and steering corrections, along with number of cars, after merging.
-   for (size_t i = 0; i < boundRects.size(); i++) {
-      int rect_x = boundRects[i].x;
-      int rect_y = boundRects[i].y;
-      int rect_width = boundRects[i].width;
-      int rect_height = boundRects[i].height;
-      rect_area = boundRects[i].area();
+   // only check distance and steering corrections after merging, once per frame.
+   if (leadCarFound == true) {
+      Rect2d rect = normaliseRect(leadCar.rect, frame_size);
+      rect_area = rect.area();
+      cout << "   [ Lead car score: " << leadCar.score << " from " << leadCar.support << " squares ]" << endl;
+      DetectionBox detection;
+      detection.detector("lead-car").x(static_cast<float>(rect.x)).y(static_cast<float>(rect.y))
+               .width(static_cast<float>(rect.width)).height(static_cast<float>(rect.height)).score(static_cast<float>(leadCar.score));
+      flightRecorder->record(detection, cluon::time::fromMicroseconds(frame_time));
 
-      rect_centerX = rect_x + 0.5 * rect_width;
-      rect_centerY = rect_y + 0.5 * rect_height;
-
-      // Now with those parameters you can calculate the 4 points
-      Point top_left(rect_x,rect_y);
-      Point top_right(rect_x + rect_width, rect_y);
-      Point bot_left(rect_x, rect_y + rect_height);
-      Point bot_right(rect_x + rect_width, rect_y + rect_height);
+      rect_centerX = rect.x + 0.5 * rect.width;
+      rect_centerY = rect.y + 0.5 * rect.height;
 
      checkCarDistance( prev_area, rect_area, rect_centerY, od4);
      checkCarPosition( rect_centerX, od4);
+     gapEstimator->addVision(frame_time, static_cast<float>(rect_area));
+     sendLeadCarGap(od4, gapEstimator, frame_time);
 
-     if (rect_area > 30000) { // for testing
+     if (rect_area > 0.098) { // for testing, ~30000 px
         *sent_lost_visual = false;
         cout << "         << Lost Visual MESSAGE RESET. >> " << endl;
      }
-     if (rect_area > 60000) {
+     if (rect_area > 0.195) { // ~60000 px
         *stop_line_arrived = false;
         cout << "          [< Stop Line Reset - Scenario reset. >]" << endl;
      }
@@ -489,110 +771,6 @@ static Mat drawSquares(
    return image;
 }
 
-// https://answers.opencv.org/question/75510/how-to-make-auto-adjustmentsbrightness-and-contrast-for-image-android-opencv-image-correction/
-void BrightnessAndContrastAuto(const cv::Mat &src, cv::Mat &dst, float clipHistPercent)
-{
-   // Tries to stretch/average out the range on a greyscale image. Might need tuning.
-   // works only on gray images and ARGB color space.
-
-    CV_Assert(clipHistPercent >= 0);
-    CV_Assert((src.type() == CV_8UC1) || (src.type() == CV_8UC3) || (src.type() == CV_8UC4));
-
-   // alpha (contrast) operates as color range amplifier, values from 0 - 3
-   // beta (brightness) operates as range shift, values from 0 - 100
-    int histSize = 256;
-    float alpha, beta;
-    double minGray = 0, maxGray = 0;
-
-    //to calculate grayscale histogram
-    cv::Mat gray;
-    if (src.type() == CV_8UC1) gray = src;
-    // modified from BGR to RGB
-    else if (src.type() == CV_8UC3) cvtColor(src, gray, COLOR_RGB2GRAY);
-    else if (src.type() == CV_8UC4) cvtColor(src, gray, COLOR_RGBA2GRAY);
-    if (clipHistPercent <= 0)
-    {
-        // keep full available range
-        // Finds the global minimum and maximum in an array.
-        cv::minMaxLoc(gray, &minGray, &maxGray);
-      // cout << "Min:  || " << minGray << "Max" << maxGray << "||" << endl;
-    }
-    else
-    {
-        cv::Mat hist; //the grayscale histogram
-
-        float range[] = { 0, 256 };
-        const float* histRange = { range };
-        bool uniform = true;
-        bool accumulate = false;
-        calcHist(&gray, 1, 0, cv::Mat (), hist, 1, &histSize, &histRange, uniform, accumulate);
-
-        // calculate cumulative distribution from the histogram
-        std::vector<float> accumulator(histSize);
-        accumulator[0] = hist.at<float>(0);
-        // cout << "accumulator [0]: " << accumulator[0];
-
-
-        for (int i = 1; i < histSize; i++)
-        {
-            accumulator[i] = accumulator[i - 1] + hist.at<float>(i);
-        }
-
-        // locate points that cuts at required value
-        float max = accumulator.back(); // last element of the array
-         // cout << "      accumulator max: " << max << endl;
-        clipHistPercent *= (max / 100.0f); //make percent as absolute
-        // cout << "clipHistPercent % : " << clipHistPercent << endl;
-
-        clipHistPercent /= 1.6f; // left and right wings
-        // cout << "clipHistPercent L/R wings : " << clipHistPercent << endl;
-
-        // accumulator[0] = 0;
-
-// as the picamera seems to have a lower...color range than the algorithm,
-// a hardcoded little boost of brightness and contrast is given
-// by artificially bumping/lowering the values of both the upper and lower ends of the histogram
-        // for (int a = 1; a < histSize/10; a++) {
-        //     accumulator[a] = (accumulator[a - 1] + hist.at<float>(a)) / 2;
-        //     // cout << "accumulator ["<< a << "]: " << accumulator[a] << endl;
-        // }
-        // for (int i = histSize - 1; i > histSize - histSize/11 ; i--) {
-        //     accumulator[i] = (accumulator[i - 1] + hist.at<float>(i)) * 2;
-        //     // cout << "accumulator ["<< i << "]: " << accumulator[i] << endl;
-        // }
-
-        // locate left cut
-        minGray = 0;
-        while (accumulator[(long)minGray] < clipHistPercent) {
-          minGray++;
-        }
-        // locate right cut
-        maxGray = histSize - 1;
-        while (accumulator[(long)maxGray] >= (max - clipHistPercent)) {
-           maxGray--;
-        }
-    }
-    // cout << "Min:  " << minGray << " || Max" << maxGray << endl;
-
-    // current range
-    float inputRange = (float)maxGray - (float)minGray;
-    // histSize is always 255
-    // inputrange in the end is always from 0 to 255
-    // maxgray is always 255 as well, and mingray is always 0 in the end.
-    alpha = (histSize - 1) / inputRange;   // alpha expands current range to histsize range
-    beta = (float)-minGray * (float)alpha;  // beta shifts current range so that minGray will go to 0
-    // cout << " Added Contrast: " << alpha << "   || " << " Added Brightness: " << beta << endl;
-
-    // does the actual brightening.
-    // Apply brightness and contrast normalization
-    // convertTo operates with saturate_cast
-    src.convertTo(dst, -1, alpha, beta);
-
-    // restore alpha channel from source / merges the frame back together from gray
-    if (dst.type() == CV_8UC4)
-    {
-        int from_to[] = { 3, 3};
-        cv::mixChannels(&src, 4, &dst,1, from_to, 1);
-    }
-    return;
-}
+#ifdef SERVICE_HOST
+} // namespace accSafeDistance
+#endif
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2019  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// The time the timers of a service run on. Live it is the wall clock. A virtual clock
+// (--virtual-clock) only moves with the sample times of the sensor data the service gets,
+// camera frames and ultrasound readings, so that a recording replayed faster than real time,
+// or the kiwiSimulator, gives the same timers as on the car. Messages of the other services
+// do not move it, they are stamped with the wall clock when sent.
+// This file is shared between the services; keep all copies identical.
+
+#ifndef SERVICE_CLOCK_HPP
+#define SERVICE_CLOCK_HPP
+
+#include "cluon-complete.hpp"
+
+#include <atomic>
+#include <cstdint>
+
+class ServiceClock {
+  private:
+   ServiceClock(const ServiceClock &) = delete;
+   ServiceClock &operator=(const ServiceClock &) = delete;
+
+   // a recording starting over
+   static const int64_t RESTART = 10000000; // us
+
+  public:
+   explicit ServiceClock(bool isVirtual) : m_virtual{isVirtual}, m_now{0} {}
+
+   bool isVirtual() const { return m_virtual; }
+
+   // A sample time of sensor data, from any thread. The virtual clock does not go back,
+   // unless by more than RESTART.
+   void observe(const cluon::data::TimeStamp &sampleTime) {
+      if (!m_virtual) { return; }
+      const int64_t time = cluon::time::toMicroseconds(sampleTime);
+      int64_t now = m_now.load();
+      while ((time > now || time < now - RESTART) && !m_now.compare_exchange_weak(now, time)) {}
+   }
+
+   // Microseconds; a virtual clock is at 0 until the first sample.
+   int64_t microseconds() const {
+      return m_virtual ? m_now.load() : cluon::time::toMicroseconds(cluon::time::now());
+   }
+   int64_t seconds() const { return microseconds() / 1000000; }
+
+  private:
+   const bool m_virtual;
+   std::atomic<int64_t> m_now;
+};
+
+#endif
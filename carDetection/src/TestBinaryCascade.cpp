@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2019  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define CATCH_CONFIG_MAIN  // This tells Catch to provide a main() - only do this once per test-runner
+
+#include "catch.hpp"
+#include "binary-cascade.hpp"
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+// The runner is built with AddressSanitizer where the compiler has it (see CMakeLists.txt),
+// so that a read past the integral image fails the test.
+
+const int WINDOW = 24; // 3x3 cells of 8 pixels
+
+// Writes a one stage LBP cascade with one stump on a feature covering the whole window; a
+// window passes if the subset has the bit of its LBP code. Returns the path of the file.
+static std::string writeLbpCascade(const std::vector<int32_t> &subset) {
+   CascadeHeader header;
+   std::memset(&header, 0, sizeof(header));
+   header.magic = CASCADE_MAGIC;
+   header.version = CASCADE_VERSION;
+   header.feature_type = CASCADE_LBP;
+   header.window_width = WINDOW;
+   header.window_height = WINDOW;
+   header.stage_count = 1;
+   header.weak_count = 1;
+   header.feature_count = 1;
+   header.rects_per_feature = 1;
+
+   const float stage_threshold = 0.0f, left = 1.0f, right = -1.0f;
+   std::vector<std::vector<char> > arrays(NUMBER_OF_CASCADE_ARRAYS);
+   auto put = [&arrays, &header](CascadeArray which, const void *data, size_t count) {
+      arrays[which].assign(static_cast<const char *>(data), static_cast<const char *>(data) + count * 4);
+      header.count[which] = static_cast<uint32_t>(count);
+   };
+   const uint32_t first = 0, count = 1, feature = 0;
+   const int32_t zero = 0, cell = WINDOW / 3;
+   put(STAGE_FIRST_WEAK, &first, 1);
+   put(STAGE_WEAK_COUNT, &count, 1);
+   put(STAGE_THRESHOLD, &stage_threshold, 1);
+   put(WEAK_FEATURE, &feature, 1);
+   put(WEAK_LEFT, &left, 1);
+   put(WEAK_RIGHT, &right, 1);
+   put(WEAK_SUBSET, subset.data(), LBP_SUBSET_SIZE);
+   put(RECT_X, &zero, 1);
+   put(RECT_Y, &zero, 1);
+   put(RECT_WIDTH, &cell, 1);
+   put(RECT_HEIGHT, &cell, 1);
+
+   std::vector<char> file(sizeof(header), 0);
+   for (int i = 0; i < NUMBER_OF_CASCADE_ARRAYS; i++) {
+      file.resize((file.size() + CASCADE_ALIGNMENT - 1) / CASCADE_ALIGNMENT * CASCADE_ALIGNMENT, 0);
+      header.offset[i] = static_cast<uint32_t>(file.size());
+      file.insert(file.end(), arrays[static_cast<size_t>(i)].begin(), arrays[static_cast<size_t>(i)].end());
+   }
+   header.file_size = static_cast<uint32_t>(file.size());
+   std::memcpy(file.data(), &header, sizeof(header));
+
+   char path[] = "/tmp/test-binary-cascade-XXXXXX";
+   const int fd = ::mkstemp(path);
+   REQUIRE(fd >= 0);
+   ::close(fd);
+   std::ofstream out(path, std::ios::binary | std::ios::trunc);
+   out.write(file.data(), static_cast<std::streamsize>(file.size()));
+   out.close();
+   return path;
+}
+
+static std::vector<cv::Rect> detect(BinaryCascade *cascade, const cv::Mat &image, bool use_simd) {
+   std::vector<cv::Rect> found;
+   cascade->setUseSimd(use_simd);
+   // the image at its own size only; 0 neighbours keeps every window
+   cascade->detectMultiScale(image, found, 2.0, 0, cv::Size(), cv::Size(WINDOW, WINDOW));
+   return found;
+}
+
+static bool sameRects(const std::vector<cv::Rect> &a, const std::vector<cv::Rect> &b) {
+   if (a.size() != b.size()) { return false; }
+   for (size_t i = 0; i < a.size(); i++) {
+      if (a[i].x != b[i].x || a[i].y != b[i].y || a[i].width != b[i].width || a[i].height != b[i].height) { return false; }
+   }
+   return true;
+}
+
+TEST_CASE("Test v_load_strided reads no further than its last lane.") {
+   // exactly the elements the lanes need, as at the end of an integral image
+   std::vector<int32_t> values{0, 1, 2, 3, 4, 5, 6};
+   int32_t lanes[4];
+   v_store(lanes, v_load_strided(values.data(), 2));
+   REQUIRE(lanes[0] == 0);
+   REQUIRE(lanes[1] == 2);
+   REQUIRE(lanes[2] == 4);
+   REQUIRE(lanes[3] == 6);
+   std::vector<int32_t> four{7, 8, 9, 10};
+   v_store(lanes, v_load_strided(four.data(), 1));
+   REQUIRE(lanes[3] == 10);
+}
+
+TEST_CASE("Test BinaryCascade evaluates the window at the bottom right corner.") {
+   // With a step of 2, the windows of a 46x46 image are at 0, 2, ..., 22. The four window
+   // group at x = 16 ends with the window at 22, whose bottom right corner is the last
+   // element of the integral image on the last row of windows.
+   const std::string path = writeLbpCascade(std::vector<int32_t>(LBP_SUBSET_SIZE, -1));
+   BinaryCascade cascade;
+   REQUIRE(cascade.load(path));
+   std::remove(path.c_str());
+   REQUIRE(cascade.compiled());
+
+   cv::Mat image(46, 46, CV_8UC1);
+   std::mt19937 random(2019);
+   for (int y = 0; y < image.rows; y++) {
+      for (int x = 0; x < image.cols; x++) { image.ptr<uint8_t>(y)[x] = static_cast<uint8_t>(random() % 256); }
+   }
+
+   const std::vector<cv::Rect> vector = detect(&cascade, image, true);
+   const std::vector<cv::Rect> scalar = detect(&cascade, image, false);
+   REQUIRE(vector.size() == 12 * 12);
+   REQUIRE(sameRects(vector, scalar));
+   bool corner = false;
+   for (const cv::Rect &r : vector) { corner = corner || (r.x == 22 && r.y == 22 && r.width == WINDOW && r.height == WINDOW); }
+   REQUIRE(corner);
+}
+
+TEST_CASE("Test BinaryCascade finds the same windows four at a time as one at a time.") {
+   std::mt19937 random(31);
+   for (int trial = 0; trial < 50; trial++) {
+      std::vector<int32_t> subset(LBP_SUBSET_SIZE);
+      for (int32_t &bits : subset) { bits = static_cast<int32_t>(random()); }
+      const std::string path = writeLbpCascade(subset);
+      BinaryCascade cascade;
+      REQUIRE(cascade.load(path));
+      std::remove(path.c_str());
+
+      cv::Mat image(WINDOW + static_cast<int>(random() % 40), WINDOW + static_cast<int>(random() % 40), CV_8UC1);
+      for (int y = 0; y < image.rows; y++) {
+         for (int x = 0; x < image.cols; x++) { image.ptr<uint8_t>(y)[x] = static_cast<uint8_t>(random() % 256); }
+      }
+      REQUIRE(sameRects(detect(&cascade, image, true), detect(&cascade, image, false)));
+   }
+}
@@ -26,6 +26,16 @@
 
 #include "cluon-complete.hpp"
 #include "opendlv-standard-message-set.hpp"
+#include "scenario-mode.hpp"
+#include "load-shedding.hpp"
+#include "binary-cascade.hpp"
+#include "gray-equalize.hpp"
+#include "dnn-detector.hpp"
+#include "thread-pool.hpp"
+#include "message-bus.hpp"
+#include "frame-reader.hpp"
+#include "service-clock.hpp"
+#include "flight-recorder.hpp"
 
 #include "opencv2/core.hpp"
 #include <opencv2/highgui/highgui.hpp>
@@ -51,76 +61,178 @@
 #include <mutex>
 
 
+#ifdef SERVICE_HOST
+namespace carDetection {
+#endif
+
 using namespace std;
 using namespace cv;
 using namespace cluon;
 
+// All geometry is expressed in normalised frame coordinates (0 - 1 of the full frame),
+// so the same thresholds hold for any camera resolution and --process-scale.
+// The values were originally tuned in pixels on 640x480 frames.
+const double CROP_BOTTOM = 0.77; // ~370 px, cuts off the bottom of the frame
+
+// Frames kept by the flight recorder are downscaled to this width.
+const int RECORDER_WIDTH = 160;
+
+// The motion gate compares the frame tile by tile, so every tile covers the same part of
+// the frame regardless of resolution; of the pixels every MOTION_STEP-th in x and y. The
+// cascade runs on the changed tiles and MOTION_MARGIN tiles around them.
+const Size MOTION_TILES(16, 12);
+const int MOTION_STEP = 2;
+const int MOTION_MARGIN = 2;
+
+// What the motion gate keeps from frame to frame.
+struct MotionGate {
+   Mat reference{};           // sampled grey levels of each tile when the cascade last ran on it
+   Mat current{};             // those of the frame being gated
+   vector<uint32_t> sads{};   // sum of absolute differences per tile
+   int frames_since_refresh{0};
+};
+
 // static double angle( Point pt1, Point pt2, Point pt0 );
 // static void findSquares( const Mat& image, vector<vector<Point> >& squares );
-// static Mat drawSquares( Mat& image, const vector<vector<Point> >& squares, vector<Rect> &boundRects, OD4Session *od4);
-void findCars(Mat &frame, vector<Rect>& foundCars, CascadeClassifier carsCascadeClassifier);
+// static Mat drawSquares( Mat& image, const vector<vector<Point> >& squares, vector<Rect> &boundRects, ServiceSession *od4);
+void findCars(Mat &frame, vector<Rect>& foundCars, BinaryCascade *carsCascade, double scale_factor, Mat &frame_gray, const Rect &region = Rect());
+void findCarsDnn(Mat &frame, vector<Rect>& foundCars, DnnDetector *detector);
 
-void removeCarFromQueue( vector<Point> &initial_car_positions, int *cars_in_queue, int *car_leave_timeout_counter);
-void checkCarPosition(OD4Session *od4, double *prev_centerX, double *prev_centerY, double centerX, double centerY,
+void removeCarFromQueue( vector<Point2d> &initial_car_positions, int *cars_in_queue, int *car_leave_timeout_counter);
+void checkCarPosition(ServiceSession *od4, double *prev_centerX, double *prev_centerY, double centerX, double centerY,
    double *prev_area, double area, bool *stop_line_arrived, bool *stop_line_arrived_trigger, bool *left_car_is_12oclock_car,
-   vector<Point> &initial_car_positions, int *cars_in_queue, int *car_leave_timeout_counter);
-void countCars(Mat frame, vector<Point> &initial_car_positions , int *cars_in_queue, bool *stop_line_arrived);
+   vector<Point2d> &initial_car_positions, int *cars_in_queue, int *car_leave_timeout_counter);
+void countCars(Mat frame, vector<Point2d> &initial_car_positions , int *cars_in_queue, bool *stop_line_arrived);
 void detectCars(
-   OD4Session *od4, Mat& image, vector<Rect> &foundCars,
+   ServiceSession *od4, Mat& image, vector<Rect> &foundCars, const Size &frame_size,
    double *prev_area, double *prev_centerX, double *prev_centerY,
    int *cars_in_queue, int *car_leave_timeout_counter, bool *stop_line_arrived, bool *stop_line_arrived_trigger,
-   vector<Point> &initial_car_positions, bool *left_car_is_12oclock_car);
-void BrightnessAndContrastAuto(const cv::Mat &src, cv::Mat &dst, float clipHistPercent);
+   vector<Point2d> &initial_car_positions, bool *left_car_is_12oclock_car);
+Rect2d normaliseRect(const Rect &rect, const Size &frame_size);
+bool sceneChanged(const Mat &frame, MotionGate *gate, int refresh_frames, int motion_threshold, vector<Rect> &changed_tiles);
+Rect motionRegion(const Size &frame_size, const vector<Rect> &changed_tiles);
 
 int32_t main(int32_t argc, char **argv) {
    int32_t retCode{1};
    auto commandlineArguments = cluon::getCommandlineArguments(argc, argv);
    if((0 == commandlineArguments.count("cid")) ||
-      (0 == commandlineArguments.count("name")) ||
+      (0 == commandlineArguments.count("name") && 0 == commandlineArguments.count("source")) ||
       (0 == commandlineArguments.count("width")) ||
       (0 == commandlineArguments.count("height")) ) {
       std::cerr << argv[0] << " attaches to a shared memory area containing an ARGB image." << std::endl;
-      std::cerr << "Usage:   " << argv[0] << " --cid=<OD4 session> --name=<name of shared memory area> [--verbose]" << std::endl;
+      std::cerr << "Usage:   " << argv[0] << " --cid=<OD4 session> --name=<name of shared memory area>|--source=<camera:n|file.rec|video|directory> [--process-scale=<0..1>] [--motion-threshold=<0..255>] [--motion-refresh=<frames>] [--latency-budget=<ms>] [--cascade=<file>] [--detector=cascade|dnn --dnn-model=<file> [--dnn-config=<file>] --dnn-labels=<file> [--dnn-confidence=<0..1>] [--dnn-input=<px>]] [--cpus=<list>] [--threads=<n>] [--nice=<n>] [--virtual-clock] [--recorder=<directory> [--recorder-seconds=<s>]] [--verbose]" << std::endl;
       std::cerr << "         --cid:    CID of the OD4Session to send and receive messages" << std::endl;
       std::cerr << "         --name:   name of the shared memory area to attach" << std::endl;
+      std::cerr << "         --source: frames from a camera, the ImageReadings of a .rec (raw or h264), a video file or a directory of images instead, files as fast as they are processed" << std::endl;
       std::cerr << "         --width:  width of the frame" << std::endl;
       std::cerr << "         --height: height of the frame" << std::endl;
-      std::cerr << "Example: " << argv[0] << " --cid=112 --name=img.i420 --width=640 --height=480" << std::endl;
+      std::cerr << "         --process-scale: downscale the frame by this factor before detection (default 1)" << std::endl;
+      std::cerr << "         --motion-threshold: mean grey level change of a tile that counts as motion (default 8)" << std::endl;
+      std::cerr << "         --motion-refresh: run detection at least every this many frames (default 10, 1 disables the motion gate)" << std::endl;
+      std::cerr << "         --latency-budget: p95 frame latency to hold by degrading detection under load (default 100, 0 disables)" << std::endl;
+      std::cerr << "         --cascade: HAAR or LBP car cascade, an .xml for cv::CascadeClassifier or a compiled .cascade (default /usr/bin/car-28-stages.xml)" << std::endl;
+      std::cerr << "         --detector: find cars with the cascade (default) or with an SSD network through cv::dnn" << std::endl;
+      std::cerr << "         --dnn-model, --dnn-config: Caffe .caffemodel/.prototxt or TensorFlow .pb/.pbtxt of the SSD" << std::endl;
+      std::cerr << "         --dnn-labels: class names of the network, one per line in class id order" << std::endl;
+      std::cerr << "         --dnn-confidence: minimum detection confidence (default 0.5)" << std::endl;
+      std::cerr << "         --dnn-input: side of the square network input (default 300)" << std::endl;
+      std::cerr << "         --cpus: CPUs to pin the service and its detection threads to, e.g. 0-1 (default all)" << std::endl;
+      std::cerr << "         --threads: threads evaluating cascade scales (default the number of --cpus, else 1)" << std::endl;
+      std::cerr << "         --nice: nice value of the service threads (default 0)" << std::endl;
+      std::cerr << "         --virtual-clock: time the timers by the sample times of the frames, for recordings replayed faster than real time (with --latency-budget=0 for the same results every time)" << std::endl;
+      std::cerr << "         --recorder: keep the last seconds of frames and messages in memory and write them to a .rec in this directory when SafeToGo is sent (default off)" << std::endl;
+      std::cerr << "         --recorder-seconds: seconds the recorder keeps (default 10)" << std::endl;
+      std::cerr << "Example: " << argv[0] << " --cid=112 --name=img.i420 --width=640 --height=480 --process-scale=0.75" << std::endl;
    } else {
       const std::string NAME{commandlineArguments["name"]};
       const uint32_t WIDTH{static_cast<uint32_t>(std::stoi(commandlineArguments["width"]))};
       const uint32_t HEIGHT{static_cast<uint32_t>(std::stoi(commandlineArguments["height"]))};
       const bool VERBOSE{commandlineArguments.count("verbose") != 0};
+      const float PROCESS_SCALE{(commandlineArguments["process-scale"].size() != 0) ? static_cast<float>(std::stof(commandlineArguments["process-scale"])) : static_cast<float>(1.0)};
+      if (PROCESS_SCALE <= 0 || PROCESS_SCALE > 1) {
+         std::cerr << argv[0] << ": --process-scale must be in (0, 1]." << std::endl;
+         return retCode;
+      }
+      const Rect CROP_RECT(0, 0, static_cast<int>(WIDTH), cvRound(HEIGHT * CROP_BOTTOM));
+      const int MOTION_THRESHOLD{(commandlineArguments["motion-threshold"].size() != 0) ? std::stoi(commandlineArguments["motion-threshold"]) : 8};
+      const int MOTION_REFRESH{(commandlineArguments["motion-refresh"].size() != 0) ? std::stoi(commandlineArguments["motion-refresh"]) : 10};
+      const double LATENCY_BUDGET{(commandlineArguments["latency-budget"].size() != 0) ? std::stod(commandlineArguments["latency-budget"]) : 100.0};
+      const std::string CASCADE{(commandlineArguments["cascade"].size() != 0) ? commandlineArguments["cascade"] : "/usr/bin/car-28-stages.xml"};
+      const bool USE_DNN{commandlineArguments["detector"] == "dnn"};
+      if (USE_DNN == false && commandlineArguments["detector"].size() != 0 && commandlineArguments["detector"] != "cascade") {
+         std::cerr << argv[0] << ": --detector must be cascade or dnn." << std::endl;
+         return retCode;
+      }
+      const float DNN_CONFIDENCE{(commandlineArguments["dnn-confidence"].size() != 0) ? std::stof(commandlineArguments["dnn-confidence"]) : 0.5f};
+      const int DNN_INPUT{(commandlineArguments["dnn-input"].size() != 0) ? std::stoi(commandlineArguments["dnn-input"]) : 300};
+      const std::vector<int> CPUS{parseCpuList(commandlineArguments["cpus"])};
+      if (CPUS.empty() && commandlineArguments["cpus"].size() != 0) {
+         std::cerr << argv[0] << ": --cpus must be a list like 0,1 or 0-2." << std::endl;
+         return retCode;
+      }
+      const int THREADS{(commandlineArguments["threads"].size() != 0) ? std::stoi(commandlineArguments["threads"]) : std::max(1, static_cast<int>(CPUS.size()))};
+      const int NICE{(commandlineArguments["nice"].size() != 0) ? std::stoi(commandlineArguments["nice"]) : 0};
+      // before any other thread is started, so that they all inherit the CPUs and priority
+      if (!pinCurrentThread(CPUS, NICE)) {
+         std::cerr << argv[0] << ": could not apply --cpus or --nice, running unpinned." << std::endl;
+      }
+      ThreadPool threadPool{static_cast<unsigned>(std::max(1, THREADS) - 1), CPUS, NICE};
+      ServiceClock serviceClock{commandlineArguments.count("virtual-clock") != 0};
+      const double RECORDER_SECONDS{(commandlineArguments["recorder-seconds"].size() != 0) ? std::stod(commandlineArguments["recorder-seconds"]) : 10.0};
+      const Size RECORDER_SIZE(RECORDER_WIDTH, cvRound(RECORDER_WIDTH * HEIGHT / static_cast<double>(WIDTH)));
+      FlightRecorder recorder{"car-detection", commandlineArguments["recorder"], RECORDER_SECONDS, 100, 15, static_cast<size_t>(RECORDER_SIZE.area()) * 3};
+      Mat recorder_small, recorder_bgr; // the recorded frame, allocated once
 
       // Attach to the shared memory.
-      std::unique_ptr<cluon::SharedMemory> sharedMemory{new cluon::SharedMemory{NAME}};
-      if (sharedMemory && sharedMemory->valid()) {
-         std::clog << argv[0] << ": Attached to shared memory '" << sharedMemory->name() << " (" << sharedMemory->size() << " bytes)." << std::endl;
+      FrameReader frames{NAME, WIDTH, HEIGHT, commandlineArguments["source"]};
+      if (frames.valid()) {
+         std::clog << argv[0] << ": Attached to '" << frames.name() << "' (" << frames.size() << " bytes)." << std::endl;
 
          // Interface to a running OpenDaVINCI session; here, you can send and receive messages.
-         cluon::OD4Session od4{static_cast<uint16_t>(std::stoi(commandlineArguments["cid"]))};
+         ServiceSession od4{static_cast<uint16_t>(std::stoi(commandlineArguments["cid"]))};
 
-         String carsCascadeName;
-         CascadeClassifier carsCascadeClassifier;
+         BinaryCascade carsCascade;
+         DnnDetector dnnDetector;
 
-         // XML trained by Group 8. Permission Given by Group 8 and Student TAs.
-         // == for local testing ==
-         // carsCascadeName = "../src/car-28-stages.xml";
-
-         carsCascadeName = "/usr/bin/car-28-stages.xml";
-         if(!carsCascadeClassifier.load(carsCascadeName)) {
-            printf("--(!)Error loading car cascade xml \n");
-            return -1;
-         };
+         if (USE_DNN) {
+            // The network also knows stop and yield signs, so signs are not mistaken for cars.
+            if (!dnnDetector.load(commandlineArguments["dnn-model"], commandlineArguments["dnn-config"], commandlineArguments["dnn-labels"])) {
+               printf("--(!)Error loading detection network %s\n", commandlineArguments["dnn-model"].c_str());
+               return -1;
+            }
+            dnnDetector.setConfidence(DNN_CONFIDENCE);
+            dnnDetector.setInputSize(Size(DNN_INPUT, DNN_INPUT));
+            cout << "Car detector: " << commandlineArguments["dnn-model"] << " (cv::dnn, " << DNN_INPUT << "x" << DNN_INPUT << ")" << endl;
+         } else {
+            // XML trained by Group 8. Permission Given by Group 8 and Student TAs.
+            // Also converted to car-28-stages.cascade by cascade-compiler at build time, which is
+            // memory-mapped and evaluated by BinaryCascade when selected with --cascade.
+            // == for local testing ==
+            // --cascade=../src/car-28-stages.xml
+
+            if(!carsCascade.load(CASCADE)) {
+               printf("--(!)Error loading car cascade %s\n", CASCADE.c_str());
+               return -1;
+            };
+            cout << "Car cascade: " << CASCADE << " (" << (carsCascade.featureType() == CASCADE_HAAR ? "HAAR" : "LBP") << ", "
+                 << (carsCascade.compiled() ? "compiled" : "cv::CascadeClassifier") << ", " << threadPool.size() << " threads)" << endl;
+            carsCascade.setThreadPool(&threadPool);
+         }
 
          // Measure beginning time
-         int64_t starttimestampmicro = cluon::time::toMicroseconds(cluon::time::now());
+         int64_t starttimestampmicro = serviceClock.microseconds();
          int64_t starttimestampsecs = starttimestampmicro / 1000000;
          cout << "Starting Timestamp: " << starttimestampsecs << endl;
 
          // Stupid warnings say it needs to be initialized so here you go compiler stop complaining
          int64_t prevtimestampsecs = 0;
          int framecounter = 0;
+         int detectioncounter = 0; // frames per second that actually ran the cascade
+         LoadShedder loadShedder{"car-detection", LATENCY_BUDGET};
+
+         MotionGate motion_gate;
+         vector<Rect> changed_tiles; // by the motion gate, in the processed frame
+         vector<Rect> last_cars; // found the last time the cascade ran, in the processed frame
 
          double prev_area = 0; // used to determine whether car is moving and amount of acceleration
          double prev_centerX = 0; // used to track cars
@@ -128,7 +240,7 @@ int32_t main(int32_t argc, char **argv) {
 
          int cars_in_queue = 0; // keeps track of the highest amount of cars
          int car_leave_timeout_counter = 0; // prevents counting 1 car leaving as 2
-         vector<Point> initial_car_positions {Point(0,0), Point(0,0), Point(0,0)}; // { left | mid | right } respectively
+         vector<Point2d> initial_car_positions {Point2d(0,0), Point2d(0,0), Point2d(0,0)}; // { left | mid | right } respectively
 
          bool stop_line_arrived = false;
          bool stop_line_arrived_trigger = false;
@@ -151,9 +263,8 @@ int32_t main(int32_t argc, char **argv) {
          // Listen for when the car has arrived at stop line
          auto onStopCar {
             [&od4, &stop_line_arrived, &left_car_is_12oclock_car, &leading_car_gone, &stop_line_arrived_trigger, &yeet_sent]
-            (cluon::data::Envelope &&envelope) {
+            (StopSignPresenceUpdate &&msg, const cluon::data::Envelope &) {
 
-               auto msg = cluon::extractMessage<StopSignPresenceUpdate>(std::move(envelope));
                bool stopSignPresence = msg.stopSignPresence(); // Get the bool
                if (stopSignPresence == false) {
                   if (leading_car_gone == false) { // if leading car not gone, then stopsign shouldnt be triggered
@@ -167,16 +278,27 @@ int32_t main(int32_t argc, char **argv) {
                }
             }
          };
-         od4.dataTrigger(StopSignPresenceUpdate::ID(), onStopCar);
+         onMessage<StopSignPresenceUpdate>(od4, onStopCar);
+
+         // cars only need to be detected on the approach and while waiting at the stop line
+         ScenarioGate scenarioGate{modeBit(MODE_APPROACHING) | modeBit(MODE_AT_STOP_LINE)};
+         auto onScenarioModeUpdate {
+            [&scenarioGate](ScenarioModeUpdate &&msg, const cluon::data::Envelope &) {
+               if (scenarioGate.update(msg.mode())) {
+                  cout << "   [ Scenario mode: " << modeName(msg.mode()) << (scenarioGate.isActive() ? " ]" : ", idle ]") << endl;
+               }
+            }
+         };
+         onMessage<ScenarioModeUpdate>(od4, onScenarioModeUpdate);
 
          // sensors are used here to detect leaving cars
          float currentDistance{0.0};
          auto onDistanceReadingAtStopLine {
-            [&od4, &stop_line_arrived, &currentDistance, &initial_car_positions,
+            [&od4, &serviceClock, &stop_line_arrived, &currentDistance, &initial_car_positions,
             &cars_in_queue, &car_leave_timeout_counter, &yeet_sent,
             MINFRONTDIST, LEFTINTERSECTFRONTDIST, MINLEFTDIST, MAXLEFTDIST]
-            (cluon::data::Envelope &&envelope) {
-               auto msg = cluon::extractMessage<opendlv::proxy::DistanceReading>(std::move(envelope));
+            (opendlv::proxy::DistanceReading &&msg, const cluon::data::Envelope &envelope) {
+               serviceClock.observe(envelope.sampleTimeStamp());
       			// senderStamp 0 corresponds to front ultra-sound distance sensor
       	      const uint16_t senderStamp = envelope.senderStamp();
       	      currentDistance = msg.distance(); // Get the distance
@@ -200,13 +322,12 @@ int32_t main(int32_t argc, char **argv) {
                }
             }
          };
-         od4.dataTrigger(opendlv::proxy::DistanceReading::ID(), onDistanceReadingAtStopLine);
+         onMessage<opendlv::proxy::DistanceReading>(od4, onDistanceReadingAtStopLine);
 
          // start detecting other cars when approaching stop line
       	auto onCarOutOfSight {
-            [&od4, VERBOSE, &leading_car_gone, &stop_line_arrived, &yeet_sent, &stop_line_arrived_trigger](cluon::data::Envelope &&envelope) {
+            [&od4, VERBOSE, &leading_car_gone, &stop_line_arrived, &yeet_sent, &stop_line_arrived_trigger](CarOutOfSight &&, const cluon::data::Envelope &) {
 
-      		   auto msg = cluon::extractMessage<CarOutOfSight>(std::move(envelope));
 
                if (leading_car_gone == true && stop_line_arrived == true && yeet_sent == true) {
                   cout << "      Scenario is over, resetting. " << endl;
@@ -229,13 +350,21 @@ int32_t main(int32_t argc, char **argv) {
                }
       		}
       	};
-      	od4.dataTrigger(CarOutOfSight::ID(), onCarOutOfSight);
+      	onMessage<CarOutOfSight>(od4, onCarOutOfSight);
+
+         // the cascade's input, kept from frame to frame so that it is allocated once
+         Mat frame_gray;
 
          // Endless loop; end the program by pressing Ctrl-C.
          while (od4.isRunning()) {
+            // sleep without touching the shared memory while not needed in this scenario mode
+            if (scenarioGate.isActive() == false) {
+               scenarioGate.waitUntilActive();
+               continue;
+            }
+
             Mat frame;
             Mat frame_HSV;
-            Mat frame_gray;
             Mat cropped_frame;
             Mat brightened_frame;
             Mat frame_threshold;
@@ -244,41 +373,70 @@ int32_t main(int32_t argc, char **argv) {
             vector<Rect> foundCars;
 
             // Wait for a notification of a new frame.
-            sharedMemory->wait();
-
-            // Lock the shared memory.
-            sharedMemory->lock();
-            {
-              // Copy image into cvMat structure.
-              // Be aware of that any code between lock/unlock is blocking
-              // the camera to provide the next frame. Thus, any
-              // computationally heavy algorithms should be placed outside
-              // lock/unlock.
-              cv::Mat wrapped(HEIGHT, WIDTH, CV_8UC4, sharedMemory->data());
-              frame = wrapped.clone();
+            if (frames.wait() == false) {
+               std::clog << argv[0] << ": end of " << frames.name() << "." << std::endl;
+               break;
+            }
+            auto frame_start = std::chrono::steady_clock::now();
+
+            frame = frames.latest();
+            if (frames.timeStamped()) { serviceClock.observe(frames.timeStamp()); }
+            if (recorder.enabled()) {
+               resize(frame, recorder_small, RECORDER_SIZE, 0, 0, INTER_AREA);
+               cvtColor(recorder_small, recorder_bgr, COLOR_BGRA2BGR);
+               recorder.recordFrame(frames.timeStamp(), static_cast<uint32_t>(recorder_bgr.cols), static_cast<uint32_t>(recorder_bgr.rows), recorder_bgr.data);
             }
-            sharedMemory->unlock();
             // TODO: Do something with the frame.
 
             // measure current time; needs to be after frame is copied to shared memory. I think.
-            int64_t timestampmicro = cluon::time::toMicroseconds(cluon::time::now());
-            int64_t timestampsecs = timestampmicro / 1000000;
-
-            // Crop the frame to get useful stuff
-            frame(Rect(Point(0, 0), Point(640, 370))).copyTo(cropped_frame);
+            int64_t timestampsecs = serviceClock.seconds();
+
+            // Crop the frame to get useful stuff, downscaled for detection if requested or under load.
+            // Detections are normalised against the size of the full frame after downscaling.
+            const DegradationLevel &quality = loadShedder.level();
+            const float scale = PROCESS_SCALE * quality.process_scale;
+            const Size process_size(cvRound(WIDTH * scale), cvRound(HEIGHT * scale));
+            if (scale < 1) {
+               resize(frame(CROP_RECT), cropped_frame, Size(), scale, scale, INTER_AREA);
+            } else {
+               cropped_frame = frame(CROP_RECT);
+            }
 
             // only start detecting cars when leading car is gone
             if (leading_car_gone == true) {
-               if (yeet_sent == false) {
-
-                  // Method for detecting car with haar cascade
-                  findCars(cropped_frame, foundCars, carsCascadeClassifier);
+               // skip the cascade while nothing in the intersection moves, e.g. waiting at the line
+               if (yeet_sent == false && loadShedder.shouldProcess() &&
+                   sceneChanged(cropped_frame, &motion_gate, MOTION_REFRESH, MOTION_THRESHOLD, changed_tiles)) {
+                  detectioncounter++;
+
+                  // Method for detecting car with haar cascade, or with the network. The cascade
+                  // only looks where the scene changed; the cars it found before elsewhere are
+                  // still there.
+                  if (USE_DNN) {
+                     findCarsDnn(cropped_frame, foundCars, &dnnDetector);
+                  } else {
+                     const Rect region = motionRegion(cropped_frame.size(), changed_tiles);
+                     findCars(cropped_frame, foundCars, &carsCascade, quality.cascade_scale_factor, frame_gray, region);
+                     for (const Rect &car : last_cars) {
+                        if ((car & region).area() == 0) { foundCars.push_back(car); }
+                     }
+                     last_cars = foundCars;
+                  }
+                  for (const Rect &car : foundCars) {
+                     const Rect2d box = normaliseRect(car, process_size);
+                     DetectionBox detection;
+                     detection.detector("car").x(static_cast<float>(box.x)).y(static_cast<float>(box.y))
+                              .width(static_cast<float>(box.width)).height(static_cast<float>(box.height)).score(1.0f);
+                     recorder.record(detection, frames.timeStamp());
+                  }
 
                   // checks position and location of cars
                   // no theres no time to separate this function ok
-                  detectCars(&od4, final_frame, foundCars, &prev_area, &prev_centerX, &prev_centerY,
+                  detectCars(&od4, final_frame, foundCars, process_size, &prev_area, &prev_centerX, &prev_centerY,
                      &cars_in_queue, &car_leave_timeout_counter, &stop_line_arrived, &stop_line_arrived_trigger,
                      initial_car_positions, &left_car_is_12oclock_car);
+
+                  loadShedder.addSample(millisecondsSince(frame_start));
                }
             }
 
@@ -286,6 +444,8 @@ int32_t main(int32_t argc, char **argv) {
             if (leading_car_gone == true && stop_line_arrived == true && cars_in_queue == 0 && yeet_sent == false) {
                SafeToGo yeet;
                od4.send(yeet);
+               recorder.record(yeet);
+               recorder.trigger("safe-to-go");
                cout << endl << " --=== Time to leave intersection. Waiting for direction. ===-- " << endl;
                yeet_sent = true;
             }
@@ -315,9 +475,10 @@ int32_t main(int32_t argc, char **argv) {
                   }
                }
 
-               cout << endl << "Timestamp: " << timestampsecs << "          FPS: " << framecounter << endl;
+               cout << endl << "Timestamp: " << timestampsecs << "          FPS: " << framecounter << "   Detections: " << detectioncounter << "   Quality level: " << loadShedder.levelIndex() << endl;
                prevtimestampsecs = timestampsecs;
                framecounter = 0;
+               detectioncounter = 0;
             }
 
          }
@@ -327,29 +488,117 @@ int32_t main(int32_t argc, char **argv) {
    return retCode;
 }
 
-void findCars(Mat &frame, vector<Rect>& foundCars, CascadeClassifier carsCascadeClassifier) {
+// Cars in the region of the frame, the whole frame if it is empty, in frame coordinates.
+// The frame is equalised as a whole so that a region sees the same grey levels.
+void findCars(Mat &frame, vector<Rect>& foundCars, BinaryCascade *carsCascade, double scale_factor, Mat &frame_gray, const Rect &region) {
 
-   Mat frame_gray;
    // the amount of overlapping squares on 1 place to confirm it is a car
    int min_neighbors = 3;
 
-   cvtColor(frame, frame_gray, COLOR_RGB2GRAY );
-   equalizeHist(frame_gray, frame_gray);
-   carsCascadeClassifier.detectMultiScale(frame_gray, foundCars, 1.1, min_neighbors);
+   grayEqualized(frame, frame_gray);
+   if (region.area() == 0) {
+      carsCascade->detectMultiScale(frame_gray, foundCars, scale_factor, min_neighbors);
+   } else {
+      carsCascade->detectMultiScale(frame_gray(region), foundCars, scale_factor, min_neighbors);
+      for (Rect &car : foundCars) { car += region.tl(); }
+   }
+
+}
+
+// The network sees the colour frame; the crop is batched as square tiles in one pass.
+void findCarsDnn(Mat &frame, vector<Rect>& foundCars, DnnDetector *detector) {
+   vector<Detection> detections;
+   detector->detect(frame, detections);
+   foundCars = detectionsOf(detections, DETECT_CAR);
+}
 
+// Converts a rect found on the processed frame into normalised frame coordinates.
+Rect2d normaliseRect(const Rect &rect, const Size &frame_size) {
+   return Rect2d(rect.x / (double) frame_size.width, rect.y / (double) frame_size.height,
+      rect.width / (double) frame_size.width, rect.height / (double) frame_size.height);
 }
 
-void countCars(Mat frame, vector<Point> &initial_car_positions, int *cars_in_queue, bool *stop_line_arrived) {
+// Cheap motion gate in front of the cascade, in one pass over the frame: the grey level of
+// every MOTION_STEP-th pixel is compared with the one of the frame the cascade last ran on
+// that tile with, and the absolute differences are summed per tile. A tile changed if the
+// mean difference is above motion_threshold; only then its reference is replaced, so slow
+// movements accumulate until they are noticed. All tiles change on the first frame, on a
+// new frame size and every refresh_frames frames.
+// Returns true if detection should run on this frame, on the changed tiles.
+bool sceneChanged(const Mat &frame, MotionGate *gate, int refresh_frames, int motion_threshold, vector<Rect> &changed_tiles) {
+   CV_Assert(frame.type() == CV_8UC4);
+   const Size sampled((frame.cols + MOTION_STEP - 1) / MOTION_STEP, (frame.rows + MOTION_STEP - 1) / MOTION_STEP);
+   const bool refresh = gate->reference.size() != sampled || gate->frames_since_refresh + 1 >= refresh_frames;
+   gate->current.create(sampled, CV_8UC1);
+   gate->sads.assign(static_cast<size_t>(MOTION_TILES.area()), 0);
+
+   for (int r = 0; r < sampled.height; r++) {
+      const uint8_t *row = frame.ptr<uint8_t>(r * MOTION_STEP);
+      uint8_t *current = gate->current.ptr<uint8_t>(r);
+      const uint8_t *reference = refresh ? current : gate->reference.ptr<uint8_t>(r);
+      uint32_t *sads = &gate->sads[static_cast<size_t>(r * MOTION_TILES.height / sampled.height * MOTION_TILES.width)];
+      for (int tx = 0; tx < MOTION_TILES.width; tx++) {
+         uint32_t sad = 0;
+         const int end = (tx + 1) * sampled.width / MOTION_TILES.width;
+         for (int c = tx * sampled.width / MOTION_TILES.width; c < end; c++) {
+            const uint8_t *pixel = row + c * MOTION_STEP * 4;
+            // the luma of cvtColor(COLOR_BGRA2GRAY) in 14 bit fixed point
+            current[c] = static_cast<uint8_t>((pixel[0] * 1868 + pixel[1] * 9617 + pixel[2] * 4899 + (1 << 13)) >> 14);
+            sad += static_cast<uint32_t>(std::abs(current[c] - reference[c]));
+         }
+         sads[tx] += sad;
+      }
+   }
+
+   changed_tiles.clear();
+   for (int ty = 0; ty < MOTION_TILES.height; ty++) {
+      const int top = ty * sampled.height / MOTION_TILES.height;
+      const int bottom = (ty + 1) * sampled.height / MOTION_TILES.height;
+      for (int tx = 0; tx < MOTION_TILES.width; tx++) {
+         const int left = tx * sampled.width / MOTION_TILES.width;
+         const int right = (tx + 1) * sampled.width / MOTION_TILES.width;
+         const uint32_t samples = static_cast<uint32_t>((bottom - top) * (right - left));
+         if (samples == 0) { continue; }
+         if (refresh || gate->sads[static_cast<size_t>(ty * MOTION_TILES.width + tx)] > static_cast<uint32_t>(motion_threshold) * samples) {
+            const Rect tile(left, top, right - left, bottom - top);
+            if (refresh == false) { gate->current(tile).copyTo(gate->reference(tile)); }
+            changed_tiles.push_back(Rect(left * MOTION_STEP, top * MOTION_STEP,
+               std::min(right * MOTION_STEP, frame.cols) - left * MOTION_STEP, std::min(bottom * MOTION_STEP, frame.rows) - top * MOTION_STEP));
+         }
+      }
+   }
+
+   if (refresh == true) {
+      std::swap(gate->reference, gate->current);
+      gate->frames_since_refresh = 0;
+   } else {
+      gate->frames_since_refresh += 1;
+   }
+   return changed_tiles.empty() == false;
+}
+
+// The box around the changed tiles, grown by MOTION_MARGIN tiles so that a car reaching out
+// of them is found whole, within the frame.
+Rect motionRegion(const Size &frame_size, const vector<Rect> &changed_tiles) {
+   Rect box = changed_tiles.empty() ? Rect() : changed_tiles[0];
+   for (const Rect &tile : changed_tiles) { box |= tile; }
+   const int margin_x = frame_size.width * MOTION_MARGIN / MOTION_TILES.width;
+   const int margin_y = frame_size.height * MOTION_MARGIN / MOTION_TILES.height;
+   box = Rect(box.x - margin_x, box.y - margin_y, box.width + 2 * margin_x, box.height + 2 * margin_y);
+   return box & Rect(Point(0, 0), frame_size);
+}
+
+void countCars(Mat frame, vector<Point2d> &initial_car_positions, int *cars_in_queue, bool *stop_line_arrived) {
    int car_num = 0;
-   if (initial_car_positions[0] != Point(0,0)) { // if theres a car on the left..
+   if (initial_car_positions[0] != Point2d(0,0)) { // if theres a car on the left..
       car_num += 1;
       cout << endl << " <<<< ";
    }
-   if (initial_car_positions[1] != Point(0,0)) { // if theres a car in the middle..
+   if (initial_car_positions[1] != Point2d(0,0)) { // if theres a car in the middle..
       car_num += 1;
       cout  << " |||| ";
    }
-   if (initial_car_positions[2] != Point(0,0)) { // if theres a car on the right..
+   if (initial_car_positions[2] != Point2d(0,0)) { // if theres a car on the right..
       car_num += 1;
       cout << " >>>> " << endl;
    }
@@ -373,34 +622,25 @@ void countCars(Mat frame, vector<Point> &initial_car_positions, int *cars_in_que
       cout << "           [<  " << car_count << " cars. >] " << endl;
    }
    putText(frame, car_count, Point(5,100), FONT_HERSHEY_DUPLEX, 1, Scalar(255,255,255), 2);
-   putText(frame, max_car_count, Point(630,100), FONT_HERSHEY_DUPLEX, 1, Scalar(255,255,255), 2);
+   putText(frame, max_car_count, Point(frame.cols - 10, 100), FONT_HERSHEY_DUPLEX, 1, Scalar(255,255,255), 2);
 }
 
 void detectCars(
-   OD4Session *od4, Mat& image, vector<Rect> &foundCars,
+   ServiceSession *od4, Mat& image, vector<Rect> &foundCars, const Size &frame_size,
    double *prev_area, double *prev_centerX, double *prev_centerY,
    int *cars_in_queue, int *car_leave_timeout_counter, bool *stop_line_arrived, bool *stop_line_arrived_trigger,
-   vector<Point> &initial_car_positions, bool *left_car_is_12oclock_car) {
+   vector<Point2d> &initial_car_positions, bool *left_car_is_12oclock_car) {
 
    double rect_area = 0;
-   double rect_centerX = 0; // valid range from 0 - 640
-   double rect_centerY = 0; // valid range from 0 - 480
+   double rect_centerX = 0; // valid range from 0 - 1
+   double rect_centerY = 0; // valid range from 0 - 1
 
    for (size_t i = 0; i < foundCars.size(); i++) {
-      int rect_x = foundCars[i].x;
-      int rect_y = foundCars[i].y;
-      int rect_width = foundCars[i].width;
-      int rect_height = foundCars[i].height;
-      rect_area = foundCars[i].area();
+      Rect2d rect = normaliseRect(foundCars[i], frame_size);
+      rect_area = rect.area();
 
-      rect_centerX = rect_x + 0.5 * rect_width;
-      rect_centerY = rect_y + 0.5 * rect_height;
-
-      // Now with those parameters you can calculate the 4 points
-      Point top_left(rect_x,rect_y);
-      Point top_right(rect_x + rect_width, rect_y);
-      Point bot_left(rect_x, rect_y + rect_height);
-      Point bot_right(rect_x + rect_width, rect_y + rect_height);
+      rect_centerX = rect.x + 0.5 * rect.width;
+      rect_centerY = rect.y + 0.5 * rect.height;
 
       checkCarPosition(
          od4, prev_centerX, prev_centerY, rect_centerX, rect_centerY,
@@ -415,36 +655,36 @@ void detectCars(
    }
 }
 
-void removeCarFromQueue( vector<Point> &initial_car_positions, int *cars_in_queue, int *car_leave_timeout_counter) {
+void removeCarFromQueue( vector<Point2d> &initial_car_positions, int *cars_in_queue, int *car_leave_timeout_counter) {
 
    if (*cars_in_queue == 1) { // deleting the only one left
-      if (initial_car_positions[0] != Point(0,0)) {
-         initial_car_positions[0] = Point(0,0);
+      if (initial_car_positions[0] != Point2d(0,0)) {
+         initial_car_positions[0] = Point2d(0,0);
          cout << "   Left Car deleted from queue." << endl;
       }
-      else if (initial_car_positions[1] != Point(0,0)) {
-         initial_car_positions[1] = Point(0,0);
+      else if (initial_car_positions[1] != Point2d(0,0)) {
+         initial_car_positions[1] = Point2d(0,0);
          cout << "   Middle Car deleted from queue." << endl;
       }
-      else if (initial_car_positions[2] != Point(0,0)) {
-         initial_car_positions[2] = Point(0,0);
+      else if (initial_car_positions[2] != Point2d(0,0)) {
+         initial_car_positions[2] = Point2d(0,0);
          cout << "   Right Car deleted from queue." << endl;
       }
    }
 
    else if (*cars_in_queue == 2) {
-      if (initial_car_positions[0] == Point(0,0)) {
+      if (initial_car_positions[0] == Point2d(0,0)) {
          cout << "No left car. Therefore  |||| >>>> ." << endl;
       }
-      if (initial_car_positions[1] == Point(0,0)) {
+      if (initial_car_positions[1] == Point2d(0,0)) {
          cout << "No middle car. Therefore   <<<< >>>> ." << endl;
       }
-      if (initial_car_positions[2] == Point(0,0)) {
+      if (initial_car_positions[2] == Point2d(0,0)) {
          cout << "No right car. Therefore    <<<< |||| ." << endl;
       }
       for (int i = 0; i < 3; i++) {
-         if (initial_car_positions[i] != Point(0,0)) {
-            initial_car_positions[i] = Point(0,0);
+         if (initial_car_positions[i] != Point2d(0,0)) {
+            initial_car_positions[i] = Point2d(0,0);
             cout << "Car deleted from queue." << endl;
             break;
          }
@@ -453,8 +693,8 @@ void removeCarFromQueue( vector<Point> &initial_car_positions, int *cars_in_queu
    }
    else if (*cars_in_queue == 3) {
       for (int i = 0; i < 3; i++) {
-         if (initial_car_positions[i] != Point(0,0)) {
-            initial_car_positions[i] = Point(0,0);
+         if (initial_car_positions[i] != Point2d(0,0)) {
+            initial_car_positions[i] = Point2d(0,0);
             cout << "Car deleted from queue." << endl;
             break;
          }
@@ -468,30 +708,30 @@ void removeCarFromQueue( vector<Point> &initial_car_positions, int *cars_in_queu
    }
 }
 
-void checkCarPosition( OD4Session *od4,
+void checkCarPosition( ServiceSession *od4,
    double *prev_centerX, double *prev_centerY, double centerX, double centerY,
    double *prev_area, double area, bool *stop_line_arrived, bool *stop_line_arrived_trigger, bool *left_car_is_12oclock_car,
-   vector<Point> &initial_car_positions, int *cars_in_queue, int *car_leave_timeout_counter ) {
+   vector<Point2d> &initial_car_positions, int *cars_in_queue, int *car_leave_timeout_counter ) {
 
    double centerX_diff = centerX - *prev_centerX; // looks at whether or not car has moved
    double centerY_diff = centerY - *prev_centerY;
 
-   int frame_center = 320;
-   int left_offset; // section of the frame
-   int right_offset;
+   double frame_center = 0.5;
+   double left_offset; // section of the frame
+   double right_offset;
 
    // special section of the frame that overlaps both left and middle.
    // detects when 12 o clock goes to the left side.
-   int stop_line_arrival_offset = 220;
+   double stop_line_arrival_offset = 0.344; // ~220 px
 
 // different offsets are needed in different phases
    if (*stop_line_arrived == false) {
-      left_offset = 270;
-      right_offset = 50;
+      left_offset = 0.422;  // ~270 px
+      right_offset = 0.078; // ~50 px
    }
    if (*stop_line_arrived == true) {
-      left_offset = 320;
-      right_offset = 25;
+      left_offset = 0.5;    // ~320 px
+      right_offset = 0.039; // ~25 px
    }
 
    cout << "   [ Area: " << area << " ] " << endl;
@@ -504,8 +744,8 @@ void checkCarPosition( OD4Session *od4,
 
       // old code, used to know when we have arrived at the stop line without the need of a message.
       if (centerX < frame_center - stop_line_arrival_offset) {
-         if (centerX_diff > -200 && centerX_diff < 0 && centerY_diff > 0) {
-            if (*prev_centerX >= 30) {
+         if (centerX_diff > -0.3125 && centerX_diff < 0 && centerY_diff > 0) {
+            if (*prev_centerX >= 0.047) {
                cout << "Detected car on left side, probably car at 12 o clock. Also probably close to stop line." << endl;
                *left_car_is_12oclock_car = true;
                *stop_line_arrived_trigger = true;
@@ -516,21 +756,21 @@ void checkCarPosition( OD4Session *od4,
       // if car on the left side of frame...
       if (centerX < frame_center - left_offset) {
          if (*left_car_is_12oclock_car == false) { // and we know we are not at the stop line...
-            if (initial_car_positions[0] == Point(0,0)) { // only add if there is no existing left car
-               initial_car_positions[0] = Point((int) centerX, (int) centerY);
+            if (initial_car_positions[0] == Point2d(0,0)) { // only add if there is no existing left car
+               initial_car_positions[0] = Point2d(centerX, centerY);
                cout << "   <<<< ADDED LEFT CAR: " << initial_car_positions[0] << endl;
             }
-            // the -200 check is to make sure it is the same car we are comparing.
+            // the -0.3125 (~200 px) check is to make sure it is the same car we are comparing.
             // else if car is going towards lower left corner of the frame....
-            else if (centerX_diff > -200 && centerX_diff < 0 && centerY_diff > 0) {
+            else if (centerX_diff > -0.3125 && centerX_diff < 0 && centerY_diff > 0) {
                cout << "Detected car on left side, probably car at 3 o clock going out of sight" << endl;
             }
          }
       }
 
       if (centerX >= frame_center - left_offset && centerX < frame_center + right_offset) {
-         if (initial_car_positions[1] == Point(0,0)) {
-            initial_car_positions[1] = Point((int) centerX, (int) centerY);
+         if (initial_car_positions[1] == Point2d(0,0)) {
+            initial_car_positions[1] = Point2d(centerX, centerY);
             cout << "   |||| ADDED MIDDLE CAR: " << initial_car_positions[1] << endl;
          }
          else if (centerX_diff < 0 && centerY_diff > 0) { // going towards bot left corner
@@ -541,9 +781,9 @@ void checkCarPosition( OD4Session *od4,
       }
 
       if (centerX > frame_center + right_offset) {
-         if (area > 10000) { // prevent stopsign from being recognized as car
-            if (initial_car_positions[2] == Point(0,0)) {
-               initial_car_positions[2] = Point((int) centerX, (int) centerY);
+         if (area > 0.0326) { // prevent stopsign from being recognized as car, ~10000 px
+            if (initial_car_positions[2] == Point2d(0,0)) {
+               initial_car_positions[2] = Point2d(centerX, centerY);
                cout << "   >>>> ADDED RIGHT CAR: " << initial_car_positions[2] << endl;
             }
          }
@@ -563,11 +803,11 @@ void checkCarPosition( OD4Session *od4,
          // car is on middle/left - camera too close to see left
          if (centerX >= frame_center - left_offset && centerX < frame_center + right_offset) {
 
-            if (centerX_diff > -30 && centerX_diff < 0 && // makes sure it is the same car we are comparing
-               centerY_diff > 0 && centerY_diff < 40) { // moving closer and towards the left
-               if (area > 10000) {                        // if car is getting bigger
+            if (centerX_diff > -0.047 && centerX_diff < 0 && // makes sure it is the same car we are comparing
+               centerY_diff > 0 && centerY_diff < 0.083) { // moving closer and towards the left
+               if (area > 0.0326) {                        // if car is getting bigger
                   cout << "   / Car leaving Intersection, towards our lane or 9 o clock. /" << endl;
-                  if (centerX < 220 && centerY > 230) {   // if very close to the bottom left of the frame
+                  if (centerX < 0.344 && centerY > 0.479) {   // if very close to the bottom left of the frame
                      cout << " </< Car has left intersection at 9 o clock or towards our lane. </<" << endl;
                      removeCarFromQueue(initial_car_positions, cars_in_queue, car_leave_timeout_counter);
                   }
@@ -575,11 +815,11 @@ void checkCarPosition( OD4Session *od4,
             }
 
             //  if car is going higher in the frame and relatively straight
-            else if (centerY_diff > -0.5 && centerY_diff < 200 &&
-                     centerX_diff > -20 && centerX_diff < 10) {
-               if (centerX > 210) {
+            else if (centerY_diff > -0.001 && centerY_diff < 0.417 &&
+                     centerX_diff > -0.031 && centerX_diff < 0.016) {
+               if (centerX > 0.328) {
                   cout << "   | Car leaving Intersection, towards 12 o clock. | " << endl;
-                  if (area < 15000) {            // if car is very far away (enough)
+                  if (area < 0.049) {            // if car is very far away (enough), ~15000 px
                      cout << "    || Car has left intersection at 12 o clock. || " << endl;
                      removeCarFromQueue(initial_car_positions, cars_in_queue, car_leave_timeout_counter);
                   }
@@ -587,10 +827,10 @@ void checkCarPosition( OD4Session *od4,
             }
 
             // if car is relatively going in a straight line horizontally and is moving left
-            else if (centerX_diff > -200 && centerX_diff < -0.5 &&
-                     centerY_diff > -5 && centerY_diff < 5 ) {
+            else if (centerX_diff > -0.3125 && centerX_diff < -0.0008 &&
+                     centerY_diff > -0.0104 && centerY_diff < 0.0104 ) {
                cout << "   < Car leaving Intersection, towards 9 o clock. < " << endl;
-               if (centerX < 180 && centerY > 150 && centerY <= 240) { // if *relatively* at the edge of frame
+               if (centerX < 0.281 && centerY > 0.3125 && centerY <= 0.5) { // if *relatively* at the edge of frame
                   cout << "   <<< Car has left Intersection, towards 9 o clock. <<< " << endl;
                   removeCarFromQueue(initial_car_positions, cars_in_queue, car_leave_timeout_counter);
                }
@@ -599,10 +839,10 @@ void checkCarPosition( OD4Session *od4,
 
          // Moving in a straight line, from left to right
          if (centerX > frame_center + right_offset) {
-            if (centerX_diff > 0.5 && centerX_diff < 200 &&
-                  centerY_diff > -5 && centerY_diff < 5) {
+            if (centerX_diff > 0.0008 && centerX_diff < 0.3125 &&
+                  centerY_diff > -0.0104 && centerY_diff < 0.0104) {
                cout << "    > Car leaving Intersection towards 3 o clock >" << endl;
-               if (centerX > 510) { // if on the far right
+               if (centerX > 0.797) { // if on the far right
                   cout << "   >> Car has left at 3 o clock >> " << endl;
                   removeCarFromQueue(initial_car_positions, cars_in_queue, car_leave_timeout_counter);
                }
@@ -614,3 +854,7 @@ void checkCarPosition( OD4Session *od4,
 
    }
 }
+
+#ifdef SERVICE_HOST
+} // namespace carDetection
+#endif
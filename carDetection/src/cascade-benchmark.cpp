@@ -0,0 +1,232 @@
+/*
+ * Copyright (C) 2019  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Compares cascades on frames captured from a replayed recording: cv::CascadeClassifier
+// with BinaryCascade (one window at a time and four at once), and optionally a second
+// cascade for the same object, e.g. an LBP version of a HAAR classifier. Prints load time,
+// time per frame and how well the detections agree with the first engine.
+// This file is shared between the services; keep all copies identical.
+
+#include "cluon-complete.hpp"
+#include "binary-cascade.hpp"
+#include "gray-equalize.hpp"
+
+#include "opencv2/core.hpp"
+#include "opencv2/imgproc.hpp"
+#include "opencv2/objdetect.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+using namespace std;
+using namespace cv;
+
+struct EngineResult {
+   string name;
+   double load_ms;
+   vector<double> frame_ms;
+   vector<vector<Rect>> detections;
+};
+
+double millisecondsBetween(chrono::steady_clock::time_point start, chrono::steady_clock::time_point end);
+bool sameDetections(vector<Rect> a, vector<Rect> b);
+int matchedDetections(const vector<Rect> &found, const vector<Rect> &reference);
+void runCascade(BinaryCascade *cascade, const vector<Mat> &frames, double scale_factor, int min_neighbors, Size min_size, EngineResult *result);
+void printResult(const EngineResult &result, const EngineResult &reference);
+
+int32_t main(int32_t argc, char **argv) {
+   int32_t retCode{1};
+   auto commandlineArguments = cluon::getCommandlineArguments(argc, argv);
+   if ((0 == commandlineArguments.count("name")) || (0 == commandlineArguments.count("width")) ||
+       (0 == commandlineArguments.count("height")) || (0 == commandlineArguments.count("cascade"))) {
+      std::cerr << argv[0] << " benchmarks cascades against each other on frames from shared memory." << std::endl;
+      std::cerr << "Usage:   " << argv[0] << " --name=<name of shared memory area> --width=<W> --height=<H> --cascade=<classifier.cascade> [--xml=<classifier.xml>] [--compare=<other.cascade>] [--frames=<n>] [--scale-factor=<f>] [--min-neighbors=<n>] [--min-size=<px>]" << std::endl;
+      std::cerr << "         --xml: the source of --cascade, run through cv::CascadeClassifier as the reference" << std::endl;
+      std::cerr << "         --compare: a second cascade for the same object, e.g. trained with LBP instead of HAAR features" << std::endl;
+      std::cerr << "         --frames: number of frames to capture before benchmarking (default 200)" << std::endl;
+      std::cerr << "         --scale-factor, --min-neighbors, --min-size: detectMultiScale parameters (default 1.1, 3, 0)" << std::endl;
+      std::cerr << "Replay a recording with the h264 decoder (see h264-decoder-viewer.yml) while capturing." << std::endl;
+      std::cerr << "Example: " << argv[0] << " --name=img.argb --width=640 --height=480 --cascade=car-28-stages.cascade --xml=car-28-stages.xml" << std::endl;
+      return retCode;
+   }
+   const uint32_t WIDTH{static_cast<uint32_t>(std::stoi(commandlineArguments["width"]))};
+   const uint32_t HEIGHT{static_cast<uint32_t>(std::stoi(commandlineArguments["height"]))};
+   const int FRAMES{(commandlineArguments["frames"].size() != 0) ? std::stoi(commandlineArguments["frames"]) : 200};
+   const double SCALE_FACTOR{(commandlineArguments["scale-factor"].size() != 0) ? std::stod(commandlineArguments["scale-factor"]) : 1.1};
+   const int MIN_NEIGHBORS{(commandlineArguments["min-neighbors"].size() != 0) ? std::stoi(commandlineArguments["min-neighbors"]) : 3};
+   const int MIN_SIZE{(commandlineArguments["min-size"].size() != 0) ? std::stoi(commandlineArguments["min-size"]) : 0};
+   if (FRAMES <= 0) {
+      std::cerr << argv[0] << ": --frames must be positive." << std::endl;
+      return retCode;
+   }
+
+   std::unique_ptr<cluon::SharedMemory> sharedMemory{new cluon::SharedMemory{commandlineArguments["name"]}};
+   if (!sharedMemory || !sharedMemory->valid()) {
+      std::cerr << argv[0] << ": cannot attach to shared memory '" << commandlineArguments["name"] << "'" << std::endl;
+      return retCode;
+   }
+
+   // Same preprocessing as the services.
+   vector<Mat> frames;
+   while (static_cast<int>(frames.size()) < FRAMES) {
+      sharedMemory->wait();
+      Mat frame;
+      sharedMemory->lock();
+      {
+         cv::Mat wrapped(HEIGHT, WIDTH, CV_8UC4, sharedMemory->data());
+         grayEqualized(wrapped, frame);
+      }
+      sharedMemory->unlock();
+      frames.push_back(frame);
+   }
+   std::cout << "Captured " << frames.size() << " frames of " << WIDTH << "x" << HEIGHT << ", vector unit " << CASCADE_SIMD_NAME << std::endl;
+
+   // One thread for every engine, OpenCV would otherwise spread the windows over all cores.
+   setNumThreads(1);
+   const Size min_size(MIN_SIZE, MIN_SIZE);
+
+   vector<EngineResult> results;
+
+   if (commandlineArguments["xml"].size() != 0) {
+      EngineResult opencv{"OpenCV CascadeClassifier", 0, {}, {}};
+      CascadeClassifier classifier;
+      auto start = chrono::steady_clock::now();
+      if (!classifier.load(commandlineArguments["xml"])) {
+         std::cerr << argv[0] << ": cannot load " << commandlineArguments["xml"] << std::endl;
+         return retCode;
+      }
+      opencv.load_ms = millisecondsBetween(start, chrono::steady_clock::now());
+      for (const Mat &frame : frames) {
+         vector<Rect> found;
+         start = chrono::steady_clock::now();
+         classifier.detectMultiScale(frame, found, SCALE_FACTOR, MIN_NEIGHBORS, 0, min_size);
+         opencv.frame_ms.push_back(millisecondsBetween(start, chrono::steady_clock::now()));
+         opencv.detections.push_back(found);
+      }
+      results.push_back(opencv);
+   }
+
+   // --cascade runs one and four windows at a time, --compare only with the faster one.
+   for (const string key : {"cascade", "compare"}) {
+      if (commandlineArguments[key].size() == 0) { continue; }
+      BinaryCascade cascade;
+      auto start = chrono::steady_clock::now();
+      if (!cascade.load(commandlineArguments[key])) {
+         std::cerr << argv[0] << ": cannot load " << commandlineArguments[key] << std::endl;
+         return retCode;
+      }
+      const double load_ms = millisecondsBetween(start, chrono::steady_clock::now());
+      const string name = string(cascade.featureType() == CASCADE_HAAR ? "HAAR " : "LBP ") + key;
+      std::cout << name << ": " << commandlineArguments[key] << ", window " << cascade.getOriginalWindowSize().width
+                << "x" << cascade.getOriginalWindowSize().height << std::endl;
+      if (key == "cascade") {
+         EngineResult scalar{name + ", 1 window", load_ms, {}, {}};
+         cascade.setUseSimd(false);
+         runCascade(&cascade, frames, SCALE_FACTOR, MIN_NEIGHBORS, min_size, &scalar);
+         results.push_back(scalar);
+      }
+      EngineResult simd{name + ", 4 windows " + CASCADE_SIMD_NAME, load_ms, {}, {}};
+      cascade.setUseSimd(true);
+      runCascade(&cascade, frames, SCALE_FACTOR, MIN_NEIGHBORS, min_size, &simd);
+      results.push_back(simd);
+   }
+
+   std::cout << "Speedup and agreement are relative to " << results.front().name << std::endl;
+   for (const EngineResult &result : results) {
+      printResult(result, results.front());
+   }
+   retCode = 0;
+   return retCode;
+}
+
+void runCascade(BinaryCascade *cascade, const vector<Mat> &frames, double scale_factor, int min_neighbors, Size min_size, EngineResult *result) {
+   for (const Mat &frame : frames) {
+      vector<Rect> found;
+      auto start = chrono::steady_clock::now();
+      cascade->detectMultiScale(frame, found, scale_factor, min_neighbors, min_size);
+      result->frame_ms.push_back(millisecondsBetween(start, chrono::steady_clock::now()));
+      result->detections.push_back(found);
+   }
+}
+
+double millisecondsBetween(chrono::steady_clock::time_point start, chrono::steady_clock::time_point end) {
+   return chrono::duration<double, milli>(end - start).count();
+}
+
+// Detections are compared as sets; the order after groupRectangles is not meaningful.
+bool sameDetections(vector<Rect> a, vector<Rect> b) {
+   auto before = [](const Rect &l, const Rect &r) {
+      return std::tie(l.x, l.y, l.width, l.height) < std::tie(r.x, r.y, r.width, r.height);
+   };
+   std::sort(a.begin(), a.end(), before);
+   std::sort(b.begin(), b.end(), before);
+   return a == b;
+}
+
+// Number of reference detections that overlap a distinct found one by at least half of their union.
+int matchedDetections(const vector<Rect> &found, const vector<Rect> &reference) {
+   int matched = 0;
+   vector<bool> used(found.size(), false);
+   for (const Rect &r : reference) {
+      for (size_t i = 0; i < found.size(); i++) {
+         const int overlap = (r & found[i]).area();
+         if (!used[i] && 2 * overlap >= r.area() + found[i].area() - overlap) {
+            used[i] = true;
+            matched++;
+            break;
+         }
+      }
+   }
+   return matched;
+}
+
+// Besides identical boxes, a cascade trained differently is judged on the frames where it
+// sees something iff the reference does, which is what the services' votes act on.
+void printResult(const EngineResult &result, const EngineResult &reference) {
+   vector<double> sorted = result.frame_ms;
+   std::sort(sorted.begin(), sorted.end());
+   double total = 0;
+   for (double ms : sorted) { total += ms; }
+   const double mean = total / static_cast<double>(sorted.size());
+   double reference_total = 0;
+   for (double ms : reference.frame_ms) { reference_total += ms; }
+   int agreeing = 0;
+   int same_presence = 0;
+   int matched = 0;
+   size_t reference_boxes = 0;
+   for (size_t i = 0; i < result.detections.size(); i++) {
+      agreeing += sameDetections(result.detections[i], reference.detections[i]) ? 1 : 0;
+      same_presence += (result.detections[i].empty() == reference.detections[i].empty()) ? 1 : 0;
+      matched += matchedDetections(result.detections[i], reference.detections[i]);
+      reference_boxes += reference.detections[i].size();
+   }
+   std::cout << std::fixed << std::setprecision(2) << std::left << std::setw(36) << result.name
+             << " load " << std::setw(8) << result.load_ms << " ms"
+             << "   mean " << std::setw(7) << mean << " ms"
+             << "   p95 " << std::setw(7) << sorted[(sorted.size() * 95) / 100] << " ms"
+             << "   speedup " << std::setw(5) << reference_total / total << "x"
+             << "   same detections " << agreeing << "/" << result.detections.size()
+             << "   same presence " << same_presence << "/" << result.detections.size()
+             << "   boxes matched " << matched << "/" << reference_boxes << std::endl;
+}
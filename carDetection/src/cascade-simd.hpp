@@ -0,0 +1,255 @@
+/*
+ * Copyright (C) 2019  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Four lane integer and float vectors for the cascade evaluator in binary-cascade.hpp:
+// NEON on the car (armhf, see CMakeLists.txt), SSE2 on x86, plain arrays elsewhere.
+// Every operation rounds exactly like the scalar float code it replaces.
+// This file is shared between the services; keep all copies identical.
+
+#ifndef CASCADE_SIMD_HPP
+#define CASCADE_SIMD_HPP
+
+#include "opencv2/core.hpp"
+#include "opencv2/imgproc.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CASCADE_SIMD_NEON 1
+#define CASCADE_SIMD_NAME "NEON"
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define CASCADE_SIMD_SSE2 1
+#define CASCADE_SIMD_NAME "SSE2"
+#else
+#define CASCADE_SIMD_NAME "scalar"
+#endif
+
+#if defined(CASCADE_SIMD_NEON)
+
+typedef int32x4_t v_int4;
+typedef float32x4_t v_float4;
+typedef uint32x4_t v_mask4;
+
+inline v_int4 v_setall(int32_t value) { return vdupq_n_s32(value); }
+inline v_float4 v_setall(float value) { return vdupq_n_f32(value); }
+inline v_int4 v_load(const int32_t *p) { return vld1q_s32(p); }
+inline v_float4 v_load(const float *p) { return vld1q_f32(p); }
+inline void v_store(int32_t *p, v_int4 a) { vst1q_s32(p, a); }
+inline void v_store(float *p, v_float4 a) { vst1q_f32(p, a); }
+// p[0], p[step], p[2 step], p[3 step]; nothing past p[3 step] is read, it may be the last
+// element of the integral image.
+inline v_int4 v_load_strided(const int32_t *p, int step) {
+   if (step == 1) { return vld1q_s32(p); }
+   if (step == 2) {
+      // p[0] and p[2] out of p[0..3], then p[4] and p[6] one by one
+      const int32x2_t low = vld2_s32(p).val[0];
+      const int32x2_t high = vld1_lane_s32(p + 6, vld1_dup_s32(p + 4), 1);
+      return vcombine_s32(low, high);
+   }
+   const int32_t lanes[4] = {p[0], p[step], p[2 * step], p[3 * step]};
+   return vld1q_s32(lanes);
+}
+// Four pixels widened to 32 bit.
+inline v_int4 v_load_expand_u8(const uint8_t *p) {
+   uint32_t word;
+   memcpy(&word, p, sizeof(word));
+   const uint16x8_t wide = vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(word)));
+   return vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(wide)));
+}
+inline v_int4 v_add(v_int4 a, v_int4 b) { return vaddq_s32(a, b); }
+inline v_int4 v_sub(v_int4 a, v_int4 b) { return vsubq_s32(a, b); }
+inline v_int4 v_mul(v_int4 a, v_int4 b) { return vmulq_s32(a, b); }
+inline v_int4 v_or(v_int4 a, v_int4 b) { return vorrq_s32(a, b); }
+inline v_float4 v_add(v_float4 a, v_float4 b) { return vaddq_f32(a, b); }
+inline v_float4 v_sub(v_float4 a, v_float4 b) { return vsubq_f32(a, b); }
+inline v_float4 v_mul(v_float4 a, v_float4 b) { return vmulq_f32(a, b); }
+inline v_float4 v_abs(v_float4 a) { return vabsq_f32(a); }
+inline v_float4 v_cvt_f32(v_int4 a) { return vcvtq_f32_s32(a); }
+inline v_mask4 v_lt(v_float4 a, v_float4 b) { return vcltq_f32(a, b); }
+inline v_float4 v_select(v_mask4 mask, v_float4 a, v_float4 b) { return vbslq_f32(mask, a, b); }
+// bit where a >= b, 0 elsewhere
+inline v_int4 v_ge_bit(v_int4 a, v_int4 b, int32_t bit) {
+   return vandq_s32(vreinterpretq_s32_u32(vcgeq_s32(a, b)), vdupq_n_s32(bit));
+}
+// Lane k of the mask as bit k.
+inline int v_signmask(v_mask4 mask) {
+   const uint32_t bits[4] = {1, 2, 4, 8};
+   const uint32x4_t selected = vandq_u32(mask, vld1q_u32(bits));
+   const uint32x2_t pairs = vadd_u32(vget_low_u32(selected), vget_high_u32(selected));
+   return static_cast<int>(vget_lane_u32(vpadd_u32(pairs, pairs), 0));
+}
+// Running sum over the lanes.
+inline v_int4 v_prefix_sum(v_int4 a) {
+   const int32x4_t zero = vdupq_n_s32(0);
+   a = vaddq_s32(a, vextq_s32(zero, a, 3));
+   return vaddq_s32(a, vextq_s32(zero, a, 2));
+}
+inline v_int4 v_broadcast_last(v_int4 a) { return vdupq_n_s32(vgetq_lane_s32(a, 3)); }
+
+#elif defined(CASCADE_SIMD_SSE2)
+
+typedef __m128i v_int4;
+typedef __m128 v_float4;
+typedef __m128 v_mask4;
+
+inline v_int4 v_setall(int32_t value) { return _mm_set1_epi32(value); }
+inline v_float4 v_setall(float value) { return _mm_set1_ps(value); }
+inline v_int4 v_load(const int32_t *p) { return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p)); }
+inline v_float4 v_load(const float *p) { return _mm_loadu_ps(p); }
+inline void v_store(int32_t *p, v_int4 a) { _mm_storeu_si128(reinterpret_cast<__m128i *>(p), a); }
+inline void v_store(float *p, v_float4 a) { _mm_storeu_ps(p, a); }
+inline v_int4 v_load_strided(const int32_t *p, int step) {
+   if (step == 1) { return v_load(p); }
+   if (step == 2) {
+      // even elements of p[0..3] and p[4..6]; the shuffle only moves bits
+      const __m128 low = _mm_castsi128_ps(v_load(p));
+      const __m128i p4p5 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p + 4));
+      const __m128 high = _mm_castsi128_ps(_mm_unpacklo_epi64(p4p5, _mm_cvtsi32_si128(p[6])));
+      return _mm_castps_si128(_mm_shuffle_ps(low, high, _MM_SHUFFLE(2, 0, 2, 0)));
+   }
+   return _mm_setr_epi32(p[0], p[step], p[2 * step], p[3 * step]);
+}
+inline v_int4 v_load_expand_u8(const uint8_t *p) {
+   int32_t word;
+   memcpy(&word, p, sizeof(word));
+   const __m128i zero = _mm_setzero_si128();
+   return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(word), zero), zero);
+}
+inline v_int4 v_add(v_int4 a, v_int4 b) { return _mm_add_epi32(a, b); }
+inline v_int4 v_sub(v_int4 a, v_int4 b) { return _mm_sub_epi32(a, b); }
+// Only for values below 2^15, which is all the integral images square.
+inline v_int4 v_mul(v_int4 a, v_int4 b) { return _mm_madd_epi16(a, b); }
+inline v_int4 v_or(v_int4 a, v_int4 b) { return _mm_or_si128(a, b); }
+inline v_float4 v_add(v_float4 a, v_float4 b) { return _mm_add_ps(a, b); }
+inline v_float4 v_sub(v_float4 a, v_float4 b) { return _mm_sub_ps(a, b); }
+inline v_float4 v_mul(v_float4 a, v_float4 b) { return _mm_mul_ps(a, b); }
+inline v_float4 v_abs(v_float4 a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+inline v_float4 v_cvt_f32(v_int4 a) { return _mm_cvtepi32_ps(a); }
+inline v_mask4 v_lt(v_float4 a, v_float4 b) { return _mm_cmplt_ps(a, b); }
+inline v_float4 v_select(v_mask4 mask, v_float4 a, v_float4 b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+inline v_int4 v_ge_bit(v_int4 a, v_int4 b, int32_t bit) { return _mm_andnot_si128(_mm_cmplt_epi32(a, b), _mm_set1_epi32(bit)); }
+inline int v_signmask(v_mask4 mask) { return _mm_movemask_ps(mask); }
+inline v_int4 v_prefix_sum(v_int4 a) {
+   a = _mm_add_epi32(a, _mm_slli_si128(a, 4));
+   return _mm_add_epi32(a, _mm_slli_si128(a, 8));
+}
+inline v_int4 v_broadcast_last(v_int4 a) { return _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 3, 3, 3)); }
+
+#else
+
+// Plain arrays with the same interface so that the evaluator has a single code path.
+struct v_int4 { int32_t val[4]; };
+struct v_float4 { float val[4]; };
+struct v_mask4 { bool val[4]; };
+
+inline v_int4 v_setall(int32_t value) { return v_int4{{value, value, value, value}}; }
+inline v_float4 v_setall(float value) { return v_float4{{value, value, value, value}}; }
+inline v_int4 v_load(const int32_t *p) { return v_int4{{p[0], p[1], p[2], p[3]}}; }
+inline v_float4 v_load(const float *p) { return v_float4{{p[0], p[1], p[2], p[3]}}; }
+inline void v_store(int32_t *p, v_int4 a) { memcpy(p, a.val, sizeof(a.val)); }
+inline void v_store(float *p, v_float4 a) { memcpy(p, a.val, sizeof(a.val)); }
+inline v_int4 v_load_strided(const int32_t *p, int step) { return v_int4{{p[0], p[step], p[2 * step], p[3 * step]}}; }
+inline v_int4 v_load_expand_u8(const uint8_t *p) { return v_int4{{p[0], p[1], p[2], p[3]}}; }
+#define CASCADE_LANEWISE(type, expression) \
+   type r;                                 \
+   for (int k = 0; k < 4; k++) { r.val[k] = (expression); } \
+   return r;
+// Integral images wrap around in 32 bit like the vector instructions do.
+inline v_int4 v_add(v_int4 a, v_int4 b) { CASCADE_LANEWISE(v_int4, static_cast<int32_t>(static_cast<uint32_t>(a.val[k]) + static_cast<uint32_t>(b.val[k]))) }
+inline v_int4 v_sub(v_int4 a, v_int4 b) { CASCADE_LANEWISE(v_int4, static_cast<int32_t>(static_cast<uint32_t>(a.val[k]) - static_cast<uint32_t>(b.val[k]))) }
+inline v_int4 v_mul(v_int4 a, v_int4 b) { CASCADE_LANEWISE(v_int4, a.val[k] * b.val[k]) }
+inline v_int4 v_or(v_int4 a, v_int4 b) { CASCADE_LANEWISE(v_int4, a.val[k] | b.val[k]) }
+inline v_float4 v_add(v_float4 a, v_float4 b) { CASCADE_LANEWISE(v_float4, a.val[k] + b.val[k]) }
+inline v_float4 v_sub(v_float4 a, v_float4 b) { CASCADE_LANEWISE(v_float4, a.val[k] - b.val[k]) }
+inline v_float4 v_mul(v_float4 a, v_float4 b) { CASCADE_LANEWISE(v_float4, a.val[k] * b.val[k]) }
+inline v_float4 v_abs(v_float4 a) { CASCADE_LANEWISE(v_float4, a.val[k] < 0 ? -a.val[k] : a.val[k]) }
+inline v_float4 v_cvt_f32(v_int4 a) { CASCADE_LANEWISE(v_float4, static_cast<float>(a.val[k])) }
+inline v_mask4 v_lt(v_float4 a, v_float4 b) { CASCADE_LANEWISE(v_mask4, a.val[k] < b.val[k]) }
+inline v_float4 v_select(v_mask4 mask, v_float4 a, v_float4 b) { CASCADE_LANEWISE(v_float4, mask.val[k] ? a.val[k] : b.val[k]) }
+inline v_int4 v_ge_bit(v_int4 a, v_int4 b, int32_t bit) { CASCADE_LANEWISE(v_int4, a.val[k] >= b.val[k] ? bit : 0) }
+#undef CASCADE_LANEWISE
+inline int v_signmask(v_mask4 mask) { return (mask.val[0] ? 1 : 0) | (mask.val[1] ? 2 : 0) | (mask.val[2] ? 4 : 0) | (mask.val[3] ? 8 : 0); }
+inline v_int4 v_prefix_sum(v_int4 a) {
+   for (int k = 1; k < 4; k++) { a.val[k] = static_cast<int32_t>(static_cast<uint32_t>(a.val[k]) + static_cast<uint32_t>(a.val[k - 1])); }
+   return a;
+}
+inline v_int4 v_broadcast_last(v_int4 a) { return v_setall(a.val[3]); }
+
+#endif
+
+// a[o0] - a[o1] - a[o2] + a[o3] for four windows step pixels apart.
+inline v_int4 v_rect_sum(const int32_t *origin, const int *offsets, int step) {
+   return v_add(v_sub(v_sub(v_load_strided(origin + offsets[0], step), v_load_strided(origin + offsets[1], step)),
+                      v_load_strided(origin + offsets[2], step)),
+                v_load_strided(origin + offsets[3], step));
+}
+
+// Integral and (optionally) squared integral image of an 8 bit image as CV_32S, identical
+// to cv::integral(image, sum, sqsum, CV_32S, CV_32S). The squared sums wrap around in
+// 32 bit; differences of four corners stay exact for any window up to 256x256 pixels.
+inline void integralImages(const cv::Mat &image, cv::Mat &sum, cv::Mat *sqsum) {
+   CV_Assert(image.type() == CV_8UC1);
+   sum.create(image.rows + 1, image.cols + 1, CV_32S);
+   memset(sum.ptr<int32_t>(0), 0, sizeof(int32_t) * static_cast<size_t>(sum.cols));
+   if (sqsum != nullptr) {
+      sqsum->create(image.rows + 1, image.cols + 1, CV_32S);
+      memset(sqsum->ptr<int32_t>(0), 0, sizeof(int32_t) * static_cast<size_t>(sqsum->cols));
+   }
+   for (int y = 0; y < image.rows; y++) {
+      const uint8_t *pixels = image.ptr<uint8_t>(y);
+      const int32_t *above = sum.ptr<int32_t>(y);
+      int32_t *row = sum.ptr<int32_t>(y + 1);
+      const int32_t *sq_above = (sqsum != nullptr) ? sqsum->ptr<int32_t>(y) : nullptr;
+      int32_t *sq_row = (sqsum != nullptr) ? sqsum->ptr<int32_t>(y + 1) : nullptr;
+      row[0] = 0;
+      if (sq_row != nullptr) { sq_row[0] = 0; }
+
+      // Four pixels at a time: running sum inside the vector plus the carry of the row so far.
+      v_int4 carry = v_setall(static_cast<int32_t>(0));
+      v_int4 sq_carry = carry;
+      int x = 0;
+      for (; x + 4 <= image.cols; x += 4) {
+         const v_int4 value = v_load_expand_u8(pixels + x);
+         carry = v_add(v_prefix_sum(value), carry);
+         v_store(row + x + 1, v_add(carry, v_load(above + x + 1)));
+         carry = v_broadcast_last(carry);
+         if (sq_row != nullptr) {
+            sq_carry = v_add(v_prefix_sum(v_mul(value, value)), sq_carry);
+            v_store(sq_row + x + 1, v_add(sq_carry, v_load(sq_above + x + 1)));
+            sq_carry = v_broadcast_last(sq_carry);
+         }
+      }
+      int32_t lanes[4];
+      v_store(lanes, carry);
+      uint32_t row_sum = static_cast<uint32_t>(lanes[3]);
+      v_store(lanes, sq_carry);
+      uint32_t sq_row_sum = static_cast<uint32_t>(lanes[3]);
+      for (; x < image.cols; x++) {
+         row_sum += pixels[x];
+         row[x + 1] = static_cast<int32_t>(row_sum + static_cast<uint32_t>(above[x + 1]));
+         if (sq_row != nullptr) {
+            sq_row_sum += static_cast<uint32_t>(pixels[x]) * pixels[x];
+            sq_row[x + 1] = static_cast<int32_t>(sq_row_sum + static_cast<uint32_t>(sq_above[x + 1]));
+         }
+      }
+   }
+}
+
+#endif
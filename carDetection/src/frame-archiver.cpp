@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2019  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Writes the frames of a recording into a frame archive (frame-archive.hpp), read with
+// --source=<file>.rec and decoded here, or captured from the shared memory area of the h264
+// decoder while the recording is replayed; any other --source of the services works too.
+// The services and benchmarks then read the archive with --source=<file>.frames.
+
+#include "cluon-complete.hpp"
+#include "opendlv-standard-message-set.hpp"
+#include "frame-archive.hpp"
+#include "frame-reader.hpp"
+
+#include "opencv2/core.hpp"
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+int32_t main(int32_t argc, char **argv) {
+   int32_t retCode{1};
+   auto commandlineArguments = cluon::getCommandlineArguments(argc, argv);
+   if ((0 == commandlineArguments.count("name") && 0 == commandlineArguments.count("source")) ||
+       (0 == commandlineArguments.count("width")) || (0 == commandlineArguments.count("height")) ||
+       (0 == commandlineArguments.count("out"))) {
+      std::cerr << argv[0] << " writes decoded frames into a memory-mappable archive for benchmarks and fast replays." << std::endl;
+      std::cerr << "Usage:   " << argv[0] << " --name=<name of shared memory area>|--source=<camera:n|file.rec|video|directory> --width=<W> --height=<H> --out=<file.frames> [--frames=<n>]" << std::endl;
+      std::cerr << "         --frames: frames to write (default 1000 from shared memory, all of a --source)" << std::endl;
+      std::cerr << "Read a recording with --source, or replay it with the h264 decoder (see h264-decoder-viewer.yml) while capturing from shared memory." << std::endl;
+      std::cerr << "Example: " << argv[0] << " --source=cardetection.rec --width=640 --height=480 --out=01-acc.frames" << std::endl;
+      std::cerr << "         " << argv[0] << " --name=img.argb --width=640 --height=480 --out=01-acc.frames --frames=500" << std::endl;
+      return retCode;
+   }
+   const uint32_t WIDTH{static_cast<uint32_t>(std::stoi(commandlineArguments["width"]))};
+   const uint32_t HEIGHT{static_cast<uint32_t>(std::stoi(commandlineArguments["height"]))};
+   const std::string SOURCE{commandlineArguments["source"]};
+   const uint64_t FRAMES{(commandlineArguments["frames"].size() != 0) ? std::stoull(commandlineArguments["frames"]) : (SOURCE.empty() ? 1000 : UINT64_MAX)};
+
+   FrameReader frames{commandlineArguments["name"], WIDTH, HEIGHT, SOURCE};
+   if (!frames.valid()) {
+      std::cerr << argv[0] << ": cannot read frames from '" << frames.name() << "'." << std::endl;
+      return retCode;
+   }
+   FrameArchiveWriter archive;
+   if (!archive.open(commandlineArguments["out"], WIDTH, HEIGHT)) {
+      std::cerr << argv[0] << ": cannot write " << commandlineArguments["out"] << "." << std::endl;
+      return retCode;
+   }
+
+   while (archive.count() < FRAMES && frames.wait()) {
+      const cv::Mat frame = frames.latest();
+      if (!archive.add(frame, cluon::time::toMicroseconds(frames.timeStamp()))) {
+         std::cerr << argv[0] << ": cannot write " << commandlineArguments["out"] << "." << std::endl;
+         return retCode;
+      }
+      if (archive.count() % 100 == 0) { std::clog << archive.count() << " frames" << std::endl; }
+   }
+   if (!archive.close()) {
+      std::cerr << argv[0] << ": cannot write " << commandlineArguments["out"] << "." << std::endl;
+      return retCode;
+   }
+   std::cout << "Wrote " << archive.count() << " frames of " << WIDTH << "x" << HEIGHT << " to " << commandlineArguments["out"] << std::endl;
+   retCode = 0;
+   return retCode;
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2019  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Phases of the intersection scenario. MoveCar owns the scenario and publishes the
+// current phase as ScenarioModeUpdate; the perception services use ScenarioGate to
+// stop processing frames in phases they are not needed in.
+// This file is shared between the services; keep all copies identical.
+
+#ifndef SCENARIO_MODE_HPP
+#define SCENARIO_MODE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+enum ScenarioMode : uint8_t {
+   MODE_UNKNOWN = 0,      // no ScenarioModeUpdate received yet, every service stays active
+   MODE_FOLLOWING = 1,    // keeping safe distance to a leading car
+   MODE_APPROACHING = 2,  // leading car is gone, driving up to the stop line
+   MODE_AT_STOP_LINE = 3, // waiting for the cars in the intersection to leave
+   MODE_CROSSING = 4      // leaving the intersection
+};
+
+inline uint32_t modeBit(uint8_t mode) { return 1u << mode; }
+
+inline const char *modeName(uint8_t mode) {
+   switch (mode) {
+      case MODE_FOLLOWING: return "following";
+      case MODE_APPROACHING: return "approaching";
+      case MODE_AT_STOP_LINE: return "at stop line";
+      case MODE_CROSSING: return "crossing";
+      default: return "unknown";
+   }
+}
+
+// Tracks the scenario mode for one service and lets the frame loop sleep while the
+// service is idle. update() is called from the OD4 data trigger thread.
+class ScenarioGate {
+  private:
+   ScenarioGate(const ScenarioGate &) = delete;
+   ScenarioGate &operator=(const ScenarioGate &) = delete;
+
+  public:
+   // active_modes is a mask of modeBit() values the service has work in.
+   explicit ScenarioGate(uint32_t active_modes)
+      : m_activeModes{active_modes}, m_mode{MODE_UNKNOWN}, m_mutex{}, m_modeChanged{} {}
+
+   // Returns true if the mode changed.
+   bool update(uint8_t mode) {
+      bool changed = false;
+      {
+         std::lock_guard<std::mutex> lock(m_mutex);
+         changed = (m_mode.exchange(mode) != mode);
+      }
+      if (changed) { m_modeChanged.notify_all(); }
+      return changed;
+   }
+
+   uint8_t mode() const { return m_mode.load(); }
+
+   bool isActiveIn(uint32_t modes) const {
+      uint8_t current = m_mode.load();
+      return current == MODE_UNKNOWN || (modes & modeBit(current)) != 0;
+   }
+
+   bool isActive() const { return isActiveIn(m_activeModes); }
+
+   // Blocks while the service is idle for the current mode. Returns at the latest
+   // after timeout so that the caller can check whether the session is still running.
+   bool waitUntilActive(std::chrono::milliseconds timeout = std::chrono::milliseconds(1000)) {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      return m_modeChanged.wait_for(lock, timeout, [this]() { return isActive(); });
+   }
+
+  private:
+   const uint32_t m_activeModes;
+   std::atomic<uint8_t> m_mode;
+   std::mutex m_mutex;
+   std::condition_variable m_modeChanged;
+};
+
+#endif
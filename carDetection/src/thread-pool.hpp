@@ -0,0 +1,232 @@
+/*
+ * Copyright (C) 2019  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Small work-stealing thread pool for the detection stages of a service, plus CPU pinning
+// and thread priorities, so that the services sharing the four cores of the car each get
+// their own cores instead of relying on whatever parallel backend OpenCV was built with.
+// This file is shared between the services; keep all copies identical.
+
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Parses a CPU list like "2,3" or "0-2"; empty if the list is empty or malformed.
+inline std::vector<int> parseCpuList(const std::string &list) {
+   std::vector<int> cpus;
+   std::stringstream items(list);
+   for (std::string item; std::getline(items, item, ',');) {
+      const size_t dash = item.find('-');
+      try {
+         const int first = std::stoi(item.substr(0, dash));
+         const int last = (dash == std::string::npos) ? first : std::stoi(item.substr(dash + 1));
+         if (first < 0 || last < first || last >= CPU_SETSIZE) { return std::vector<int>(); }
+         for (int cpu = first; cpu <= last; cpu++) { cpus.push_back(cpu); }
+      } catch (const std::exception &) {
+         return std::vector<int>();
+      }
+   }
+   return cpus;
+}
+
+// Restricts the calling thread to the given CPUs (no change if empty) and sets its nice
+// value (no change if 0). Threads started afterwards inherit both, including the ones
+// OpenCV starts. Returns false if refused, e.g. a negative nice value without CAP_SYS_NICE.
+inline bool pinCurrentThread(const std::vector<int> &cpus, int nice) {
+   bool ok = true;
+   if (!cpus.empty()) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      for (int cpu : cpus) { CPU_SET(cpu, &set); }
+      ok = (sched_setaffinity(0, sizeof(set), &set) == 0);
+   }
+   if (nice != 0) {
+      // on Linux the nice value of a thread id applies to that thread only
+      const id_t tid = static_cast<id_t>(syscall(SYS_gettid));
+      ok = (setpriority(PRIO_PROCESS, tid, nice) == 0) && ok;
+   }
+   return ok;
+}
+
+// Every worker has its own deque of tasks; it takes work from the back of its own and,
+// when that is empty, steals from the front of the others. parallelFor deals the tasks
+// out round robin and the calling thread works on them too, so nested calls from inside
+// a task cannot deadlock. With 0 workers everything runs on the calling thread.
+class ThreadPool {
+  private:
+   ThreadPool(const ThreadPool &) = delete;
+   ThreadPool &operator=(const ThreadPool &) = delete;
+
+   struct Batch {
+      const std::function<void(int)> *body;
+      std::atomic<int> remaining;
+   };
+
+   struct Task {
+      Batch *batch;
+      int index;
+   };
+
+   struct Queue {
+      Queue() : mutex{}, tasks{} {}
+      std::mutex mutex;
+      std::deque<Task> tasks;
+   };
+
+  public:
+   ThreadPool(unsigned workers, const std::vector<int> &cpus, int nice)
+      : m_queues{}, m_threads{}, m_mutex{}, m_wake{}, m_done{}, m_pending{0}, m_next{0}, m_stop{false} {
+      for (unsigned i = 0; i < workers; i++) {
+         m_queues.push_back(std::unique_ptr<Queue>(new Queue()));
+      }
+      for (unsigned i = 0; i < workers; i++) {
+         m_threads.push_back(std::thread([this, i, cpus, nice]() {
+            pinCurrentThread(cpus, nice);
+            workerLoop(i);
+         }));
+      }
+   }
+
+   ~ThreadPool() {
+      {
+         std::lock_guard<std::mutex> lock(m_mutex);
+         m_stop = true;
+      }
+      m_wake.notify_all();
+      for (std::thread &thread : m_threads) { thread.join(); }
+   }
+
+   // Threads working on a parallelFor: the workers and the caller.
+   unsigned size() const { return static_cast<unsigned>(m_threads.size()) + 1; }
+
+   // Runs body(i) for every i in [0, count) and returns when all are done.
+   void parallelFor(int count, const std::function<void(int)> &body) {
+      if (m_threads.empty() || count <= 1) {
+         for (int i = 0; i < count; i++) { body(i); }
+         return;
+      }
+      Batch batch;
+      batch.body = &body;
+      batch.remaining = count;
+      for (int i = 0; i < count; i++) {
+         Queue &queue = *m_queues[m_next++ % m_queues.size()];
+         std::lock_guard<std::mutex> lock(queue.mutex);
+         queue.tasks.push_back(Task{&batch, i});
+      }
+      {
+         std::lock_guard<std::mutex> lock(m_mutex);
+         m_pending += count;
+      }
+      m_wake.notify_all();
+
+      Task task{nullptr, 0};
+      while (batch.remaining > 0 && take(currentQueue(), &task)) {
+         run(task);
+      }
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_done.wait(lock, [&batch]() { return batch.remaining == 0; });
+   }
+
+  private:
+   // The pool a worker thread belongs to and the index of its queue there. A worker of one
+   // pool that waits for a batch of another is not a worker of that one.
+   struct Worker {
+      const ThreadPool *pool;
+      size_t queue;
+   };
+   static Worker &currentWorker() {
+      static thread_local Worker worker{nullptr, 0};
+      return worker;
+   }
+
+   // Index of the calling worker's queue, or beyond the queues for threads of other pools
+   // and the rest.
+   size_t currentQueue() const {
+      const Worker &worker = currentWorker();
+      return (worker.pool == this) ? worker.queue : static_cast<size_t>(-1);
+   }
+
+   // Pops from the back of the own queue, else steals from the front of another one.
+   bool take(size_t self, Task *task) {
+      const size_t count = m_queues.size();
+      for (size_t k = 0; k < count; k++) {
+         const size_t i = (self < count) ? (self + k) % count : k;
+         Queue &queue = *m_queues[i];
+         std::lock_guard<std::mutex> lock(queue.mutex);
+         if (queue.tasks.empty()) { continue; }
+         if (i == self) {
+            *task = queue.tasks.back();
+            queue.tasks.pop_back();
+         } else {
+            *task = queue.tasks.front();
+            queue.tasks.pop_front();
+         }
+         m_pending--;
+         return true;
+      }
+      return false;
+   }
+
+   void run(const Task &task) {
+      (*task.batch->body)(task.index);
+      if (task.batch->remaining.fetch_sub(1) == 1) {
+         // the batch may be gone as soon as its caller sees remaining == 0
+         std::lock_guard<std::mutex> lock(m_mutex);
+         m_done.notify_all();
+      }
+   }
+
+   void workerLoop(size_t self) {
+      currentWorker() = Worker{this, self};
+      Task task{nullptr, 0};
+      while (true) {
+         if (take(self, &task)) {
+            run(task);
+            continue;
+         }
+         std::unique_lock<std::mutex> lock(m_mutex);
+         m_wake.wait(lock, [this]() { return m_stop || m_pending > 0; });
+         if (m_stop && m_pending == 0) { return; }
+      }
+   }
+
+   std::vector<std::unique_ptr<Queue>> m_queues;
+   std::vector<std::thread> m_threads;
+   std::mutex m_mutex; // guards sleeping and waking up, not the queues
+   std::condition_variable m_wake;
+   std::condition_variable m_done;
+   std::atomic<int> m_pending; // tasks queued and not yet taken
+   std::atomic<size_t> m_next;
+   bool m_stop;
+};
+
+#endif
@@ -0,0 +1,470 @@
+/*
+ * Copyright (C) 2019  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Closed-loop stand-in for the Kiwi car and its sensors. The pedal and steering requests of
+// MoveCar drive a kinematic bicycle model; the simulator sends the front ultrasound reading
+// and renders the camera frame into the shared memory area the services attach to, with the
+// pink lead car and the cars at the intersection as flat boxes. Time is virtual: it advances
+// one tick at a time and is stamped on every message and frame, so it can run faster than
+// real time. Every run reports the following error and the CPU time per tick.
+
+#include "cluon-complete.hpp"
+#include "opendlv-standard-message-set.hpp"
+#include "message-bus.hpp"
+
+#include "opencv2/core.hpp"
+#include "opencv2/imgproc.hpp"
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace cv;
+
+// Kiwi car
+const double WHEELBASE = 0.12;           // m
+const double CAR_LENGTH = 0.36;          // m
+const double CAR_WIDTH = 0.17;           // m
+const double CAR_HEIGHT = 0.15;          // m
+const double PEDAL_DEADBAND = 0.1;       // pedal position below which the car does not move
+const double PEDAL_GAIN = 20;            // m/s per pedal position above the deadband
+const double SPEED_TIME_CONSTANT = 0.3;  // s
+const double STEERING_TIME_CONSTANT = 0.1; // s
+const double MAX_STEERING = 0.4;         // rad
+const double OTHER_ACCELERATION = 0.5;   // m/s^2 of the other cars
+
+// sensors
+const double CAMERA_HEIGHT = 0.12;       // m
+const double CAMERA_FIELD_OF_VIEW = 62.2 * CV_PI / 180; // horizontal, Raspberry Pi camera v2
+const double ULTRASOUND_CONE = 15 * CV_PI / 180; // half angle
+const double ULTRASOUND_MAX = 4.0;       // m, reported when nothing is in range
+const double ULTRASOUND_NOISE = 0.005;   // m
+
+// scenarios
+const double START_GAP = 0.45;           // m from our front to the lead car's back
+const double STOP_LINE_X = 4.0;          // m, in the intersection scenario
+
+// The lead car's back is pink. The services read the BGRA frame as RGB, so this is the
+// colour their HSV thresholds see as pink (hue ~160, OpenCV scale).
+const Scalar LEAD_PLATE(255, 80, 200, 255);
+const Scalar CAR_BODY(40, 40, 40, 255);
+const Scalar WHEEL(10, 10, 10, 255);
+const Scalar SKY(190, 180, 170, 255);
+const Scalar GROUND(90, 90, 90, 255);
+
+struct SpeedSegment {
+   double start;   // s into the run
+   double speed;   // m/s
+   double yawRate; // rad/s
+};
+
+struct SimCar {
+   double x;   // m; the ego car starts at the origin heading along x
+   double y;   // m, to the left
+   double yaw; // rad
+   double speed;
+   vector<SpeedSegment> script;
+   bool lead;
+};
+
+struct EgoCar {
+   double x;
+   double y;
+   double yaw;
+   double speed;
+   double steering;
+};
+
+struct RunStats {
+   int64_t ticks;
+   int64_t frames;
+   double squaredError;
+   int64_t errorSamples;
+   double minGap;
+   int collisions;
+   bool colliding;
+};
+
+bool makeScenario(const string &scenario, double duration, mt19937 *rng, vector<SimCar> *cars);
+void stepEgo(EgoCar *ego, double pedal, double steeringRequest, double dt);
+void stepCar(SimCar *car, double t, double dt);
+void relativePosition(const EgoCar &ego, double x, double y, double *forward, double *left);
+double frontDistance(const EgoCar &ego, const vector<SimCar> &cars);
+bool leadGap(const EgoCar &ego, const vector<SimCar> &cars, double *gap);
+void renderFrame(const EgoCar &ego, const vector<SimCar> &cars, Mat *frame);
+
+int32_t main(int32_t argc, char **argv) {
+   int32_t retCode{1};
+   auto commandlineArguments = cluon::getCommandlineArguments(argc, argv);
+   if((0 == commandlineArguments.count("cid")) ||
+      (0 == commandlineArguments.count("name")) ||
+      (0 == commandlineArguments.count("width")) ||
+      (0 == commandlineArguments.count("height")) ) {
+      std::cerr << argv[0] << " simulates the Kiwi car, its front ultrasound and its camera in closed loop with the services." << std::endl;
+      std::cerr << "Usage:   " << argv[0] << " --cid=<OD4 session> --name=<name of shared memory area> --width=<w> --height=<h> [--scenario=follow|intersection] [--runs=<n>] [--duration=<s>] [--speedup=<x>] [--lockstep] [--verbose]" << std::endl;
+      std::cerr << "         --cid:    CID of the OD4Session to send and receive messages" << std::endl;
+      std::cerr << "         --name:   name of the shared memory area to create" << std::endl;
+      std::cerr << "         --width:  width of the frame" << std::endl;
+      std::cerr << "         --height: height of the frame" << std::endl;
+      std::cerr << "         --scenario: follow a lead car with random speed changes, or follow it to an intersection with three cars (default follow)" << std::endl;
+      std::cerr << "         --runs: number of runs, each a new random scenario (default 1)" << std::endl;
+      std::cerr << "         --duration: virtual seconds per run (default 30)" << std::endl;
+      std::cerr << "         --speedup: virtual seconds per real second, 0 as fast as possible (default 1)" << std::endl;
+      std::cerr << "         --lockstep: after every frame, wait up to 100 ms for the pedal request it causes" << std::endl;
+      std::cerr << "         --tick-rate, --frame-rate, --distance-rate: in virtual Hz (default 100, 15, 20)" << std::endl;
+      std::cerr << "         --target-gap: gap the following error is measured against (default 0.4)" << std::endl;
+      std::cerr << "         --seed: of the random scenarios (default 1)" << std::endl;
+      std::cerr << "Example: " << argv[0] << " --cid=112 --name=img.argb --width=640 --height=480 --runs=100 --speedup=0 --lockstep" << std::endl;
+      return retCode;
+   }
+   const std::string NAME{commandlineArguments["name"]};
+   const uint32_t WIDTH{static_cast<uint32_t>(std::stoi(commandlineArguments["width"]))};
+   const uint32_t HEIGHT{static_cast<uint32_t>(std::stoi(commandlineArguments["height"]))};
+   const bool VERBOSE{commandlineArguments.count("verbose") != 0};
+   const bool LOCKSTEP{commandlineArguments.count("lockstep") != 0};
+   const std::string SCENARIO{(commandlineArguments["scenario"].size() != 0) ? commandlineArguments["scenario"] : "follow"};
+   const int RUNS{(commandlineArguments["runs"].size() != 0) ? std::stoi(commandlineArguments["runs"]) : 1};
+   const double DURATION{(commandlineArguments["duration"].size() != 0) ? std::stod(commandlineArguments["duration"]) : 30.0};
+   const double SPEEDUP{(commandlineArguments["speedup"].size() != 0) ? std::stod(commandlineArguments["speedup"]) : 1.0};
+   const double TICK_RATE{(commandlineArguments["tick-rate"].size() != 0) ? std::stod(commandlineArguments["tick-rate"]) : 100.0};
+   const double FRAME_RATE{(commandlineArguments["frame-rate"].size() != 0) ? std::stod(commandlineArguments["frame-rate"]) : 15.0};
+   const double DISTANCE_RATE{(commandlineArguments["distance-rate"].size() != 0) ? std::stod(commandlineArguments["distance-rate"]) : 20.0};
+   const double TARGET_GAP{(commandlineArguments["target-gap"].size() != 0) ? std::stod(commandlineArguments["target-gap"]) : 0.4};
+   const unsigned SEED{(commandlineArguments["seed"].size() != 0) ? static_cast<unsigned>(std::stoul(commandlineArguments["seed"])) : 1u};
+   if (TICK_RATE <= 0 || FRAME_RATE <= 0 || DISTANCE_RATE <= 0 || SPEEDUP < 0 || RUNS < 1) {
+      std::cerr << argv[0] << ": rates and --runs must be positive, --speedup must not be negative." << std::endl;
+      return retCode;
+   }
+   const double DT{1.0 / TICK_RATE};
+   const int64_t TICK_MICROSECONDS{static_cast<int64_t>(std::llround(1e6 * DT))};
+   const int64_t FRAME_EVERY{std::max<int64_t>(1, std::llround(TICK_RATE / FRAME_RATE))};
+   const int64_t DISTANCE_EVERY{std::max<int64_t>(1, std::llround(TICK_RATE / DISTANCE_RATE))};
+   const int64_t TICKS{static_cast<int64_t>(std::llround(DURATION * TICK_RATE))};
+
+   cluon::SharedMemory sharedMemory{NAME, WIDTH * HEIGHT * 4};
+   if (!sharedMemory.valid()) {
+      std::cerr << argv[0] << ": could not create shared memory '" << NAME << "'." << std::endl;
+      return retCode;
+   }
+   std::clog << argv[0] << ": Created shared memory '" << sharedMemory.name() << " (" << sharedMemory.size() << " bytes)." << std::endl;
+
+   ServiceSession od4{static_cast<uint16_t>(std::stoi(commandlineArguments["cid"]))};
+
+   // The requests of MoveCar; the pedal request also ends the wait of --lockstep.
+   std::mutex actuationMutex;
+   std::condition_variable actuated;
+   double pedal{0};
+   double steeringRequest{0};
+   uint64_t pedalRequests{0};
+   auto onPedalPositionRequest{[&actuationMutex, &actuated, &pedal, &pedalRequests](opendlv::proxy::PedalPositionRequest &&msg, const cluon::data::Envelope &) {
+      {
+         std::lock_guard<std::mutex> lock(actuationMutex);
+         pedal = msg.position();
+         pedalRequests++;
+      }
+      actuated.notify_all();
+   }};
+   onMessage<opendlv::proxy::PedalPositionRequest>(od4, onPedalPositionRequest);
+   auto onGroundSteeringRequest{[&actuationMutex, &steeringRequest](opendlv::proxy::GroundSteeringRequest &&msg, const cluon::data::Envelope &) {
+      std::lock_guard<std::mutex> lock(actuationMutex);
+      steeringRequest = msg.groundSteering();
+   }};
+   onMessage<opendlv::proxy::GroundSteeringRequest>(od4, onGroundSteeringRequest);
+
+   mt19937 rng{SEED};
+   normal_distribution<double> ultrasoundNoise(0, ULTRASOUND_NOISE);
+   Mat frame(static_cast<int>(HEIGHT), static_cast<int>(WIDTH), CV_8UC4);
+
+   // the virtual clock goes on over the runs, the services must not see time jump back
+   int64_t clock = cluon::time::toMicroseconds(cluon::time::now());
+   double sumSquaredError = 0;
+   int64_t sumErrorSamples = 0;
+   double worstGap = ULTRASOUND_MAX;
+   int collisions = 0;
+   double cpuPerTick = 0;
+   double virtualSeconds = 0;
+   double realSeconds = 0;
+
+   for (int run = 0; run < RUNS && od4.isRunning(); run++) {
+      vector<SimCar> cars;
+      if (!makeScenario(SCENARIO, DURATION, &rng, &cars)) {
+         std::cerr << argv[0] << ": unknown scenario '" << SCENARIO << "'." << std::endl;
+         return retCode;
+      }
+      EgoCar ego{0, 0, 0, 0, 0};
+      RunStats stats{0, 0, 0, 0, ULTRASOUND_MAX, 0, false};
+
+      struct rusage usageBefore;
+      getrusage(RUSAGE_SELF, &usageBefore);
+      const auto realStart = std::chrono::steady_clock::now();
+
+      for (int64_t tick = 0; tick < TICKS && od4.isRunning(); tick++) {
+         const double t = static_cast<double>(tick) * DT;
+         double pedalNow;
+         double steeringNow;
+         {
+            std::lock_guard<std::mutex> lock(actuationMutex);
+            pedalNow = pedal;
+            steeringNow = steeringRequest;
+         }
+         stepEgo(&ego, pedalNow, steeringNow, DT);
+         for (SimCar &car : cars) { stepCar(&car, t, DT); }
+         clock += TICK_MICROSECONDS;
+         const cluon::data::TimeStamp sampleTime{cluon::time::fromMicroseconds(clock)};
+         stats.ticks++;
+
+         opendlv::sim::Frame egoFrame;
+         egoFrame.x(static_cast<float>(ego.x)).y(static_cast<float>(ego.y)).yaw(static_cast<float>(ego.yaw));
+         od4.send(egoFrame, sampleTime, 0);
+         opendlv::sim::KinematicState egoState;
+         egoState.vx(static_cast<float>(ego.speed)).yawRate(static_cast<float>(ego.speed / WHEELBASE * std::tan(ego.steering)));
+         od4.send(egoState, sampleTime, 0);
+
+         if (tick % DISTANCE_EVERY == 0) {
+            opendlv::proxy::DistanceReading front;
+            front.distance(static_cast<float>(std::max(0.0, frontDistance(ego, cars) + ultrasoundNoise(rng))));
+            od4.send(front, sampleTime, 0);
+         }
+
+         if (tick % FRAME_EVERY == 0) {
+            renderFrame(ego, cars, &frame);
+            uint64_t requestsBefore;
+            {
+               std::lock_guard<std::mutex> lock(actuationMutex);
+               requestsBefore = pedalRequests;
+            }
+            sharedMemory.lock();
+            std::memcpy(sharedMemory.data(), frame.data, frame.total() * frame.elemSize());
+            sharedMemory.setTimeStamp(sampleTime);
+            sharedMemory.unlock();
+            sharedMemory.notifyAll();
+            stats.frames++;
+            if (LOCKSTEP) {
+               std::unique_lock<std::mutex> lock(actuationMutex);
+               actuated.wait_for(lock, std::chrono::milliseconds(100), [&pedalRequests, requestsBefore]() { return pedalRequests > requestsBefore; });
+            }
+         }
+
+         double gap;
+         if (leadGap(ego, cars, &gap)) {
+            stats.squaredError += (gap - TARGET_GAP) * (gap - TARGET_GAP);
+            stats.errorSamples++;
+            stats.minGap = std::min(stats.minGap, gap);
+            if (gap <= 0 && !stats.colliding) { stats.collisions++; }
+            stats.colliding = (gap <= 0);
+         }
+
+         if (VERBOSE && tick % static_cast<int64_t>(TICK_RATE) == 0) {
+            std::cout << "t=" << t << " pedal=" << pedalNow << " steering=" << steeringNow << " speed=" << ego.speed << " x=" << ego.x << " y=" << ego.y;
+            if (leadGap(ego, cars, &gap)) { std::cout << " gap=" << gap; }
+            std::cout << std::endl;
+         }
+
+         if (SPEEDUP > 0) {
+            std::this_thread::sleep_until(realStart + std::chrono::microseconds(static_cast<int64_t>(static_cast<double>(stats.ticks * TICK_MICROSECONDS) / SPEEDUP)));
+         }
+      }
+
+      struct rusage usageAfter;
+      getrusage(RUSAGE_SELF, &usageAfter);
+      const double cpuMicroseconds = 1e6 * static_cast<double>(usageAfter.ru_utime.tv_sec - usageBefore.ru_utime.tv_sec + usageAfter.ru_stime.tv_sec - usageBefore.ru_stime.tv_sec)
+                                   + static_cast<double>(usageAfter.ru_utime.tv_usec - usageBefore.ru_utime.tv_usec + usageAfter.ru_stime.tv_usec - usageBefore.ru_stime.tv_usec);
+      const double real = std::chrono::duration<double>(std::chrono::steady_clock::now() - realStart).count();
+      const double simulated = static_cast<double>(stats.ticks) * DT;
+      const double rmsError = (stats.errorSamples > 0) ? std::sqrt(stats.squaredError / static_cast<double>(stats.errorSamples)) : 0;
+      const double runCpuPerTick = (stats.ticks > 0) ? cpuMicroseconds / static_cast<double>(stats.ticks) / 1000 : 0;
+      std::cout << "run " << run << ": " << simulated << " s in " << real << " s (" << simulated / std::max(real, 1e-6) << "x), "
+                << stats.frames << " frames, gap rms error " << rmsError << " m, min gap " << stats.minGap << " m, "
+                << stats.collisions << " collisions, cpu " << runCpuPerTick << " ms/tick" << std::endl;
+
+      sumSquaredError += stats.squaredError;
+      sumErrorSamples += stats.errorSamples;
+      worstGap = std::min(worstGap, stats.minGap);
+      collisions += stats.collisions;
+      cpuPerTick += runCpuPerTick;
+      virtualSeconds += simulated;
+      realSeconds += real;
+   }
+
+   if (RUNS > 1) {
+      std::cout << "all " << RUNS << " runs: " << virtualSeconds << " s in " << realSeconds << " s (" << virtualSeconds / std::max(realSeconds, 1e-6) << "x), "
+                << "gap rms error " << ((sumErrorSamples > 0) ? std::sqrt(sumSquaredError / static_cast<double>(sumErrorSamples)) : 0) << " m, "
+                << "min gap " << worstGap << " m, " << collisions << " collisions, cpu " << cpuPerTick / RUNS << " ms/tick" << std::endl;
+   }
+   retCode = 0;
+   return retCode;
+}
+
+// follow: the lead car changes speed every 2 to 5 s, between standing still and 0.4 m/s.
+// intersection: the lead car stops at the line, waits and turns left; a car on the right, one
+// ahead and one on the left wait at the intersection and leave one after the other.
+bool makeScenario(const string &scenario, double duration, mt19937 *rng, vector<SimCar> *cars) {
+   const double leadX = START_GAP + CAR_LENGTH;
+   if (scenario == "follow") {
+      uniform_real_distribution<double> interval(2, 5);
+      uniform_real_distribution<double> speed(0, 0.4);
+      SimCar lead{leadX, 0, 0, 0, {{0, 0, 0}}, true};
+      for (double t = 1; t < duration; t += interval(*rng)) {
+         lead.script.push_back(SpeedSegment{t, speed(*rng), 0});
+      }
+      cars->push_back(lead);
+      return true;
+   }
+   if (scenario == "intersection") {
+      uniform_real_distribution<double> wait(2, 4);
+      const double arrival = 1 + (STOP_LINE_X - leadX) / 0.3; // at 0.3 m/s, give or take the acceleration
+      const double turn = arrival + wait(*rng);
+      cars->push_back(SimCar{leadX, 0, 0, 0, {{0, 0, 0}, {1, 0.3, 0}, {arrival, 0, 0}, {turn, 0.3, 0.8}, {turn + 2, 0.3, 0}}, true});
+      double leave = turn + 2;
+      // right, ahead and left of the intersection, facing it
+      const double positions[3][3] = {{STOP_LINE_X + 0.6, -0.9, CV_PI / 2}, {STOP_LINE_X + 1.8, 0.25, CV_PI}, {STOP_LINE_X + 1.1, 0.9, -CV_PI / 2}};
+      for (const auto &position : positions) {
+         leave += wait(*rng);
+         cars->push_back(SimCar{position[0], position[1], position[2], 0, {{0, 0, 0}, {leave, 0.3, 0}}, false});
+      }
+      return true;
+   }
+   return false;
+}
+
+// Kinematic bicycle model; the speed and the steering angle follow the requests with a lag.
+void stepEgo(EgoCar *ego, double pedal, double steeringRequest, double dt) {
+   const double targetSpeed = (pedal > PEDAL_DEADBAND) ? (pedal - PEDAL_DEADBAND) * PEDAL_GAIN : 0;
+   const double targetSteering = std::max(-MAX_STEERING, std::min(MAX_STEERING, steeringRequest));
+   ego->speed += (targetSpeed - ego->speed) * std::min(1.0, dt / SPEED_TIME_CONSTANT);
+   ego->steering += (targetSteering - ego->steering) * std::min(1.0, dt / STEERING_TIME_CONSTANT);
+   ego->x += ego->speed * std::cos(ego->yaw) * dt;
+   ego->y += ego->speed * std::sin(ego->yaw) * dt;
+   ego->yaw += ego->speed / WHEELBASE * std::tan(ego->steering) * dt;
+}
+
+void stepCar(SimCar *car, double t, double dt) {
+   const SpeedSegment *segment = &car->script.front();
+   for (const SpeedSegment &s : car->script) {
+      if (s.start <= t) { segment = &s; }
+   }
+   const double step = OTHER_ACCELERATION * dt;
+   car->speed += std::max(-step, std::min(step, segment->speed - car->speed));
+   if (car->speed > 0) { car->yaw += segment->yawRate * dt; }
+   car->x += car->speed * std::cos(car->yaw) * dt;
+   car->y += car->speed * std::sin(car->yaw) * dt;
+}
+
+void relativePosition(const EgoCar &ego, double x, double y, double *forward, double *left) {
+   const double dx = x - ego.x;
+   const double dy = y - ego.y;
+   *forward = std::cos(ego.yaw) * dx + std::sin(ego.yaw) * dy;
+   *left = -std::sin(ego.yaw) * dx + std::cos(ego.yaw) * dy;
+}
+
+// From our front bumper to the nearest car in the cone of the front sensor.
+double frontDistance(const EgoCar &ego, const vector<SimCar> &cars) {
+   double distance = ULTRASOUND_MAX;
+   for (const SimCar &car : cars) {
+      double forward;
+      double left;
+      relativePosition(ego, car.x, car.y, &forward, &left);
+      if (forward > 0 && std::abs(std::atan2(left, forward)) < ULTRASOUND_CONE) {
+         distance = std::min(distance, forward - CAR_LENGTH);
+      }
+   }
+   return distance;
+}
+
+// Bumper to bumper, while the lead car is in front of us.
+bool leadGap(const EgoCar &ego, const vector<SimCar> &cars, double *gap) {
+   for (const SimCar &car : cars) {
+      double forward;
+      double left;
+      relativePosition(ego, car.x, car.y, &forward, &left);
+      if (car.lead && forward > 0 && std::abs(left) < CAR_WIDTH) {
+         *gap = forward - CAR_LENGTH;
+         return true;
+      }
+   }
+   return false;
+}
+
+// Pinhole camera at our front bumper. Every car is drawn as the box around its projected
+// footprint, farthest first; the lead car's back gets its pink plate when it faces away.
+void renderFrame(const EgoCar &ego, const vector<SimCar> &cars, Mat *frame) {
+   const double cx = frame->cols / 2.0;
+   const double cy = frame->rows / 2.0;
+   const double f = cx / std::tan(CAMERA_FIELD_OF_VIEW / 2);
+   frame->setTo(SKY);
+   rectangle(*frame, Point(0, cvRound(cy)), Point(frame->cols, frame->rows), GROUND, FILLED);
+
+   const double cameraX = ego.x + CAR_LENGTH / 2 * std::cos(ego.yaw);
+   const double cameraY = ego.y + CAR_LENGTH / 2 * std::sin(ego.yaw);
+   const EgoCar camera{cameraX, cameraY, ego.yaw, 0, 0};
+
+   vector<pair<double, const SimCar *> > order;
+   for (const SimCar &car : cars) {
+      double forward;
+      double left;
+      relativePosition(camera, car.x, car.y, &forward, &left);
+      order.push_back(make_pair(forward, &car));
+   }
+   std::sort(order.begin(), order.end(), [](const pair<double, const SimCar *> &a, const pair<double, const SimCar *> &b) { return a.first > b.first; });
+
+   const double NEAR = 0.05;
+   for (const auto &entry : order) {
+      const SimCar &car = *entry.second;
+      const double c = std::cos(car.yaw);
+      const double s = std::sin(car.yaw);
+      // rear left, rear right, front right, front left
+      const double corners[4][2] = {{-CAR_LENGTH / 2, CAR_WIDTH / 2}, {-CAR_LENGTH / 2, -CAR_WIDTH / 2}, {CAR_LENGTH / 2, -CAR_WIDTH / 2}, {CAR_LENGTH / 2, CAR_WIDTH / 2}};
+      double u[4];
+      double depth[4];
+      bool visible = true;
+      for (int i = 0; i < 4; i++) {
+         double left;
+         relativePosition(camera, car.x + c * corners[i][0] - s * corners[i][1], car.y + s * corners[i][0] + c * corners[i][1], &depth[i], &left);
+         if (depth[i] < NEAR) { visible = false; break; }
+         u[i] = cx - f * left / depth[i];
+      }
+      if (!visible) { continue; }
+      const double nearest = *std::min_element(depth, depth + 4);
+      const int top = cvRound(cy + f * (CAMERA_HEIGHT - CAR_HEIGHT) / nearest);
+      const int bottom = cvRound(cy + f * CAMERA_HEIGHT / nearest);
+      const int leftEdge = cvRound(*std::min_element(u, u + 4));
+      const int rightEdge = cvRound(*std::max_element(u, u + 4));
+      rectangle(*frame, Point(leftEdge, top), Point(rightEdge, bottom), CAR_BODY, FILLED);
+      const int wheel = std::max(1, cvRound(f * 0.03 / nearest));
+      circle(*frame, Point(leftEdge + wheel, bottom), wheel, WHEEL, FILLED);
+      circle(*frame, Point(rightEdge - wheel, bottom), wheel, WHEEL, FILLED);
+
+      if (car.lead && std::cos(car.yaw - ego.yaw) > 0.5) {
+         const double plateDepth = std::min(depth[0], depth[1]);
+         const int plateTop = cvRound(cy + f * (CAMERA_HEIGHT - CAR_HEIGHT) / plateDepth);
+         const int plateBottom = cvRound(cy + f * (CAMERA_HEIGHT - 0.03) / plateDepth);
+         rectangle(*frame, Point(cvRound(std::min(u[0], u[1])), plateTop), Point(cvRound(std::max(u[0], u[1])), plateBottom), LEAD_PLATE, FILLED);
+      }
+   }
+}
@@ -0,0 +1,403 @@
+/*
+ * Copyright (C) 2019  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Micro-benchmarks of the vision and control kernels of the services on the fixed frames of
+// a frame archive (frame-archiver in carDetection). Every kernel gets the inputs it gets in its
+// service, prepared outside of the measurement, and is timed call by call on one thread.
+// Reported per call: nanoseconds, heap allocations and their bytes, and the frame bytes the
+// kernel reads and writes. --json writes the same as JSON to compare commits and machines.
+//
+// The kernels are static in, or private to, their services, so the service sources are
+// compiled into this file; with SERVICE_HOST each is in its own namespace as in the service host.
+
+#include "cluon-complete.hpp"
+#include "opendlv-standard-message-set.hpp"
+#include "message-bus.hpp"
+
+#include "../../carDetection/src/car-detection.cpp"
+#include "../../stopSignRecognition/src/stop-sign.cpp"
+#include "../../accSafeDistance/src/safe-distance.cpp"
+#include "../../carDetection/src/frame-archive.hpp"
+
+#include "opencv2/core.hpp"
+#include "opencv2/imgproc.hpp"
+
+#include <sys/utsname.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <set>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+const char KERNEL_NAMES[] = "AutoExposure,ColorSegmenter,findSquares,segmentRuns,findMarkerBlobs,bestRect,drawSquares,BoxTracker,checkCarDistance,checkCarPosition,"
+                            "findCars,findSigns,detectAndDisplayStopSign,detectAndDisplayYieldSigns";
+const size_t WARMUP_FRAMES = 10; // run through every kernel before measuring
+
+// The pink of the lead car, as in safe-distance.
+const cv::Scalar PINK_LOW(135, 53, 65);
+const cv::Scalar PINK_HIGH(360 / 2, 255, 255);
+
+// Heap allocations of the measuring thread: operator new, for the containers, and the cv::Mat
+// buffers from the default allocator. OpenCV's own scratch space (cv::AutoBuffer and
+// cv::fastMalloc outside of a Mat) goes around both and is not counted.
+struct AllocationCount {
+   uint64_t calls;
+   uint64_t bytes;
+};
+static thread_local bool countAllocations = false;
+static thread_local AllocationCount allocations = {0, 0};
+
+void *operator new(size_t size) {
+   if (countAllocations) {
+      allocations.calls++;
+      allocations.bytes += size;
+   }
+   void *memory = std::malloc((size == 0) ? 1 : size);
+   if (memory == nullptr) { throw std::bad_alloc(); }
+   return memory;
+}
+void operator delete(void *memory) noexcept { std::free(memory); }
+void operator delete(void *memory, size_t) noexcept { std::free(memory); }
+
+class CountingMatAllocator : public cv::MatAllocator {
+  public:
+   cv::UMatData *allocate(int dims, const int *sizes, int type, void *data, size_t *step, int flags, cv::UMatUsageFlags usageFlags) const override {
+      cv::UMatData *u = cv::Mat::getStdAllocator()->allocate(dims, sizes, type, data, step, flags, usageFlags);
+      if (countAllocations && u != nullptr && data == nullptr) {
+         allocations.calls++;
+         allocations.bytes += u->size;
+      }
+      return u;
+   }
+   bool allocate(cv::UMatData *u, int accessFlags, cv::UMatUsageFlags usageFlags) const override {
+      return cv::Mat::getStdAllocator()->allocate(u, accessFlags, usageFlags);
+   }
+   void deallocate(cv::UMatData *u) const override { cv::Mat::getStdAllocator()->deallocate(u); }
+};
+
+// Takes what the kernels print, so that it is formatted as in the services but not written.
+class NullBuffer : public std::streambuf {
+  protected:
+   int overflow(int c) override { return traits_type::not_eof(c); }
+   std::streamsize xsputn(const char *, std::streamsize count) override { return count; }
+};
+
+struct KernelResult {
+   std::string name{};
+   std::vector<double> nanoseconds{};
+   uint64_t allocations{0};
+   uint64_t allocatedBytes{0};
+   uint64_t touchedBytes{0};
+};
+
+// The measurements of the kernels, in the order they first ran.
+class KernelResults {
+  public:
+   explicit KernelResults(const std::set<std::string> &selected) : m_selected{selected}, m_results{}, m_recording{false} {}
+
+   bool selected(const std::string &name) const { return m_selected.empty() || m_selected.count(name) != 0; }
+   void setRecording(bool recording) { m_recording = recording; }
+   const std::vector<KernelResult> &results() const { return m_results; }
+
+   // Times one call of kernel; touched are the frame bytes it reads and writes. Kernels that
+   // are not selected run as well, the kernels after them need their results.
+   template <typename Kernel>
+   void measure(const std::string &name, uint64_t touched, Kernel kernel) {
+      allocations = AllocationCount{0, 0};
+      countAllocations = true;
+      const auto start = std::chrono::steady_clock::now();
+      kernel();
+      const auto end = std::chrono::steady_clock::now();
+      countAllocations = false;
+      if (!m_recording || !selected(name)) { return; }
+
+      KernelResult &result = find(name);
+      result.nanoseconds.push_back(std::chrono::duration<double, std::nano>(end - start).count());
+      result.allocations += allocations.calls;
+      result.allocatedBytes += allocations.bytes;
+      result.touchedBytes += touched;
+   }
+
+  private:
+   KernelResult &find(const std::string &name) {
+      for (KernelResult &result : m_results) {
+         if (result.name == name) { return result; }
+      }
+      m_results.push_back(KernelResult());
+      m_results.back().name = name;
+      return m_results.back();
+   }
+
+   const std::set<std::string> m_selected;
+   std::vector<KernelResult> m_results;
+   bool m_recording;
+};
+
+uint64_t bytesOf(const cv::Mat &mat) { return static_cast<uint64_t>(mat.total() * mat.elemSize()); }
+double percentile(std::vector<double> values, double fraction);
+std::string jsonString(const std::string &text);
+void writeJson(std::ostream &out, const std::string &label, const std::string &archive, const FrameArchive &frames, uint32_t passes,
+   const std::vector<KernelResult> &results);
+
+int32_t main(int32_t argc, char **argv) {
+   int32_t retCode{1};
+   auto commandlineArguments = cluon::getCommandlineArguments(argc, argv);
+   if (0 == commandlineArguments.count("frames")) {
+      std::cerr << argv[0] << " times the vision and control kernels of the services on the frames of a frame archive." << std::endl;
+      std::cerr << "Usage:   " << argv[0] << " --frames=<file.frames> [--passes=<n>] [--kernels=<list>] [--json=<file>] [--label=<text>] [--car-cascade=<file>] [--stop-cascade=<file>] [--yield-cascade=<file>]" << std::endl;
+      std::cerr << "         --frames: frame archive written by frame-archiver" << std::endl;
+      std::cerr << "         --passes: times every kernel runs over all frames (default 3)" << std::endl;
+      std::cerr << "         --kernels: kernels to report (default all: " << KERNEL_NAMES << ")" << std::endl;
+      std::cerr << "         --json: also write the results to this file" << std::endl;
+      std::cerr << "         --label: stored with the results, e.g. the commit" << std::endl;
+      std::cerr << "         --car-cascade, --stop-cascade, --yield-cascade: compiled cascades (default as the services, in /usr/bin); the kernels of a missing one are left out" << std::endl;
+      std::cerr << "Example: " << argv[0] << " --frames=01-acc.frames --json=x86-$(git rev-parse --short HEAD).json --label=$(git rev-parse --short HEAD)" << std::endl;
+      return retCode;
+   }
+   const std::string ARCHIVE{commandlineArguments["frames"]};
+   const uint32_t PASSES{(commandlineArguments["passes"].size() != 0) ? static_cast<uint32_t>(std::max(1, std::stoi(commandlineArguments["passes"]))) : 3};
+   const std::string CAR_CASCADE{(commandlineArguments["car-cascade"].size() != 0) ? commandlineArguments["car-cascade"] : "/usr/bin/car-28-stages.xml"};
+   const std::string STOP_CASCADE{(commandlineArguments["stop-cascade"].size() != 0) ? commandlineArguments["stop-cascade"] : "/usr/bin/stopSignClassifier.xml"};
+   const std::string YIELD_CASCADE{(commandlineArguments["yield-cascade"].size() != 0) ? commandlineArguments["yield-cascade"] : "/usr/bin/yieldsign.xml"};
+   std::set<std::string> kernels;
+   {
+      std::stringstream list(commandlineArguments["kernels"]);
+      for (std::string kernel; std::getline(list, kernel, ',');) {
+         if (!kernel.empty()) { kernels.insert(kernel); }
+      }
+   }
+
+   FrameArchive frames;
+   if (!frames.load(ARCHIVE) || frames.size() == 0) {
+      std::cerr << argv[0] << ": cannot read frames from " << ARCHIVE << "." << std::endl;
+      return retCode;
+   }
+   KernelResults results{kernels};
+
+   // The kernels as configured in the services at full quality, on one thread, without a
+   // flight recorder and with nobody listening to the messages they send.
+   const DegradationLevel &quality = DEGRADATION_LEVELS[0];
+   FlightRecorder noRecorder{"kernel-benchmark", "", 0, 0, 0, 0};
+   accSafeDistance::flightRecorder = &noRecorder;
+   stopSignRecognition::flightRecorder = &noRecorder;
+   ServiceSession bus{0};
+
+   BinaryCascade carsCascade;
+   const bool HAVE_CARS = carsCascade.load(CAR_CASCADE);
+   if (!HAVE_CARS) { std::cerr << argv[0] << ": no car cascade " << CAR_CASCADE << ", findCars left out." << std::endl; }
+   const bool HAVE_SIGNS = stopSignRecognition::stopSignCascade.load(STOP_CASCADE) && stopSignRecognition::yieldSignCascadeClassifier.load(YIELD_CASCADE);
+   if (!HAVE_SIGNS) { std::cerr << argv[0] << ": no sign cascades " << STOP_CASCADE << ", " << YIELD_CASCADE << ", the sign kernels left out." << std::endl; }
+
+   const cv::Size FRAME_SIZE{frames.frameSize()};
+   const cv::Rect SAFE_DISTANCE_CROP(0, 0, FRAME_SIZE.width, cvRound(FRAME_SIZE.height * accSafeDistance::CROP_BOTTOM));
+   const cv::Rect CAR_DETECTION_CROP(0, 0, FRAME_SIZE.width, cvRound(FRAME_SIZE.height * carDetection::CROP_BOTTOM));
+
+   CountingMatAllocator matAllocator;
+   cv::MatAllocator *defaultAllocator = cv::Mat::getDefaultAllocator();
+   cv::Mat::setDefaultAllocator(&matAllocator);
+   NullBuffer nullBuffer;
+   std::streambuf *coutBuffer = std::cout.rdbuf(&nullBuffer);
+
+   // state the services keep from frame to frame
+   double prevArea = 0;
+   int lostVisualFrameCounter = 0;
+   bool sentLostVisual = false;
+   bool stopLineArrived = false;
+   GapEstimator gapEstimator{0.056f, 2.0f};
+   AutoExposure autoExposure{0.6f};
+   ColorSegmenter markers{cv::COLOR_RGB2HSV};
+   markers.addClass(PINK_LOW, PINK_HIGH);
+   double checkedArea = 0;
+
+   cv::Mat brightened, drawn, carFrame, carGray, signFrame, signGray;
+   std::vector<cv::Mat> masks;
+   std::vector<std::vector<PixelRun> > runs;
+   BlobExtractor blobExtractor;
+   std::vector<Blob> blobs;
+   std::vector<std::vector<cv::Point> > blobSquares;
+   std::vector<double> blobScores;
+   BoxTracker leadCarTracker{1}; // seeded on every frame the lead car is found, followed into the next
+   bool following = false;
+   std::vector<std::vector<cv::Point> > squares;
+   std::vector<double> scores;
+   std::vector<cv::Rect> rects, cars, stopsigns, yieldsigns;
+   for (uint32_t pass = 0; pass <= PASSES; pass++) {
+      // pass 0 warms up the caches, the allocator and the cascades on the first frames
+      results.setRecording(pass > 0);
+      const size_t count = (pass == 0) ? std::min(WARMUP_FRAMES, frames.size()) : frames.size();
+      for (size_t i = 0; i < count; i++) {
+         const cv::Mat frame = frames.frame(i);
+         const int64_t frameTime = frames.time(i);
+
+         // safe-distance
+         const cv::Mat cropped = frame(SAFE_DISTANCE_CROP);
+         results.measure("AutoExposure", bytesOf(cropped) * 2, [&]() {
+            autoExposure.apply(cropped, brightened);
+         });
+         results.measure("ColorSegmenter", bytesOf(brightened) + cropped.total(), [&]() { markers.segment(brightened, masks); });
+         const cv::Mat &mask = masks[0];
+         results.measure("findSquares", bytesOf(mask), [&]() {
+            accSafeDistance::findSquares(mask, cropped.size(), quality.threshold_levels, nullptr, squares, scores);
+         });
+         // the blob path of --markers=blobs, from the same frame
+         results.measure("segmentRuns", bytesOf(brightened), [&]() { markers.segmentRuns(brightened, runs); });
+         results.measure("findMarkerBlobs", runs[0].size() * sizeof(PixelRun), [&]() {
+            blobExtractor.extract(runs[0], blobs, accSafeDistance::MIN_SQUARE_AREA * cropped.size().area());
+            accSafeDistance::findMarkerBlobs(blobs, cropped.size(), blobSquares, blobScores);
+         });
+         rects.clear();
+         for (const std::vector<cv::Point> &square : squares) { rects.push_back(cv::boundingRect(square)); }
+         accSafeDistance::ScoredRect leadCar{cv::Rect(), 0, 0};
+         bool leadCarFound = false;
+         results.measure("bestRect", 0, [&]() { leadCarFound = accSafeDistance::bestRect(rects, scores, &leadCar); });
+         mask.copyTo(drawn);
+         results.measure("drawSquares", bytesOf(drawn), [&]() {
+            accSafeDistance::drawSquares(drawn, squares, scores, cropped.size(), &bus, &prevArea, &lostVisualFrameCounter,
+               &sentLostVisual, &stopLineArrived, &gapEstimator, frameTime);
+         });
+         if (following) {
+            cv::Rect2d tracked;
+            results.measure("BoxTracker", 0, [&]() { leadCarTracker.track(cropped, &tracked); });
+         }
+         following = leadCarFound && leadCarTracker.reset(cropped, leadCar.rect);
+         const cv::Rect2d box = leadCarFound ? accSafeDistance::normaliseRect(leadCar.rect, cropped.size()) : cv::Rect2d(0, 0, 0, 0);
+         const double centerX = leadCarFound ? box.x + 0.5 * box.width : 1337;
+         const double centerY = leadCarFound ? box.y + 0.5 * box.height : 1337;
+         results.measure("checkCarDistance", 0, [&]() { accSafeDistance::checkCarDistance(&checkedArea, box.area(), centerY, &bus); });
+         checkedArea = box.area();
+         results.measure("checkCarPosition", 0, [&]() { accSafeDistance::checkCarPosition(centerX, &bus); });
+
+         // car-detection
+         if (HAVE_CARS && results.selected("findCars")) {
+            carFrame = frame(CAR_DETECTION_CROP);
+            results.measure("findCars", bytesOf(carFrame) + carFrame.total() * 2, [&]() {
+               carDetection::findCars(carFrame, cars, &carsCascade, quality.cascade_scale_factor, carGray);
+            });
+         }
+
+         // stop-sign
+         if (HAVE_SIGNS) {
+            signFrame = frame;
+            stopsigns.clear();
+            yieldsigns.clear();
+            results.measure("findSigns", bytesOf(signFrame), [&]() {
+               stopSignRecognition::findSigns(signFrame, true, true, quality.cascade_scale_factor, nullptr, stopsigns, yieldsigns, signGray);
+            });
+            results.measure("detectAndDisplayStopSign", 0, [&]() { stopSignRecognition::detectAndDisplayStopSign(signFrame, stopsigns, &bus); });
+            results.measure("detectAndDisplayYieldSigns", 0, [&]() { stopSignRecognition::detectAndDisplayYieldSigns(signFrame, yieldsigns, &bus); });
+         }
+      }
+   }
+
+   std::cout.rdbuf(coutBuffer);
+   cv::Mat::setDefaultAllocator(defaultAllocator);
+
+   std::cout << frames.size() << " frames of " << FRAME_SIZE.width << "x" << FRAME_SIZE.height << " from " << ARCHIVE << ", " << PASSES << " passes" << std::endl;
+   std::cout << std::left << std::setw(28) << "kernel" << std::right << std::setw(12) << "ns/frame" << std::setw(12) << "p50" << std::setw(12) << "p95"
+             << std::setw(10) << "allocs" << std::setw(12) << "alloc B" << std::setw(12) << "touched B" << std::endl;
+   for (const KernelResult &result : results.results()) {
+      const double calls = static_cast<double>(result.nanoseconds.size());
+      double total = 0;
+      for (double ns : result.nanoseconds) { total += ns; }
+      std::cout << std::left << std::setw(28) << result.name << std::right << std::fixed << std::setprecision(0)
+                << std::setw(12) << total / calls << std::setw(12) << percentile(result.nanoseconds, 0.5) << std::setw(12) << percentile(result.nanoseconds, 0.95)
+                << std::setprecision(1) << std::setw(10) << static_cast<double>(result.allocations) / calls
+                << std::setprecision(0) << std::setw(12) << static_cast<double>(result.allocatedBytes) / calls
+                << std::setw(12) << static_cast<double>(result.touchedBytes) / calls << std::endl;
+   }
+   if (commandlineArguments["json"].size() != 0) {
+      std::ofstream json(commandlineArguments["json"], std::ios::out | std::ios::trunc);
+      writeJson(json, commandlineArguments["label"], ARCHIVE, frames, PASSES, results.results());
+      json.close();
+      if (json.fail()) {
+         std::cerr << argv[0] << ": cannot write " << commandlineArguments["json"] << "." << std::endl;
+         return retCode;
+      }
+   }
+   retCode = 0;
+   return retCode;
+}
+
+// Nearest rank.
+double percentile(std::vector<double> values, double fraction) {
+   if (values.empty()) { return 0; }
+   const size_t index = std::min(values.size() - 1, static_cast<size_t>(fraction * static_cast<double>(values.size())));
+   std::nth_element(values.begin(), values.begin() + static_cast<std::ptrdiff_t>(index), values.end());
+   return values[index];
+}
+
+std::string jsonString(const std::string &text) {
+   std::string quoted{"\""};
+   for (char c : text) {
+      if (c == '"' || c == '\\') {
+         quoted += '\\';
+         quoted += c;
+      } else if (static_cast<unsigned char>(c) < 0x20) {
+         char escaped[8];
+         std::snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned int>(c));
+         quoted += escaped;
+      } else {
+         quoted += c;
+      }
+   }
+   return quoted + "\"";
+}
+
+// One object per run; the machine and the compiler are stored so that results of x86 and
+// armhf builds can be told apart when compared.
+void writeJson(std::ostream &out, const std::string &label, const std::string &archive, const FrameArchive &frames, uint32_t passes,
+   const std::vector<KernelResult> &results) {
+   struct utsname machine;
+   const std::string MACHINE{(::uname(&machine) == 0) ? machine.machine : "unknown"};
+   out << "{" << std::endl;
+   out << "  \"label\": " << jsonString(label) << "," << std::endl;
+   out << "  \"machine\": " << jsonString(MACHINE) << "," << std::endl;
+   out << "  \"compiler\": " << jsonString(__VERSION__) << "," << std::endl;
+   out << "  \"opencv\": " << jsonString(CV_VERSION) << "," << std::endl;
+   out << "  \"archive\": " << jsonString(archive) << "," << std::endl;
+   out << "  \"width\": " << frames.frameSize().width << ", \"height\": " << frames.frameSize().height
+       << ", \"frames\": " << frames.size() << ", \"passes\": " << passes << "," << std::endl;
+   out << "  \"kernels\": [" << std::endl;
+   out << std::fixed;
+   for (size_t i = 0; i < results.size(); i++) {
+      const KernelResult &result = results[i];
+      const double calls = static_cast<double>(result.nanoseconds.size());
+      double total = 0;
+      for (double ns : result.nanoseconds) { total += ns; }
+      out << "    {\"name\": " << jsonString(result.name) << ", \"calls\": " << result.nanoseconds.size() << std::setprecision(1)
+          << ", \"ns_per_frame\": " << total / calls
+          << ", \"ns_p50\": " << percentile(result.nanoseconds, 0.5)
+          << ", \"ns_p95\": " << percentile(result.nanoseconds, 0.95)
+          << ", \"ns_min\": " << *std::min_element(result.nanoseconds.begin(), result.nanoseconds.end())
+          << ", \"allocations_per_call\": " << static_cast<double>(result.allocations) / calls
+          << ", \"allocated_bytes_per_call\": " << static_cast<double>(result.allocatedBytes) / calls
+          << ", \"bytes_touched_per_call\": " << static_cast<double>(result.touchedBytes) / calls << "}"
+          << ((i + 1 < results.size()) ? "," : "") << std::endl;
+   }
+   out << "  ]" << std::endl;
+   out << "}" << std::endl;
+}
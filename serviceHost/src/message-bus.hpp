@@ -0,0 +1,346 @@
+/*
+ * Copyright (C) 2019  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Message passing between services in the same process. Built into the service host
+// (SERVICE_HOST defined), ServiceSession is a BusSession: messages are handed to the
+// receiving services as objects through a lock-free queue per service, with no encoding
+// and no socket in between. Built on its own, a service uses a cluon::OD4Session as before.
+// Services subscribe with onMessage<T>(), which works with either.
+// This file is shared between the services; keep all copies identical.
+
+#ifndef MESSAGE_BUS_HPP
+#define MESSAGE_BUS_HPP
+
+#include "cluon-complete.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Bounded queue for many producers and one consumer, after D. Vyukov's bounded MPMC queue:
+// every cell carries a sequence number telling whose turn it is, so producers only race on
+// the enqueue position and never take a lock. SIZE must be a power of two.
+template <typename T, size_t SIZE>
+class MessageQueue {
+  private:
+   MessageQueue(const MessageQueue &) = delete;
+   MessageQueue &operator=(const MessageQueue &) = delete;
+
+   struct Cell {
+      Cell() : sequence{0}, value{} {}
+      std::atomic<size_t> sequence;
+      T value;
+   };
+
+  public:
+   MessageQueue() : m_cells(SIZE), m_enqueue{0}, m_dequeue{0} {
+      static_assert(SIZE >= 2 && (SIZE & (SIZE - 1)) == 0, "SIZE must be a power of two");
+      for (size_t i = 0; i < SIZE; i++) { m_cells[i].sequence.store(i, std::memory_order_relaxed); }
+   }
+
+   // False if the queue is full.
+   bool push(T &&value) {
+      size_t position = m_enqueue.load(std::memory_order_relaxed);
+      while (true) {
+         Cell &cell = m_cells[position & (SIZE - 1)];
+         const size_t sequence = cell.sequence.load(std::memory_order_acquire);
+         if (sequence == position) {
+            if (m_enqueue.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+               cell.value = std::move(value);
+               cell.sequence.store(position + 1, std::memory_order_release);
+               return true;
+            }
+         } else if (sequence < position) {
+            return false;
+         } else {
+            position = m_enqueue.load(std::memory_order_relaxed);
+         }
+      }
+   }
+
+   // Only ever called by the one consumer; false if the queue is empty.
+   bool pop(T *value) {
+      Cell &cell = m_cells[m_dequeue & (SIZE - 1)];
+      if (cell.sequence.load(std::memory_order_acquire) != m_dequeue + 1) { return false; }
+      *value = std::move(cell.value);
+      cell.value = T();
+      cell.sequence.store(m_dequeue + SIZE, std::memory_order_release);
+      m_dequeue++;
+      return true;
+   }
+
+  private:
+   std::vector<Cell> m_cells;
+   std::atomic<size_t> m_enqueue;
+   size_t m_dequeue;
+};
+
+// A message on its way to one service: the envelope carries the header (type, time stamps,
+// sender stamp); the payload is either the object itself or, for messages that came in
+// from another process, the envelope's serialized data.
+struct BusDelivery {
+   BusDelivery() : envelope{}, message{} {}
+   cluon::data::Envelope envelope;
+   std::shared_ptr<const void> message;
+};
+
+// The receiving end of one service: its handlers by message type and the queue they are
+// fed from by one dispatcher thread, so that a service sees its messages one at a time and
+// in order, as it does with an OD4Session.
+class BusInbox {
+  private:
+   BusInbox(const BusInbox &) = delete;
+   BusInbox &operator=(const BusInbox &) = delete;
+
+  public:
+   typedef std::map<int32_t, std::function<void(BusDelivery &)>> Handlers;
+
+   BusInbox() : queue{}, handlers{std::make_shared<const Handlers>()}, mutex{}, wake{}, sleeping{false}, stop{false}, dropped{0} {}
+
+   // Called by any sending thread.
+   void deliver(BusDelivery &&delivery) {
+      if (!queue.push(std::move(delivery))) {
+         // a service stuck in a handler; drop like a full socket buffer would, not block the sender
+         if (dropped++ == 0) { std::cerr << "message bus: inbox full, dropping messages" << std::endl; }
+         return;
+      }
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (sleeping.load()) {
+         std::lock_guard<std::mutex> lock(mutex);
+         wake.notify_one();
+      }
+   }
+
+   void dispatch() {
+      BusDelivery delivery;
+      while (!stop.load()) {
+         if (!queue.pop(&delivery)) {
+            std::unique_lock<std::mutex> lock(mutex);
+            sleeping.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!queue.pop(&delivery)) {
+               wake.wait_for(lock, std::chrono::milliseconds(100));
+               sleeping.store(false);
+               continue;
+            }
+            sleeping.store(false);
+         }
+         std::shared_ptr<const Handlers> current = std::atomic_load(&handlers);
+         auto handler = current->find(delivery.envelope.dataType());
+         if (handler != current->end()) { handler->second(delivery); }
+      }
+   }
+
+   MessageQueue<BusDelivery, 256> queue;
+   std::shared_ptr<const Handlers> handlers; // replaced as a whole, read without a lock
+   std::mutex mutex;                          // only for sleeping and waking up
+   std::condition_variable wake;
+   std::atomic<bool> sleeping;
+   std::atomic<bool> stop;
+   std::atomic<uint64_t> dropped;
+};
+
+// All services of one CID in this process. The routing table from message type to the
+// inboxes subscribed to it is copied on every change, which only happens while services
+// start, so senders read it without a lock. With a bridge, messages also go to and come
+// from the OD4Session of other processes, e.g. the car's proxies and the ultrasonic sensors.
+class MessageBus {
+  private:
+   MessageBus(const MessageBus &) = delete;
+   MessageBus &operator=(const MessageBus &) = delete;
+
+  public:
+   typedef std::map<int32_t, std::vector<std::shared_ptr<BusInbox>>> Routes;
+
+   MessageBus() : m_mutex{}, m_routes{std::make_shared<const Routes>()}, m_bridge{}, m_exports{}, m_running{true} {}
+
+   // The bus of a CID; buses live as long as the process.
+   static MessageBus &forCid(uint16_t cid) {
+      static std::mutex mutex;
+      static std::map<uint16_t, std::unique_ptr<MessageBus>> buses;
+      std::lock_guard<std::mutex> lock(mutex);
+      std::unique_ptr<MessageBus> &bus = buses[cid];
+      if (!bus) { bus.reset(new MessageBus()); }
+      return *bus;
+   }
+
+   // Forwards the given message types (all if empty) to session and imports every type a
+   // service here subscribes to from it. Set before the services start.
+   void setBridge(std::shared_ptr<cluon::OD4Session> session, const std::set<int32_t> &exports) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_bridge = session;
+      m_exports = exports;
+      for (const auto &route : *m_routes) { importFromBridge(route.first); }
+   }
+
+   std::shared_ptr<cluon::OD4Session> bridge(int32_t dataType) const {
+      return (m_exports.empty() || m_exports.count(dataType) != 0) ? m_bridge : nullptr;
+   }
+
+   void subscribe(int32_t dataType, std::shared_ptr<BusInbox> inbox) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      std::shared_ptr<Routes> routes = std::make_shared<Routes>(*m_routes);
+      (*routes)[dataType].push_back(inbox);
+      std::atomic_store(&m_routes, std::shared_ptr<const Routes>(routes));
+      importFromBridge(dataType);
+   }
+
+   void unsubscribe(const std::shared_ptr<BusInbox> &inbox) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      std::shared_ptr<Routes> routes = std::make_shared<Routes>(*m_routes);
+      for (auto &route : *routes) {
+         std::vector<std::shared_ptr<BusInbox>> &inboxes = route.second;
+         for (size_t i = inboxes.size(); i-- > 0;) {
+            if (inboxes[i] == inbox) { inboxes.erase(inboxes.begin() + static_cast<std::ptrdiff_t>(i)); }
+         }
+      }
+      std::atomic_store(&m_routes, std::shared_ptr<const Routes>(routes));
+   }
+
+   // True if a service other than the sender would receive the type.
+   bool hasReceivers(int32_t dataType, const BusInbox *sender) const {
+      std::shared_ptr<const Routes> routes = std::atomic_load(&m_routes);
+      auto route = routes->find(dataType);
+      if (route == routes->end()) { return false; }
+      for (const std::shared_ptr<BusInbox> &inbox : route->second) {
+         if (inbox.get() != sender) { return true; }
+      }
+      return false;
+   }
+
+   // Like an OD4Session, a service does not receive what it sent itself.
+   void publish(const BusDelivery &delivery, const BusInbox *sender) {
+      std::shared_ptr<const Routes> routes = std::atomic_load(&m_routes);
+      auto route = routes->find(delivery.envelope.dataType());
+      if (route == routes->end()) { return; }
+      for (const std::shared_ptr<BusInbox> &inbox : route->second) {
+         if (inbox.get() != sender) { inbox->deliver(BusDelivery(delivery)); }
+      }
+   }
+
+   bool isRunning() const { return m_running.load(); }
+   void stop() { m_running.store(false); }
+
+  private:
+   void importFromBridge(int32_t dataType) {
+      if (!m_bridge) { return; }
+      m_bridge->dataTrigger(dataType, [this](cluon::data::Envelope &&envelope) {
+         BusDelivery delivery;
+         delivery.envelope = std::move(envelope);
+         publish(delivery, nullptr);
+      });
+   }
+
+   std::mutex m_mutex; // serialises changes of the routes and the bridge
+   std::shared_ptr<const Routes> m_routes;
+   std::shared_ptr<cluon::OD4Session> m_bridge;
+   std::set<int32_t> m_exports;
+   std::atomic<bool> m_running;
+};
+
+// What a service holds instead of an OD4Session in the service host: same send() and
+// isRunning(), subscriptions through onMessage<T>().
+class BusSession {
+  private:
+   BusSession(const BusSession &) = delete;
+   BusSession &operator=(const BusSession &) = delete;
+
+  public:
+   explicit BusSession(uint16_t cid)
+      : m_bus(MessageBus::forCid(cid)), m_inbox{std::make_shared<BusInbox>()}, m_dispatcher{} {
+      std::shared_ptr<BusInbox> inbox = m_inbox;
+      m_dispatcher = std::thread([inbox]() { inbox->dispatch(); });
+   }
+
+   ~BusSession() {
+      m_bus.unsubscribe(m_inbox);
+      m_inbox->stop.store(true);
+      {
+         std::lock_guard<std::mutex> lock(m_inbox->mutex);
+         m_inbox->wake.notify_one();
+      }
+      m_dispatcher.join();
+   }
+
+   template <typename T>
+   void send(T &message, const cluon::data::TimeStamp &sampleTimeStamp = cluon::data::TimeStamp(), uint32_t senderStamp = 0) {
+      const int32_t dataType = static_cast<int32_t>(T::ID());
+      if (m_bus.hasReceivers(dataType, m_inbox.get())) {
+         BusDelivery delivery;
+         delivery.envelope.dataType(dataType);
+         delivery.envelope.sent(cluon::time::now());
+         delivery.envelope.sampleTimeStamp((0 == (sampleTimeStamp.seconds() + sampleTimeStamp.microseconds())) ? delivery.envelope.sent() : sampleTimeStamp);
+         delivery.envelope.senderStamp(senderStamp);
+         delivery.message = std::make_shared<const T>(message);
+         m_bus.publish(delivery, m_inbox.get());
+      }
+      std::shared_ptr<cluon::OD4Session> bridge = m_bus.bridge(dataType);
+      if (bridge) { bridge->send(message, sampleTimeStamp, senderStamp); }
+   }
+
+   bool isRunning() const { return m_bus.isRunning(); }
+
+   void subscribe(int32_t dataType, std::function<void(BusDelivery &)> handler) {
+      std::shared_ptr<BusInbox::Handlers> handlers = std::make_shared<BusInbox::Handlers>(*std::atomic_load(&m_inbox->handlers));
+      (*handlers)[dataType] = handler;
+      std::atomic_store(&m_inbox->handlers, std::shared_ptr<const BusInbox::Handlers>(handlers));
+      m_bus.subscribe(dataType, m_inbox);
+   }
+
+  private:
+   MessageBus &m_bus;
+   std::shared_ptr<BusInbox> m_inbox;
+   std::thread m_dispatcher;
+};
+
+// Calls handler with every message of type T the session receives, decoded from the
+// envelope, which is passed along for its header.
+template <typename T>
+inline void onMessage(cluon::OD4Session &session, std::function<void(T &&, const cluon::data::Envelope &)> handler) {
+   session.dataTrigger(T::ID(), [handler](cluon::data::Envelope &&envelope) {
+      T message = cluon::extractMessage<T>(std::move(envelope)); // only reads the payload
+      handler(std::move(message), envelope);
+   });
+}
+
+// The same on the bus: a copy of the sent object, decoded only if it came over the bridge.
+template <typename T>
+inline void onMessage(BusSession &session, std::function<void(T &&, const cluon::data::Envelope &)> handler) {
+   session.subscribe(T::ID(), [handler](BusDelivery &delivery) {
+      T message = delivery.message ? *static_cast<const T *>(delivery.message.get()) : cluon::extractMessage<T>(std::move(delivery.envelope));
+      handler(std::move(message), delivery.envelope);
+   });
+}
+
+#ifdef SERVICE_HOST
+typedef BusSession ServiceSession;
+#else
+typedef cluon::OD4Session ServiceSession;
+#endif
+
+#endif
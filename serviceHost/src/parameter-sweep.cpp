@@ -0,0 +1,502 @@
+/*
+ * Copyright (C) 2019  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Parameter sweep of a detector of the services: runs it over the frames of frame archives
+// for every point of a grid of its parameters, the points in parallel on all cores, and
+// prints the Pareto front of time per frame against agreement with the labelled detections.
+// Labels are boxes per frame in a CSV (--labels); without one, the detections with the
+// parameters the services use are the labels, and --write-labels saves them to correct by hand.
+// A point keeps the scenario outcome of an archive when the decision the service takes from
+// the detections goes through the same values as with the labels, e.g. no car, one car,
+// no car for 03-car-at-9.
+//
+// The detectors are built from the kernels of the services, so the service sources are
+// compiled into this file; with SERVICE_HOST each is in its own namespace as in the service host.
+
+#include "cluon-complete.hpp"
+#include "opendlv-standard-message-set.hpp"
+#include "message-bus.hpp"
+
+#include "../../carDetection/src/car-detection.cpp"
+#include "../../stopSignRecognition/src/stop-sign.cpp"
+#include "../../accSafeDistance/src/safe-distance.cpp"
+#include "../../carDetection/src/frame-archive.hpp"
+#include "../../carDetection/src/gray-equalize.hpp"
+
+#include "opencv2/core.hpp"
+#include "opencv2/imgproc.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+const int DEBOUNCE_FRAMES = 5;      // a decision counts once it held this long, as the stop sign votes
+const double MATCH_OVERLAP = 0.5;   // intersection over union of a detection and its label
+const double LEAD_CAR_NEAR = 0.026; // optimal area of checkCarDistance; a larger box brakes
+const int MAX_CARS = 3;             // cars counted at the intersection, one per direction
+
+struct SweepPoint {
+   double scale_factor; // cascades
+   int min_neighbors;
+   double min_size;     // of the frame height
+   int low_h;           // lead car, the lower bound of the pink
+   int low_s;
+   int low_v;
+   int threshold_levels;
+};
+
+struct PointResult {
+   SweepPoint point;
+   double mean_ms;
+   double p95_ms;
+   double precision;
+   double recall;
+   double f1;
+   double frame_agreement; // share of frames with the same decision as with the labels
+   size_t outcomes_kept;   // archives
+};
+
+// Normalised boxes of every frame of every archive.
+typedef std::vector<std::vector<std::vector<cv::Rect2d> > > Boxes;
+
+std::vector<std::string> splitList(const std::string &list);
+std::vector<double> numberList(const std::string &list, const std::string &defaults);
+std::string baseName(const std::string &path);
+std::string describe(const std::string &detector, const SweepPoint &point);
+std::vector<cv::Rect2d> detect(const std::string &detector, const SweepPoint &point, const cv::Mat &frame, BinaryCascade *cascade, cv::Mat &gray, AutoExposure *exposure,
+   const ColorSegmenter *markers);
+int decide(const std::string &detector, const std::vector<cv::Rect2d> &boxes);
+std::vector<int> outcome(const std::vector<int> &decisions);
+void runPoint(const std::string &detector, const SweepPoint &point, const std::vector<std::unique_ptr<FrameArchive> > &archives, size_t step,
+   BinaryCascade *cascade, Boxes *found, std::vector<double> *milliseconds);
+void scorePoint(const std::string &detector, const Boxes &found, const Boxes &labels, size_t step, PointResult *result);
+void setTimes(std::vector<double> milliseconds, PointResult *result);
+std::vector<size_t> paretoFront(const std::vector<PointResult> &results, const std::vector<size_t> &candidates);
+bool readLabels(const std::string &file, const std::vector<std::string> &names, Boxes *labels);
+bool writeLabels(const std::string &file, const std::vector<std::string> &names, const Boxes &labels);
+
+int32_t main(int32_t argc, char **argv) {
+   int32_t retCode{1};
+   auto commandlineArguments = cluon::getCommandlineArguments(argc, argv);
+   const std::string DETECTOR{commandlineArguments["detector"]};
+   if ((0 == commandlineArguments.count("frames")) ||
+       (DETECTOR != "car" && DETECTOR != "stop-sign" && DETECTOR != "yield-sign" && DETECTOR != "lead-car")) {
+      std::cerr << argv[0] << " sweeps the parameters of a detector over frame archives and prints the speed/accuracy Pareto front." << std::endl;
+      std::cerr << "Usage:   " << argv[0] << " --frames=<a.frames,b.frames,...> --detector=<car|stop-sign|yield-sign|lead-car> [--labels=<file.csv>] [--write-labels=<file.csv>] [--cascade=<file>] [--step=<n>] [--threads=<n>] [--csv=<file>] [<grid>]" << std::endl;
+      std::cerr << "         --frames: frame archives written by frame-archiver, e.g. one per submission recording" << std::endl;
+      std::cerr << "         --detector: car (car-detection), stop-sign, yield-sign (stop-sign) or lead-car (safe-distance)" << std::endl;
+      std::cerr << "         --labels: boxes per frame as archive,frame,x,y,width,height in normalised coordinates (default the detections with the parameters of the service)" << std::endl;
+      std::cerr << "         --write-labels: write the labels used to this file, to correct them by hand" << std::endl;
+      std::cerr << "         --cascade: compiled cascade of the car or sign detector (default as the services, in /usr/bin)" << std::endl;
+      std::cerr << "         --step: use every n-th frame (default 1)" << std::endl;
+      std::cerr << "         --threads: grid points evaluated at once (default the number of cores)" << std::endl;
+      std::cerr << "         --csv: write the results of all grid points to this file" << std::endl;
+      std::cerr << "         grid of the cascades: --scale-factors=<list> (default 1.05,1.1,1.2,1.3) --min-neighbors=<list> (default 1,2,3,4) --min-sizes=<list of fractions of the frame height>" << std::endl;
+      std::cerr << "         grid of the lead car: --hue=<list> (default 125,135,145) --saturation=<list> (default 33,53,73) --value=<list> (default 45,65,85) --threshold-levels=<list> (default 0,3,5,7,11; 0 is the blob of --markers=blobs)" << std::endl;
+      std::cerr << "Example: " << argv[0] << " --frames=03-car-at-9.frames,04-car-at-12.frames,05-car-at-3.frames --detector=car --cascade=car-28-stages.cascade --step=2" << std::endl;
+      return retCode;
+   }
+   const bool CASCADE_DETECTOR{DETECTOR != "lead-car"};
+   const std::string CASCADE{(commandlineArguments["cascade"].size() != 0) ? commandlineArguments["cascade"] :
+      (DETECTOR == "car") ? "/usr/bin/car-28-stages.xml" : (DETECTOR == "stop-sign") ? "/usr/bin/stopSignClassifier.xml" : "/usr/bin/yieldsign.xml"};
+   const size_t STEP{(commandlineArguments["step"].size() != 0) ? static_cast<size_t>(std::max(1, std::stoi(commandlineArguments["step"]))) : 1};
+   const unsigned THREADS{(commandlineArguments["threads"].size() != 0) ? static_cast<unsigned>(std::max(1, std::stoi(commandlineArguments["threads"]))) :
+      std::max(1u, std::thread::hardware_concurrency())};
+
+   std::vector<std::string> names;
+   std::vector<std::unique_ptr<FrameArchive> > archives;
+   for (const std::string &file : splitList(commandlineArguments["frames"])) {
+      std::unique_ptr<FrameArchive> archive{new FrameArchive()};
+      if (!archive->load(file) || archive->size() == 0) {
+         std::cerr << argv[0] << ": cannot read frames from " << file << "." << std::endl;
+         return retCode;
+      }
+      names.push_back(baseName(file));
+      archives.push_back(std::move(archive));
+   }
+   if (CASCADE_DETECTOR) {
+      BinaryCascade cascade;
+      if (!cascade.load(CASCADE)) {
+         std::cerr << argv[0] << ": cannot load the cascade " << CASCADE << "." << std::endl;
+         return retCode;
+      }
+   }
+
+   // The parameters of the services are the reference; the grid varies those of the detector.
+   // safe-distance traces its marker as squares by default; threshold level 0 is the blob.
+   const DegradationLevel &quality = DEGRADATION_LEVELS[0];
+   const SweepPoint REFERENCE{quality.cascade_scale_factor, (DETECTOR == "car") ? 3 : 2, (DETECTOR == "car") ? 0 : stopSignRecognition::MIN_SIGN_SIZE,
+      135, 53, 65, quality.threshold_levels};
+   std::vector<SweepPoint> grid;
+   if (CASCADE_DETECTOR) {
+      for (double scale_factor : numberList(commandlineArguments["scale-factors"], "1.05,1.1,1.2,1.3")) {
+         for (double min_neighbors : numberList(commandlineArguments["min-neighbors"], "1,2,3,4")) {
+            for (double min_size : numberList(commandlineArguments["min-sizes"], (DETECTOR == "car") ? "0,0.083,0.125" : "0.083,0.125,0.167")) {
+               SweepPoint point = REFERENCE;
+               point.scale_factor = scale_factor;
+               point.min_neighbors = static_cast<int>(min_neighbors);
+               point.min_size = min_size;
+               grid.push_back(point);
+            }
+         }
+      }
+   } else {
+      for (double low_h : numberList(commandlineArguments["hue"], "125,135,145")) {
+         for (double low_s : numberList(commandlineArguments["saturation"], "33,53,73")) {
+            for (double low_v : numberList(commandlineArguments["value"], "45,65,85")) {
+               for (double threshold_levels : numberList(commandlineArguments["threshold-levels"], "0,3,5,7,11")) {
+                  SweepPoint point = REFERENCE;
+                  point.low_h = static_cast<int>(low_h);
+                  point.low_s = static_cast<int>(low_s);
+                  point.low_v = static_cast<int>(low_v);
+                  point.threshold_levels = static_cast<int>(threshold_levels);
+                  grid.push_back(point);
+               }
+            }
+         }
+      }
+   }
+
+   ThreadPool pool{THREADS - 1, std::vector<int>(), 0};
+
+   Boxes labels;
+   if (commandlineArguments["labels"].size() != 0) {
+      if (!readLabels(commandlineArguments["labels"], names, &labels)) {
+         std::cerr << argv[0] << ": cannot read labels from " << commandlineArguments["labels"] << "." << std::endl;
+         return retCode;
+      }
+      labels.resize(archives.size());
+      for (size_t a = 0; a < archives.size(); a++) { labels[a].resize(archives[a]->size()); }
+   } else {
+      BinaryCascade cascade;
+      if (CASCADE_DETECTOR) { cascade.load(CASCADE); }
+      std::vector<double> milliseconds;
+      runPoint(DETECTOR, REFERENCE, archives, STEP, &cascade, &labels, &milliseconds);
+   }
+   if (commandlineArguments["write-labels"].size() != 0 && !writeLabels(commandlineArguments["write-labels"], names, labels)) {
+      std::cerr << argv[0] << ": cannot write " << commandlineArguments["write-labels"] << "." << std::endl;
+   }
+
+   // every grid point is one task with its own cascade, which is not shared between threads
+   std::vector<PointResult> results(grid.size());
+   pool.parallelFor(static_cast<int>(grid.size()), [&](int i) {
+      BinaryCascade cascade;
+      if (CASCADE_DETECTOR) { cascade.load(CASCADE); }
+      Boxes found;
+      std::vector<double> milliseconds;
+      PointResult &result = results[static_cast<size_t>(i)];
+      result.point = grid[static_cast<size_t>(i)];
+      runPoint(DETECTOR, result.point, archives, STEP, &cascade, &found, &milliseconds);
+      setTimes(milliseconds, &result);
+      scorePoint(DETECTOR, found, labels, STEP, &result);
+   });
+
+   // The times of points running side by side include their contention; the points on the
+   // front are timed again one at a time and the front is taken again among them.
+   std::vector<size_t> all(results.size());
+   for (size_t i = 0; i < all.size(); i++) { all[i] = i; }
+   std::vector<size_t> front = paretoFront(results, all);
+   for (size_t i : front) {
+      BinaryCascade cascade;
+      if (CASCADE_DETECTOR) { cascade.load(CASCADE); }
+      Boxes found;
+      std::vector<double> milliseconds;
+      runPoint(DETECTOR, results[i].point, archives, STEP, &cascade, &found, &milliseconds);
+      setTimes(milliseconds, &results[i]);
+   }
+   front = paretoFront(results, front);
+
+   size_t frames = 0;
+   for (const std::unique_ptr<FrameArchive> &archive : archives) { frames += (archive->size() + STEP - 1) / STEP; }
+   std::cout << DETECTOR << ": " << grid.size() << " parameter sets on " << frames << " frames of " << archives.size() << " archives, "
+             << THREADS << " threads; reference " << describe(DETECTOR, REFERENCE) << std::endl;
+   auto print = [&DETECTOR, &archives](const PointResult &result) {
+      std::cout << "  " << std::left << std::setw(44) << describe(DETECTOR, result.point) << std::right << std::fixed
+                << std::setprecision(2) << std::setw(9) << result.mean_ms << " ms" << std::setw(9) << result.p95_ms << " ms p95"
+                << std::setprecision(3) << "  precision " << result.precision << "  recall " << result.recall << "  F1 " << result.f1
+                << "  frames " << result.frame_agreement << "  outcomes " << result.outcomes_kept << "/" << archives.size() << std::endl;
+   };
+   std::cout << "Pareto front, fastest first:" << std::endl;
+   for (size_t i : front) { print(results[i]); }
+   size_t fastest = results.size();
+   for (size_t i = 0; i < results.size(); i++) {
+      if (results[i].outcomes_kept == archives.size() && (fastest == results.size() || results[i].mean_ms < results[fastest].mean_ms)) { fastest = i; }
+   }
+   if (fastest < results.size()) {
+      std::cout << "Fastest keeping the outcomes of all archives:" << std::endl;
+      print(results[fastest]);
+   } else {
+      std::cout << "No parameter set keeps the outcomes of all archives." << std::endl;
+   }
+
+   if (commandlineArguments["csv"].size() != 0) {
+      std::ofstream csv(commandlineArguments["csv"], std::ios::out | std::ios::trunc);
+      csv << "scale_factor,min_neighbors,min_size,low_h,low_s,low_v,threshold_levels,mean_ms,p95_ms,precision,recall,f1,frame_agreement,outcomes_kept,pareto" << std::endl;
+      for (size_t i = 0; i < results.size(); i++) {
+         const PointResult &result = results[i];
+         csv << result.point.scale_factor << "," << result.point.min_neighbors << "," << result.point.min_size << ","
+             << result.point.low_h << "," << result.point.low_s << "," << result.point.low_v << "," << result.point.threshold_levels << ","
+             << result.mean_ms << "," << result.p95_ms << "," << result.precision << "," << result.recall << "," << result.f1 << ","
+             << result.frame_agreement << "," << result.outcomes_kept << "," << (std::count(front.begin(), front.end(), i) != 0 ? 1 : 0) << std::endl;
+      }
+      csv.close();
+      if (csv.fail()) {
+         std::cerr << argv[0] << ": cannot write " << commandlineArguments["csv"] << "." << std::endl;
+         return retCode;
+      }
+   }
+   retCode = 0;
+   return retCode;
+}
+
+std::vector<std::string> splitList(const std::string &list) {
+   std::vector<std::string> items;
+   std::stringstream stream(list);
+   for (std::string item; std::getline(stream, item, ',');) {
+      if (!item.empty()) { items.push_back(item); }
+   }
+   return items;
+}
+
+std::vector<double> numberList(const std::string &list, const std::string &defaults) {
+   std::vector<double> numbers;
+   for (const std::string &item : splitList(list.empty() ? defaults : list)) { numbers.push_back(std::stod(item)); }
+   return numbers;
+}
+
+std::string baseName(const std::string &path) {
+   const size_t slash = path.find_last_of('/');
+   return (slash == std::string::npos) ? path : path.substr(slash + 1);
+}
+
+std::string describe(const std::string &detector, const SweepPoint &point) {
+   std::stringstream text;
+   if (detector == "lead-car") {
+      text << "hsv>=" << point.low_h << "," << point.low_s << "," << point.low_v;
+      if (point.threshold_levels == 0) {
+         text << " blobs";
+      } else {
+         text << " levels=" << point.threshold_levels;
+      }
+   } else {
+      text << "scale=" << point.scale_factor << " neighbors=" << point.min_neighbors << " min-size=" << point.min_size;
+   }
+   return text.str();
+}
+
+// The boxes of one frame as the service finds them with the parameters of point, normalised
+// to the frame; for the lead car the one box after the grouping, if any. gray is the buffer
+// of the cascades' input, exposure the lead car's brightness of the recording so far and
+// markers its pink of the point.
+std::vector<cv::Rect2d> detect(const std::string &detector, const SweepPoint &point, const cv::Mat &frame, BinaryCascade *cascade, cv::Mat &gray, AutoExposure *exposure,
+   const ColorSegmenter *markers) {
+   std::vector<cv::Rect> found;
+   const int min_size = cvRound(point.min_size * frame.rows);
+   if (detector == "car") {
+      // as findCars, on the crop of car-detection
+      const cv::Mat cropped = frame(cv::Rect(0, 0, frame.cols, cvRound(frame.rows * carDetection::CROP_BOTTOM)));
+      grayEqualized(cropped, gray);
+      cascade->detectMultiScale(gray, found, point.scale_factor, point.min_neighbors, cv::Size(min_size, min_size));
+   } else if (detector == "lead-car") {
+      // as safe-distance, up to the grouping of the squares; threshold level 0 is --markers=blobs
+      const cv::Mat cropped = frame(cv::Rect(0, 0, frame.cols, cvRound(frame.rows * accSafeDistance::CROP_BOTTOM)));
+      cv::Mat brightened;
+      exposure->apply(cropped, brightened);
+      std::vector<std::vector<cv::Point> > squares;
+      std::vector<double> scores;
+      if (point.threshold_levels == 0) {
+         std::vector<std::vector<PixelRun> > runs;
+         BlobExtractor blobExtractor;
+         std::vector<Blob> blobs;
+         markers->segmentRuns(brightened, runs);
+         blobExtractor.extract(runs[0], blobs, accSafeDistance::MIN_SQUARE_AREA * frame.size().area());
+         accSafeDistance::findMarkerBlobs(blobs, frame.size(), squares, scores);
+      } else {
+         std::vector<cv::Mat> masks;
+         markers->segment(brightened, masks);
+         accSafeDistance::findSquares(masks[0], frame.size(), point.threshold_levels, nullptr, squares, scores);
+      }
+      std::vector<cv::Rect> rects;
+      for (const std::vector<cv::Point> &square : squares) { rects.push_back(cv::boundingRect(square)); }
+      accSafeDistance::ScoredRect leadCar{cv::Rect(), 0, 0};
+      if (accSafeDistance::bestRect(rects, scores, &leadCar, (point.threshold_levels == 0) ? 1 : accSafeDistance::MIN_SQUARE_SUPPORT)) {
+         found.push_back(leadCar.rect);
+      }
+   } else {
+      // as findSigns, around the red blobs
+      const std::vector<cv::Rect> windows = stopSignRecognition::redProposals(frame, min_size);
+      if (!windows.empty()) {
+         grayEqualized(frame, gray, windows);
+         std::vector<cv::Rect> inWindow;
+         for (const cv::Rect &window : windows) {
+            cascade->detectMultiScale(gray(window), inWindow, point.scale_factor, point.min_neighbors, cv::Size(min_size, min_size));
+            for (const cv::Rect &r : inWindow) { found.push_back(r + window.tl()); }
+         }
+      }
+   }
+   std::vector<cv::Rect2d> boxes;
+   for (const cv::Rect &rect : found) { boxes.push_back(carDetection::normaliseRect(rect, frame.size())); }
+   return boxes;
+}
+
+// What the service makes of the boxes of a frame: the cars at the intersection, whether a
+// sign is near enough, or no lead car, one farther than the gap kept, or a nearer one.
+int decide(const std::string &detector, const std::vector<cv::Rect2d> &boxes) {
+   double largest = 0;
+   for (const cv::Rect2d &box : boxes) { largest = std::max(largest, box.area()); }
+   if (detector == "car") { return std::min(static_cast<int>(boxes.size()), MAX_CARS); }
+   if (detector == "stop-sign") { return (largest > stopSignRecognition::MIN_STOPSIGN_AREA) ? 1 : 0; }
+   if (detector == "yield-sign") { return (largest > stopSignRecognition::MIN_YIELDSIGN_AREA) ? 1 : 0; }
+   if (boxes.empty()) { return 0; }
+   return (largest < LEAD_CAR_NEAR) ? 1 : 2;
+}
+
+// The values a decision goes through, each once it held for DEBOUNCE_FRAMES frames.
+std::vector<int> outcome(const std::vector<int> &decisions) {
+   std::vector<int> values;
+   int held = 0;
+   for (size_t i = 0; i < decisions.size(); i++) {
+      held = (i > 0 && decisions[i] == decisions[i - 1]) ? held + 1 : 1;
+      if (held == DEBOUNCE_FRAMES && (values.empty() || values.back() != decisions[i])) { values.push_back(decisions[i]); }
+   }
+   return values;
+}
+
+// Runs the detector over every step-th frame of the archives; found gets the boxes of those
+// frames, the others stay empty.
+void runPoint(const std::string &detector, const SweepPoint &point, const std::vector<std::unique_ptr<FrameArchive> > &archives, size_t step,
+   BinaryCascade *cascade, Boxes *found, std::vector<double> *milliseconds) {
+   found->assign(archives.size(), std::vector<std::vector<cv::Rect2d> >());
+   milliseconds->clear();
+   cv::Mat gray;
+   ColorSegmenter markers{cv::COLOR_RGB2HSV};
+   markers.addClass(cv::Scalar(point.low_h, point.low_s, point.low_v), cv::Scalar(360 / 2, 255, 255));
+   for (size_t a = 0; a < archives.size(); a++) {
+      (*found)[a].resize(archives[a]->size());
+      AutoExposure exposure{0.6f};
+      for (size_t i = 0; i < archives[a]->size(); i += step) {
+         const cv::Mat frame = archives[a]->frame(i);
+         const auto start = std::chrono::steady_clock::now();
+         (*found)[a][i] = detect(detector, point, frame, cascade, gray, &exposure, &markers);
+         milliseconds->push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+      }
+   }
+}
+
+// Detections are matched one to one to the labels of their frame, the best overlap first.
+void scorePoint(const std::string &detector, const Boxes &found, const Boxes &labels, size_t step, PointResult *result) {
+   uint64_t detections = 0, labelled = 0, matched = 0, frames = 0, agreeing = 0;
+   result->outcomes_kept = 0;
+   for (size_t a = 0; a < found.size(); a++) {
+      std::vector<int> decisions, labelDecisions;
+      for (size_t i = 0; i < found[a].size(); i += step) {
+         const std::vector<cv::Rect2d> &boxes = found[a][i];
+         const std::vector<cv::Rect2d> &truth = labels[a][i];
+         std::vector<bool> taken(truth.size(), false);
+         for (const cv::Rect2d &box : boxes) {
+            double best = MATCH_OVERLAP;
+            size_t match = truth.size();
+            for (size_t t = 0; t < truth.size(); t++) {
+               const double overlap = (box & truth[t]).area();
+               const double iou = overlap / (box.area() + truth[t].area() - overlap);
+               if (!taken[t] && iou >= best) {
+                  best = iou;
+                  match = t;
+               }
+            }
+            if (match < truth.size()) {
+               taken[match] = true;
+               matched++;
+            }
+         }
+         detections += boxes.size();
+         labelled += truth.size();
+         decisions.push_back(decide(detector, boxes));
+         labelDecisions.push_back(decide(detector, truth));
+         agreeing += (decisions.back() == labelDecisions.back()) ? 1 : 0;
+         frames++;
+      }
+      if (outcome(decisions) == outcome(labelDecisions)) { result->outcomes_kept++; }
+   }
+   // no boxes where there are none is right
+   result->precision = (detections == 0) ? 1 : static_cast<double>(matched) / static_cast<double>(detections);
+   result->recall = (labelled == 0) ? 1 : static_cast<double>(matched) / static_cast<double>(labelled);
+   result->f1 = (result->precision + result->recall > 0) ? 2 * result->precision * result->recall / (result->precision + result->recall) : 0;
+   result->frame_agreement = (frames == 0) ? 0 : static_cast<double>(agreeing) / static_cast<double>(frames);
+}
+
+void setTimes(std::vector<double> milliseconds, PointResult *result) {
+   result->mean_ms = 0;
+   result->p95_ms = 0;
+   if (milliseconds.empty()) { return; }
+   for (double ms : milliseconds) { result->mean_ms += ms; }
+   result->mean_ms /= static_cast<double>(milliseconds.size());
+   const size_t index = std::min(milliseconds.size() - 1, milliseconds.size() * 95 / 100);
+   std::nth_element(milliseconds.begin(), milliseconds.begin() + static_cast<std::ptrdiff_t>(index), milliseconds.end());
+   result->p95_ms = milliseconds[index];
+}
+
+// The candidates no other candidate beats in both time and F1, fastest first.
+std::vector<size_t> paretoFront(const std::vector<PointResult> &results, const std::vector<size_t> &candidates) {
+   std::vector<size_t> order = candidates;
+   std::sort(order.begin(), order.end(), [&results](size_t a, size_t b) {
+      return (results[a].mean_ms < results[b].mean_ms) || (!(results[b].mean_ms < results[a].mean_ms) && results[a].f1 > results[b].f1);
+   });
+   std::vector<size_t> front;
+   for (size_t i : order) {
+      if (front.empty() || results[i].f1 > results[front.back()].f1) { front.push_back(i); }
+   }
+   return front;
+}
+
+bool readLabels(const std::string &file, const std::vector<std::string> &names, Boxes *labels) {
+   std::ifstream in(file);
+   if (!in.good()) { return false; }
+   labels->assign(names.size(), std::vector<std::vector<cv::Rect2d> >());
+   for (std::string line; std::getline(in, line);) {
+      const std::vector<std::string> fields = splitList(line);
+      if (fields.size() != 6 || fields[0] == "archive") { continue; }
+      const size_t archive = static_cast<size_t>(std::find(names.begin(), names.end(), fields[0]) - names.begin());
+      if (archive == names.size()) { continue; }
+      const size_t frame = static_cast<size_t>(std::stoul(fields[1]));
+      if ((*labels)[archive].size() <= frame) { (*labels)[archive].resize(frame + 1); }
+      (*labels)[archive][frame].push_back(cv::Rect2d(std::stod(fields[2]), std::stod(fields[3]), std::stod(fields[4]), std::stod(fields[5])));
+   }
+   return true;
+}
+
+bool writeLabels(const std::string &file, const std::vector<std::string> &names, const Boxes &labels) {
+   std::ofstream out(file, std::ios::out | std::ios::trunc);
+   out << "archive,frame,x,y,width,height" << std::endl;
+   for (size_t a = 0; a < labels.size(); a++) {
+      for (size_t i = 0; i < labels[a].size(); i++) {
+         for (const cv::Rect2d &box : labels[a][i]) {
+            out << names[a] << "," << i << "," << box.x << "," << box.y << "," << box.width << "," << box.height << std::endl;
+         }
+      }
+   }
+   out.close();
+   return !out.fail();
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2019  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Runs the services in one process, each on its own thread with its own command line.
+// The services are compiled in from their own directories with SERVICE_HOST defined: they
+// then talk through the in-process message bus (message-bus.hpp) and share one copy of
+// every camera frame (frame-reader.hpp). A bridge to the OD4Session connects them with the
+// processes outside, e.g. the car's proxies and the ultrasonic sensors.
+
+#include "cluon-complete.hpp"
+#include "message-bus.hpp"
+
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace carDetection { int32_t main(int32_t argc, char **argv); }
+namespace stopSignRecognition { int32_t main(int32_t argc, char **argv); }
+namespace accSafeDistance { int32_t main(int32_t argc, char **argv); }
+namespace MoveCar { int32_t main(int32_t argc, char **argv); }
+namespace InputDirection { int32_t main(int32_t argc, char **argv); }
+
+struct HostedService {
+   const char *name;
+   int32_t (*main)(int32_t argc, char **argv);
+};
+
+const HostedService SERVICES[] = {
+   {"car-detection", carDetection::main},
+   {"stop-sign", stopSignRecognition::main},
+   {"safe-distance", accSafeDistance::main},
+   {"move-car", MoveCar::main},
+   {"input-direction", InputDirection::main},
+};
+
+std::vector<std::string> splitList(const std::string &list);
+std::vector<std::string> serviceArguments(const std::string &service, int32_t argc, char **argv);
+
+int32_t main(int32_t argc, char **argv) {
+   int32_t retCode{1};
+   auto commandlineArguments = cluon::getCommandlineArguments(argc, argv);
+   if (0 == commandlineArguments.count("cid")) {
+      std::cerr << argv[0] << " runs the services in one process, passing messages and camera frames in memory." << std::endl;
+      std::cerr << "Usage:   " << argv[0] << " --cid=<OD4 session> [--services=<list>] [--export=<message ids>] [--no-bridge] [<service options>] [--<service>.<option>=<value>]" << std::endl;
+      std::cerr << "         --services: services to run (default car-detection,stop-sign,safe-distance,move-car,input-direction)" << std::endl;
+      std::cerr << "         --export: message ids forwarded to the OD4Session for other processes (default all)" << std::endl;
+      std::cerr << "         --no-bridge: no OD4Session at all; only the services in this process talk to each other" << std::endl;
+      std::cerr << "         Every other option goes to every service; --<service>.<option> only to that service." << std::endl;
+      std::cerr << "Example: " << argv[0] << " --cid=112 --name=img.argb --width=640 --height=480 --car-detection.cpus=0-1 --stop-sign.cpus=2 --safe-distance.cpus=2 --move-car.cpus=3" << std::endl;
+      return retCode;
+   }
+   const uint16_t CID{static_cast<uint16_t>(std::stoi(commandlineArguments["cid"]))};
+
+   std::vector<const HostedService *> selected;
+   const std::string SERVICE_LIST{(commandlineArguments["services"].size() != 0) ? commandlineArguments["services"] : "car-detection,stop-sign,safe-distance,move-car,input-direction"};
+   for (const std::string &name : splitList(SERVICE_LIST)) {
+      const HostedService *found = nullptr;
+      for (const HostedService &service : SERVICES) {
+         if (name == service.name) { found = &service; }
+      }
+      if (found == nullptr) {
+         std::cerr << argv[0] << ": unknown service '" << name << "'." << std::endl;
+         return retCode;
+      }
+      selected.push_back(found);
+   }
+
+   // Messages from outside come in for every type a service subscribes to; what the services
+   // send goes out as well, unless --export narrows it down. Outgoing messages are encoded
+   // once for the socket, the services here get the object either way.
+   std::shared_ptr<cluon::OD4Session> bridge;
+   if (0 == commandlineArguments.count("no-bridge")) {
+      bridge = std::make_shared<cluon::OD4Session>(CID);
+      if (0 == bridge->isRunning()) {
+         std::cerr << argv[0] << ": no OD4Session running for the bridge." << std::endl;
+         return retCode;
+      }
+      std::set<int32_t> exports;
+      for (const std::string &id : splitList(commandlineArguments["export"])) {
+         exports.insert(std::stoi(id));
+      }
+      MessageBus::forCid(CID).setBridge(bridge, exports);
+   }
+
+   std::vector<std::thread> threads;
+   for (const HostedService *service : selected) {
+      std::vector<std::string> arguments = serviceArguments(service->name, argc, argv);
+      threads.push_back(std::thread([service, arguments]() {
+         std::vector<std::string> strings = arguments;
+         std::vector<char *> pointers;
+         for (std::string &argument : strings) { pointers.push_back(&argument[0]); }
+         pointers.push_back(nullptr);
+         const int32_t serviceRetCode = service->main(static_cast<int32_t>(strings.size()), pointers.data());
+         std::clog << service->name << " exited with " << serviceRetCode << std::endl;
+      }));
+   }
+   for (std::thread &thread : threads) { thread.join(); }
+   MessageBus::forCid(CID).stop();
+   retCode = 0;
+   return retCode;
+}
+
+std::vector<std::string> splitList(const std::string &list) {
+   std::vector<std::string> items;
+   std::stringstream stream(list);
+   for (std::string item; std::getline(stream, item, ',');) {
+      if (!item.empty()) { items.push_back(item); }
+   }
+   return items;
+}
+
+// The command line of one service: its name, the options meant for all services and its
+// own --<service>.<option> ones without the prefix, which come last and so take precedence.
+std::vector<std::string> serviceArguments(const std::string &service, int32_t argc, char **argv) {
+   std::vector<std::string> common{service};
+   std::vector<std::string> own;
+   for (int32_t i = 1; i < argc; i++) {
+      const std::string argument{argv[i]};
+      const size_t dot = argument.find('.');
+      const size_t equals = argument.find('=');
+      bool prefixed = false;
+      if (argument.compare(0, 2, "--") == 0 && dot != std::string::npos && (equals == std::string::npos || dot < equals)) {
+         for (const HostedService &hosted : SERVICES) {
+            if (argument.compare(2, dot - 2, hosted.name) == 0 && dot - 2 == std::string(hosted.name).size()) { prefixed = true; }
+         }
+      }
+      if (prefixed) {
+         if (argument.compare(2, dot - 2, service) == 0 && dot - 2 == service.size()) {
+            own.push_back("--" + argument.substr(dot + 1));
+         }
+      } else if (argument.compare(0, 10, "--services") != 0 && argument.compare(0, 8, "--export") != 0 && argument != "--no-bridge") {
+         common.push_back(argument);
+      }
+   }
+   common.insert(common.end(), own.begin(), own.end());
+   return common;
+}
@@ -0,0 +1,556 @@
+/*
+ * Copyright (C) 2019  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Precompiled form of an opencv_traincascade classifier (BOOST stages of stumps over HAAR
+// or LBP features). cascade-compiler converts the XML once at build time; the services
+// memory-map the result at startup and evaluate it in place instead of parsing the XML.
+// This file is shared between the services; keep all copies identical.
+
+#ifndef BINARY_CASCADE_HPP
+#define BINARY_CASCADE_HPP
+
+#include "opencv2/core.hpp"
+#include "opencv2/imgproc.hpp"
+#include "opencv2/objdetect.hpp"
+
+#include "cascade-simd.hpp"
+#include "thread-pool.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// File layout: a CascadeHeader followed by flat arrays of 4 byte elements (structure of
+// arrays), each starting on a 16 byte boundary. The file is written in the byte order of
+// the machine that runs cascade-compiler, i.e. it is built together with the service.
+const uint32_t CASCADE_MAGIC = 0x43534344; // "DCSC" when read little endian
+const uint32_t CASCADE_VERSION = 1;
+const size_t CASCADE_ALIGNMENT = 16;
+
+enum CascadeFeatureType : uint32_t {
+   CASCADE_HAAR = 0,
+   CASCADE_LBP = 1
+};
+
+// Haar features have up to three weighted rectangles, unused ones have weight 0.
+// An LBP feature is one rectangle, the cell size of its 3x3 block grid.
+const int HAAR_RECTS_PER_FEATURE = 3;
+const int LBP_SUBSET_SIZE = 8; // 256 bit category mask per stump
+
+// Float stage sums closer than this to the stage threshold are recomputed in double.
+// A stage has at most a few hundred leaves, the float rounding error stays far below it.
+const float STAGE_SUM_MARGIN = 1e-3f;
+
+enum CascadeArray {
+   STAGE_FIRST_WEAK = 0, // uint32, index of the first stump of a stage
+   STAGE_WEAK_COUNT,     // uint32
+   STAGE_THRESHOLD,      // float, already lowered by the OpenCV threshold epsilon
+   WEAK_FEATURE,         // uint32, feature index of a stump
+   WEAK_THRESHOLD,       // float, HAAR only
+   WEAK_LEFT,            // float, leaf below the threshold (HAAR) or inside the subset (LBP)
+   WEAK_RIGHT,           // float
+   WEAK_SUBSET,          // int32 [LBP_SUBSET_SIZE] per stump, LBP only
+   RECT_X,               // int32, [rect * feature_count + feature]
+   RECT_Y,
+   RECT_WIDTH,
+   RECT_HEIGHT,
+   RECT_WEIGHT,          // float, HAAR only
+   NUMBER_OF_CASCADE_ARRAYS
+};
+
+struct CascadeHeader {
+   uint32_t magic;
+   uint32_t version;
+   uint32_t feature_type;
+   int32_t window_width;
+   int32_t window_height;
+   uint32_t stage_count;
+   uint32_t weak_count;
+   uint32_t feature_count;
+   uint32_t rects_per_feature;
+   uint32_t file_size;
+   uint32_t offset[NUMBER_OF_CASCADE_ARRAYS]; // bytes from the start of the file
+   uint32_t count[NUMBER_OF_CASCADE_ARRAYS];  // elements
+};
+
+// Memory-mapped cascade with the detectMultiScale interface of cv::CascadeClassifier.
+// Detection follows OpenCV's CascadeClassifier: the image is scaled, not the features,
+// windows are visited with a step of 2 pixels below scale 2, and the hits are grouped
+// with groupRectangles(minNeighbors, 0.2). An .xml file is loaded into cv::CascadeClassifier
+// instead, which then does the detection; that is what the services load by default until
+// cascade-benchmark has shown on the recordings that the compiled cascades detect the same.
+class BinaryCascade {
+  private:
+   BinaryCascade(const BinaryCascade &) = delete;
+   BinaryCascade &operator=(const BinaryCascade &) = delete;
+
+  public:
+   BinaryCascade()
+      : m_map{nullptr}, m_size{0}, m_header{nullptr}, m_opencv{}, m_useSimd{true}, m_pool{nullptr}, m_scratch{} {}
+   ~BinaryCascade() { unload(); }
+
+   bool load(const std::string &path) {
+      unload();
+      const std::string xml = ".xml";
+      if (path.size() > xml.size() && path.compare(path.size() - xml.size(), xml.size(), xml) == 0) {
+         return m_opencv.load(path);
+      }
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0) { return false; }
+      struct stat info;
+      if (::fstat(fd, &info) != 0 || info.st_size < static_cast<off_t>(sizeof(CascadeHeader))) {
+         ::close(fd);
+         return false;
+      }
+      void *map = ::mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+      if (map == MAP_FAILED) { return false; }
+      m_map = map;
+      m_size = static_cast<size_t>(info.st_size);
+      m_header = static_cast<const CascadeHeader *>(m_map);
+      if (!valid()) {
+         unload();
+         return false;
+      }
+      return true;
+   }
+
+   bool empty() const { return m_header == nullptr && m_opencv.empty(); }
+
+   // False if an .xml was loaded and cv::CascadeClassifier detects.
+   bool compiled() const { return m_header != nullptr; }
+
+   CascadeFeatureType featureType() const {
+      return static_cast<CascadeFeatureType>(compiled() ? static_cast<int>(m_header->feature_type) : m_opencv.getFeatureType());
+   }
+
+   cv::Size getOriginalWindowSize() const {
+      return compiled() ? cv::Size(m_header->window_width, m_header->window_height) : m_opencv.getOriginalWindowSize();
+   }
+
+   // Evaluates four neighbouring windows at once (default) or one at a time, for comparison.
+   void setUseSimd(bool use_simd) { m_useSimd = use_simd; }
+   bool useSimd() const { return m_useSimd; }
+
+   // Scales are evaluated as tasks of this pool; nullptr (default) runs them one by one.
+   void setThreadPool(ThreadPool *pool) { m_pool = pool; }
+
+   // image has to be CV_8UC1.
+   void detectMultiScale(const cv::Mat &image, std::vector<cv::Rect> &objects, double scale_factor = 1.1,
+                         int min_neighbors = 3, cv::Size min_size = cv::Size(), cv::Size max_size = cv::Size()) {
+      objects.clear();
+      if (!compiled() && !m_opencv.empty() && !image.empty()) {
+         m_opencv.detectMultiScale(image, objects, scale_factor, min_neighbors, 0, min_size, max_size);
+         return;
+      }
+      if (!compiled() || image.empty() || image.type() != CV_8UC1 || scale_factor <= 1) { return; }
+      if (max_size.width <= 0 || max_size.height <= 0) { max_size = image.size(); }
+
+      const cv::Size window = getOriginalWindowSize();
+      std::vector<double> factors;
+      for (double factor = 1;; factor *= scale_factor) {
+         const cv::Size window_size(cvRound(window.width * factor), cvRound(window.height * factor));
+         if (window_size.width > max_size.width || window_size.height > max_size.height) { break; }
+         if (window_size.width < min_size.width || window_size.height < min_size.height) { continue; }
+         const cv::Size scaled_size(cvRound(image.cols / factor), cvRound(image.rows / factor));
+         if (scaled_size.width < window.width || scaled_size.height < window.height) { break; }
+         factors.push_back(factor);
+      }
+
+      // Every scale has its own buffers and candidates; they are joined in scale order, so
+      // the result does not depend on how the scales were spread over the threads.
+      if (m_scratch.size() < factors.size()) { m_scratch.resize(factors.size()); }
+      auto scaleTask = [this, &image, &factors, window](int i) {
+         const float scale = static_cast<float>(factors[static_cast<size_t>(i)]);
+         const cv::Size window_size(cvRound(window.width * factors[static_cast<size_t>(i)]), cvRound(window.height * factors[static_cast<size_t>(i)]));
+         const cv::Size scaled_size(cvRound(image.cols / scale), cvRound(image.rows / scale));
+         Scratch &b = m_scratch[static_cast<size_t>(i)];
+         b.candidates.clear();
+         if (scaled_size == image.size()) {
+            detectAtScale(&b, image, scale, window_size, &b.candidates);
+         } else {
+            cv::resize(image, b.scaled, scaled_size, 0, 0, cv::INTER_LINEAR);
+            detectAtScale(&b, b.scaled, scale, window_size, &b.candidates);
+         }
+      };
+      if (m_pool != nullptr) {
+         m_pool->parallelFor(static_cast<int>(factors.size()), scaleTask);
+      } else {
+         for (size_t i = 0; i < factors.size(); i++) { scaleTask(static_cast<int>(i)); }
+      }
+      for (size_t i = 0; i < factors.size(); i++) {
+         objects.insert(objects.end(), m_scratch[i].candidates.begin(), m_scratch[i].candidates.end());
+      }
+      cv::groupRectangles(objects, min_neighbors, 0.2);
+   }
+
+  private:
+   // Buffers of one scale: the scaled image, its integral images, the feature offsets for
+   // their row step and the windows that passed.
+   struct Scratch {
+      cv::Mat scaled{};
+      cv::Mat sum{};
+      cv::Mat sqsum{};
+      std::vector<int> rectOffsets{};
+      int normOffsets[4]{};
+      int normSqOffsets[4]{};
+      std::vector<cv::Rect> candidates{};
+   };
+
+   template <typename T> const T *array(CascadeArray which) const {
+      return reinterpret_cast<const T *>(static_cast<const uint8_t *>(m_map) + m_header->offset[which]);
+   }
+
+   bool valid() const {
+      const CascadeHeader &h = *m_header;
+      if (h.magic != CASCADE_MAGIC || h.version != CASCADE_VERSION || h.file_size != m_size) { return false; }
+      if (h.feature_type != CASCADE_HAAR && h.feature_type != CASCADE_LBP) { return false; }
+      if (h.window_width <= 2 || h.window_height <= 2 || h.stage_count == 0) { return false; }
+      for (int i = 0; i < NUMBER_OF_CASCADE_ARRAYS; i++) {
+         if (h.offset[i] % CASCADE_ALIGNMENT != 0 || h.offset[i] < sizeof(CascadeHeader)) { return false; }
+         if (static_cast<uint64_t>(h.offset[i]) + static_cast<uint64_t>(h.count[i]) * 4 > m_size) { return false; }
+      }
+      const bool haar = (h.feature_type == CASCADE_HAAR);
+      const uint32_t rects = h.rects_per_feature * h.feature_count;
+      if (h.rects_per_feature != static_cast<uint32_t>(haar ? HAAR_RECTS_PER_FEATURE : 1)) { return false; }
+      if (h.count[STAGE_FIRST_WEAK] != h.stage_count || h.count[STAGE_WEAK_COUNT] != h.stage_count ||
+          h.count[STAGE_THRESHOLD] != h.stage_count || h.count[WEAK_FEATURE] != h.weak_count ||
+          h.count[WEAK_THRESHOLD] != (haar ? h.weak_count : 0) || h.count[WEAK_LEFT] != h.weak_count ||
+          h.count[WEAK_RIGHT] != h.weak_count || h.count[WEAK_SUBSET] != (haar ? 0 : h.weak_count * LBP_SUBSET_SIZE) ||
+          h.count[RECT_X] != rects || h.count[RECT_Y] != rects || h.count[RECT_WIDTH] != rects ||
+          h.count[RECT_HEIGHT] != rects || h.count[RECT_WEIGHT] != (haar ? rects : 0)) {
+         return false;
+      }
+      // Every index must stay inside its array, evaluation does not check them again.
+      const uint32_t *first = array<uint32_t>(STAGE_FIRST_WEAK);
+      const uint32_t *count = array<uint32_t>(STAGE_WEAK_COUNT);
+      for (uint32_t s = 0; s < h.stage_count; s++) {
+         if (static_cast<uint64_t>(first[s]) + count[s] > h.weak_count) { return false; }
+      }
+      const uint32_t *feature = array<uint32_t>(WEAK_FEATURE);
+      for (uint32_t w = 0; w < h.weak_count; w++) {
+         if (feature[w] >= h.feature_count) { return false; }
+      }
+      const int32_t *x = array<int32_t>(RECT_X);
+      const int32_t *y = array<int32_t>(RECT_Y);
+      const int32_t *width = array<int32_t>(RECT_WIDTH);
+      const int32_t *height = array<int32_t>(RECT_HEIGHT);
+      const int grid = haar ? 1 : 3;
+      for (uint32_t r = 0; r < rects; r++) {
+         if (x[r] < 0 || y[r] < 0 || width[r] < 0 || height[r] < 0 || x[r] + grid * width[r] > h.window_width ||
+             y[r] + grid * height[r] > h.window_height) {
+            return false;
+         }
+      }
+      return true;
+   }
+
+   void unload() {
+      if (m_map != nullptr) { ::munmap(m_map, m_size); }
+      m_map = nullptr;
+      m_size = 0;
+      m_header = nullptr;
+      m_opencv = cv::CascadeClassifier();
+   }
+
+   // Offsets of the rectangle corners relative to the window origin in an integral image
+   // with the given row step (in elements): top left, top right, bottom left, bottom right.
+   static void cornerOffsets(int x, int y, int width, int height, size_t step, int *offsets) {
+      const int row = static_cast<int>(step);
+      offsets[0] = y * row + x;
+      offsets[1] = y * row + x + width;
+      offsets[2] = (y + height) * row + x;
+      offsets[3] = (y + height) * row + x + width;
+   }
+
+   template <typename T> static T rectSum(const T *origin, const int *offsets) {
+      return origin[offsets[0]] - origin[offsets[1]] - origin[offsets[2]] + origin[offsets[3]];
+   }
+
+   void prepareOffsets(Scratch *scratch) const {
+      Scratch &b = *scratch;
+      const CascadeHeader &h = *m_header;
+      const size_t step = b.sum.step / sizeof(int);
+      const int32_t *x = array<int32_t>(RECT_X);
+      const int32_t *y = array<int32_t>(RECT_Y);
+      const int32_t *width = array<int32_t>(RECT_WIDTH);
+      const int32_t *height = array<int32_t>(RECT_HEIGHT);
+      const uint32_t rects = h.rects_per_feature * h.feature_count;
+      if (h.feature_type == CASCADE_HAAR) {
+         b.rectOffsets.resize(rects * 4);
+         for (uint32_t r = 0; r < rects; r++) {
+            cornerOffsets(x[r], y[r], width[r], height[r], step, &b.rectOffsets[r * 4]);
+         }
+         cornerOffsets(1, 1, h.window_width - 2, h.window_height - 2, step, b.normOffsets);
+         cornerOffsets(1, 1, h.window_width - 2, h.window_height - 2, b.sqsum.step / sizeof(int), b.normSqOffsets);
+      } else {
+         // 4x4 grid points of the 3x3 cells, row by row.
+         b.rectOffsets.resize(rects * 16);
+         for (uint32_t r = 0; r < rects; r++) {
+            for (int j = 0; j < 4; j++) {
+               for (int i = 0; i < 4; i++) {
+                  b.rectOffsets[r * 16 + static_cast<uint32_t>(j * 4 + i)] =
+                     static_cast<int>(step) * (y[r] + j * height[r]) + x[r] + i * width[r];
+               }
+            }
+         }
+      }
+   }
+
+   // Variance normalisation of a Haar window; false for windows without enough contrast.
+   bool varianceNorm(const Scratch &b, const int *sum, const int *sqsum, float *variance_norm) const {
+      const double area = (m_header->window_width - 2) * (m_header->window_height - 2);
+      const int norm_sum = rectSum(sum, b.normOffsets);
+      // 32 bit squared sums wrap like in OpenCV; the difference of the corners is still exact.
+      const unsigned norm_sqsum = static_cast<unsigned>(rectSum(sqsum, b.normSqOffsets));
+      double nf = area * norm_sqsum - static_cast<double>(norm_sum) * norm_sum;
+      if (nf <= 0) { return false; }
+      *variance_norm = static_cast<float>(1. / std::sqrt(nf));
+      return area * *variance_norm < 1e-1;
+   }
+
+   double haarStageSum(const Scratch &b, const int *sum, float variance_norm, uint32_t s) const {
+      const uint32_t *stage_first = array<uint32_t>(STAGE_FIRST_WEAK);
+      const uint32_t *stage_count = array<uint32_t>(STAGE_WEAK_COUNT);
+      const uint32_t *weak_feature = array<uint32_t>(WEAK_FEATURE);
+      const float *weak_threshold = array<float>(WEAK_THRESHOLD);
+      const float *weak_left = array<float>(WEAK_LEFT);
+      const float *weak_right = array<float>(WEAK_RIGHT);
+      const float *weight = array<float>(RECT_WEIGHT);
+      const uint32_t features = m_header->feature_count;
+      double stage_sum = 0;
+      const uint32_t end = stage_first[s] + stage_count[s];
+      for (uint32_t w = stage_first[s]; w < end; w++) {
+         const uint32_t f = weak_feature[w];
+         // an unused third rectangle has weight 0 and adds exactly nothing
+         const float value = weight[f] * static_cast<float>(rectSum(sum, &b.rectOffsets[f * 4])) +
+                             weight[features + f] * static_cast<float>(rectSum(sum, &b.rectOffsets[(features + f) * 4])) +
+                             weight[2 * features + f] * static_cast<float>(rectSum(sum, &b.rectOffsets[(2 * features + f) * 4]));
+         stage_sum += (value * variance_norm < weak_threshold[w]) ? weak_left[w] : weak_right[w];
+      }
+      return stage_sum;
+   }
+
+   double lbpStageSum(const Scratch &b, const int *sum, uint32_t s) const {
+      const uint32_t *stage_first = array<uint32_t>(STAGE_FIRST_WEAK);
+      const uint32_t *stage_count = array<uint32_t>(STAGE_WEAK_COUNT);
+      const uint32_t *weak_feature = array<uint32_t>(WEAK_FEATURE);
+      const float *weak_left = array<float>(WEAK_LEFT);
+      const float *weak_right = array<float>(WEAK_RIGHT);
+      const int32_t *subsets = array<int32_t>(WEAK_SUBSET);
+      double stage_sum = 0;
+      const uint32_t end = stage_first[s] + stage_count[s];
+      for (uint32_t w = stage_first[s]; w < end; w++) {
+         const int *p = &b.rectOffsets[weak_feature[w] * 16];
+         const int center = sum[p[5]] - sum[p[6]] - sum[p[9]] + sum[p[10]];
+         // Neighbour cells clockwise from the top left, same bit order as OpenCV.
+         const int code = ((sum[p[0]] - sum[p[1]] - sum[p[4]] + sum[p[5]]) >= center ? 128 : 0) |
+                          ((sum[p[1]] - sum[p[2]] - sum[p[5]] + sum[p[6]]) >= center ? 64 : 0) |
+                          ((sum[p[2]] - sum[p[3]] - sum[p[6]] + sum[p[7]]) >= center ? 32 : 0) |
+                          ((sum[p[6]] - sum[p[7]] - sum[p[10]] + sum[p[11]]) >= center ? 16 : 0) |
+                          ((sum[p[10]] - sum[p[11]] - sum[p[14]] + sum[p[15]]) >= center ? 8 : 0) |
+                          ((sum[p[9]] - sum[p[10]] - sum[p[13]] + sum[p[14]]) >= center ? 4 : 0) |
+                          ((sum[p[8]] - sum[p[9]] - sum[p[12]] + sum[p[13]]) >= center ? 2 : 0) |
+                          ((sum[p[4]] - sum[p[5]] - sum[p[8]] + sum[p[9]]) >= center ? 1 : 0);
+         const int32_t *subset = &subsets[w * LBP_SUBSET_SIZE];
+         stage_sum += (subset[code >> 5] & (1 << (code & 31))) ? weak_left[w] : weak_right[w];
+      }
+      return stage_sum;
+   }
+
+   // Returns 1 if the window passed all stages, -stage if it was rejected there, and -1
+   // for windows without enough contrast (HAAR); same convention as OpenCV's runAt.
+   int evaluate(const Scratch &b, const int *sum, const int *sqsum) const {
+      const bool haar = (m_header->feature_type == CASCADE_HAAR);
+      const float *stage_threshold = array<float>(STAGE_THRESHOLD);
+      float variance_norm = 1.0f;
+      if (haar && !varianceNorm(b, sum, sqsum, &variance_norm)) { return -1; }
+      for (uint32_t s = 0; s < m_header->stage_count; s++) {
+         const double stage_sum = haar ? haarStageSum(b, sum, variance_norm, s) : lbpStageSum(b, sum, s);
+         if (stage_sum < stage_threshold[s]) { return -static_cast<int>(s); }
+      }
+      return 1;
+   }
+
+   // Evaluates the four windows at sum, sum + step, sum + 2 step and sum + 3 step of one row
+   // in the lanes of a vector, with the results of evaluate(). Lanes stop contributing once
+   // rejected and the row stops when all four are. The stage sums are accumulated in float;
+   // lanes that end up within STAGE_SUM_MARGIN of a stage threshold are summed again in
+   // double like OpenCV does, so the decisions are the same as the scalar ones.
+   // skip carries OpenCV's rule that the window after a first stage rejection is not
+   // evaluated at all; skipped lanes report -1.
+   void evaluate4(const Scratch &b, const int *sum, const int *sqsum, int step, bool *skip, int *results) const {
+      const bool haar = (m_header->feature_type == CASCADE_HAAR);
+      const uint32_t *stage_first = array<uint32_t>(STAGE_FIRST_WEAK);
+      const uint32_t *stage_count = array<uint32_t>(STAGE_WEAK_COUNT);
+      const float *stage_threshold = array<float>(STAGE_THRESHOLD);
+      const uint32_t *weak_feature = array<uint32_t>(WEAK_FEATURE);
+      const float *weak_threshold = haar ? array<float>(WEAK_THRESHOLD) : nullptr;
+      const float *weak_left = array<float>(WEAK_LEFT);
+      const float *weak_right = array<float>(WEAK_RIGHT);
+      const float *weight = haar ? array<float>(RECT_WEIGHT) : nullptr;
+      const int32_t *subsets = haar ? nullptr : array<int32_t>(WEAK_SUBSET);
+      const uint32_t features = m_header->feature_count;
+
+      float norms[4] = {1.0f, 1.0f, 1.0f, 1.0f};
+      int alive = 0;
+      for (int k = 0; k < 4; k++) {
+         results[k] = 1;
+         if (haar && !varianceNorm(b, sum + k * step, sqsum + k * step, &norms[k])) {
+            results[k] = -1;
+         } else {
+            alive |= 1 << k;
+         }
+      }
+      if (alive == 0) {
+         // all four without contrast: none of them sets the skip for its neighbour
+         *skip = false;
+         return;
+      }
+      const v_float4 variance_norm = v_load(norms);
+      const v_float4 margin = v_setall(STAGE_SUM_MARGIN);
+
+      for (uint32_t s = 0; s < m_header->stage_count && alive != 0; s++) {
+         v_float4 stage_sum = v_setall(0.0f);
+         const uint32_t end = stage_first[s] + stage_count[s];
+         for (uint32_t w = stage_first[s]; w < end; w++) {
+            const uint32_t f = weak_feature[w];
+            if (haar) {
+               const v_float4 value = v_mul(
+                  v_add(v_add(v_mul(v_setall(weight[f]), v_cvt_f32(v_rect_sum(sum, &b.rectOffsets[f * 4], step))),
+                              v_mul(v_setall(weight[features + f]), v_cvt_f32(v_rect_sum(sum, &b.rectOffsets[(features + f) * 4], step)))),
+                        v_mul(v_setall(weight[2 * features + f]), v_cvt_f32(v_rect_sum(sum, &b.rectOffsets[(2 * features + f) * 4], step)))),
+                  variance_norm);
+               stage_sum = v_add(stage_sum, v_select(v_lt(value, v_setall(weak_threshold[w])), v_setall(weak_left[w]), v_setall(weak_right[w])));
+            } else {
+               const int *p = &b.rectOffsets[f * 16];
+               v_int4 corner[16];
+               for (int i = 0; i < 16; i++) { corner[i] = v_load_strided(sum + p[i], step); }
+               const v_int4 center = v_add(v_sub(v_sub(corner[5], corner[6]), corner[9]), corner[10]);
+               v_int4 code = v_ge_bit(v_add(v_sub(v_sub(corner[0], corner[1]), corner[4]), corner[5]), center, 128);
+               code = v_or(code, v_ge_bit(v_add(v_sub(v_sub(corner[1], corner[2]), corner[5]), corner[6]), center, 64));
+               code = v_or(code, v_ge_bit(v_add(v_sub(v_sub(corner[2], corner[3]), corner[6]), corner[7]), center, 32));
+               code = v_or(code, v_ge_bit(v_add(v_sub(v_sub(corner[6], corner[7]), corner[10]), corner[11]), center, 16));
+               code = v_or(code, v_ge_bit(v_add(v_sub(v_sub(corner[10], corner[11]), corner[14]), corner[15]), center, 8));
+               code = v_or(code, v_ge_bit(v_add(v_sub(v_sub(corner[9], corner[10]), corner[13]), corner[14]), center, 4));
+               code = v_or(code, v_ge_bit(v_add(v_sub(v_sub(corner[8], corner[9]), corner[12]), corner[13]), center, 2));
+               code = v_or(code, v_ge_bit(v_add(v_sub(v_sub(corner[4], corner[5]), corner[8]), corner[9]), center, 1));
+               // the 256 bit subset lookup has no vector form, the leaves go back into a vector
+               int32_t codes[4];
+               v_store(codes, code);
+               const int32_t *subset = &subsets[w * LBP_SUBSET_SIZE];
+               float leaves[4];
+               for (int k = 0; k < 4; k++) {
+                  leaves[k] = (subset[codes[k] >> 5] & (1 << (codes[k] & 31))) ? weak_left[w] : weak_right[w];
+               }
+               stage_sum = v_add(stage_sum, v_load(leaves));
+            }
+         }
+
+         const v_float4 threshold = v_setall(stage_threshold[s]);
+         int rejected = v_signmask(v_lt(stage_sum, threshold)) & alive;
+         const int close = v_signmask(v_lt(v_abs(v_sub(stage_sum, threshold)), margin)) & alive;
+         for (int k = 0; k < 4; k++) {
+            if ((close & (1 << k)) == 0) { continue; }
+            const double exact = haar ? haarStageSum(b, sum + k * step, norms[k], s) : lbpStageSum(b, sum + k * step, s);
+            rejected = (exact < stage_threshold[s]) ? (rejected | (1 << k)) : (rejected & ~(1 << k));
+         }
+         for (int k = 0; k < 4; k++) {
+            if (rejected & (1 << k)) { results[k] = -static_cast<int>(s); }
+         }
+         alive &= ~rejected;
+
+         if (s == 0) {
+            // The first stage decides which windows OpenCV would not have evaluated.
+            for (int k = 0; k < 4; k++) {
+               if (*skip) {
+                  *skip = false;
+                  results[k] = -1;
+                  alive &= ~(1 << k);
+               } else {
+                  *skip = (results[k] == 0);
+               }
+            }
+         }
+      }
+   }
+
+   void detectAtScale(Scratch *scratch, const cv::Mat &scaled, float scale, const cv::Size &window_size, std::vector<cv::Rect> *candidates) const {
+      Scratch &b = *scratch;
+      const bool haar = (m_header->feature_type == CASCADE_HAAR);
+      if (m_useSimd) {
+         integralImages(scaled, b.sum, haar ? &b.sqsum : nullptr);
+      } else if (haar) {
+         cv::integral(scaled, b.sum, b.sqsum, CV_32S, CV_32S);
+      } else {
+         cv::integral(scaled, b.sum, CV_32S);
+      }
+      prepareOffsets(&b);
+
+      const cv::Size window = getOriginalWindowSize();
+      // the windows at x = 0 to scaled.cols - window.width, as OpenCV's working size
+      const int width = scaled.cols - window.width + 1;
+      const int height = scaled.rows - window.height + 1;
+      const int step = (scale > 2.f) ? 1 : 2;
+      for (int y = 0; y < height; y += step) {
+         const int *sum_row = b.sum.ptr<int>(y);
+         const int *sqsum_row = haar ? b.sqsum.ptr<int>(y) : nullptr;
+         // rejected by the first stage: skip the neighbouring window as well
+         bool skip = false;
+         int x = 0;
+         if (m_useSimd) {
+            for (; x + 3 * step < width; x += 4 * step) {
+               int results[4];
+               evaluate4(b, sum_row + x, haar ? sqsum_row + x : nullptr, step, &skip, results);
+               for (int k = 0; k < 4; k++) {
+                  if (results[k] > 0) {
+                     candidates->push_back(cv::Rect(cvRound((x + k * step) * scale), cvRound(y * scale), window_size.width, window_size.height));
+                  }
+               }
+            }
+         }
+         for (; x < width; x += step) {
+            if (skip) {
+               skip = false;
+               continue;
+            }
+            const int result = evaluate(b, sum_row + x, haar ? sqsum_row + x : nullptr);
+            if (result > 0) {
+               candidates->push_back(cv::Rect(cvRound(x * scale), cvRound(y * scale), window_size.width, window_size.height));
+            }
+            skip = (result == 0);
+         }
+      }
+   }
+
+   void *m_map;
+   size_t m_size;
+   const CascadeHeader *m_header;
+   cv::CascadeClassifier m_opencv; // an .xml loaded instead
+   bool m_useSimd;
+   ThreadPool *m_pool;
+   std::vector<Scratch> m_scratch; // one per scale of the last detectMultiScale
+};
+
+#endif
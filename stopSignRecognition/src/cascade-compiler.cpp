@@ -0,0 +1,221 @@
+/*
+ * Copyright (C) 2019  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Converts an opencv_traincascade XML classifier into the binary layout of
+// binary-cascade.hpp. Runs at build time; see CMakeLists.txt.
+// This file is shared between the services; keep all copies identical.
+
+#include "cluon-complete.hpp"
+#include "binary-cascade.hpp"
+
+#include "opencv2/core.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace cv;
+
+// OpenCV lowers every stage threshold by this when it loads a cascade.
+const float THRESHOLD_EPS = 1e-5f;
+
+struct CascadeArrays {
+   vector<uint32_t> stage_first_weak{};
+   vector<uint32_t> stage_weak_count{};
+   vector<float> stage_threshold{};
+   vector<uint32_t> weak_feature{};
+   vector<float> weak_threshold{};
+   vector<float> weak_left{};
+   vector<float> weak_right{};
+   vector<int32_t> weak_subset{};
+   vector<int32_t> rect_x{};
+   vector<int32_t> rect_y{};
+   vector<int32_t> rect_width{};
+   vector<int32_t> rect_height{};
+   vector<float> rect_weight{};
+};
+
+bool readCascade(const string &path, CascadeHeader *header, CascadeArrays *arrays);
+bool writeCascade(const string &path, CascadeHeader *header, const CascadeArrays &arrays);
+
+int32_t main(int32_t argc, char **argv) {
+   int32_t retCode{1};
+   auto commandlineArguments = cluon::getCommandlineArguments(argc, argv);
+   if ((0 == commandlineArguments.count("xml")) || (0 == commandlineArguments.count("out"))) {
+      std::cerr << argv[0] << " converts an OpenCV cascade classifier to the memory-mappable format of the detection services." << std::endl;
+      std::cerr << "Usage:   " << argv[0] << " --xml=<classifier.xml> --out=<classifier.cascade>" << std::endl;
+      std::cerr << "Example: " << argv[0] << " --xml=car-28-stages.xml --out=car-28-stages.cascade" << std::endl;
+      return retCode;
+   }
+
+   CascadeHeader header;
+   memset(&header, 0, sizeof(header));
+   CascadeArrays arrays;
+   if (!readCascade(commandlineArguments["xml"], &header, &arrays)) {
+      return retCode;
+   }
+   if (!writeCascade(commandlineArguments["out"], &header, arrays)) {
+      std::cerr << argv[0] << ": could not write " << commandlineArguments["out"] << std::endl;
+      return retCode;
+   }
+   std::cout << commandlineArguments["out"] << ": " << (header.feature_type == CASCADE_HAAR ? "HAAR" : "LBP") << " "
+             << header.window_width << "x" << header.window_height << ", " << header.stage_count << " stages, "
+             << header.weak_count << " stumps, " << header.feature_count << " features, " << header.file_size << " bytes" << std::endl;
+   retCode = 0;
+   return retCode;
+}
+
+bool readCascade(const string &path, CascadeHeader *header, CascadeArrays *arrays) {
+   FileStorage storage(path, FileStorage::READ);
+   if (!storage.isOpened()) {
+      std::cerr << path << ": cannot be opened" << std::endl;
+      return false;
+   }
+   // Only the format written by opencv_traincascade is supported, not the old haartraining one.
+   FileNode cascade = storage["cascade"];
+   if (cascade.empty() || (String)cascade["stageType"] != "BOOST") {
+      std::cerr << path << ": not a BOOST cascade in opencv_traincascade format" << std::endl;
+      return false;
+   }
+   const String feature_type = (String)cascade["featureType"];
+   bool haar = false;
+   if (feature_type == "HAAR") {
+      haar = true;
+   } else if (feature_type != "LBP") {
+      std::cerr << path << ": unsupported feature type " << feature_type << std::endl;
+      return false;
+   }
+   header->magic = CASCADE_MAGIC;
+   header->version = CASCADE_VERSION;
+   header->feature_type = haar ? CASCADE_HAAR : CASCADE_LBP;
+   header->window_width = (int)cascade["width"];
+   header->window_height = (int)cascade["height"];
+   header->rects_per_feature = haar ? HAAR_RECTS_PER_FEATURE : 1;
+
+   FileNode stages = cascade["stages"];
+   for (FileNodeIterator stage = stages.begin(); stage != stages.end(); ++stage) {
+      FileNode weak_classifiers = (*stage)["weakClassifiers"];
+      arrays->stage_first_weak.push_back(static_cast<uint32_t>(arrays->weak_feature.size()));
+      arrays->stage_weak_count.push_back(static_cast<uint32_t>(weak_classifiers.size()));
+      arrays->stage_threshold.push_back((float)(*stage)["stageThreshold"] - THRESHOLD_EPS);
+      for (FileNodeIterator weak = weak_classifiers.begin(); weak != weak_classifiers.end(); ++weak) {
+         FileNode nodes = (*weak)["internalNodes"];
+         FileNode leaves = (*weak)["leafValues"];
+         // A stump is "0 -1 feature threshold" (HAAR) or "0 -1 feature subset[8]" (LBP) with two leaves.
+         const size_t node_size = haar ? 4 : 3 + LBP_SUBSET_SIZE;
+         if (nodes.size() != node_size || leaves.size() != 2) {
+            std::cerr << path << ": only stumps (maxDepth 1) are supported" << std::endl;
+            return false;
+         }
+         arrays->weak_feature.push_back(static_cast<uint32_t>((int)nodes[2]));
+         if (haar) {
+            arrays->weak_threshold.push_back((float)nodes[3]);
+         } else {
+            for (int i = 0; i < LBP_SUBSET_SIZE; i++) {
+               arrays->weak_subset.push_back((int)nodes[3 + i]);
+            }
+         }
+         arrays->weak_left.push_back((float)leaves[0]);
+         arrays->weak_right.push_back((float)leaves[1]);
+      }
+   }
+
+   // Rectangles are stored rect-major so that rect r of feature f is at r * feature_count + f.
+   FileNode features = cascade["features"];
+   const size_t feature_count = features.size();
+   const size_t rect_count = feature_count * header->rects_per_feature;
+   arrays->rect_x.assign(rect_count, 0);
+   arrays->rect_y.assign(rect_count, 0);
+   arrays->rect_width.assign(rect_count, 0);
+   arrays->rect_height.assign(rect_count, 0);
+   if (haar) { arrays->rect_weight.assign(rect_count, 0.0f); }
+   size_t f = 0;
+   for (FileNodeIterator feature = features.begin(); feature != features.end(); ++feature, f++) {
+      if (haar) {
+         if ((int)(*feature)["tilted"] != 0) {
+            std::cerr << path << ": tilted Haar features are not supported" << std::endl;
+            return false;
+         }
+         FileNode rects = (*feature)["rects"];
+         if (rects.size() > static_cast<size_t>(HAAR_RECTS_PER_FEATURE)) {
+            std::cerr << path << ": feature " << f << " has more than " << HAAR_RECTS_PER_FEATURE << " rectangles" << std::endl;
+            return false;
+         }
+         size_t r = 0;
+         for (FileNodeIterator rect = rects.begin(); rect != rects.end(); ++rect, r++) {
+            const size_t i = r * feature_count + f;
+            arrays->rect_x[i] = (int)(*rect)[0];
+            arrays->rect_y[i] = (int)(*rect)[1];
+            arrays->rect_width[i] = (int)(*rect)[2];
+            arrays->rect_height[i] = (int)(*rect)[3];
+            arrays->rect_weight[i] = (float)(*rect)[4];
+         }
+      } else {
+         FileNode rect = (*feature)["rect"];
+         arrays->rect_x[f] = (int)rect[0];
+         arrays->rect_y[f] = (int)rect[1];
+         arrays->rect_width[f] = (int)rect[2];
+         arrays->rect_height[f] = (int)rect[3];
+      }
+   }
+
+   header->stage_count = static_cast<uint32_t>(arrays->stage_threshold.size());
+   header->weak_count = static_cast<uint32_t>(arrays->weak_feature.size());
+   header->feature_count = static_cast<uint32_t>(feature_count);
+   for (uint32_t feature_index : arrays->weak_feature) {
+      if (feature_index >= header->feature_count) {
+         std::cerr << path << ": stump refers to missing feature " << feature_index << std::endl;
+         return false;
+      }
+   }
+   return header->stage_count > 0;
+}
+
+bool writeCascade(const string &path, CascadeHeader *header, const CascadeArrays &arrays) {
+   const void *data[NUMBER_OF_CASCADE_ARRAYS] = {
+      arrays.stage_first_weak.data(), arrays.stage_weak_count.data(), arrays.stage_threshold.data(),
+      arrays.weak_feature.data(), arrays.weak_threshold.data(), arrays.weak_left.data(), arrays.weak_right.data(),
+      arrays.weak_subset.data(), arrays.rect_x.data(), arrays.rect_y.data(), arrays.rect_width.data(),
+      arrays.rect_height.data(), arrays.rect_weight.data()};
+   const size_t count[NUMBER_OF_CASCADE_ARRAYS] = {
+      arrays.stage_first_weak.size(), arrays.stage_weak_count.size(), arrays.stage_threshold.size(),
+      arrays.weak_feature.size(), arrays.weak_threshold.size(), arrays.weak_left.size(), arrays.weak_right.size(),
+      arrays.weak_subset.size(), arrays.rect_x.size(), arrays.rect_y.size(), arrays.rect_width.size(),
+      arrays.rect_height.size(), arrays.rect_weight.size()};
+
+   // Lay the arrays out one after the other, each on an aligned offset.
+   size_t offset = (sizeof(CascadeHeader) + CASCADE_ALIGNMENT - 1) / CASCADE_ALIGNMENT * CASCADE_ALIGNMENT;
+   for (int i = 0; i < NUMBER_OF_CASCADE_ARRAYS; i++) {
+      header->offset[i] = static_cast<uint32_t>(offset);
+      header->count[i] = static_cast<uint32_t>(count[i]);
+      offset += (count[i] * 4 + CASCADE_ALIGNMENT - 1) / CASCADE_ALIGNMENT * CASCADE_ALIGNMENT;
+   }
+   header->file_size = static_cast<uint32_t>(offset);
+
+   vector<char> file(offset, 0);
+   memcpy(file.data(), header, sizeof(CascadeHeader));
+   for (int i = 0; i < NUMBER_OF_CASCADE_ARRAYS; i++) {
+      if (count[i] > 0) { memcpy(file.data() + header->offset[i], data[i], count[i] * 4); }
+   }
+   ofstream out(path, ios::binary | ios::trunc);
+   out.write(file.data(), static_cast<streamsize>(file.size()));
+   return out.good();
+}
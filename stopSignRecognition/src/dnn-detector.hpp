@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2019  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Alternative to the cascades: a small single-shot detector (SSD) run on the CPU through
+// cv::dnn, finding cars, stop signs and yield signs in one forward pass. The frame is cut
+// into square tiles that are batched into one blob, so a wide frame is not squashed into
+// the square network input and small signs keep their resolution.
+// This file is shared between the services; keep all copies identical.
+
+#ifndef DNN_DETECTOR_HPP
+#define DNN_DETECTOR_HPP
+
+#include "opencv2/core.hpp"
+#include "opencv2/dnn.hpp"
+#include "opencv2/imgproc.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <string>
+#include <vector>
+
+enum DetectionClass {
+   DETECT_CAR = 0,
+   DETECT_STOP_SIGN,
+   DETECT_YIELD_SIGN,
+   NUMBER_OF_DETECTION_CLASSES
+};
+
+struct Detection {
+   DetectionClass label;
+   float confidence;
+   cv::Rect box; // pixels of the frame given to detect()
+};
+
+// Boxes of one class found by the same object in overlapping tiles are merged above this IoU.
+const float DNN_NMS_THRESHOLD = 0.45f;
+
+// Maps a label file entry ("car", "stop sign", "yield_sign", ...) to the classes the
+// services use; -1 for every other class of the network.
+inline int detectionClassFromName(std::string name) {
+   for (char &c : name) {
+      c = (c == ' ' || c == '_') ? '-' : static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+   }
+   if (name == "car") { return DETECT_CAR; }
+   if (name == "stop-sign") { return DETECT_STOP_SIGN; }
+   if (name == "yield-sign" || name == "yield") { return DETECT_YIELD_SIGN; }
+   return -1;
+}
+
+// Square tiles of frame height spread evenly over the frame width, overlapping where the
+// width is not a multiple of the height; the whole frame if it is taller than wide.
+inline std::vector<cv::Rect> squareTiles(const cv::Size &frame_size) {
+   std::vector<cv::Rect> tiles;
+   const int side = std::min(frame_size.width, frame_size.height);
+   const int count = (frame_size.width + side - 1) / side;
+   if (side == 0 || count == 1 || frame_size.height > frame_size.width) {
+      tiles.push_back(cv::Rect(0, 0, frame_size.width, frame_size.height));
+      return tiles;
+   }
+   for (int i = 0; i < count; i++) {
+      const int x = cvRound(i * (frame_size.width - side) / static_cast<double>(count - 1));
+      tiles.push_back(cv::Rect(x, 0, side, side));
+   }
+   return tiles;
+}
+
+// SSD with a DetectionOutput layer, i.e. an output of [image, class, confidence, x1, y1,
+// x2, y2] rows in coordinates relative to each input image, as trained with the Caffe or
+// TensorFlow object detection tools. The input normalisation follows the framework:
+// Caffe MobileNet-SSD takes (BGR - 127.5) / 127.5, TensorFlow takes RGB 0 - 255.
+class DnnDetector {
+  private:
+   DnnDetector(const DnnDetector &) = delete;
+   DnnDetector &operator=(const DnnDetector &) = delete;
+
+  public:
+   DnnDetector()
+      : m_net{}, m_classes{}, m_inputSize{300, 300}, m_scale{1.0}, m_mean{}, m_swapRB{false}, m_confidence{0.5f}, m_tiles{}, m_bgr{} {}
+
+   // model: .caffemodel or frozen .pb; config: .prototxt or .pbtxt; labels: one class name
+   // per line, line n naming the class id n the network reports (line 0 usually background).
+   bool load(const std::string &model, const std::string &config, const std::string &labels) {
+      std::ifstream labels_file(labels);
+      if (!labels_file.good()) { return false; }
+      m_classes.clear();
+      bool any = false;
+      for (std::string line; std::getline(labels_file, line);) {
+         line.erase(line.find_last_not_of(" \t\r") + 1);
+         m_classes.push_back(detectionClassFromName(line));
+         any = any || m_classes.back() >= 0;
+      }
+      if (!any) { return false; }
+
+      const bool caffe = model.size() >= 11 && model.compare(model.size() - 11, 11, ".caffemodel") == 0;
+      m_scale = caffe ? 1.0 / 127.5 : 1.0;
+      m_mean = caffe ? cv::Scalar(127.5, 127.5, 127.5) : cv::Scalar();
+      m_swapRB = !caffe;
+      try {
+         m_net = cv::dnn::readNet(model, config);
+      } catch (const cv::Exception &) {
+         return false;
+      }
+      if (m_net.empty()) { return false; }
+      m_net.setPreferableBackend(cv::dnn::DNN_BACKEND_DEFAULT);
+      m_net.setPreferableTarget(cv::dnn::DNN_TARGET_CPU);
+      return true;
+   }
+
+   bool empty() const { return m_net.empty(); }
+
+   void setInputSize(const cv::Size &input_size) { m_inputSize = input_size; }
+   void setConfidence(float confidence) { m_confidence = confidence; }
+
+   // Detects in the square tiles of a BGR or BGRA frame with one forward pass.
+   void detect(const cv::Mat &frame, std::vector<Detection> &detections) {
+      detect(frame, squareTiles(frame.size()), detections);
+   }
+
+   // Detects in the given regions of a BGR or BGRA frame, batched into one forward pass.
+   // Boxes are in frame pixels; duplicates from overlapping regions are suppressed.
+   void detect(const cv::Mat &frame, const std::vector<cv::Rect> &rois, std::vector<Detection> &detections) {
+      detections.clear();
+      if (rois.empty()) { return; }
+      const cv::Mat *bgr = &frame;
+      if (frame.channels() == 4) {
+         cv::cvtColor(frame, m_bgr, cv::COLOR_BGRA2BGR);
+         bgr = &m_bgr;
+      }
+      m_tiles.clear();
+      for (const cv::Rect &roi : rois) {
+         m_tiles.push_back((*bgr)(roi & cv::Rect(0, 0, frame.cols, frame.rows)));
+      }
+      cv::Mat blob = cv::dnn::blobFromImages(m_tiles, m_scale, m_inputSize, m_mean, m_swapRB, false);
+      m_net.setInput(blob);
+      cv::Mat output = m_net.forward();
+
+      std::vector<cv::Rect> boxes[NUMBER_OF_DETECTION_CLASSES];
+      std::vector<float> scores[NUMBER_OF_DETECTION_CLASSES];
+      const cv::Mat rows(output.size[2], output.size[3], CV_32F, output.ptr<float>());
+      for (int i = 0; i < rows.rows; i++) {
+         const float *row = rows.ptr<float>(i);
+         const int image = static_cast<int>(row[0]);
+         const int id = static_cast<int>(row[1]);
+         if (row[2] < m_confidence || image < 0 || image >= static_cast<int>(m_tiles.size()) ||
+             id < 0 || id >= static_cast<int>(m_classes.size()) || m_classes[static_cast<size_t>(id)] < 0) {
+            continue;
+         }
+         const cv::Rect tile = rois[static_cast<size_t>(image)] & cv::Rect(0, 0, frame.cols, frame.rows);
+         const cv::Point top_left(tile.x + cvRound(row[3] * tile.width), tile.y + cvRound(row[4] * tile.height));
+         const cv::Point bottom_right(tile.x + cvRound(row[5] * tile.width), tile.y + cvRound(row[6] * tile.height));
+         const cv::Rect box = cv::Rect(top_left, bottom_right) & tile;
+         if (box.area() > 0) {
+            boxes[m_classes[static_cast<size_t>(id)]].push_back(box);
+            scores[m_classes[static_cast<size_t>(id)]].push_back(row[2]);
+         }
+      }
+      for (int c = 0; c < NUMBER_OF_DETECTION_CLASSES; c++) {
+         std::vector<int> keep;
+         cv::dnn::NMSBoxes(boxes[c], scores[c], m_confidence, DNN_NMS_THRESHOLD, keep);
+         for (int k : keep) {
+            detections.push_back(Detection{static_cast<DetectionClass>(c), scores[c][static_cast<size_t>(k)], boxes[c][static_cast<size_t>(k)]});
+         }
+      }
+   }
+
+  private:
+   cv::dnn::Net m_net;
+   std::vector<int> m_classes; // network class id -> DetectionClass or -1
+   cv::Size m_inputSize;
+   double m_scale;
+   cv::Scalar m_mean;
+   bool m_swapRB;
+   float m_confidence;
+   std::vector<cv::Mat> m_tiles;
+   cv::Mat m_bgr;
+};
+
+// Boxes of one class, for code written against the cascades.
+inline std::vector<cv::Rect> detectionsOf(const std::vector<Detection> &detections, DetectionClass label) {
+   std::vector<cv::Rect> boxes;
+   for (const Detection &detection : detections) {
+      if (detection.label == label) { boxes.push_back(detection.box); }
+   }
+   return boxes;
+}
+
+#endif
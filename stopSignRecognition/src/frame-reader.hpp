@@ -0,0 +1,551 @@
+/*
+ * Copyright (C) 2019  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Camera frames for the services. By default they come from the shared memory area of the
+// video decoder. A service on its own copies every frame out of the area while holding its
+// lock, as before. In the service host (SERVICE_HOST defined) one thread copies each frame
+// once and all services get the same copy, so the frames returned must be treated as
+// read-only there.
+// The sample time of a frame is the one the decoder put on the area; decoders that leave it
+// unchanged get the time the frame was read instead.
+// With --source the same service code runs on other frames instead (openFrameSource):
+// a camera (camera:<n>), a frame archive (frame-archive.hpp), a .rec with ImageReadings,
+// a video file or a directory of images. Files and directories are read as fast as the service takes the frames, and
+// their frames carry the time they were taken, so --virtual-clock follows them. Include it
+// after the message set.
+// This file is shared between the services; keep all copies identical.
+
+#ifndef FRAME_READER_HPP
+#define FRAME_READER_HPP
+
+#include "cluon-complete.hpp"
+#include "frame-archive.hpp"
+
+#include "opencv2/core.hpp"
+#include "opencv2/imgcodecs.hpp"
+#include "opencv2/imgproc.hpp"
+#include "opencv2/videoio.hpp"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+const double VIDEO_DEFAULT_FPS = 30; // for videos that do not tell, and between the images of a directory
+
+// The sample time of the frame in the locked area; the time now if the decoder did not
+// stamp it, i.e. the stamp is still the one seen with the previous frame. Returns whether
+// the decoder stamped it.
+inline bool frameTimeStamp(cluon::SharedMemory *sharedMemory, cluon::data::TimeStamp *lastStamp, cluon::data::TimeStamp *timeStamp) {
+   std::pair<bool, cluon::data::TimeStamp> stamp = sharedMemory->getTimeStamp();
+   const bool stamped = stamp.first && cluon::time::toMicroseconds(stamp.second) != cluon::time::toMicroseconds(*lastStamp);
+   *lastStamp = stamp.second;
+   *timeStamp = stamped ? stamp.second : cluon::time::now();
+   return stamped;
+}
+
+// Where the frames of a FrameReader come from.
+class FrameSource {
+  private:
+   FrameSource(const FrameSource &) = delete;
+   FrameSource &operator=(const FrameSource &) = delete;
+
+  public:
+   FrameSource() = default;
+   virtual ~FrameSource() = default;
+
+   virtual bool valid() const = 0;
+   virtual std::string name() const = 0;
+   virtual uint32_t size() const = 0;
+
+   // Blocks until the next frame arrives; false once a file or directory has no more.
+   virtual bool wait() = 0;
+
+   // The latest frame, or a region of it, as BGRA of the size the reader was opened with.
+   virtual cv::Mat latest(const cv::Rect &roi) = 0;
+
+   // Sample time of the frame returned last, and whether it is the time it was taken.
+   virtual const cluon::data::TimeStamp &timeStamp() const = 0;
+   virtual bool timeStamped() const = 0;
+};
+
+#ifdef SERVICE_HOST
+// Copies the frames of one shared memory area for every reader in the process.
+class FrameHub {
+  private:
+   FrameHub(const FrameHub &) = delete;
+   FrameHub &operator=(const FrameHub &) = delete;
+
+   FrameHub(const std::string &name, uint32_t width, uint32_t height)
+      : m_sharedMemory{new cluon::SharedMemory{name}}, m_width{width}, m_height{height}, m_mutex{}, m_newFrame{}, m_frame{}, m_timeStamp{}, m_stamped{false}, m_lastStamp{}, m_count{0} {
+      if (m_sharedMemory->valid()) {
+         // runs as long as the process; cluon::SharedMemory::wait cannot be interrupted
+         std::thread([this]() { copyFrames(); }).detach();
+      }
+   }
+
+  public:
+   // The hub of a shared memory area, started by its first reader.
+   static FrameHub &forName(const std::string &name, uint32_t width, uint32_t height) {
+      static std::mutex mutex;
+      static std::map<std::string, FrameHub *> hubs;
+      std::lock_guard<std::mutex> lock(mutex);
+      FrameHub *&hub = hubs[name];
+      if (hub == nullptr) { hub = new FrameHub(name, width, height); }
+      return *hub;
+   }
+
+   bool valid() const { return m_sharedMemory->valid(); }
+   const cluon::SharedMemory &sharedMemory() const { return *m_sharedMemory; }
+
+   // Blocks until there is a frame after the given one; returns its number.
+   uint64_t wait(uint64_t seen) {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_newFrame.wait(lock, [this, seen]() { return m_count > seen; });
+      return m_count;
+   }
+
+   cv::Mat frame(cluon::data::TimeStamp *timeStamp, bool *stamped) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      *timeStamp = m_timeStamp;
+      *stamped = m_stamped;
+      return m_frame;
+   }
+
+  private:
+   void copyFrames() {
+      while (true) {
+         m_sharedMemory->wait();
+         // a new buffer every frame, readers may still be working on the last one
+         cv::Mat frame;
+         cluon::data::TimeStamp timeStamp;
+         bool stamped;
+         m_sharedMemory->lock();
+         {
+            cv::Mat wrapped(static_cast<int>(m_height), static_cast<int>(m_width), CV_8UC4, m_sharedMemory->data());
+            frame = wrapped.clone();
+            stamped = frameTimeStamp(m_sharedMemory.get(), &m_lastStamp, &timeStamp);
+         }
+         m_sharedMemory->unlock();
+         {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_frame = frame;
+            m_timeStamp = timeStamp;
+            m_stamped = stamped;
+            m_count++;
+         }
+         m_newFrame.notify_all();
+      }
+   }
+
+   std::unique_ptr<cluon::SharedMemory> m_sharedMemory;
+   const uint32_t m_width;
+   const uint32_t m_height;
+   std::mutex m_mutex;
+   std::condition_variable m_newFrame;
+   cv::Mat m_frame;
+   cluon::data::TimeStamp m_timeStamp;
+   bool m_stamped;
+   cluon::data::TimeStamp m_lastStamp; // as found on the area, only used by copyFrames
+   uint64_t m_count;
+};
+
+class SharedMemoryFrames : public FrameSource {
+  public:
+   SharedMemoryFrames(const std::string &name, uint32_t width, uint32_t height)
+      : m_hub(FrameHub::forName(name, width, height)), m_seen{0}, m_timeStamp{}, m_stamped{false} {}
+
+   bool valid() const override { return m_hub.valid(); }
+   std::string name() const override { return m_hub.sharedMemory().name(); }
+   uint32_t size() const override { return m_hub.sharedMemory().size(); }
+
+   bool wait() override {
+      m_seen = m_hub.wait(m_seen);
+      return true;
+   }
+
+   // Shared with the other services, do not write to it.
+   cv::Mat latest(const cv::Rect &roi) override { return m_hub.frame(&m_timeStamp, &m_stamped)(roi); }
+
+   const cluon::data::TimeStamp &timeStamp() const override { return m_timeStamp; }
+   bool timeStamped() const override { return m_stamped; }
+
+  private:
+   FrameHub &m_hub;
+   uint64_t m_seen;
+   cluon::data::TimeStamp m_timeStamp;
+   bool m_stamped;
+};
+#else
+class SharedMemoryFrames : public FrameSource {
+  public:
+   SharedMemoryFrames(const std::string &name, uint32_t width, uint32_t height)
+      : m_sharedMemory{new cluon::SharedMemory{name}}, m_width{width}, m_height{height}, m_timeStamp{}, m_stamped{false}, m_lastStamp{} {}
+
+   bool valid() const override { return m_sharedMemory->valid(); }
+   std::string name() const override { return m_sharedMemory->name(); }
+   uint32_t size() const override { return m_sharedMemory->size(); }
+
+   bool wait() override {
+      m_sharedMemory->wait();
+      return true;
+   }
+
+   // A copy. Any code between lock and unlock blocks the camera from providing the next
+   // frame, so nothing else is done there.
+   cv::Mat latest(const cv::Rect &roi) override {
+      cv::Mat frame;
+      m_sharedMemory->lock();
+      {
+         cv::Mat wrapped(static_cast<int>(m_height), static_cast<int>(m_width), CV_8UC4, m_sharedMemory->data());
+         wrapped(roi).copyTo(frame);
+         m_stamped = frameTimeStamp(m_sharedMemory.get(), &m_lastStamp, &m_timeStamp);
+      }
+      m_sharedMemory->unlock();
+      return frame;
+   }
+
+   const cluon::data::TimeStamp &timeStamp() const override { return m_timeStamp; }
+   bool timeStamped() const override { return m_stamped; }
+
+  private:
+   std::unique_ptr<cluon::SharedMemory> m_sharedMemory;
+   const uint32_t m_width;
+   const uint32_t m_height;
+   cluon::data::TimeStamp m_timeStamp;
+   bool m_stamped;
+   cluon::data::TimeStamp m_lastStamp; // as found on the area
+};
+#endif
+
+// Frames decoded in the service itself, made to look like the ones on the shared memory
+// area: BGRA, scaled to the size the reader was opened with. Every frame is a new buffer,
+// so the frame returned is not copied again.
+class DecodedFrames : public FrameSource {
+  public:
+   DecodedFrames(const std::string &source, uint32_t width, uint32_t height)
+      : m_source{source}, m_width{width}, m_height{height}, m_frame{}, m_timeStamp{}, m_stamped{false} {}
+
+   std::string name() const override { return m_source; }
+   uint32_t size() const override { return m_width * m_height * 4; }
+
+   cv::Mat latest(const cv::Rect &roi) override { return m_frame(roi); }
+
+   const cluon::data::TimeStamp &timeStamp() const override { return m_timeStamp; }
+   bool timeStamped() const override { return m_stamped; }
+
+  protected:
+   // A decoded BGR, BGRA or grey image becomes the latest frame.
+   void setFrame(const cv::Mat &image, const cluon::data::TimeStamp &timeStamp, bool stamped) {
+      cv::Mat bgra;
+      if (image.channels() == 1) {
+         cv::cvtColor(image, bgra, cv::COLOR_GRAY2BGRA);
+      } else if (image.channels() == 3) {
+         cv::cvtColor(image, bgra, cv::COLOR_BGR2BGRA);
+      } else {
+         bgra = image.clone();
+      }
+      const cv::Size size(static_cast<int>(m_width), static_cast<int>(m_height));
+      if (bgra.size() != size) {
+         cv::resize(bgra, m_frame, size, 0, 0, cv::INTER_AREA);
+      } else {
+         m_frame = bgra;
+      }
+      m_timeStamp = timeStamp;
+      m_stamped = stamped;
+   }
+
+  private:
+   const std::string m_source;
+   const uint32_t m_width;
+   const uint32_t m_height;
+   cv::Mat m_frame;
+   cluon::data::TimeStamp m_timeStamp;
+   bool m_stamped;
+};
+
+// A camera (device >= 0), timed by the wall clock, or a video file, timed by its frame rate
+// from 0.
+class VideoFrames : public DecodedFrames {
+  public:
+   VideoFrames(const std::string &source, int device, uint32_t width, uint32_t height)
+      : DecodedFrames(source, width, height), m_capture{}, m_live{device >= 0}, m_frameTime{0}, m_count{0} {
+      if (m_live) {
+         m_capture.open(device);
+      } else {
+         m_capture.open(source);
+      }
+      const double fps = m_capture.isOpened() ? m_capture.get(cv::CAP_PROP_FPS) : 0;
+      m_frameTime = 1e6 / ((fps > 0) ? fps : VIDEO_DEFAULT_FPS);
+   }
+
+   bool valid() const override { return m_capture.isOpened(); }
+
+   bool wait() override {
+      cv::Mat image;
+      if (!m_capture.read(image) || image.empty()) { return false; }
+      if (m_live) {
+         setFrame(image, cluon::time::now(), false);
+      } else {
+         setFrame(image, cluon::time::fromMicroseconds(static_cast<int64_t>(static_cast<double>(m_count) * m_frameTime)), true);
+      }
+      m_count++;
+      return true;
+   }
+
+  private:
+   cv::VideoCapture m_capture;
+   const bool m_live;
+   double m_frameTime; // us
+   uint64_t m_count;
+};
+
+// The images of a directory in name order, timed as if taken at VIDEO_DEFAULT_FPS. Files
+// that are not images are skipped.
+class ImageDirectoryFrames : public DecodedFrames {
+  public:
+   ImageDirectoryFrames(const std::string &directory, uint32_t width, uint32_t height)
+      : DecodedFrames(directory, width, height), m_files{}, m_next{0}, m_count{0} {
+      cv::glob(directory, m_files, false); // sorted
+   }
+
+   bool valid() const override { return !m_files.empty(); }
+
+   bool wait() override {
+      while (m_next < m_files.size()) {
+         cv::Mat image = cv::imread(m_files[m_next++], cv::IMREAD_COLOR);
+         if (!image.empty()) {
+            setFrame(image, cluon::time::fromMicroseconds(static_cast<int64_t>(static_cast<double>(m_count++) * 1e6 / VIDEO_DEFAULT_FPS)), true);
+            return true;
+         }
+      }
+      return false;
+   }
+
+  private:
+   std::vector<cv::String> m_files;
+   size_t m_next;
+   uint64_t m_count;
+};
+
+// The ImageReadings of a .rec, timed by their sample times. Raw BGR3 frames, as the
+// flight recorder writes them, and I420 are converted one by one. The car's h264 is decoded
+// by OpenCV's video reader: at the first h264 frame the h264 of the rest of the recording is
+// written into a temporary stream file, and the n-th frame decoded from it gets the sample
+// time of the n-th h264 reading. Other frames after it are not read.
+class RecordingFrames : public DecodedFrames {
+  public:
+   RecordingFrames(const std::string &file, uint32_t width, uint32_t height)
+      : DecodedFrames(file, width, height), m_file{file, std::ios::in | std::ios::binary}, m_opened{m_file.good()}, m_skipped{}, m_h264{}, m_h264Times{} {}
+
+   bool valid() const override { return m_opened; }
+
+   bool wait() override {
+      if (m_h264.isOpened()) { return decodedH264(); }
+      while (m_file.good()) {
+         std::pair<bool, cluon::data::Envelope> entry = cluon::extractEnvelope(m_file);
+         if (!entry.first) { break; }
+         if (entry.second.dataType() != opendlv::proxy::ImageReading::ID()) { continue; }
+         const cluon::data::TimeStamp sampleTime = entry.second.sampleTimeStamp();
+         opendlv::proxy::ImageReading reading = cluon::extractMessage<opendlv::proxy::ImageReading>(std::move(entry.second));
+         const int width = static_cast<int>(reading.width());
+         const int height = static_cast<int>(reading.height());
+         std::string data = reading.data();
+         cv::Mat image;
+         if (reading.fourcc() == "BGR3" && data.size() == static_cast<size_t>(width) * height * 3) {
+            image = cv::Mat(height, width, CV_8UC3, &data[0]);
+         } else if (reading.fourcc() == "I420" && data.size() == static_cast<size_t>(width) * height * 3 / 2) {
+            cv::cvtColor(cv::Mat(height * 3 / 2, width, CV_8UC1, &data[0]), image, cv::COLOR_YUV2BGR_I420);
+         } else if (reading.fourcc() == "h264") {
+            return openH264(data, sampleTime) && decodedH264();
+         } else {
+            if (m_skipped[reading.fourcc()]++ == 0) {
+               std::cerr << name() << ": skipping " << reading.fourcc() << " frames, only BGR3, I420 and h264 are read." << std::endl;
+            }
+            continue;
+         }
+         setFrame(image, sampleTime, true);
+         return true;
+      }
+      return false;
+   }
+
+  private:
+   // Writes the given h264 frame and those of the rest of the recording into a stream file,
+   // keeping their sample times, and opens it. The file is gone once the reader has it open.
+   bool openH264(const std::string &first, const cluon::data::TimeStamp &firstTime) {
+      char path[] = "/tmp/recording-frames-XXXXXX.h264";
+      const int fd = ::mkstemps(path, 5);
+      if (fd < 0) {
+         std::cerr << name() << ": cannot write the h264 stream to /tmp." << std::endl;
+         return false;
+      }
+      ::close(fd);
+      {
+         std::ofstream stream(path, std::ios::out | std::ios::binary | std::ios::trunc);
+         stream.write(first.data(), static_cast<std::streamsize>(first.size()));
+         m_h264Times.push_back(firstTime);
+         while (m_file.good()) {
+            std::pair<bool, cluon::data::Envelope> entry = cluon::extractEnvelope(m_file);
+            if (!entry.first) { break; }
+            if (entry.second.dataType() != opendlv::proxy::ImageReading::ID()) { continue; }
+            const cluon::data::TimeStamp sampleTime = entry.second.sampleTimeStamp();
+            opendlv::proxy::ImageReading reading = cluon::extractMessage<opendlv::proxy::ImageReading>(std::move(entry.second));
+            if (reading.fourcc() != "h264") {
+               m_skipped[reading.fourcc()]++;
+               continue;
+            }
+            stream.write(reading.data().data(), static_cast<std::streamsize>(reading.data().size()));
+            m_h264Times.push_back(sampleTime);
+         }
+      }
+      m_h264.open(path);
+      ::unlink(path);
+      if (!m_h264.isOpened()) {
+         std::cerr << name() << ": cannot decode h264, OpenCV is built without a video reader for it." << std::endl;
+         m_h264Times.clear();
+         return false;
+      }
+      return true;
+   }
+
+   bool decodedH264() {
+      cv::Mat image;
+      if (m_h264Times.empty() || !m_h264.read(image) || image.empty()) { return false; }
+      setFrame(image, m_h264Times.front(), true);
+      m_h264Times.pop_front();
+      return true;
+   }
+
+   std::ifstream m_file;
+   bool m_opened;
+   std::map<std::string, uint64_t> m_skipped; // frames by fourcc
+   cv::VideoCapture m_h264;
+   std::deque<cluon::data::TimeStamp> m_h264Times; // of the h264 frames not decoded yet
+};
+
+// The frames of a frame archive, in place and timed by the index. Frames of another size
+// than the reader's are scaled, which costs a copy.
+class ArchiveFrames : public FrameSource {
+  public:
+   ArchiveFrames(const std::string &file, uint32_t width, uint32_t height)
+      : m_file{file}, m_size{static_cast<int>(width), static_cast<int>(height)}, m_archive{}, m_next{0}, m_frame{}, m_timeStamp{} {
+      m_archive.load(file);
+   }
+
+   bool valid() const override { return !m_archive.empty(); }
+   std::string name() const override { return m_file; }
+   uint32_t size() const override { return static_cast<uint32_t>(m_size.area()) * 4; }
+
+   bool wait() override {
+      if (m_next >= m_archive.size()) { return false; }
+      m_frame = m_archive.frame(m_next);
+      if (m_frame.size() != m_size) {
+         cv::Mat scaled;
+         cv::resize(m_frame, scaled, m_size, 0, 0, cv::INTER_AREA);
+         m_frame = scaled;
+      }
+      m_timeStamp = cluon::time::fromMicroseconds(m_archive.time(m_next));
+      m_next++;
+      return true;
+   }
+
+   cv::Mat latest(const cv::Rect &roi) override { return m_frame(roi); }
+
+   const cluon::data::TimeStamp &timeStamp() const override { return m_timeStamp; }
+   bool timeStamped() const override { return true; }
+
+  private:
+   const std::string m_file;
+   const cv::Size m_size;
+   FrameArchive m_archive;
+   size_t m_next;
+   cv::Mat m_frame;
+   cluon::data::TimeStamp m_timeStamp;
+};
+
+// The frames of --source, or of the shared memory area name if there is none:
+//   camera:<n>     the camera with this number
+//   <file>.frames  a frame archive
+//   <file>.rec     the ImageReadings of a recording, raw or h264
+//   <directory>    the images in it
+//   <file>         a video file
+inline std::unique_ptr<FrameSource> openFrameSource(const std::string &source, const std::string &name, uint32_t width, uint32_t height) {
+   if (source.empty()) {
+      return std::unique_ptr<FrameSource>(new SharedMemoryFrames(name, width, height));
+   }
+   if (source.compare(0, 7, "camera:") == 0) {
+      return std::unique_ptr<FrameSource>(new VideoFrames(source, std::stoi(source.substr(7)), width, height));
+   }
+   if (source.size() > 7 && source.compare(source.size() - 7, 7, ".frames") == 0) {
+      return std::unique_ptr<FrameSource>(new ArchiveFrames(source, width, height));
+   }
+   if (source.size() > 4 && source.compare(source.size() - 4, 4, ".rec") == 0) {
+      return std::unique_ptr<FrameSource>(new RecordingFrames(source, width, height));
+   }
+   struct stat status;
+   if (stat(source.c_str(), &status) == 0 && S_ISDIR(status.st_mode)) {
+      return std::unique_ptr<FrameSource>(new ImageDirectoryFrames(source, width, height));
+   }
+   return std::unique_ptr<FrameSource>(new VideoFrames(source, -1, width, height));
+}
+
+class FrameReader {
+  private:
+   FrameReader(const FrameReader &) = delete;
+   FrameReader &operator=(const FrameReader &) = delete;
+
+  public:
+   // The shared memory area name, unless a source is given (see openFrameSource).
+   FrameReader(const std::string &name, uint32_t width, uint32_t height, const std::string &source = "")
+      : m_source{openFrameSource(source, name, width, height)}, m_width{width}, m_height{height} {}
+
+   bool valid() const { return m_source->valid(); }
+   std::string name() const { return m_source->name(); }
+   uint32_t size() const { return m_source->size(); }
+
+   // Blocks until the next frame arrives; false at the end of a file or directory.
+   bool wait() { return m_source->wait(); }
+
+   // The latest frame, or a region of it; in the service host it is shared with the other
+   // services, do not write to it.
+   cv::Mat latest() { return latest(cv::Rect(0, 0, static_cast<int>(m_width), static_cast<int>(m_height))); }
+   cv::Mat latest(const cv::Rect &roi) { return m_source->latest(roi); }
+
+   // Sample time of the frame returned last, and whether it is the time it was taken.
+   const cluon::data::TimeStamp &timeStamp() const { return m_source->timeStamp(); }
+   bool timeStamped() const { return m_source->timeStamped(); }
+
+  private:
+   std::unique_ptr<FrameSource> m_source;
+   const uint32_t m_width;
+   const uint32_t m_height;
+};
+
+#endif
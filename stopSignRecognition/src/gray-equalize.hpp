@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2019  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// The input of the cascades, cvtColor to gray and equalizeHist, in one kernel: the luma of a
+// BGRA frame is computed and counted into the histogram in one pass, the equalisation LUT
+// is applied in a second one, into a gray buffer the caller keeps from frame to frame.
+// Luma and LUT round like cvtColor(COLOR_BGR2GRAY) and equalizeHist do. The frames of the
+// shared memory area are BGRA, so blue is the first channel.
+// This file is shared between the services; keep all copies identical.
+
+#ifndef GRAY_EQUALIZE_HPP
+#define GRAY_EQUALIZE_HPP
+
+#include "cascade-simd.hpp"
+
+#include "opencv2/core.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+// cvtColor's luma weights in 14 bit fixed point
+const int GRAY_SHIFT = 14;
+const int GRAY_B = 1868;
+const int GRAY_G = 9617;
+const int GRAY_R = 4899;
+
+inline uint8_t grayOf(int b, int g, int r) {
+   return static_cast<uint8_t>((b * GRAY_B + g * GRAY_G + r * GRAY_R + (1 << (GRAY_SHIFT - 1))) >> GRAY_SHIFT);
+}
+
+// Counts a row into four histograms in turn, so that runs of equal pixels do not wait on
+// the increment of the one before.
+inline void countGrayRow(const uint8_t *gray, int width, uint32_t histograms[4][256]) {
+   int x = 0;
+   for (; x + 4 <= width; x += 4) {
+      histograms[0][gray[x]]++;
+      histograms[1][gray[x + 1]]++;
+      histograms[2][gray[x + 2]]++;
+      histograms[3][gray[x + 3]]++;
+   }
+   for (; x < width; x++) { histograms[0][gray[x]]++; }
+}
+
+// Luma of a row of BGRA pixels, eight at a time.
+inline void grayRowBgra(const uint8_t *bgra, uint8_t *gray, int width) {
+   int x = 0;
+#if defined(CASCADE_SIMD_NEON)
+   const uint32x4_t round = vdupq_n_u32(1 << (GRAY_SHIFT - 1));
+   for (; x + 8 <= width; x += 8) {
+      const uint8x8x4_t pixels = vld4_u8(bgra + 4 * x);
+      const uint16x8_t b = vmovl_u8(pixels.val[0]);
+      const uint16x8_t g = vmovl_u8(pixels.val[1]);
+      const uint16x8_t r = vmovl_u8(pixels.val[2]);
+      uint32x4_t low = vmlal_n_u16(round, vget_low_u16(b), GRAY_B);
+      uint32x4_t high = vmlal_n_u16(round, vget_high_u16(b), GRAY_B);
+      low = vmlal_n_u16(low, vget_low_u16(g), GRAY_G);
+      high = vmlal_n_u16(high, vget_high_u16(g), GRAY_G);
+      low = vmlal_n_u16(low, vget_low_u16(r), GRAY_R);
+      high = vmlal_n_u16(high, vget_high_u16(r), GRAY_R);
+      vst1_u8(gray + x, vmovn_u16(vcombine_u16(vshrn_n_u32(low, GRAY_SHIFT), vshrn_n_u32(high, GRAY_SHIFT))));
+   }
+#elif defined(CASCADE_SIMD_SSE2)
+   // the pixels widened to 16 bit, b g r a; madd gives b*B + g*G and r*R per pixel
+   const __m128i weights = _mm_setr_epi16(GRAY_B, GRAY_G, GRAY_R, 0, GRAY_B, GRAY_G, GRAY_R, 0);
+   const __m128i round = _mm_set1_epi32(1 << (GRAY_SHIFT - 1));
+   const __m128i zero = _mm_setzero_si128();
+   auto luma = [&weights, &round, &zero](__m128i four) {
+      const __m128i pairs01 = _mm_shuffle_epi32(_mm_madd_epi16(_mm_unpacklo_epi8(four, zero), weights), _MM_SHUFFLE(3, 1, 2, 0));
+      const __m128i pairs23 = _mm_shuffle_epi32(_mm_madd_epi16(_mm_unpackhi_epi8(four, zero), weights), _MM_SHUFFLE(3, 1, 2, 0));
+      const __m128i sums = _mm_add_epi32(_mm_unpacklo_epi64(pairs01, pairs23), _mm_unpackhi_epi64(pairs01, pairs23));
+      return _mm_srai_epi32(_mm_add_epi32(sums, round), GRAY_SHIFT);
+   };
+   for (; x + 8 <= width; x += 8) {
+      const __m128i first = luma(_mm_loadu_si128(reinterpret_cast<const __m128i *>(bgra + 4 * x)));
+      const __m128i second = luma(_mm_loadu_si128(reinterpret_cast<const __m128i *>(bgra + 4 * x + 16)));
+      const __m128i words = _mm_packs_epi32(first, second);
+      _mm_storel_epi64(reinterpret_cast<__m128i *>(gray + x), _mm_packus_epi16(words, words));
+   }
+#endif
+   for (; x < width; x++) { gray[x] = grayOf(bgra[4 * x], bgra[4 * x + 1], bgra[4 * x + 2]); }
+}
+
+inline void grayRowBgr(const uint8_t *bgr, uint8_t *gray, int width) {
+   for (int x = 0; x < width; x++) { gray[x] = grayOf(bgr[3 * x], bgr[3 * x + 1], bgr[3 * x + 2]); }
+}
+
+// The LUT of equalizeHist for a histogram of total pixels: the cumulative histogram above
+// the darkest value present, stretched to 0-255.
+inline void equalizeLut(const uint32_t histogram[256], uint32_t total, uint8_t lut[256]) {
+   int i = 0;
+   while (i < 255 && histogram[i] == 0) { i++; }
+   if (histogram[i] == total) {
+      // one value only, it is kept
+      std::memset(lut, i, 256);
+      return;
+   }
+   std::memset(lut, 0, 256);
+   const float scale = 255.0f / static_cast<float>(total - histogram[i]);
+   uint32_t sum = 0;
+   for (i++; i < 256; i++) {
+      sum += histogram[i];
+      lut[i] = cv::saturate_cast<uint8_t>(static_cast<float>(sum) * scale);
+   }
+}
+
+inline void applyLutRow(uint8_t *gray, int width, const uint8_t lut[256]) {
+   int x = 0;
+   for (; x + 4 <= width; x += 4) {
+      const uint8_t a = lut[gray[x]], b = lut[gray[x + 1]], c = lut[gray[x + 2]], d = lut[gray[x + 3]];
+      gray[x] = a;
+      gray[x + 1] = b;
+      gray[x + 2] = c;
+      gray[x + 3] = d;
+   }
+   for (; x < width; x++) { gray[x] = lut[gray[x]]; }
+}
+
+// gray = equalizeHist(cvtColor(frame, COLOR_BGR(A)2GRAY)) for a BGRA, BGR or gray frame or a
+// view into one; gray is only allocated when the size changes.
+//
+// With rois, the tiled variant for cascades that only search some windows: the histogram is
+// still the one of the whole frame, so a window sees the same pixels as a search of the
+// whole frame, but the LUT is only applied inside the rois, once where they overlap. Outside
+// of them gray holds the plain luma.
+inline void grayEqualized(const cv::Mat &frame, cv::Mat &gray, const std::vector<cv::Rect> &rois = std::vector<cv::Rect>()) {
+   CV_Assert(frame.depth() == CV_8U && (frame.channels() == 4 || frame.channels() == 3 || frame.channels() == 1));
+   gray.create(frame.size(), CV_8UC1);
+   uint32_t histograms[4][256];
+   std::memset(histograms, 0, sizeof(histograms));
+   for (int y = 0; y < frame.rows; y++) {
+      const uint8_t *in = frame.ptr<uint8_t>(y);
+      uint8_t *out = gray.ptr<uint8_t>(y);
+      if (frame.channels() == 4) {
+         grayRowBgra(in, out, frame.cols);
+      } else if (frame.channels() == 3) {
+         grayRowBgr(in, out, frame.cols);
+      } else {
+         std::memcpy(out, in, static_cast<size_t>(frame.cols));
+      }
+      countGrayRow(out, frame.cols, histograms);
+   }
+   for (int v = 0; v < 256; v++) { histograms[0][v] += histograms[1][v] + histograms[2][v] + histograms[3][v]; }
+   uint8_t lut[256];
+   equalizeLut(histograms[0], static_cast<uint32_t>(frame.total()), lut);
+
+   if (rois.empty()) {
+      for (int y = 0; y < gray.rows; y++) { applyLutRow(gray.ptr<uint8_t>(y), gray.cols, lut); }
+      return;
+   }
+   const cv::Rect whole(0, 0, gray.cols, gray.rows);
+   std::vector<std::pair<int, int> > spans;
+   for (int y = 0; y < gray.rows; y++) {
+      // the column spans of the rois on this row, merged
+      spans.clear();
+      for (const cv::Rect &roi : rois) {
+         const cv::Rect r = roi & whole;
+         if (r.width > 0 && y >= r.y && y < r.y + r.height) { spans.push_back(std::make_pair(r.x, r.x + r.width)); }
+      }
+      std::sort(spans.begin(), spans.end());
+      uint8_t *row = gray.ptr<uint8_t>(y);
+      int done = 0;
+      for (const std::pair<int, int> &span : spans) {
+         const int from = std::max(span.first, done);
+         if (span.second > from) {
+            applyLutRow(row + from, span.second - from, lut);
+            done = span.second;
+         }
+      }
+   }
+}
+
+#endif
@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2019  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Keeps the per-frame latency of a vision service under a budget by trading detection
+// quality for time when the board is busy. Every service reads the knobs it has.
+// This file is shared between the services; keep all copies identical.
+
+#ifndef LOAD_SHEDDING_HPP
+#define LOAD_SHEDDING_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+struct DegradationLevel {
+   float process_scale;         // multiplied with --process-scale
+   double cascade_scale_factor; // scaleFactor of detectMultiScale
+   int threshold_levels;        // threshold levels tried by findSquares
+};
+
+// Level 0 is full quality. Cheap knobs are given up first; every level does less work per
+// frame than the one before it, so each step lowers the latency the controller measures.
+const DegradationLevel DEGRADATION_LEVELS[] = {
+   {1.0f, 1.1, 11},
+   {1.0f, 1.2, 7},
+   {0.75f, 1.2, 5},
+   {0.5f, 1.3, 4},
+   {0.4f, 1.4, 3},
+   {0.35f, 1.5, 2}
+};
+const int NUMBER_OF_DEGRADATION_LEVELS = sizeof(DEGRADATION_LEVELS) / sizeof(DEGRADATION_LEVELS[0]);
+
+// Skipping frames does not make a processed frame any faster, so it is not a level: it is
+// the fallback once the last level is over the budget, at most every n-th frame.
+const int MAX_FRAME_INTERVAL = 4;
+
+class LoadShedder {
+  public:
+   // budget_ms of 0 disables the controller, the service then stays at level 0.
+   LoadShedder(const std::string &name, double budget_ms, size_t window = 30)
+      : m_name{name}, m_budget{budget_ms}, m_window{window}, m_samples{}, m_level{0}, m_frame{0}, m_quietWindows{0}, m_p95{0}, m_frameInterval{1} {
+      m_samples.reserve(window);
+   }
+
+   const DegradationLevel &level() const { return DEGRADATION_LEVELS[m_level]; }
+   int levelIndex() const { return m_level; }
+   double p95() const { return m_p95; }
+   int frameInterval() const { return m_frameInterval; }
+
+   // Call once per frame; returns false if detection should be skipped on this frame.
+   bool shouldProcess() {
+      return (m_frame++ % static_cast<uint64_t>(m_frameInterval)) == 0;
+   }
+
+   // Feeds the latency of a processed frame. After every window of frames the p95 is
+   // compared with the budget: above it the service degrades one level, and it only
+   // recovers after two windows well below the budget so the levels do not oscillate.
+   // A window measured at the last level sets the frame interval on its own: every n-th
+   // frame, where n is how many budgets the p95 takes.
+   void addSample(double latency_ms) {
+      if (m_budget <= 0) { return; }
+      m_samples.push_back(latency_ms);
+      if (m_samples.size() < m_window) { return; }
+
+      size_t index = (m_samples.size() * 95) / 100;
+      std::nth_element(m_samples.begin(), m_samples.begin() + index, m_samples.end());
+      m_p95 = m_samples[index];
+      m_samples.clear();
+
+      const int previous = m_level;
+      const int previousInterval = m_frameInterval;
+      if (previous == NUMBER_OF_DEGRADATION_LEVELS - 1) {
+         m_frameInterval = std::min(std::max(static_cast<int>(std::ceil(m_p95 / m_budget)), 1), MAX_FRAME_INTERVAL);
+      }
+      if (m_p95 > m_budget) {
+         m_quietWindows = 0;
+         m_level = std::min(m_level + 1, NUMBER_OF_DEGRADATION_LEVELS - 1);
+      } else if (m_p95 < 0.6 * m_budget) {
+         if (++m_quietWindows >= 2) {
+            m_quietWindows = 0;
+            m_level = std::max(m_level - 1, 0);
+         }
+      } else {
+         m_quietWindows = 0;
+      }
+      if (m_level != previous || m_frameInterval != previousInterval) {
+         std::cout << "   [ " << m_name << " load shedding: level " << m_level << "/" << NUMBER_OF_DEGRADATION_LEVELS - 1
+                   << ", frame interval " << m_frameInterval << ", p95 " << m_p95 << " ms, budget " << m_budget << " ms ]" << std::endl;
+      }
+   }
+
+  private:
+   std::string m_name;
+   double m_budget;
+   size_t m_window;
+   std::vector<double> m_samples;
+   int m_level;
+   uint64_t m_frame;
+   int m_quietWindows;
+   double m_p95;
+   int m_frameInterval;
+};
+
+// Milliseconds elapsed since start.
+inline double millisecondsSince(const std::chrono::steady_clock::time_point &start) {
+   return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+#endif
@@ -17,6 +17,15 @@
 
 #include "cluon-complete.hpp"
 #include "opendlv-standard-message-set.hpp"
+#include "scenario-mode.hpp"
+#include "load-shedding.hpp"
+#include "binary-cascade.hpp"
+#include "gray-equalize.hpp"
+#include "dnn-detector.hpp"
+#include "thread-pool.hpp"
+#include "message-bus.hpp"
+#include "frame-reader.hpp"
+#include "flight-recorder.hpp"
 
 #include "opencv2/core.hpp"
 #include <opencv2/highgui/highgui.hpp>
@@ -41,16 +50,48 @@
 #include <mutex>
 
 
+#ifdef SERVICE_HOST
+namespace stopSignRecognition {
+#endif
+
 using namespace std;
 using namespace cv;
 using namespace cluon;
 
-void detectAndDisplayStopSign( Mat frame, OD4Session *od4);
-void detectAndDisplayYieldSigns( Mat frame, OD4Session *od4);
+void findSigns(Mat frame, bool find_stopsigns, bool find_yieldsigns, double scale_factor, DnnDetector *detector,
+   std::vector<Rect> &stopsigns, std::vector<Rect> &yieldsigns, Mat &frame_gray);
+void redMask(const Mat &frame, Mat &mask);
+std::vector<Rect> redProposals(const Mat &frame, int min_size);
+void detectAndDisplayStopSign( const Mat &frame, const std::vector<Rect> &stopsigns, ServiceSession *od4);
+void detectAndDisplayYieldSigns( const Mat &frame, const std::vector<Rect> &yieldSign, ServiceSession *od4);
+void recordSigns(const std::string &detector, const std::vector<Rect> &signs, const Size &frame_size, const cluon::data::TimeStamp &sampleTime);
+
+// All geometry is expressed in normalised frame coordinates (0 - 1 of the full frame),
+// so the same thresholds hold for any camera resolution and --process-scale.
+// The values were originally tuned in pixels on 640x480 frames.
+const double MIN_SIGN_SIZE = 0.125;       // ~60 px, of the frame height
+const double MIN_STOPSIGN_AREA = 0.0114;  // ~3500 px
+const double MIN_YIELDSIGN_AREA = 0.0098; // ~3000 px
+
+// Both signs are saturated red, so the cascades only search padded windows around red blobs.
+// A pixel is red if its red channel is bright and well above green and blue.
+const int RED_MIN = 90;
+const int RED_MARGIN = 40;
+const double MIN_RED_BLOB = 0.5;        // of the minimum sign size, the red of a sign is at least this large
+const double MAX_RED_BLOB_ASPECT = 2.5; // longer side over shorter side
+const double RED_BLOB_PADDING = 0.5;    // of the blob size on every side, context for the cascade window
+
+// Scenario modes each cascade is needed in. The stop sign only matters until we stop
+// at it; the yield (direction) sign is read until the direction is chosen.
+const uint32_t STOPSIGN_MODES = modeBit(MODE_FOLLOWING) | modeBit(MODE_APPROACHING);
+const uint32_t YIELDSIGN_MODES = modeBit(MODE_FOLLOWING) | modeBit(MODE_APPROACHING) | modeBit(MODE_AT_STOP_LINE);
+
+// Frames kept by the flight recorder are downscaled to this width.
+const int RECORDER_WIDTH = 160;
 
 //defining variables for stop sign
 String stopSignCascadeName;
-CascadeClassifier stopSignCascade;
+BinaryCascade stopSignCascade;
 bool stopSignPresent = false;
 const int lookBackNoOfFrames = 7;
 int NO_OF_STOPSIGNS_REQUIRED = 5;
@@ -59,7 +100,7 @@ bool seenFrameStopsigns[lookBackNoOfFrames] = {false};
 /////////////////////////////////////////////////////////////
 //defining variables for stop sign
 String yieldSignCascadeName;
-CascadeClassifier yieldSignCascadeClassifier;
+BinaryCascade yieldSignCascadeClassifier;
 
 bool yieldSignPresent = false;
 const int lookBackNoOfFramesYield = 10;
@@ -67,83 +108,192 @@ int NO_OF_YIELDSIGNS_REQUIRED = 6;
 int currentIndexYield = 0;
 bool seenFrameYieldSign[lookBackNoOfFramesYield] = {false};
 
+//searching the whole frame with the cascades instead of around red blobs
+bool searchWholeFrame = false;
+//threads for the cascade scales and the red mask, nullptr runs everything on the main thread
+ThreadPool *threadPool = nullptr;
+//what the service saw and sent, written out when it reports the stop line; off unless --recorder
+FlightRecorder *flightRecorder = nullptr;
+
 int32_t main(int32_t argc, char **argv) {
     int32_t retCode{1};
     auto commandlineArguments = cluon::getCommandlineArguments(argc, argv);
 
     if ( (0 == commandlineArguments.count("cid")) ||
-        (0 == commandlineArguments.count("name")) ||
+        (0 == commandlineArguments.count("name") && 0 == commandlineArguments.count("source")) ||
         (0 == commandlineArguments.count("width")) ||
         (0 == commandlineArguments.count("height")) ) {
         std::cerr << argv[0] << " attaches to a shared memory area containing an ARGB image." << std::endl;
 
-        std::cerr << "Usage:   " << argv[0] << " --cid=<OD4 session> --name=<name of shared memory area> [--verbose]" << std::endl;
+        std::cerr << "Usage:   " << argv[0] << " --cid=<OD4 session> --name=<name of shared memory area>|--source=<camera:n|file.rec|video|directory> [--process-scale=<0..1>] [--latency-budget=<ms>] [--stop-cascade=<file>] [--yield-cascade=<file>] [--detector=cascade|dnn --dnn-model=<file> [--dnn-config=<file>] --dnn-labels=<file> [--dnn-confidence=<0..1>] [--dnn-input=<px>]] [--whole-frame] [--cpus=<list>] [--threads=<n>] [--nice=<n>] [--recorder=<directory> [--recorder-seconds=<s>]] [--verbose]" << std::endl;
         std::cerr << "         --cid:    CID of the OD4Session to send and receive messages" << std::endl;
         std::cerr << "         --name:   name of the shared memory area to attach" << std::endl;
+        std::cerr << "         --source: frames from a camera, the ImageReadings of a .rec (raw or h264), a video file or a directory of images instead, files as fast as they are processed" << std::endl;
         std::cerr << "         --width:  width of the frame" << std::endl;
         std::cerr << "         --height: height of the frame" << std::endl;
-        std::cerr << "Example: " << argv[0] << " --cid=112 --name=img.i420 --width=640 --height=480" << std::endl;
+        std::cerr << "         --process-scale: downscale the frame by this factor before detection (default 1)" << std::endl;
+        std::cerr << "         --latency-budget: p95 frame latency to hold by degrading detection under load (default 100, 0 disables)" << std::endl;
+        std::cerr << "         --stop-cascade: HAAR or LBP stop sign cascade, an .xml for cv::CascadeClassifier or a compiled .cascade (default /usr/bin/stopSignClassifier.xml)" << std::endl;
+        std::cerr << "         --yield-cascade: HAAR or LBP yield sign cascade, an .xml or a compiled .cascade (default /usr/bin/yieldsign.xml)" << std::endl;
+        std::cerr << "         --whole-frame: run the cascades on the whole frame, not only around red blobs" << std::endl;
+        std::cerr << "         --detector: find signs with the two cascades (default) or with one SSD network through cv::dnn" << std::endl;
+        std::cerr << "         --dnn-model, --dnn-config: Caffe .caffemodel/.prototxt or TensorFlow .pb/.pbtxt of the SSD" << std::endl;
+        std::cerr << "         --dnn-labels: class names of the network, one per line in class id order" << std::endl;
+        std::cerr << "         --dnn-confidence: minimum detection confidence (default 0.5)" << std::endl;
+        std::cerr << "         --dnn-input: side of the square network input (default 300)" << std::endl;
+        std::cerr << "         --cpus: CPUs to pin the service and its detection threads to, e.g. 2 (default all)" << std::endl;
+        std::cerr << "         --threads: threads evaluating cascade scales and the red mask (default the number of --cpus, else 1)" << std::endl;
+        std::cerr << "         --nice: nice value of the service threads (default 0)" << std::endl;
+        std::cerr << "         --recorder: keep the last seconds of frames and messages in memory and write them to a .rec in this directory when the stop line is reported (default off)" << std::endl;
+        std::cerr << "         --recorder-seconds: seconds the recorder keeps (default 10)" << std::endl;
+        std::cerr << "Example: " << argv[0] << " --cid=112 --name=img.i420 --width=640 --height=480 --process-scale=0.5" << std::endl;
     }
     else {
         const std::string NAME{commandlineArguments["name"]};
         const uint32_t WIDTH{static_cast<uint32_t>(std::stoi(commandlineArguments["width"]))};
         const uint32_t HEIGHT{static_cast<uint32_t>(std::stoi(commandlineArguments["height"]))};
         const bool VERBOSE{commandlineArguments.count("verbose") != 0};
+        const float PROCESS_SCALE{(commandlineArguments["process-scale"].size() != 0) ? static_cast<float>(std::stof(commandlineArguments["process-scale"])) : static_cast<float>(1.0)};
+        if (PROCESS_SCALE <= 0 || PROCESS_SCALE > 1) {
+            std::cerr << argv[0] << ": --process-scale must be in (0, 1]." << std::endl;
+            return retCode;
+        }
+        const double LATENCY_BUDGET{(commandlineArguments["latency-budget"].size() != 0) ? std::stod(commandlineArguments["latency-budget"]) : 100.0};
+        stopSignCascadeName = (commandlineArguments["stop-cascade"].size() != 0) ? commandlineArguments["stop-cascade"] : "/usr/bin/stopSignClassifier.xml";
+        yieldSignCascadeName = (commandlineArguments["yield-cascade"].size() != 0) ? commandlineArguments["yield-cascade"] : "/usr/bin/yieldsign.xml";
+        searchWholeFrame = (commandlineArguments.count("whole-frame") != 0);
+        const bool USE_DNN{commandlineArguments["detector"] == "dnn"};
+        if (USE_DNN == false && commandlineArguments["detector"].size() != 0 && commandlineArguments["detector"] != "cascade") {
+            std::cerr << argv[0] << ": --detector must be cascade or dnn." << std::endl;
+            return retCode;
+        }
+        const float DNN_CONFIDENCE{(commandlineArguments["dnn-confidence"].size() != 0) ? std::stof(commandlineArguments["dnn-confidence"]) : 0.5f};
+        const int DNN_INPUT{(commandlineArguments["dnn-input"].size() != 0) ? std::stoi(commandlineArguments["dnn-input"]) : 300};
+        const std::vector<int> CPUS{parseCpuList(commandlineArguments["cpus"])};
+        if (CPUS.empty() && commandlineArguments["cpus"].size() != 0) {
+            std::cerr << argv[0] << ": --cpus must be a list like 0,1 or 0-2." << std::endl;
+            return retCode;
+        }
+        const int THREADS{(commandlineArguments["threads"].size() != 0) ? std::stoi(commandlineArguments["threads"]) : std::max(1, static_cast<int>(CPUS.size()))};
+        const int NICE{(commandlineArguments["nice"].size() != 0) ? std::stoi(commandlineArguments["nice"]) : 0};
+        // before any other thread is started, so that they all inherit the CPUs and priority
+        if (!pinCurrentThread(CPUS, NICE)) {
+            std::cerr << argv[0] << ": could not apply --cpus or --nice, running unpinned." << std::endl;
+        }
+        ThreadPool pool{static_cast<unsigned>(std::max(1, THREADS) - 1), CPUS, NICE};
+        threadPool = &pool;
+        const double RECORDER_SECONDS{(commandlineArguments["recorder-seconds"].size() != 0) ? std::stod(commandlineArguments["recorder-seconds"]) : 10.0};
+        const Size RECORDER_SIZE(RECORDER_WIDTH, cvRound(RECORDER_WIDTH * HEIGHT / static_cast<double>(WIDTH)));
+        FlightRecorder recorder{"stop-sign", commandlineArguments["recorder"], RECORDER_SECONDS, 50, 15, static_cast<size_t>(RECORDER_SIZE.area()) * 3};
+        Mat recorder_small, recorder_bgr; // the recorded frame, allocated once
+        flightRecorder = &recorder;
 
         // Attach to the shared memory.
-        std::unique_ptr<cluon::SharedMemory> sharedMemory{new cluon::SharedMemory{NAME}};
-        if (sharedMemory && sharedMemory->valid()) {
-            std::clog << argv[0] << ": Attached to shared memory '" << sharedMemory->name() << " (" << sharedMemory->size() << " bytes)." << std::endl;
-
-
-
-            //Loading the haar cascade
-            //"../stopSignClassifier.xml" because the build file is in another folder, necessary to build for testing
-            stopSignCascadeName = "/usr/bin/stopSignClassifier.xml";
-            if(!stopSignCascade.load(stopSignCascadeName)) {
-               printf("--(!)Error loading stopsign cascade\n");
-               return -1;
-            };
-
-            //Loading the haar cascade
-            //classifier trained by ourseves using this youtube tutoriastopSignCascadeNamel as guidance https://www.youtube.com/watch?time_continue=203&v=WEzm7L5zoZE
-            //The pictures taken for the classifier where from: https://github.com/cfizette/road-sign-cascades
-            yieldSignCascadeName = "/usr/bin/yieldsign.xml";
-            if(!yieldSignCascadeClassifier.load(yieldSignCascadeName)) {
-               printf("--(!)Error loading stopsign cascade\n");
-               return -1;
-            };
+        FrameReader frames{NAME, WIDTH, HEIGHT, commandlineArguments["source"]};
+        if (frames.valid()) {
+            std::clog << argv[0] << ": Attached to '" << frames.name() << "' (" << frames.size() << " bytes)." << std::endl;
+
+
+
+            //One network finding both signs in a single forward pass replaces the two cascades
+            DnnDetector signDetector;
+            if (USE_DNN) {
+               if (!signDetector.load(commandlineArguments["dnn-model"], commandlineArguments["dnn-config"], commandlineArguments["dnn-labels"])) {
+                  printf("--(!)Error loading detection network %s\n", commandlineArguments["dnn-model"].c_str());
+                  return -1;
+               }
+               signDetector.setConfidence(DNN_CONFIDENCE);
+               signDetector.setInputSize(Size(DNN_INPUT, DNN_INPUT));
+               std::cout << "Sign detector: " << commandlineArguments["dnn-model"] << " (cv::dnn, " << DNN_INPUT << "x" << DNN_INPUT << ")" << std::endl;
+            } else {
+               //Loading the cascade; the .cascade cascade-compiler makes of it at build time can be selected instead
+               //--stop-cascade=../src/stopSignClassifier.xml because the build file is in another folder, necessary to build for testing
+               if(!stopSignCascade.load(stopSignCascadeName)) {
+                  printf("--(!)Error loading stopsign cascade\n");
+                  return -1;
+               };
+
+               //Loading the yield sign cascade
+               //classifier trained by ourseves using this youtube tutoriastopSignCascadeNamel as guidance https://www.youtube.com/watch?time_continue=203&v=WEzm7L5zoZE
+               //The pictures taken for the classifier where from: https://github.com/cfizette/road-sign-cascades
+               if(!yieldSignCascadeClassifier.load(yieldSignCascadeName)) {
+                  printf("--(!)Error loading yieldsign cascade\n");
+                  return -1;
+               };
+               std::cout << "Stop sign cascade: " << stopSignCascadeName << " (" << (stopSignCascade.featureType() == CASCADE_HAAR ? "HAAR" : "LBP") << ")" << std::endl;
+               std::cout << "Yield sign cascade: " << yieldSignCascadeName << " (" << (yieldSignCascadeClassifier.featureType() == CASCADE_HAAR ? "HAAR" : "LBP") << ")" << std::endl;
+               stopSignCascade.setThreadPool(threadPool);
+               yieldSignCascadeClassifier.setThreadPool(threadPool);
+            }
             
             // Interface to a running OpenDaVINCI session; here, you can send and receive messages.
-            cluon::OD4Session od4{static_cast<uint16_t>(std::stoi(commandlineArguments["cid"]))};
+            ServiceSession od4{static_cast<uint16_t>(std::stoi(commandlineArguments["cid"]))};
+
+            ScenarioGate scenarioGate{STOPSIGN_MODES | YIELDSIGN_MODES};
+            auto onScenarioModeUpdate {
+               [&scenarioGate](ScenarioModeUpdate &&msg, const cluon::data::Envelope &) {
+                  if (scenarioGate.update(msg.mode())) {
+                     std::cout << "Scenario mode: " << modeName(msg.mode()) << (scenarioGate.isActive() ? "" : ", idle") << std::endl;
+                  }
+               }
+            };
+            onMessage<ScenarioModeUpdate>(od4, onScenarioModeUpdate);
+
+            LoadShedder loadShedder{"stop-sign", LATENCY_BUDGET};
+            // the cascades' input, kept from frame to frame so that it is allocated once
+            Mat frame_gray;
 
             // Endless loop; end the program by pressing Ctrl-C.
          while (od4.isRunning()) {
+             // sleep without touching the shared memory while no sign is needed in this scenario mode
+             if (scenarioGate.isActive() == false) {
+                 scenarioGate.waitUntilActive();
+                 continue;
+             }
+
              Mat frame;
              Mat frame_HSV;
-             Mat frame_gray;
-             Mat cropped_frame;
 
              // Wait for a notification of a new frame.
-             sharedMemory->wait();
-
-             // Lock the shared memory.
-             sharedMemory->lock();
-             {
-                 // Copy image into cvMat structure.
-                 // Be aware of that any code between lock/unlock is blocking
-                 // the camera to provide the next frame. Thus, any
-                 // computationally heavy algorithms should be placed outside
-                 // lock/unlock.
-                 cv::Mat wrapped(HEIGHT, WIDTH, CV_8UC4, sharedMemory->data());
-                 frame = wrapped.clone();
+             if (frames.wait() == false) {
+                 std::clog << argv[0] << ": end of " << frames.name() << "." << std::endl;
+                 break;
+             }
+             auto frame_start = std::chrono::steady_clock::now();
+             // under load, detection may be skipped on some frames
+             if (loadShedder.shouldProcess() == false) {
+                 continue;
              }
-             sharedMemory->unlock();
 
-             frame(Rect(Point(100, 150), Point(580, 400))).copyTo(cropped_frame);
-             // Method for detecting stop sign with haar cascade
-             detectAndDisplayStopSign(frame , &od4);
-             detectAndDisplayYieldSigns( frame, &od4);
+             frame = frames.latest();
+             if (recorder.enabled()) {
+                 resize(frame, recorder_small, RECORDER_SIZE, 0, 0, INTER_AREA);
+                 cvtColor(recorder_small, recorder_bgr, COLOR_BGRA2BGR);
+                 recorder.recordFrame(frames.timeStamp(), static_cast<uint32_t>(recorder_bgr.cols), static_cast<uint32_t>(recorder_bgr.rows), recorder_bgr.data);
+             }
+
+             // Downscale for detection if requested or under load; the thresholds are normalised to the frame.
+             const DegradationLevel &quality = loadShedder.level();
+             const float scale = PROCESS_SCALE * quality.process_scale;
+             if (scale < 1) {
+                 resize(frame, frame, Size(), scale, scale, INTER_AREA);
+             }
+             // Method for detecting stop sign with haar cascade, or both signs with the network
+             const bool stopSignNeeded = scenarioGate.isActiveIn(STOPSIGN_MODES);
+             const bool yieldSignNeeded = scenarioGate.isActiveIn(YIELDSIGN_MODES);
+             std::vector<Rect> stopsigns;
+             std::vector<Rect> yieldsigns;
+             findSigns(frame, stopSignNeeded, yieldSignNeeded, quality.cascade_scale_factor, USE_DNN ? &signDetector : nullptr,
+                stopsigns, yieldsigns, frame_gray);
+             recordSigns("stop-sign", stopsigns, frame.size(), frames.timeStamp());
+             recordSigns("yield-sign", yieldsigns, frame.size(), frames.timeStamp());
+             if (stopSignNeeded) {
+                 detectAndDisplayStopSign(frame, stopsigns, &od4);
+             }
+             if (yieldSignNeeded) {
+                 detectAndDisplayYieldSigns(frame, yieldsigns, &od4);
+             }
+             loadShedder.addSample(millisecondsSince(frame_start));
 
              // Display image.
             if (VERBOSE) {
@@ -157,6 +307,112 @@ int32_t main(int32_t argc, char **argv) {
    return retCode;
 }
 
+//Runs the cascades of the signs that are needed on the equalized gray frame, or the
+//network once on the colour frame when a detector is given. frame_gray is the caller's buffer.
+//The cascades only search around red blobs; a frame without any is not searched at all.
+void findSigns(Mat frame, bool find_stopsigns, bool find_yieldsigns, double scale_factor, DnnDetector *detector,
+   std::vector<Rect> &stopsigns, std::vector<Rect> &yieldsigns, Mat &frame_gray)
+{
+    if (detector != nullptr) {
+        std::vector<Detection> detections;
+        detector->detect(frame, detections);
+        stopsigns = detectionsOf(detections, DETECT_STOP_SIGN);
+        yieldsigns = detectionsOf(detections, DETECT_YIELD_SIGN);
+        return;
+    }
+    int min_size = cvRound(MIN_SIGN_SIZE * frame.rows);
+    std::vector<Rect> windows{Rect(0, 0, frame.cols, frame.rows)};
+    if (!searchWholeFrame) {
+        windows = redProposals(frame, min_size);
+        if (windows.empty()) {
+            return;
+        }
+    }
+    //equalized over the whole frame, so a window sees the same pixels as a whole-frame search,
+    //but only the windows are equalized
+    grayEqualized(frame, frame_gray, windows);
+    std::vector<Rect> found;
+    for (const Rect &window : windows) {
+        if (find_stopsigns) {
+            stopSignCascade.detectMultiScale(frame_gray(window), found, scale_factor, 2, Size(min_size, min_size));
+            for (const Rect &r : found) { stopsigns.push_back(r + window.tl()); }
+        }
+        if (find_yieldsigns) {
+            yieldSignCascadeClassifier.detectMultiScale(frame_gray(window), found, scale_factor, 2, Size(min_size, min_size));
+            for (const Rect &r : found) { yieldsigns.push_back(r + window.tl()); }
+        }
+    }
+}
+
+//Marks red pixels of a BGR(A) frame in one pass, in bands of rows spread over the threads.
+//The loop is branch free so that the compiler vectorises it.
+void redMask(const Mat &frame, Mat &mask)
+{
+    mask.create(frame.size(), CV_8UC1);
+    const int channels = frame.channels();
+    const int bands = (threadPool != nullptr) ? static_cast<int>(threadPool->size()) : 1;
+    auto band = [&frame, &mask, channels, bands](int b) {
+        for (int y = b * frame.rows / bands; y < (b + 1) * frame.rows / bands; y++) {
+            const uchar *pixel = frame.ptr<uchar>(y);
+            uchar *out = mask.ptr<uchar>(y);
+            for (int x = 0; x < frame.cols; x++, pixel += channels) {
+                const int blue = pixel[0];
+                const int green = pixel[1];
+                const int red = pixel[2];
+                const int other = (green > blue) ? green : blue;
+                out[x] = static_cast<uchar>(((red >= RED_MIN) & (red - other >= RED_MARGIN)) * 255);
+            }
+        }
+    };
+    if (threadPool != nullptr) {
+        threadPool->parallelFor(bands, band);
+    } else {
+        band(0);
+    }
+}
+
+//Windows worth searching for a sign: red blobs of plausible size and shape, padded and
+//at least one minimum sign large, with overlapping windows merged.
+std::vector<Rect> redProposals(const Mat &frame, int min_size)
+{
+    Mat mask, labels, stats, centroids;
+    redMask(frame, mask);
+    const int count = connectedComponentsWithStats(mask, labels, stats, centroids, 8, CV_32S);
+
+    const Rect frame_rect(0, 0, frame.cols, frame.rows);
+    const int min_blob = cvRound(MIN_RED_BLOB * min_size);
+    std::vector<Rect> windows;
+    for (int i = 1; i < count; i++) { // 0 is the background
+        const int width = stats.at<int>(i, CC_STAT_WIDTH);
+        const int height = stats.at<int>(i, CC_STAT_HEIGHT);
+        if (std::max(width, height) < min_blob ||
+            std::max(width, height) > MAX_RED_BLOB_ASPECT * std::min(width, height)) {
+            continue;
+        }
+        const int side = std::max(cvRound(std::max(width, height) * (1 + 2 * RED_BLOB_PADDING)), min_size + 2);
+        const Point center(stats.at<int>(i, CC_STAT_LEFT) + width / 2, stats.at<int>(i, CC_STAT_TOP) + height / 2);
+        const Rect window = Rect(center.x - side / 2, center.y - side / 2, side, side) & frame_rect;
+        if (window.width > min_size && window.height > min_size) {
+            windows.push_back(window);
+        }
+    }
+
+    //a sign must not be split over two windows, so overlapping windows become their union
+    for (bool merged = true; merged;) {
+        merged = false;
+        for (size_t i = 0; i < windows.size() && !merged; i++) {
+            for (size_t j = i + 1; j < windows.size() && !merged; j++) {
+                if ((windows[i] & windows[j]).area() > 0) {
+                    windows[i] |= windows[j];
+                    windows.erase(windows.begin() + static_cast<std::ptrdiff_t>(j));
+                    merged = true;
+                }
+            }
+        }
+    }
+    return windows;
+}
+
 //If there is a stop sing in the current frame then it returns a boolean weather 
 //
 bool insertCurrentFrameStopSign(bool stopSignCurrentFrame) {
@@ -186,31 +442,21 @@ bool insertCurrentFrameStopSign(bool stopSignCurrentFrame) {
 //Haar cascade for Stop sign copied and modified from
 //https://docs.opencv.org/3.4.1/db/d28/tutorial_cascade_classifier.html
 //Classifier gotten from : https://github.com/markgaynor/stopsigns
-void detectAndDisplayStopSign( Mat frame, OD4Session *od4)
+void detectAndDisplayStopSign( const Mat &frame, const std::vector<Rect> &stopsigns, ServiceSession *od4)
 {
     //Sending messages for stop sign detection
     StopSignPresenceUpdate stopSignPresenceUpdate;
 
-    std::vector<Rect> stopsigns;
-    Mat frame_gray;
-    cvtColor( frame, frame_gray, COLOR_BGR2GRAY );
-    equalizeHist( frame_gray, frame_gray );
-    //-- Detect stop signs
-    stopSignCascade.detectMultiScale(frame_gray, stopsigns, 1.1, 2, 0|CASCADE_SCALE_IMAGE, Size(60, 60));
     //checks if the stop sign is present in the current frame
     
         float stopSignArea = 0;
         for (size_t i = 0; i < stopsigns.size(); i++)
         {
-            Point center( stopsigns[i].x + stopsigns[i].width/2, stopsigns[i].y + stopsigns[i].height/2 );
-            //Draw a circle when recognized
-            ellipse( frame, center, Size( stopsigns[i].width/2, stopsigns[i].height/2 ), 0, 0, 360, Scalar( 0, 0, 255 ), 4, 8, 0 );
-            Mat faceROI = frame_gray( stopsigns[i] );
-            stopSignArea = stopsigns[i].width * stopsigns[i].height;
+            stopSignArea = (float) stopsigns[i].area() / (float) frame.size().area();
         }
 
         //It compares the previous state with the current one and it reports it if there is a change of state
-            bool valueToReport = insertCurrentFrameStopSign(stopSignArea > 3500);
+            bool valueToReport = insertCurrentFrameStopSign(stopSignArea > MIN_STOPSIGN_AREA);
             if(stopSignPresent != valueToReport){
                 stopSignPresent = valueToReport;
                 stopSignPresenceUpdate.stopSignPresence(valueToReport);
@@ -219,6 +465,8 @@ void detectAndDisplayStopSign( Mat frame, OD4Session *od4)
                 } else {
                     std::cout << "No Stop sign is being seen anymore, so STOP! " << std::endl;
                     od4->send(stopSignPresenceUpdate);
+                    flightRecorder->record(stopSignPresenceUpdate);
+                    flightRecorder->trigger("stop-line");
                 }
                 
             }
@@ -256,37 +504,28 @@ bool insertCurrentFrameYieldSign(bool yieldSignCurrentFrame) {
 //Haar cascade for yieldSigns copied and modified from
 //https://docs.opencv.org/3.4.1/db/d28/tutorial_cascade_classifier.html
 
-void detectAndDisplayYieldSigns( Mat frame, OD4Session *od4)
+void detectAndDisplayYieldSigns( const Mat &frame, const std::vector<Rect> &yieldSign, ServiceSession *od4)
 {
     //Sending messages for yield sign detection
     YieldPresenceUpdate yieldPresenceUpdate;
 
-    std::vector<Rect> yieldSign;
-    Mat frame_gray;
-    cvtColor( frame, frame_gray, COLOR_BGR2GRAY );
-    equalizeHist( frame_gray, frame_gray );
-    //-- Detect yieldSigns
-    yieldSignCascadeClassifier.detectMultiScale(frame_gray, yieldSign, 1.1, 2, 0|CASCADE_SCALE_IMAGE, Size(60, 60));
     //checks if the yieldSign is present in the current frame
     
         float yieldSignArea = 0;
         for (size_t i = 0; i < yieldSign.size(); i++)
         {
-            Point center( yieldSign[i].x + yieldSign[i].width/2, yieldSign[i].y + yieldSign[i].height/2 );
-            //Draw a circle when recognized
-            ellipse( frame, center, Size( yieldSign[i].width/2, yieldSign[i].height/2 ), 0, 0, 360, Scalar( 0, 0, 255 ), 4, 8, 0 );
-            Mat faceROI = frame_gray( yieldSign[i] );
-            yieldSignArea = yieldSign[i].width * yieldSign[i].height;
+            yieldSignArea = (float) yieldSign[i].area() / (float) frame.size().area();
         }
 
         //It compares the previous state with the current one and it reports it if there is a change of state
-            bool valueToReportYield = insertCurrentFrameYieldSign(yieldSignArea > 3000);
+            bool valueToReportYield = insertCurrentFrameYieldSign(yieldSignArea > MIN_YIELDSIGN_AREA);
             if(yieldSignPresent != valueToReportYield){
                 yieldSignPresent = valueToReportYield;
                 yieldPresenceUpdate.yieldPresence(valueToReportYield);
                 if(valueToReportYield) {
                     std::cout << "Forbidden right turn detected " << std::endl;
                     od4->send(yieldPresenceUpdate);
+                    flightRecorder->record(yieldPresenceUpdate);
                 } else {
                     std::cout << "No yield sign is being detected, take any direction " << std::endl;
                 }
@@ -295,3 +534,21 @@ void detectAndDisplayYieldSigns( Mat frame, OD4Session *od4)
   //  imshow( "yieldSign", frame );
 }
 
+//Notes the signs found on a frame for the flight recorder, normalised to the frame.
+void recordSigns(const std::string &detector, const std::vector<Rect> &signs, const Size &frame_size, const cluon::data::TimeStamp &sampleTime)
+{
+    for (const Rect &sign : signs) {
+        DetectionBox detection;
+        detection.detector(detector)
+                 .x(static_cast<float>(sign.x) / static_cast<float>(frame_size.width))
+                 .y(static_cast<float>(sign.y) / static_cast<float>(frame_size.height))
+                 .width(static_cast<float>(sign.width) / static_cast<float>(frame_size.width))
+                 .height(static_cast<float>(sign.height) / static_cast<float>(frame_size.height))
+                 .score(1.0f);
+        flightRecorder->record(detection, sampleTime);
+    }
+}
+
+#ifdef SERVICE_HOST
+} // namespace stopSignRecognition
+#endif